@@ -0,0 +1,477 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Benchmark for the whole package lifecycle. Generates a synthetic tree, builds two versions of a package from
+ * it and times creating, installing, updating, reverse installing and removing them in a scratch sysroot,
+ * all through the same functions packrat itself calls. Results go to stdout as JSON, one object per run.
+ * Everything packrat prints along the way goes to /dev/null unless --verbose is given.
+ * Needs root, like packrat does, and loop mounts the packages as squashfs, so nothing touches the network.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/utsname.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+#define BENCH_PKGID "packrat-bench"
+
+//Types
+struct TreeSpec
+{
+	unsigned NumFiles;
+	unsigned Depth; //Directory levels files are spread over.
+	unsigned Fanout; //Subdirectories per level.
+	unsigned MinSize; //File sizes are log-uniform between these two.
+	unsigned MaxSize;
+	double SymlinkRatio;
+	double ChangeRatio; //Fraction of files the second version rewrites.
+	uint32_t Seed;
+};
+
+struct TreeStats
+{
+	unsigned Files;
+	unsigned Symlinks;
+	unsigned Directories;
+	uint64_t Bytes;
+};
+
+struct Phase
+{
+	const char *Name;
+	double Seconds;
+	bool Success;
+};
+
+//Prototypes
+static uint32_t NextRandom(uint32_t *State);
+static double RandomUnit(uint32_t *State);
+static double Now(void);
+static bool WriteSynthFile(const char *Path, const size_t Size, uint32_t State);
+static bool GenerateTree(const char *Root, const TreeSpec &Spec, const unsigned Version, TreeStats *Out);
+static bool MakeSysroot(const char *Sysroot, const char *Arch);
+static void PrintResults(FILE *Out, const TreeSpec &Spec, const char *Arch, const bool Tmpfs, const TreeStats &Stats, const std::vector<Phase> &Phases);
+
+//Functions
+static uint32_t NextRandom(uint32_t *State)
+{ //xorshift32. Same seed, same tree, on every box.
+	uint32_t Value = *State;
+	
+	Value ^= Value << 13;
+	Value ^= Value >> 17;
+	Value ^= Value << 5;
+	
+	return *State = Value;
+}
+
+static double RandomUnit(uint32_t *State)
+{ //[0, 1)
+	return NextRandom(State) / 4294967296.0;
+}
+
+static double Now(void)
+{
+	struct timespec Time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	
+	return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+static bool WriteSynthFile(const char *Path, const size_t Size, uint32_t State)
+{ //Lowercase noise. Compresses about as well as typical package contents, so mksquashfs isn't unrealistically fast or slow.
+	char Buf[65536];
+	const int Descriptor = open(Path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	
+	if (Descriptor == -1) return false;
+	
+	for (size_t Inc = 0; Inc < sizeof Buf; ++Inc) Buf[Inc] = 'a' + NextRandom(&State) % 26;
+	
+	for (size_t Written = 0; Written < Size; )
+	{
+		const size_t Chunk = Size - Written < sizeof Buf ? Size - Written : sizeof Buf;
+		
+		if (write(Descriptor, Buf, Chunk) != (ssize_t)Chunk)
+		{
+			close(Descriptor);
+			return false;
+		}
+		
+		Written += Chunk;
+		
+		//Don't repeat a whole chunk verbatim, or squashfs dedupes it away.
+		for (unsigned Inc = 0; Inc < 64; ++Inc) Buf[NextRandom(&State) % sizeof Buf] = 'a' + NextRandom(&State) % 26;
+	}
+	
+	close(Descriptor);
+	
+	return true;
+}
+
+static bool GenerateTree(const char *Root, const TreeSpec &Spec, const unsigned Version, TreeStats *Out)
+{ /*Files are spread round robin over Fanout^Depth leaf directories under usr/share/packrat-bench. Version 2
+	rewrites ChangeRatio of the files and keeps everything else byte for byte, so updates have something to skip.*/
+	unsigned NumLeaves = 1;
+	
+	for (unsigned Inc = 0; Inc < Spec.Depth && NumLeaves < Spec.NumFiles; ++Inc) NumLeaves *= Spec.Fanout;
+	
+	memset(Out, 0, sizeof *Out);
+	
+	char Base[4096];
+	
+	snprintf(Base, sizeof Base, "%s/usr/share/" BENCH_PKGID, Root);
+	
+	if (!Files::RecursiveMkdir(Base, 0, 0, 0755)) return false;
+	
+	for (unsigned FileNum = 0; FileNum < Spec.NumFiles; ++FileNum)
+	{
+		Utils::PathBuilder Path(Base);
+		unsigned Leaf = FileNum % NumLeaves;
+		char Component[64];
+		
+		for (unsigned Level = 1; Level < NumLeaves; Level *= Spec.Fanout, Leaf /= Spec.Fanout)
+		{
+			snprintf(Component, sizeof Component, "d%u", Leaf % Spec.Fanout);
+			
+			if (!Path.Push(Component)) return false;
+			
+			if (mkdir(Path, 0755) == 0) ++Out->Directories;
+			else if (errno != EEXIST) return false;
+		}
+		
+		//One stream per file, so the tree doesn't depend on what came before in it.
+		uint32_t State = Spec.Seed ^ (FileNum + 1) * 2654435761u;
+		
+		if (!State) State = 1;
+		
+		NextRandom(&State);
+		
+		if (RandomUnit(&State) < Spec.SymlinkRatio && FileNum >= NumLeaves)
+		{ //Points at an earlier regular file or symlink in the same directory.
+			char Target[64];
+			
+			snprintf(Component, sizeof Component, "f%u", FileNum);
+			snprintf(Target, sizeof Target, "f%u", FileNum - NumLeaves);
+			
+			if (!Path.Push(Component) || symlink(Target, Path) != 0) return false;
+			
+			++Out->Symlinks;
+			continue;
+		}
+		
+		const double Low = log(Spec.MinSize ? Spec.MinSize : 1), High = log(Spec.MaxSize ? Spec.MaxSize : 1);
+		const size_t Size = Spec.MinSize == Spec.MaxSize ? Spec.MinSize : (size_t)exp(Low + RandomUnit(&State) * (High - Low));
+		
+		//Rolled for every version, so unchanged files get the same contents in each.
+		const bool Changed = RandomUnit(&State) < Spec.ChangeRatio;
+		
+		if (Version > 1 && Changed) State ^= Version * 40503u;
+		
+		snprintf(Component, sizeof Component, "f%u", FileNum);
+		
+		if (!Path.Push(Component) || !WriteSynthFile(Path, Size, State)) return false;
+		
+		++Out->Files;
+		Out->Bytes += Size;
+	}
+	
+	return true;
+}
+
+static bool MakeSysroot(const char *Sysroot, const char *Arch)
+{ //Just enough for Config::LoadConfig() and the database. Owners come from the host, so lookups behave like they would for real.
+	char Path[4096], ConfigText[256];
+	
+	snprintf(Path, sizeof Path, "%s/etc", Sysroot);
+	if (!Files::RecursiveMkdir(Path, 0, 0, 0755)) return false;
+	
+	snprintf(Path, sizeof Path, "%s/var/packrat/cache", Sysroot);
+	if (!Files::RecursiveMkdir(Path, 0, 0, 0755)) return false;
+	
+	snprintf(Path, sizeof Path, "%s/var/packrat/repos", Sysroot);
+	if (!Files::RecursiveMkdir(Path, 0, 0, 0755)) return false;
+	
+	snprintf(Path, sizeof Path, "%s" CONFIGFILE_PATH, Sysroot);
+	snprintf(ConfigText, sizeof ConfigText, "Arch=@%s\nOSRelease=bench\n", Arch);
+	
+	if (!Utils::WriteFile(Path, ConfigText, strlen(ConfigText), false, 0644)) return false;
+	
+	if (!Files::FileCopy("/etc/passwd", "etc/passwd", true, Sysroot, 0, 0, 0644) ||
+		!Files::FileCopy("/etc/group", "etc/group", true, Sysroot, 0, 0, 0644))
+	{
+		return false;
+	}
+	
+	return Config::LoadConfig(Sysroot) && DB::InitializeEmptyDB(Sysroot);
+}
+
+static void PrintResults(FILE *Out, const TreeSpec &Spec, const char *Arch, const bool Tmpfs, const TreeStats &Stats, const std::vector<Phase> &Phases)
+{
+	bool Success = true;
+	
+	fprintf(Out, "{\n\t\"benchmark\": \"" BENCH_PKGID "\",\n\t\"timestamp\": %lu,\n\t\"arch\": \"%s\",\n", (unsigned long)time(NULL), Arch);
+	fprintf(Out, "\t\"config\": { \"files\": %u, \"depth\": %u, \"fanout\": %u, \"min_size\": %u, \"max_size\": %u, "
+			"\"symlink_ratio\": %g, \"change_ratio\": %g, \"seed\": %u, \"tmpfs\": %s, \"cpu_jobs\": %u, \"io_jobs\": %u },\n",
+			Spec.NumFiles, Spec.Depth, Spec.Fanout, Spec.MinSize, Spec.MaxSize, Spec.SymlinkRatio, Spec.ChangeRatio,
+			(unsigned)Spec.Seed, Tmpfs ? "true" : "false", Config::CPUJobs, Config::IOJobs);
+	fprintf(Out, "\t\"tree\": { \"files\": %u, \"symlinks\": %u, \"directories\": %u, \"bytes\": %llu },\n\t\"phases\": [\n",
+			Stats.Files, Stats.Symlinks, Stats.Directories, (unsigned long long)Stats.Bytes);
+	
+	for (size_t Inc = 0; Inc < Phases.size(); ++Inc)
+	{
+		fprintf(Out, "\t\t{ \"name\": \"%s\", \"seconds\": %.6f, \"success\": %s }%s\n", Phases[Inc].Name, Phases[Inc].Seconds,
+				Phases[Inc].Success ? "true" : "false", Inc + 1 < Phases.size() ? "," : "");
+		
+		Success = Success && Phases[Inc].Success;
+	}
+	
+	fprintf(Out, "\t],\n\t\"success\": %s\n}\n", Success ? "true" : "false");
+}
+
+int main(int argc, char **argv)
+{
+	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stderr, NULL, _IONBF, 0);
+	
+	TreeSpec Spec = { 1000, 3, 4, 64, 262144, 0.05, 0.1, 1 };
+	char WorkDir[4096] = "/tmp/packrat-bench";
+	char Arch[64] = { '\0' };
+	bool Tmpfs = false, Verbose = false, Keep = false;
+	char Temp[256];
+	
+	struct utsname Uname;
+	
+	if (uname(&Uname) == 0) SubStrings.Copy(Arch, Uname.machine, sizeof Arch);
+	
+	for (int Inc = 1; Inc < argc; ++Inc)
+	{
+		if (SubStrings.StartsWith("--files=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.NumFiles = strtoul(Temp, NULL, 10);
+		}
+		else if (SubStrings.StartsWith("--depth=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.Depth = strtoul(Temp, NULL, 10);
+		}
+		else if (SubStrings.StartsWith("--fanout=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.Fanout = strtoul(Temp, NULL, 10);
+		}
+		else if (SubStrings.StartsWith("--minsize=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.MinSize = strtoul(Temp, NULL, 10);
+		}
+		else if (SubStrings.StartsWith("--maxsize=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.MaxSize = strtoul(Temp, NULL, 10);
+		}
+		else if (SubStrings.StartsWith("--symlinks=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.SymlinkRatio = strtod(Temp, NULL);
+		}
+		else if (SubStrings.StartsWith("--changes=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.ChangeRatio = strtod(Temp, NULL);
+		}
+		else if (SubStrings.StartsWith("--seed=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			Spec.Seed = strtoul(Temp, NULL, 10);
+		}
+		else if (SubStrings.StartsWith("--arch=", argv[Inc]))
+		{
+			SubStrings.Extract(Arch, sizeof Arch, "=", NULL, argv[Inc]);
+		}
+		else if (SubStrings.StartsWith("--workdir=", argv[Inc]))
+		{
+			SubStrings.Extract(WorkDir, sizeof WorkDir, "=", NULL, argv[Inc]);
+		}
+		else if (!strcmp(argv[Inc], "--tmpfs"))
+		{
+			Tmpfs = true;
+		}
+		else if (!strcmp(argv[Inc], "--keep"))
+		{
+			Keep = true;
+		}
+		else if (!strcmp(argv[Inc], "--verbose"))
+		{
+			Verbose = true;
+		}
+		else
+		{
+			fprintf(stderr, "Bad argument \"%s\".\n"
+					"Usage: %s [--files=N] [--depth=N] [--fanout=N] [--minsize=bytes] [--maxsize=bytes] [--symlinks=ratio]\n"
+					"\t[--changes=ratio] [--seed=N] [--arch=arch] [--workdir=path] [--tmpfs] [--keep] [--verbose]\n", argv[Inc], argv[0]);
+			return 1;
+		}
+	}
+	
+	if (getuid() != 0)
+	{
+		fputs("You must be root to run the benchmark, packrat needs it to create and install packages.\n", stderr);
+		return 1;
+	}
+	
+	if (!Spec.NumFiles || !Spec.Fanout || Spec.MinSize > Spec.MaxSize || *WorkDir != '/' || !*Arch)
+	{
+		fputs("Need at least one file, a nonzero fanout, minsize no larger than maxsize, an absolute workdir and an architecture.\n", stderr);
+		return 1;
+	}
+	
+	Files::RemoveTree(WorkDir);
+	
+	if (!Files::RecursiveMkdir(WorkDir, 0, 0, 0755))
+	{
+		fprintf(stderr, "Failed to create work directory %s.\n", WorkDir);
+		return 1;
+	}
+	
+	if (Tmpfs && mount("packrat-bench", WorkDir, "tmpfs", 0, "mode=0755") != 0)
+	{
+		fprintf(stderr, "Failed to mount tmpfs on %s: %s\n", WorkDir, strerror(errno));
+		return 1;
+	}
+	
+	const PkString Tree1 = PkString(WorkDir) + "/tree1", Tree2 = PkString(WorkDir) + "/tree2", Sysroot = PkString(WorkDir) + "/sysroot";
+	TreeStats Stats, Stats2;
+	std::vector<Phase> Phases;
+	
+	//Everything packrat says goes to /dev/null, the results go where stdout was.
+	FILE *Results = fdopen(dup(STDOUT_FILENO), "w");
+	
+	if (!Verbose)
+	{
+		const int Null = open("/dev/null", O_WRONLY);
+		
+		dup2(Null, STDOUT_FILENO);
+		dup2(Null, STDERR_FILENO);
+		close(Null);
+	}
+	
+	PkgObj Pkg = PkgObj();
+	
+	Pkg.PackageID = BENCH_PKGID;
+	Pkg.Arch = Arch;
+	Pkg.Description = "Synthetic package for benchmarking";
+	
+	const PkString PkgPath1 = PkString(WorkDir) + "/" BENCH_PKGID "_1.0-0." + Arch + ".pkrt";
+	const PkString PkgPath2 = PkString(WorkDir) + "/" BENCH_PKGID "_2.0-0." + Arch + ".pkrt";
+	
+	double Start = Now();
+	bool Success = GenerateTree(Tree1, Spec, 1, &Stats) && GenerateTree(Tree2, Spec, 2, &Stats2);
+	
+	Phase Generate = { "generate", Now() - Start, Success };
+	Phases.push_back(Generate);
+	
+	if (Success)
+	{
+		Start = Now();
+		Success = MakeSysroot(Sysroot, Arch);
+		
+		Phase Setup = { "setup", Now() - Start, Success };
+		Phases.push_back(Setup);
+	}
+	
+	//CreatePackage() and ReverseInstall() both work in the current directory.
+	if (Success && chdir(WorkDir) != 0) Success = false;
+	
+	if (Success)
+	{
+		Pkg.VersionString = "1.0";
+		
+		Start = Now();
+		Success = Package::CreatePackage(&Pkg, Tree1);
+		
+		Phase Create = { "create", Now() - Start, Success };
+		Phases.push_back(Create);
+	}
+	
+	if (Success)
+	{
+		Pkg.VersionString = "2.0";
+		
+		Start = Now();
+		Success = Package::CreatePackage(&Pkg, Tree2);
+		
+		Phase Create = { "create_update", Now() - Start, Success };
+		Phases.push_back(Create);
+	}
+	
+	if (Success)
+	{
+		Start = Now();
+		Success = Action::InstallPackage(PkgPath1, Sysroot);
+		
+		Phase Install = { "install", Now() - Start, Success };
+		Phases.push_back(Install);
+	}
+	
+	if (Success)
+	{
+		Start = Now();
+		Success = Action::UpdatePackage(PkgPath2, Sysroot);
+		
+		Phase Update = { "update", Now() - Start, Success };
+		Phases.push_back(Update);
+	}
+	
+	if (Success)
+	{
+		Start = Now();
+		Success = Action::ReverseInstall(BENCH_PKGID, Arch, Sysroot);
+		
+		Phase Reverse = { "reverse_install", Now() - Start, Success };
+		Phases.push_back(Reverse);
+	}
+	
+	if (Success)
+	{
+		Start = Now();
+		Success = Action::UninstallPackage(BENCH_PKGID, Arch, Sysroot);
+		
+		Phase Uninstall = { "uninstall", Now() - Start, Success };
+		Phases.push_back(Uninstall);
+	}
+	
+	Hooks::Shutdown();
+	chdir("/");
+	
+	if (Tmpfs && !Keep) umount2(WorkDir, MNT_DETACH);
+	else if (!Keep) Files::RemoveTree(WorkDir);
+	
+	PrintResults(Results, Spec, Arch, Tmpfs, Stats, Phases);
+	fclose(Results);
+	
+	return !Success;
+}
@@ -0,0 +1,550 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Microbenchmarks for the helpers that show up in profiles. Builds its fixtures once in a scratch directory:
+ * a 100,000 line file list, a sysroot with 5,000 users and groups, an installed database of 1,000 packages,
+ * and a repo with a 40,000 entry catalog.
+ * Before anything runs, the query plan of every kind of search is checked to go through the search index.
+ * Each benchmark runs until --mintime has passed and reports ns/op, plus allocations and bytes allocated per op.
+ * Allocations are counted by wrapping glibc's malloc family, so sqlite's and libstdc++'s count too.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sqlite3.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+#define MICRO_NUM_LINES 100000
+#define MICRO_NUM_USERS 5000
+#define MICRO_NUM_INSTALLED 1000
+#define MICRO_NUM_CATALOG 40000
+#define MICRO_CHECKSUM_SIZE (1024 * 1024)
+
+//Types
+struct Benchmark
+{
+	const char *Name;
+	void (*Func)(void);
+};
+
+struct Result
+{
+	const char *Name;
+	unsigned long Iterations;
+	double NsPerOp;
+	double AllocsPerOp;
+	double BytesPerOp;
+};
+
+//Prototypes
+extern "C"
+{
+	void *__libc_malloc(size_t Size);
+	void *__libc_calloc(size_t Count, size_t Size);
+	void *__libc_realloc(void *Ptr, size_t Size);
+	void __libc_free(void *Ptr);
+}
+
+static double Now(void);
+static bool MakeFixtures(const char *Arch);
+static bool MakeCatalog(const char *RepoName, const char *Arch);
+static void BenchFileListView(void);
+static void BenchLinesToLinkedList(void);
+static void BenchSlurp(void);
+static void BenchMakeFileChecksum(void);
+static void BenchLookupUsername(void);
+static void BenchLookupGroupname(void);
+static void BenchLoadPackage(void);
+static void BenchSearchOne(void);
+static void BenchSearchAll(void);
+static void BenchSearchPrefix(void);
+static void BenchSearchSubstring(void);
+static void BenchSearchKeyword(void);
+static bool CheckSearchPlans(void);
+static Result RunBenchmark(const Benchmark &Bench, const double MinTime);
+
+//Globals
+static volatile bool Counting;
+static unsigned long NumAllocs, NumBytes;
+static volatile size_t Sink; //Results go here so nothing gets optimized out.
+
+static PkString WorkDir, Sysroot, FileListPath, ChecksumPath, FileListText;
+static char LastUser[64], LastGroup[64], LastInstalled[64], LastCatalog[64], MicroArch[64];
+
+static const Benchmark Benchmarks[] =
+{
+	{ "Utils::FileListView/100k", BenchFileListView },
+	{ "Utils::LinesToLinkedList/100k", BenchLinesToLinkedList },
+	{ "Utils::Slurp/100k", BenchSlurp },
+	{ "Package::MakeFileChecksum/1MiB", BenchMakeFileChecksum },
+	{ "PWSR::LookupUsername/5k", BenchLookupUsername },
+	{ "PWSR::LookupGroupname/5k", BenchLookupGroupname },
+	{ "DB::LoadPackage/1k", BenchLoadPackage },
+	{ "Repos::SearchRepoCatalogs/one/40k", BenchSearchOne },
+	{ "Repos::SearchRepoCatalogs/all/40k", BenchSearchAll },
+	{ "Search::SearchRepos/prefix/40k", BenchSearchPrefix },
+	{ "Search::SearchRepos/substring/40k", BenchSearchSubstring },
+	{ "Search::SearchRepos/keyword/40k", BenchSearchKeyword },
+};
+
+//Functions
+extern "C" void *malloc(size_t Size) throw()
+{
+	if (Counting)
+	{
+		__sync_fetch_and_add(&NumAllocs, 1);
+		__sync_fetch_and_add(&NumBytes, Size);
+	}
+	
+	return __libc_malloc(Size);
+}
+
+extern "C" void *calloc(size_t Count, size_t Size) throw()
+{
+	if (Counting)
+	{
+		__sync_fetch_and_add(&NumAllocs, 1);
+		__sync_fetch_and_add(&NumBytes, Count * Size);
+	}
+	
+	return __libc_calloc(Count, Size);
+}
+
+extern "C" void *realloc(void *Ptr, size_t Size) throw()
+{ //Counts as an allocation, since it usually is one.
+	if (Counting)
+	{
+		__sync_fetch_and_add(&NumAllocs, 1);
+		__sync_fetch_and_add(&NumBytes, Size);
+	}
+	
+	return __libc_realloc(Ptr, Size);
+}
+
+extern "C" void free(void *Ptr) throw()
+{
+	__libc_free(Ptr);
+}
+
+static double Now(void)
+{
+	struct timespec Time;
+	
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	
+	return Time.tv_sec + Time.tv_nsec / 1e9;
+}
+
+static bool MakeCatalog(const char *RepoName, const char *Arch)
+{ /*Repos::AddToCatalog() opens and commits once per entry, which takes ages for 40k, so this does it in one transaction.
+	The index gets built here too, the way Repos::DownloadCatalogs() would, so searches never fall back to SQLite.*/
+	const PkString &RepoDir = Sysroot + REPOS_DIRECTORY + RepoName;
+	const PkString &CatalogPath = Repos::GetRepoCatalogPath(RepoName, Arch, Sysroot);
+	char Buf[512];
+	
+	if (!Files::RecursiveMkdir(RepoDir + "/" REPOS_CATALOGS_DIRECTORY, getuid(), getgid(), 0755)) return false;
+	
+	snprintf(Buf, sizeof Buf, "Name=%s\nMirrorURL=http://localhost/\nSupportedArches=%s\n", RepoName, Arch);
+	
+	if (!Utils::WriteFile(RepoDir + "/" REPO_DESC_FILENAME, Buf, strlen(Buf), false, 0644)) return false;
+	
+	if (!Repos::InitializeEmptyCatalog(CatalogPath)) return false;
+	
+	sqlite3 *Handle = NULL;
+	sqlite3_stmt *Statement = NULL;
+	const char SQL[] = "insert into catalog (PackageID, VersionString, PackageGeneration, Description, Dependencies) values (?, ?, 0, ?, ?);";
+	
+	if (sqlite3_open(CatalogPath, &Handle) != SQLITE_OK) return false;
+	
+	bool Success = sqlite3_exec(Handle, "begin;", NULL, NULL, NULL) == SQLITE_OK &&
+					sqlite3_prepare_v2(Handle, SQL, sizeof SQL - 1, &Statement, NULL) == SQLITE_OK;
+	
+	for (unsigned Inc = 0; Success && Inc < MICRO_NUM_CATALOG; ++Inc)
+	{
+		char ID[64], Desc[128], Deps[256];
+		
+		snprintf(ID, sizeof ID, "pkg%05u", Inc);
+		snprintf(Desc, sizeof Desc, "Synthetic catalog entry number %u", Inc);
+		snprintf(Deps, sizeof Deps, "pkg%05u.%s\npkg%05u.%s\npkg%05u.%s\n", Inc / 2, Arch, Inc / 3, Arch, Inc / 5, Arch);
+		
+		sqlite3_bind_text(Statement, 1, ID, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(Statement, 2, "1.0", -1, SQLITE_STATIC);
+		sqlite3_bind_text(Statement, 3, Desc, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(Statement, 4, Deps, -1, SQLITE_TRANSIENT);
+		
+		Success = sqlite3_step(Statement) == SQLITE_DONE;
+		sqlite3_reset(Statement);
+		
+		SubStrings.Copy(LastCatalog, ID, sizeof LastCatalog);
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	Success = Success && sqlite3_exec(Handle, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+	
+	sqlite3_close(Handle);
+	
+	return Success && CatIndex::BuildIndex(CatalogPath, CatalogPath + CATALOG_INDEX_SUFFIX) &&
+			Search::BuildSearchIndex(CatalogPath, CatalogPath + CATALOG_SEARCH_SUFFIX);
+}
+
+static bool MakeFixtures(const char *Arch)
+{
+	char Buf[512];
+	PkString Text;
+	
+	Files::RemoveTree(WorkDir);
+	
+	if (!Files::RecursiveMkdir(Sysroot + "/etc", getuid(), getgid(), 0755) ||
+		!Files::RecursiveMkdir(Sysroot + DB_DIRECTORY, getuid(), getgid(), 0755))
+	{
+		return false;
+	}
+	
+	///Configuration
+	snprintf(Buf, sizeof Buf, "Arch=@%s\nOSRelease=micro\n", Arch);
+	
+	if (!Utils::WriteFile(Sysroot + CONFIGFILE_PATH, Buf, strlen(Buf), false, 0644) || !Config::LoadConfig(Sysroot)) return false;
+	
+	///passwd and group, the names we look up are on the last lines.
+	for (unsigned Inc = 0; Inc < MICRO_NUM_USERS; ++Inc)
+	{
+		snprintf(Buf, sizeof Buf, "user%u:x:%u:%u:Synthetic user %u:/home/user%u:/bin/sh\n", Inc, Inc + 1000, Inc + 1000, Inc, Inc);
+		Text += Buf;
+		snprintf(LastUser, sizeof LastUser, "user%u", Inc);
+	}
+	
+	if (!Utils::WriteFile(Sysroot + "/etc/passwd", Text, Text.size(), false, 0644)) return false;
+	
+	Text.clear();
+	
+	for (unsigned Inc = 0; Inc < MICRO_NUM_USERS; ++Inc)
+	{
+		snprintf(Buf, sizeof Buf, "group%u:x:%u:user%u\n", Inc, Inc + 1000, Inc);
+		Text += Buf;
+		snprintf(LastGroup, sizeof LastGroup, "group%u", Inc);
+	}
+	
+	if (!Utils::WriteFile(Sysroot + "/etc/group", Text, Text.size(), false, 0644)) return false;
+	
+	///File list, a directory every hundred files like a typical package.
+	FileListText.clear();
+	FileListText.reserve(MICRO_NUM_LINES * 64);
+	
+	for (unsigned Inc = 0; Inc < MICRO_NUM_LINES; ++Inc)
+	{
+		if (Inc % 100 == 0) snprintf(Buf, sizeof Buf, "d root:root:755 usr/share/micro/dir%u\n", Inc / 100);
+		else snprintf(Buf, sizeof Buf, "f root:root:644 usr/share/micro/dir%u/file_number_%u.dat\n", Inc / 100, Inc);
+		
+		FileListText += Buf;
+	}
+	
+	if (!Utils::WriteFile(FileListPath, FileListText, FileListText.size(), false, 0644)) return false;
+	
+	///Something to checksum.
+	Text.assign(MICRO_CHECKSUM_SIZE, '\0');
+	
+	for (size_t Inc = 0; Inc < Text.size(); ++Inc) Text[Inc] = 'a' + (Inc * 2654435761u >> 13) % 26;
+	
+	if (!Utils::WriteFile(ChecksumPath, Text, Text.size(), false, 0644)) return false;
+	
+	///Installed database, fifty files per package.
+	if (!DB::InitializeEmptyDB(Sysroot)) return false;
+	
+	const PkString &PkgFileList = WorkDir + "/pkg_filelist.txt", &PkgChecksums = WorkDir + "/pkg_checksums.txt";
+	PkString Sums;
+	
+	Text.clear();
+	
+	for (unsigned Inc = 0; Inc < 50; ++Inc)
+	{
+		snprintf(Buf, sizeof Buf, "f root:root:644 usr/lib/micro/lib%u.so\n", Inc);
+		Text += Buf;
+		snprintf(Buf, sizeof Buf, "%040u usr/lib/micro/lib%u.so\n", Inc, Inc);
+		Sums += Buf;
+	}
+	
+	if (!Utils::WriteFile(PkgFileList, Text, Text.size(), false, 0644) ||
+		!Utils::WriteFile(PkgChecksums, Sums, Sums.size(), false, 0644))
+	{
+		return false;
+	}
+	
+	PkgObj Pkg = PkgObj();
+	
+	Pkg.Arch = Arch;
+	Pkg.VersionString = "1.0";
+	Pkg.Description = "Synthetic installed package";
+	
+	for (unsigned Inc = 0; Inc < MICRO_NUM_INSTALLED; ++Inc)
+	{
+		snprintf(LastInstalled, sizeof LastInstalled, "micro%u", Inc);
+		Pkg.PackageID = LastInstalled;
+		
+		if (!DB::SavePackage(Pkg, PkgFileList, PkgChecksums, Sysroot)) return false;
+	}
+	
+	///Catalog
+	return MakeCatalog("micro", Arch) && Repos::LoadRepos(Sysroot);
+}
+
+static void BenchFileListView(void)
+{
+	Utils::FileListView View(FileListText);
+	Utils::FileListLine LineStruct;
+	size_t Total = 0;
+	
+	while (View.Next(&LineStruct)) Total += LineStruct.Path.Size;
+	
+	Sink = Total;
+}
+
+static void BenchLinesToLinkedList(void)
+{
+	std::list<PkString> *Lines = Utils::LinesToLinkedList(FileListText);
+	
+	Sink = Lines->size();
+	delete Lines;
+}
+
+static void BenchSlurp(void)
+{
+	Sink = Utils::Slurp(FileListPath).size();
+}
+
+static void BenchMakeFileChecksum(void)
+{
+	Sink = Package::MakeFileChecksum(ChecksumPath).size();
+}
+
+static void BenchLookupUsername(void)
+{
+	Sink = PWSR::LookupUsername(Sysroot, LastUser).UserID;
+}
+
+static void BenchLookupGroupname(void)
+{
+	gid_t GroupID = 0;
+	
+	PWSR::LookupGroupname(Sysroot, LastGroup, &GroupID);
+	Sink = GroupID;
+}
+
+static void BenchLoadPackage(void)
+{
+	PkgObj Pkg;
+	
+	DB::LoadPackage(LastInstalled, MicroArch, &Pkg, Sysroot);
+	Sink = Pkg.PackageID.size();
+}
+
+static void BenchSearchOne(void)
+{
+	std::list<Repos::CatalogEntry> *Entries = Repos::SearchRepoCatalogs("micro", LastCatalog, Sysroot);
+	
+	Sink = Entries ? Entries->size() : 0;
+	delete Entries;
+}
+
+static void BenchSearchAll(void)
+{
+	std::list<Repos::CatalogEntry> *Entries = Repos::SearchRepoCatalogs("micro", "", Sysroot);
+	
+	Sink = Entries ? Entries->size() : 0;
+	delete Entries;
+}
+
+static void BenchSearchPrefix(void)
+{
+	std::list<Search::SearchResult> *Results = Search::SearchRepos("pkg3999", Search::MATCH_PREFIX, Sysroot);
+	
+	Sink = Results->size();
+	delete Results;
+}
+
+static void BenchSearchSubstring(void)
+{
+	std::list<Search::SearchResult> *Results = Search::SearchRepos("3999", Search::MATCH_SUBSTRING, Sysroot);
+	
+	Sink = Results->size();
+	delete Results;
+}
+
+static void BenchSearchKeyword(void)
+{
+	std::list<Search::SearchResult> *Results = Search::SearchRepos("entry 3999", Search::MATCH_KEYWORD, Sysroot);
+	
+	Sink = Results->size();
+	delete Results;
+}
+
+static bool CheckSearchPlans(void)
+{ /*A scan of the FTS5 table with nothing after "INDEX 0:" means it got no constraint to use, and read every row.
+	Terms under three characters are left out, the trigram index can't do anything for those.*/
+	static const struct { Search::MatchMode Mode; const char *Query; } Checks[] =
+	{
+		{ Search::MATCH_PREFIX, "pkg3999" },
+		{ Search::MATCH_PREFIX, "pkg_39%" },
+		{ Search::MATCH_SUBSTRING, "3999" },
+		{ Search::MATCH_SUBSTRING, "y_n%" },
+		{ Search::MATCH_KEYWORD, "entry 3999" },
+		{ Search::MATCH_KEYWORD, "entry 39" },
+	};
+	const PkString &CatalogPath = Repos::GetRepoCatalogPath("micro", MicroArch, Sysroot);
+	bool Success = true;
+	
+	for (size_t Inc = 0; Inc < sizeof Checks / sizeof *Checks; ++Inc)
+	{
+		PkString Plan;
+		
+		if (!Search::ExplainQuery(CatalogPath, Checks[Inc].Query, Checks[Inc].Mode, &Plan) || !strstr(Plan, "VIRTUAL TABLE INDEX") ||
+			strstr(Plan, "VIRTUAL TABLE INDEX 0:\n"))
+		{
+			fprintf(stderr, "Search for \"%s\" doesn't use the search index:\n%s", Checks[Inc].Query, +Plan);
+			Success = false;
+		}
+	}
+	
+	return Success;
+}
+
+static Result RunBenchmark(const Benchmark &Bench, const double MinTime)
+{ //One untimed run first, so page cache and lazy setup don't land on the first iteration.
+	Result Out = { Bench.Name, 0, 0.0, 0.0, 0.0 };
+	
+	Bench.Func();
+	
+	NumAllocs = 0;
+	NumBytes = 0;
+	Counting = true;
+	
+	const double Start = Now();
+	double Elapsed = 0.0;
+	
+	do
+	{
+		Bench.Func();
+		++Out.Iterations;
+	} while ((Elapsed = Now() - Start) < MinTime);
+	
+	Counting = false;
+	
+	Out.NsPerOp = Elapsed * 1e9 / Out.Iterations;
+	Out.AllocsPerOp = (double)NumAllocs / Out.Iterations;
+	Out.BytesPerOp = (double)NumBytes / Out.Iterations;
+	
+	return Out;
+}
+
+int main(int argc, char **argv)
+{
+	char Path[4096] = "/tmp/packrat-microbench";
+	char Filter[256] = { '\0' };
+	char Temp[256];
+	double MinTime = 1.0;
+	bool JSON = false, Keep = false;
+	
+	SubStrings.Copy(MicroArch, "x86_64", sizeof MicroArch);
+	
+	for (int Inc = 1; Inc < argc; ++Inc)
+	{
+		if (SubStrings.StartsWith("--workdir=", argv[Inc]))
+		{
+			SubStrings.Extract(Path, sizeof Path, "=", NULL, argv[Inc]);
+		}
+		else if (SubStrings.StartsWith("--filter=", argv[Inc]))
+		{
+			SubStrings.Extract(Filter, sizeof Filter, "=", NULL, argv[Inc]);
+		}
+		else if (SubStrings.StartsWith("--mintime=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			MinTime = strtod(Temp, NULL);
+		}
+		else if (!strcmp(argv[Inc], "--json"))
+		{
+			JSON = true;
+		}
+		else if (!strcmp(argv[Inc], "--keep"))
+		{
+			Keep = true;
+		}
+		else
+		{
+			fprintf(stderr, "Bad argument \"%s\".\n"
+					"Usage: %s [--filter=substring] [--mintime=seconds] [--workdir=path] [--json] [--keep]\n", argv[Inc], argv[0]);
+			return 1;
+		}
+	}
+	
+	if (*Path != '/')
+	{
+		fputs("The work directory must be an absolute path.\n", stderr);
+		return 1;
+	}
+	
+	WorkDir = Path;
+	Sysroot = WorkDir + "/sysroot";
+	FileListPath = WorkDir + "/filelist.txt";
+	ChecksumPath = WorkDir + "/checksum.dat";
+	
+	fputs("Building fixtures...\n", stderr);
+	
+	if (!MakeFixtures(MicroArch))
+	{
+		fprintf(stderr, "Failed to build fixtures in %s.\n", +WorkDir);
+		return 1;
+	}
+	
+	if (!CheckSearchPlans()) return 1;
+	
+	std::vector<Result> Results;
+	
+	for (size_t Inc = 0; Inc < sizeof Benchmarks / sizeof *Benchmarks; ++Inc)
+	{
+		if (*Filter && !strstr(Benchmarks[Inc].Name, Filter)) continue;
+		
+		Results.push_back(RunBenchmark(Benchmarks[Inc], MinTime));
+		
+		const Result &R = Results.back();
+		
+		if (!JSON) printf("%-42s %8lu %16.0f ns/op %12.1f allocs/op %14.0f B/op\n", R.Name, R.Iterations, R.NsPerOp, R.AllocsPerOp, R.BytesPerOp);
+	}
+	
+	if (JSON)
+	{
+		printf("{\n\t\"benchmark\": \"packrat-microbench\",\n\t\"timestamp\": %lu,\n\t\"results\": [\n", (unsigned long)time(NULL));
+		
+		for (size_t Inc = 0; Inc < Results.size(); ++Inc)
+		{
+			const Result &R = Results[Inc];
+			
+			printf("\t\t{ \"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f }%s\n",
+					R.Name, R.Iterations, R.NsPerOp, R.AllocsPerOp, R.BytesPerOp, Inc + 1 < Results.size() ? "," : "");
+		}
+		
+		puts("\t]\n}");
+	}
+	
+	if (!Keep) Files::RemoveTree(WorkDir);
+	
+	return 0;
+}
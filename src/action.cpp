@@ -18,49 +18,67 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/mount.h>
 #include "substrings/substrings.h"
 #include "packrat.h"
 
+//Types
+struct InstallJob
+{ //One package, from being mounted to being committed to the database.
+	PkString PkgPath;
+	char Path[4096]; //Where it's mounted, from Package::MountPackage()
+	PkgObj Pkg;
+	PkString FileListBuf;
+	PkString ChecksumsBuf;
+	Journal::Transaction Txn;
+	PkString Error; //Set by whichever step failed.
+	bool Failed;
+	
+	InstallJob(void) : Pkg(), Failed() { *Path = '\0'; }
+};
+
+struct InstallWave
+{
+	std::vector<InstallJob> Jobs;
+	const char *Sysroot;
+};
+
 //Prototypes
 static bool ExecutePkgCmd(const char *Command, const char *Sysroot);
+static bool PrepareInstall(InstallJob *Job, const char *Sysroot);
+static bool FinishPrepare(InstallJob *Job, const char *Sysroot);
+static void RunPreInstall(const InstallJob &Job, const char *Sysroot);
+static bool PublishFiles(InstallJob *Job);
+static bool CommitInstall(InstallJob *Job, const char *Sysroot, Triggers::Pending *Trig);
+static void PrepareWorker(void *Data, const size_t Index);
+static void CopyWorker(void *Data, const size_t Index);
 
 //Functions
 static bool ExecutePkgCmd(const char *Command, const char *Sysroot)
 { //Execute commands in a sysroot.
-	pid_t PID = fork();
-	
-	if (PID == -1) return false;
-	
-	if (PID > 0)
-	{ //Parent code
-		int ExitStatus = 1;
-		
-		waitpid(PID, &ExitStatus, 0);
-		
-		return WEXITSTATUS(ExitStatus) == 0;
-		
-	}
-	
-	//Child code
+	int ExitStatus = 1;
+	PkString Output;
 	
-	chroot(Sysroot);
-	chdir("/");
+	const bool Ran = Hooks::Run(Command, Sysroot, &ExitStatus, &Output);
 	
-	execlp("sh", "sh", "-c", Command, NULL);
+	fputs(Output, stdout);
 	
-	exit(1); //If we failed to execute, we return failure.
+	return Ran && ExitStatus == 0;
 }
 
 void Action::DeleteTempCacheDir(const char *Path)
-{
-	char CmdBuf[2][4096] = {  "rm -rf ", "umount " };
+{ //Not every temp dir has a package mounted on it, so EINVAL is fine.
+	const Trace::Scope Phase("cleanup");
+	
+	if (umount2(Path, 0) != 0 && errno == EBUSY)
+	{ //Something still has it open. Let the kernel finish the job once they're done.
+		umount2(Path, MNT_DETACH);
+	}
 	
-	SubStrings.Cat(CmdBuf[0], Path, sizeof CmdBuf);
-	SubStrings.Cat(CmdBuf[1], Path, sizeof CmdBuf);
-	system(CmdBuf[1]);
-	system(CmdBuf[0]);
+	Files::RemoveTree(Path);
 }
 
 bool Action::CreateTempCacheDir(char *OutBuf, const unsigned OutBufSize, const char *Sysroot)
@@ -84,6 +102,7 @@ bool Action::CreateTempCacheDir(char *OutBuf, const unsigned OutBufSize, const c
 
 bool Action::ReverseInstall(const char *PackageID, const char *Arch, const char *Sysroot)
 { //Turns files from an installation into a package.
+	const Trace::Scope Phase("reverse install", PackageID);
 	
 	Console::InitActions();
 	
@@ -124,7 +143,7 @@ bool Action::ReverseInstall(const char *PackageID, const char *Arch, const char
 	const PkString &InfoDir = TempDir + "/info";
 	//Create the necessary subdirectories.
 
-	if (mkdir(FilesDir, 0755) != 0 && mkdir(InfoDir, 0755) != 0)
+	if (mkdir(FilesDir, 0755) != 0 || mkdir(InfoDir, 0755) != 0)
 	{
 		Console::VomitActionError("Failed to create subdirectories of cache directory!");
 		Action::DeleteTempCacheDir(TempDir);
@@ -144,6 +163,7 @@ bool Action::ReverseInstall(const char *PackageID, const char *Arch, const char
 	
 	//Verify acquired reverse installation file checksums.
 	Console::SetCurrentAction("Verifying checksums of acquired files");
+	Console::BeginProgress();
 	
 	if (!Package::VerifyChecksums(ChecksumsBuf, FilesDir))
 	{
@@ -193,6 +213,8 @@ bool Action::ReverseInstall(const char *PackageID, const char *Arch, const char
 
 bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 {
+	const Trace::Scope Phase("update", PkgPath);
+	
 	Console::InitActions();
 
 	char Path[4096];
@@ -209,11 +231,11 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 	
 	snprintf(InfoPath, sizeof InfoPath, "%s/info/", Path);
 	
-	PkgObj OldPkg;
+	PkgObj Pkg;
 	
 	Console::SetCurrentAction("Reading package metadata");
 	
-	if (!Package::GetMetadata(InfoPath, &OldPkg))
+	if (!Package::GetMetadata(InfoPath, &Pkg))
 	{
 		fputs("ERROR: Failed to read package metadata!\n", stderr);
 		Action::DeleteTempCacheDir(Path);
@@ -221,20 +243,20 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 	}
 	
 	
-	Console::SetActionSubject(OldPkg.PackageID + "." + OldPkg.Arch);
+	Console::SetActionSubject(Pkg.PackageID + "." + Pkg.Arch);
 	
-	if (!Config::ArchPresent(OldPkg.Arch))
+	if (!Config::ArchPresent(Pkg.Arch))
 	{ //While not explicitly needed for the update operation, it gives the user some useful info.
-		fprintf(stderr, "Package's architecture %s not supported on this system.\n", +OldPkg.Arch);
+		fprintf(stderr, "Package's architecture %s not supported on this system.\n", +Pkg.Arch);
 		Action::DeleteTempCacheDir(Path);
 		return false;
 	}
 	
-	PkgObj Pkg;
+	PkgObj OldPkg;
 	
-	if (!DB::LoadPackage(OldPkg.PackageID, OldPkg.Arch, &Pkg, Sysroot))
+	if (!DB::LoadPackage(Pkg.PackageID, Pkg.Arch, &OldPkg, Sysroot))
 	{
-		fprintf(stderr, "Package %s.%s is not installed, so can't update it.\n", +OldPkg.PackageID, +OldPkg.Arch);
+		fprintf(stderr, "Package %s.%s is not installed, so can't update it.\n", +Pkg.PackageID, +Pkg.Arch);
 		Action::DeleteTempCacheDir(Path);
 		return false;
 	}
@@ -247,13 +269,29 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 		return false;
 	}
 	
+	//A delta only applies on top of the exact version it was made from.
+	const bool IsDelta = Delta::IsDelta(Path);
+	PkString BaseVersion;
+	unsigned BaseGeneration = 0;
+	
+	if (IsDelta && (!Delta::GetBase(Path, &BaseVersion, &BaseGeneration) ||
+					BaseVersion != OldPkg.VersionString || BaseGeneration != OldPkg.PackageGeneration))
+	{
+		fprintf(stderr, "This delta package applies to %s_%s-%u.%s, but %s_%s-%u.%s is installed.\n", +Pkg.PackageID, +BaseVersion,
+				BaseGeneration, +Pkg.Arch, +OldPkg.PackageID, +OldPkg.VersionString, OldPkg.PackageGeneration, +OldPkg.Arch);
+		Action::DeleteTempCacheDir(Path);
+		return false;
+	}
+	
 	Console::SetCurrentAction("Verifying file checksums");
-	//Verify checksums.
+	Console::BeginProgress();
+	//Verify checksums. A delta's are checked as it's applied, since most of its files are already installed.
 	
-	PkString ChecksumsBuf;
+	Utils::MappedFile ChecksumsBuf, FileListBuf;
 	try
 	{
-		ChecksumsBuf = Utils::Slurp(PkString(InfoPath) + "/checksums.txt");
+		ChecksumsBuf.Open(PkString(InfoPath) + "/checksums.txt");
+		FileListBuf.Open(PkString(InfoPath) + "/filelist.txt");
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -262,7 +300,7 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 		return false;
 	}
 	
-	if (!ChecksumsBuf || !Package::VerifyChecksums(ChecksumsBuf, Path))
+	if (!ChecksumsBuf.Size() || (!IsDelta && !Package::VerifyChecksums(ChecksumsBuf.Data(), PkString(Path) + "/files")))
 	{
 		char Buf[1024];
 		
@@ -274,26 +312,29 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 		return false;
 	}
 	
-	//Update files
-	PkString OldFileListBuf;
+	//Compare against what's installed now, so we know what to delete.
+	PkString OldFileListBuf, OldChecksumsBuf;
 	
-	try
+	if (!FileListBuf.Size() || !DB::GetFilesInfo(OldPkg.PackageID, OldPkg.Arch, &OldFileListBuf, &OldChecksumsBuf, Sysroot))
 	{
-		OldFileListBuf = Utils::Slurp(PkString(InfoPath) + "/filelist.txt");
+		Console::VomitActionError("Unable to compare file lists between old and new packages.");
+		Action::DeleteTempCacheDir(Path);
+		return false;
 	}
-	catch (Utils::SlurpFailure &S)
+	
+	Journal::Transaction Txn;
+	Triggers::Pending Trig;
+	
+	if (!Triggers::Begin(&Trig, Sysroot))
 	{
-		Console::VomitActionError(PkString() + "Unable to slurp file \"" + (S.Sysroot + S.Path) + "\": " + S.Reason + "\n");
-
+		Console::VomitActionError("Failed to read triggers from the package database!");
 		Action::DeleteTempCacheDir(Path);
 		return false;
 	}
 	
-	PkString NewFileListBuf;
-	
-	if (!OldFileListBuf || !DB::GetFilesInfo(OldPkg.PackageID, OldPkg.Arch, &NewFileListBuf, NULL, Sysroot))
+	if (!Journal::Begin(&Txn, Pkg, InfoPath, FileListBuf.Data(), OldFileListBuf, Sysroot))
 	{
-		Console::VomitActionError("Unable to compare file lists between old and new packages.");
+		Console::VomitActionError("Failed to create install journal!");
 		Action::DeleteTempCacheDir(Path);
 		return false;
 	}
@@ -309,10 +350,23 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 	}
 	
 	Console::SetCurrentAction("Updating files");
+	Console::BeginProgress();
 	
-	if (!Package::UpdateFiles(Path, Sysroot, OldFileListBuf, NewFileListBuf))
+	//Nothing installed is touched until the journal is committed.
+	const bool Staged = IsDelta ? Delta::StageFiles(Path, Sysroot, FileListBuf.Data(), ChecksumsBuf.Data(), OldChecksumsBuf, &Txn)
+								: Package::UpdateFiles(Path, Sysroot, FileListBuf.Data(), ChecksumsBuf.Data(), OldChecksumsBuf, &Txn);
+	
+	if (!Staged || !Journal::SyncSysroot(Sysroot) || !Journal::Commit(&Txn))
 	{
 		fputs("ERROR: File update failed.\n", stderr);
+		Journal::Abort(Txn);
+		Action::DeleteTempCacheDir(Path);
+		return false;
+	}
+	
+	if (!Journal::SyncSysroot(Sysroot))
+	{ //The journal is committed, the next run will finish the job.
+		fputs("ERROR: Failed to sync updated files to disk!\n", stderr);
 		Action::DeleteTempCacheDir(Path);
 		return false;
 	}
@@ -328,12 +382,21 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 	}
 	
 	Console::SetCurrentAction("Updating database");
-	if (!DB::SavePackage(Pkg, PkString(InfoPath) + "/filelist.txt", PkString(InfoPath) + "/checksums.txt", Sysroot))
+	
+	if (!Journal::CommitDB(Txn))
 	{
 		fputs("CRITICAL ERROR: Failed to save package database information!\n", stderr);
 		Action::DeleteTempCacheDir(Path);
+		return false;
 	}
 	
+	Journal::Finish(Txn);
+	
+	//Old files count too, some of them are gone now.
+	Triggers::Activate(&Trig, Pkg, FileListBuf.Data());
+	Triggers::Activate(&Trig, Pkg, OldFileListBuf);
+	Triggers::RunPending(&Trig, Sysroot);
+	
 	//Delete temporary directory
 	Action::DeleteTempCacheDir(Path);
 	
@@ -344,158 +407,398 @@ bool Action::UpdatePackage(const char *PkgPath, const char *Sysroot)
 	return true;
 }
 
-bool Action::InstallPackage(const char *PkgPath, const char *Sysroot)
-{
-	Console::InitActions();
-
-	char Path[4096]; //Will contain a value from Package::MountPackage()
-
-	Console::SetCurrentAction("Mounting package");
+static bool PrepareInstall(InstallJob *Job, const char *Sysroot)
+{ /*Mounts a package, reads its metadata, checks it's installable and verifies its checksums.
+	Safe to run from a worker thread, so no Console calls and no database; failures go in Job->Error.
+	FinishPrepare() is the rest of it, back on the main thread.*/
+	const Trace::Scope Phase("prepare", Job->PkgPath);
 	
 	//Extract the pkrt file into a temporary directory, which is given back to us in Path.
-	if (!Package::MountPackage(PkgPath, Sysroot, Path, sizeof Path))
+	if (!Package::MountPackage(Job->PkgPath, Sysroot, Job->Path, sizeof Job->Path))
 	{
-		Console::VomitActionError("Failed to mount package to temporary directory!");
+		Job->Error = "Failed to mount package to temporary directory!";
 		return false;
 	}
-	PkString Derp = PkString();
-	const PkString InfoDirPath = PkString(Path) + "/info";
-	const PkString FilesDirPath = PkString(Path) + "/files";
 	
-	struct PkgObj Pkg = { 0 }; //Zero initialize the entire blob.
-	
-	Console::SetCurrentAction("Reading package metadata");
+	const PkString InfoDirPath = PkString(Job->Path) + "/info";
+	const PkString FilesDirPath = PkString(Job->Path) + "/files";
 	
 	//Check metadata to see if the architecture is supported.
-	if (!Package::GetMetadata(InfoDirPath, &Pkg))
+	if (!Package::GetMetadata(InfoDirPath, &Job->Pkg))
 	{
-		Console::VomitActionError("Failed to read package metadata!", stderr);
-		Action::DeleteTempCacheDir(Path);
+		Job->Error = "Failed to read package metadata!";
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
-	Console::SetActionSubject(Pkg.PackageID + "." + Pkg.Arch);
-	//Already installed?
-	PkgObj ExistingPkg = { 0 };
+	PkgObj &Pkg = Job->Pkg;
 	
-	if (DB::LoadPackage(Pkg.PackageID, Pkg.Arch, &ExistingPkg, Sysroot ? Sysroot : "/"))
-	{
-		fprintf(stderr, "\nPackage %s.%s is already installed. The installed version is %s_%s-%u.%s\n", +Pkg.PackageID, +Pkg.Arch, +ExistingPkg.PackageID, +ExistingPkg.VersionString, ExistingPkg.PackageGeneration, +ExistingPkg.Arch);
-		Action::DeleteTempCacheDir(Path);
-		return false;
-	}
-
 	if (!Config::ArchPresent(Pkg.Arch))
 	{
-		Console::VomitActionError(PkString() + "Package's architecture " + Pkg.Arch + " not supported on this system.");
-		Action::DeleteTempCacheDir(Path);
+		Job->Error = PkString() + "Package's architecture " + Pkg.Arch + " not supported on this system.";
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
-	Console::SetCurrentAction("Verifying file checksums");
-	
-	PkString ChecksumsBuf;
+	PkString &ChecksumsBuf = Job->ChecksumsBuf;
 	try
 	{
 		ChecksumsBuf = Utils::Slurp(InfoDirPath + "/checksums.txt");
+		Job->FileListBuf = Utils::Slurp(InfoDirPath + "/filelist.txt");
 	}
 	catch (Utils::SlurpFailure &S)
 	{
-		Console::VomitActionError(PkString() + "Unable to slurp file \"" + (S.Sysroot + S.Path) + "\": " + S.Reason + "\n");
-		Action::DeleteTempCacheDir(Path);
+		Job->Error = PkString() + "Unable to slurp file \"" + (S.Sysroot + S.Path) + "\": " + S.Reason;
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
-	if (!ChecksumsBuf)
+	if (!ChecksumsBuf || !Job->FileListBuf)
 	{
-		Action::DeleteTempCacheDir(Path);
+		Job->Error = "Package has an empty checksum list or file list!";
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
-	//puts(ChecksumsBuf); fflush(NULL);
 	//Verify checksums to ensure file integrity.
 	if (!Package::VerifyChecksums(ChecksumsBuf, FilesDirPath))
 	{
 		char Buf[1024];
 		snprintf(Buf, sizeof Buf, "%s_%s-%u.%s: Package file checksum failure; package may be damaged.",
 				+Pkg.PackageID, +Pkg.VersionString, Pkg.PackageGeneration, +Pkg.Arch);
-		Action::DeleteTempCacheDir(Path);
+		Job->Error = Buf;
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
-	//Process the pre-install command.
-	if (*Pkg.Cmds.PreInstall)
-	{
-		Console::SetCurrentAction("Executing pre-install commands");
-		if (!ExecutePkgCmd(Pkg.Cmds.PreInstall, Sysroot))
-		{
-			fputs("\nWARNING: Failure exexuting pre-install commands.\n", stderr);
-		}
-	}
-	
-	//We need a file list.
-	PkString FilelistBuf;
-	try
-	{
-		FilelistBuf = Utils::Slurp(InfoDirPath + "/filelist.txt");
-	}
-	catch (Utils::SlurpFailure &S)
-	{
-		Console::VomitActionError(PkString() + "Unable to slurp file \"" + (S.Sysroot + S.Path) + "\": " + S.Reason + "\n");
-		Action::DeleteTempCacheDir(Path);
+	return true;
+}
+
+static bool FinishPrepare(InstallJob *Job, const char *Sysroot)
+{ //Main thread only, like everything else in db.cpp. The journal waits until we know the install is going ahead.
+	const PkgObj &Pkg = Job->Pkg;
+	PkgObj ExistingPkg = PkgObj();
+	
+	if (DB::LoadPackage(Pkg.PackageID, Pkg.Arch, &ExistingPkg, Sysroot ? Sysroot : ""))
+	{
+		char Buf[2048];
+		snprintf(Buf, sizeof Buf, "Package %s.%s is already installed. The installed version is %s_%s-%u.%s", +Pkg.PackageID, +Pkg.Arch,
+				+ExistingPkg.PackageID, +ExistingPkg.VersionString, ExistingPkg.PackageGeneration, +ExistingPkg.Arch);
+		Job->Error = Buf;
+		Action::DeleteTempCacheDir(Job->Path);
+		return false;
 	}
 	
-	if (!FilelistBuf)
+	if (!Journal::Begin(&Job->Txn, Pkg, PkString(Job->Path) + "/info", Job->FileListBuf, NULL, Sysroot))
 	{
-		Console::VomitActionError("Unable to open file list for scanning!", stderr);
-		Action::DeleteTempCacheDir(Path);
+		Job->Error = "Failed to create install journal!";
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
-	Console::SetCurrentAction("Installing files");
+	return true;
+}
+
+static void RunPreInstall(const InstallJob &Job, const char *Sysroot)
+{
+	if (!*Job.Pkg.Cmds.PreInstall) return;
+	
+	Console::SetCurrentAction("Executing pre-install commands");
 	
-	//Install the files.
-	if (!Package::InstallFiles(Path, Sysroot, FilelistBuf))
+	if (!ExecutePkgCmd(Job.Pkg.Cmds.PreInstall, Sysroot))
 	{
-		Console::VomitActionError("Failed to install files! Aborting installation.", stderr);
-		Action::DeleteTempCacheDir(Path);
+		fputs("\nWARNING: Failure exexuting pre-install commands.\n", stderr);
+	}
+}
+
+static bool PublishFiles(InstallJob *Job)
+{ //The staged files must be synced by now. Moves them into place, after which there's no going back.
+	if (!Journal::Commit(&Job->Txn))
+	{
+		Job->Error = "Failed to commit install journal! Aborting installation.";
+		Job->Failed = true;
+		Journal::Abort(Job->Txn);
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
+	return true;
+}
+
+static bool CommitInstall(InstallJob *Job, const char *Sysroot, Triggers::Pending *Trig)
+{ //Everything after the files are in place and synced. Always releases the package's temporary directory.
+	const Trace::Scope Phase("commit", Job->PkgPath);
+	
+	const PkgObj &Pkg = Job->Pkg;
+	
 	//Process the post-install command.
 	if (*Pkg.Cmds.PostInstall)
 	{
-		fputs("Executing post-install commands...\n", stdout);
+		Console::SetCurrentAction("Executing post-install commands");
 		if (!ExecutePkgCmd(Pkg.Cmds.PostInstall, Sysroot))
 		{
-			fputs("WARNING: Failure exexuting post-install commands.\n", stderr);
+			fputs("\nWARNING: Failure exexuting post-install commands.\n", stderr);
 		}
 	}
 	
 	///Update the database.
 	Console::SetCurrentAction("Updating package database");
 	
-	if (!DB::SavePackage(Pkg, InfoDirPath + "/filelist.txt", InfoDirPath + "/checksums.txt", Sysroot ? Sysroot : ""))
-	{
+	if (!Journal::CommitDB(Job->Txn))
+	{ //The journal stays, so the next run tries again.
 		Console::VomitActionError("Failed to save package database information!");
-		Action::DeleteTempCacheDir(Path);
+		Action::DeleteTempCacheDir(Job->Path);
 		return false;
 	}
 	
+	Journal::Finish(Job->Txn);
+	
+	Triggers::Activate(Trig, Pkg, Job->FileListBuf);
+	
 	//Delete temporary directory
-	Action::DeleteTempCacheDir(Path);
+	Action::DeleteTempCacheDir(Job->Path);
 	
 	char Buf[2048];
 	snprintf(Buf, sizeof Buf, "Package %s_%s-%u.%s installed successfully\n", +Pkg.PackageID, +Pkg.VersionString, Pkg.PackageGeneration, +Pkg.Arch);
 	
 	Console::SetCurrentAction(Buf);
 	
-	//Again, DB::Add is pointless with DB::Shutdown right after, but we're keeping it for now.
+	return true;
+}
+
+static void PrepareWorker(void *Data, const size_t Index)
+{
+	InstallWave *Wave = static_cast<InstallWave*>(Data);
+	InstallJob &Job = Wave->Jobs[Index];
+	
+	Job.Failed = !PrepareInstall(&Job, Wave->Sysroot);
+}
+
+static void CopyWorker(void *Data, const size_t Index)
+{
+	InstallWave *Wave = static_cast<InstallWave*>(Data);
+	InstallJob &Job = Wave->Jobs[Index];
+	
+	if (Job.Failed) return;
+	
+	const Trace::Scope Phase("install files", Job.PkgPath);
+	
+	if (!Package::InstallFiles(Job.Path, Wave->Sysroot, Job.FileListBuf, &Job.Txn, Job.ChecksumsBuf))
+	{
+		Job.Error = "Failed to install files! Aborting installation.";
+		Job.Failed = true;
+		Journal::Abort(Job.Txn);
+		Action::DeleteTempCacheDir(Job.Path);
+	}
+}
+
+bool Action::InstallPackage(const char *PkgPath, const char *Sysroot)
+{
+	const Trace::Scope Phase("install", PkgPath);
+	
+	Console::InitActions();
+	
+	InstallJob Job;
+	Job.PkgPath = PkgPath;
+	
+	Triggers::Pending Trig;
+	
+	if (!Triggers::Begin(&Trig, Sysroot))
+	{
+		Console::VomitActionError("Failed to read triggers from the package database!");
+		return false;
+	}
+	
+	Console::SetCurrentAction("Mounting and verifying package");
+	Console::BeginProgress();
+	
+	if (!PrepareInstall(&Job, Sysroot) || !FinishPrepare(&Job, Sysroot))
+	{
+		Console::VomitActionError(Job.Error);
+		return false;
+	}
+	
+	Console::SetActionSubject(Job.Pkg.PackageID + "." + Job.Pkg.Arch);
+	
+	RunPreInstall(Job, Sysroot);
+	
+	Console::SetCurrentAction("Installing files");
+	Console::BeginProgress();
+	
+	//Install the files under temporary names.
+	if (!Package::InstallFiles(Job.Path, Sysroot, Job.FileListBuf, &Job.Txn, Job.ChecksumsBuf))
+	{
+		Console::VomitActionError("Failed to install files! Aborting installation.", stderr);
+		Journal::Abort(Job.Txn);
+		Action::DeleteTempCacheDir(Job.Path);
+		return false;
+	}
+	
+	Console::SetCurrentAction("Syncing files");
+	
+	if (!Journal::SyncSysroot(Sysroot))
+	{
+		Console::VomitActionError("Failed to sync installed files to disk! Aborting installation.");
+		Journal::Abort(Job.Txn);
+		Action::DeleteTempCacheDir(Job.Path);
+		return false;
+	}
+	
+	if (!PublishFiles(&Job))
+	{
+		Console::VomitActionError(Job.Error);
+		return false;
+	}
+	
+	if (!Journal::SyncSysroot(Sysroot))
+	{ //The journal is committed, the next run will finish the job.
+		Console::VomitActionError("Failed to sync installed files to disk!");
+		Action::DeleteTempCacheDir(Job.Path);
+		return false;
+	}
+	
+	if (!CommitInstall(&Job, Sysroot, &Trig)) return false;
+	
+	Triggers::RunPending(&Trig, Sysroot);
+	
+	return true;
+}
+
+bool Action::InstallPackages(const std::vector<std::vector<PkString> > &Waves, const char *Sysroot)
+{ /*Installs a whole plan, as split up by Resolver::SplitWaves(). Nothing in a wave depends on anything else in it,
+	so every package in a wave is mounted and verified at once, bounded by Config::CPUJobs, then has its files copied
+	at once, bounded by Config::IOJobs. Hooks and database commits still happen one package at a time, in plan order.
+	The whole wave shares two syncs, one before its journals are committed and one before the database is touched.
+	Triggers wait until every wave is done.*/
+	const Trace::Scope Phase("install");
+	
+	char Buf[256];
+	Triggers::Pending Trig;
+	
+	if (!Triggers::Begin(&Trig, Sysroot))
+	{
+		Console::VomitActionError("Failed to read triggers from the package database!");
+		return false;
+	}
+	
+	for (size_t WaveInc = 0; WaveInc < Waves.size(); ++WaveInc)
+	{
+		const Trace::Scope WavePhase("wave");
+		InstallWave Wave;
+		
+		Wave.Sysroot = Sysroot;
+		Wave.Jobs.resize(Waves[WaveInc].size());
+		
+		for (size_t Inc = 0; Inc < Wave.Jobs.size(); ++Inc)
+		{
+			Wave.Jobs[Inc].PkgPath = Waves[WaveInc][Inc];
+		}
+		
+		snprintf(Buf, sizeof Buf, "wave %u/%u", (unsigned)WaveInc + 1, (unsigned)Waves.size());
+		Console::InitActions(Buf);
+		
+		snprintf(Buf, sizeof Buf, "Mounting and verifying %u package(s)", (unsigned)Wave.Jobs.size());
+		Console::SetCurrentAction(Buf);
+		Console::BeginProgress();
+		
+		Workers::Run(PrepareWorker, &Wave, Wave.Jobs.size(), Config::CPUJobs);
+		
+		Console::EndProgress();
+		
+		for (size_t Inc = 0; Inc < Wave.Jobs.size(); ++Inc)
+		{
+			if (!Wave.Jobs[Inc].Failed) Wave.Jobs[Inc].Failed = !FinishPrepare(&Wave.Jobs[Inc], Sysroot);
+		}
+		
+		//Hooks run in the sysroot and can see each other's effects, so one at a time.
+		for (size_t Inc = 0; Inc < Wave.Jobs.size(); ++Inc)
+		{
+			if (Wave.Jobs[Inc].Failed) continue;
+			
+			Console::SetActionSubject(Wave.Jobs[Inc].Pkg.PackageID + "." + Wave.Jobs[Inc].Pkg.Arch);
+			RunPreInstall(Wave.Jobs[Inc], Sysroot);
+		}
+		
+		snprintf(Buf, sizeof Buf, "wave %u/%u", (unsigned)WaveInc + 1, (unsigned)Waves.size());
+		Console::SetActionSubject(Buf);
+		
+		snprintf(Buf, sizeof Buf, "Installing files for %u package(s)", (unsigned)Wave.Jobs.size());
+		Console::SetCurrentAction(Buf);
+		Console::BeginProgress();
+		
+		Workers::Run(CopyWorker, &Wave, Wave.Jobs.size(), Config::IOJobs);
+		
+		Console::EndProgress();
+		
+		Console::SetCurrentAction("Syncing files");
+		
+		const bool Synced = Journal::SyncSysroot(Sysroot);
+		
+		for (size_t Inc = 0; Inc < Wave.Jobs.size(); ++Inc)
+		{
+			InstallJob &Job = Wave.Jobs[Inc];
+			
+			if (Job.Failed) continue;
+			
+			if (!Synced)
+			{
+				Job.Error = "Failed to sync installed files to disk! Aborting installation.";
+				Job.Failed = true;
+				Journal::Abort(Job.Txn);
+				Action::DeleteTempCacheDir(Job.Path);
+				continue;
+			}
+			
+			PublishFiles(&Job);
+		}
+		
+		if (Synced && !Journal::SyncSysroot(Sysroot))
+		{ //Committed journals get finished by the next run.
+			Console::VomitActionError("Failed to sync installed files to disk!");
+			
+			for (size_t Inc = 0; Inc < Wave.Jobs.size(); ++Inc)
+			{
+				if (!Wave.Jobs[Inc].Failed) Action::DeleteTempCacheDir(Wave.Jobs[Inc].Path);
+			}
+			
+			return false;
+		}
+		
+		bool WaveFailed = false;
+		
+		for (size_t Inc = 0; Inc < Wave.Jobs.size(); ++Inc)
+		{
+			InstallJob &Job = Wave.Jobs[Inc];
+			
+			Console::InitActions(Job.Pkg.PackageID ? +(Job.Pkg.PackageID + "." + Job.Pkg.Arch) : +Job.PkgPath);
+			
+			if (Job.Failed)
+			{
+				Console::VomitActionError(Job.Error);
+				WaveFailed = true;
+				continue;
+			}
+			
+			if (!CommitInstall(&Job, Sysroot, &Trig)) WaveFailed = true;
+		}
+		
+		if (WaveFailed)
+		{ //Later waves may need what just failed. What did get installed still gets its triggers.
+			Console::VomitActionError("Not continuing with the rest of the installation.");
+			Triggers::RunPending(&Trig, Sysroot);
+			return false;
+		}
+	}
+	
+	Triggers::RunPending(&Trig, Sysroot);
+	
 	return true;
 }
 
 bool Action::UninstallPackage(const char *PackageID, const char *Arch, const char *Sysroot)
 {
+	const Trace::Scope Phase("uninstall", PackageID);
+	
 	Console::InitActions(PkString(PackageID) + (Arch ? +(PkString(".") + Arch) : ""));
 	
 	if (!Arch && DB::HasMultiArches(PackageID, Sysroot ? Sysroot : ""))
@@ -535,10 +838,20 @@ bool Action::UninstallPackage(const char *PackageID, const char *Arch, const cha
 		}
 	}
 	
+	//Directories other packages still list stay, even if they end up empty.
+	std::set<PkString> KeepDirs;
+	Triggers::Pending Trig;
+	
+	if (!DB::GetDirectoriesInUse(Pkg.PackageID, Pkg.Arch, &KeepDirs, Sysroot ? Sysroot : "") || !Triggers::Begin(&Trig, Sysroot))
+	{
+		Console::VomitActionError("Failed to read the package database, cannot uninstall!");
+		return false;
+	}
+	
 	Console::SetCurrentAction("Deleting files");
 	
 	//Now delete the files.
-	if (!Package::UninstallFiles(Sysroot, FileListBuf))
+	if (!Package::UninstallFiles(Sysroot, FileListBuf, &KeepDirs))
 	{
 		Console::VomitActionError("File deletion failure! Aborting uninstallation.");
 		return false;
@@ -560,6 +873,9 @@ bool Action::UninstallPackage(const char *PackageID, const char *Arch, const cha
 	
 	DB::DeletePackage(Pkg.PackageID, Pkg.Arch, Sysroot);
 	
+	Triggers::Activate(&Trig, Pkg, FileListBuf);
+	Triggers::RunPending(&Trig, Sysroot);
+	
 	char Buf[2048];
 	snprintf(Buf, sizeof Buf, "Package %s_%s-%u.%s uninstalled successfully\n", +Pkg.PackageID, +Pkg.VersionString,
 			Pkg.PackageGeneration, +Pkg.Arch);
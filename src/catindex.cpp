@@ -0,0 +1,616 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Binary catalog index. Built from a downloaded catalog.<arch>.db so lookups don't need SQLite at all.
+ * Layout, integers are native-endian since the file never leaves the machine that built it:
+ *
+ * [IndexHeader]
+ * [IndexEntry x NumEntries]		sorted by PackageID
+ * [uint32_t x NumBuckets]			open addressing hash table on PackageID, value is entry index + 1, 0 is empty.
+ * [IndexDep x NumDeps]			packed dependency arrays, each entry owns DepStart..DepStart+DepCount
+ * [IndexProvide x NumProvides]		sonames and files from the catalog's provides table, sorted by Name then Entry
+ * [uint32_t x NumProvideBuckets]	hash table on provide Name, value is index of the first provide with that name + 1.
+ * [char x StringsSize]			sorted, deduplicated, NUL terminated string table. Offset 0 is always "".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sqlite3.h>
+#include <algorithm>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+#define INDEX_MAGIC "PKRTIDX"
+#define INDEX_VERSION 3
+
+//Types
+struct IndexHeader
+{
+	char Magic[8];
+	uint32_t Version;
+	uint32_t NumEntries;
+	uint32_t NumBuckets;
+	uint32_t NumDeps;
+	uint32_t EntriesOffset;
+	uint32_t BucketsOffset;
+	uint32_t DepsOffset;
+	uint32_t StringsOffset;
+	uint32_t StringsSize;
+	uint32_t NumProvides;
+	uint32_t NumProvideBuckets;
+	uint32_t ProvidesOffset;
+	uint32_t ProvideBucketsOffset;
+	
+	//So we know when the catalog we were built from has been replaced, even twice in the same second.
+	uint64_t CatalogSize;
+	uint64_t CatalogMTime;
+	uint64_t CatalogMTimeNsec;
+	uint64_t CatalogInode;
+};
+
+struct IndexEntry
+{
+	uint32_t PackageID;
+	uint32_t VersionString;
+	uint32_t Description;
+	uint32_t PackageGeneration;
+	uint32_t DepStart;
+	uint32_t DepCount;
+};
+
+struct IndexDep
+{
+	uint32_t PackageID;
+	uint32_t Arch;
+};
+
+struct IndexProvide
+{
+	uint32_t Name;
+	uint32_t Entry;
+	uint32_t Type; //Repos::CatalogEntry::ProvideStruct::ProvideType
+	
+	bool operator<(const IndexProvide &Other) const { return Name != Other.Name ? Name < Other.Name : Entry < Other.Entry; }
+};
+
+struct CatIndex::IndexMap
+{
+	const uint8_t *Base;
+	size_t Size;
+	
+	const IndexHeader *Header;
+	const IndexEntry *Entries;
+	const uint32_t *Buckets;
+	const IndexDep *Deps;
+	const IndexProvide *Provides;
+	const uint32_t *ProvideBuckets;
+	const char *Strings;
+	
+	struct stat FileStat; //Of the index file, for OpenCatalogIndex() to tell if it's been rebuilt.
+	unsigned Refs; //Unmapped when the last CloseIndex() drops this to zero.
+};
+
+//Prototypes
+static uint32_t HashString(const char *String);
+static bool ReadProvides(sqlite3 *Handle, std::multimap<PkString, Repos::CatalogEntry::ProvideStruct> *Out);
+static inline const char *GetString(const CatIndex::IndexMap *Map, const uint32_t Offset);
+static bool BuiltFrom(const IndexHeader &Header, const struct stat &CatalogStat);
+
+//Globals
+static std::map<PkString, CatIndex::IndexMap*> OpenMaps; //By catalog path. Each holds a reference, see OpenCatalogIndex().
+
+//Functions
+static uint32_t HashString(const char *String)
+{ //FNV-1a. Cheap and plenty good for package names.
+	uint32_t Hash = 2166136261u;
+	
+	for (; *String; ++String)
+	{
+		Hash ^= (uint8_t)*String;
+		Hash *= 16777619u;
+	}
+	
+	return Hash;
+}
+
+static inline const char *GetString(const CatIndex::IndexMap *Map, const uint32_t Offset)
+{ //Bounds checked, we don't trust what's on disk any further than we have to.
+	return Offset < Map->Header->StringsSize ? Map->Strings + Offset : "";
+}
+
+static bool BuiltFrom(const IndexHeader &Header, const struct stat &CatalogStat)
+{ //The same checks as Utils::SameFile(), against what the index recorded.
+	return (uint64_t)CatalogStat.st_size == Header.CatalogSize && (uint64_t)CatalogStat.st_mtim.tv_sec == Header.CatalogMTime &&
+			(uint64_t)CatalogStat.st_mtim.tv_nsec == Header.CatalogMTimeNsec && (uint64_t)CatalogStat.st_ino == Header.CatalogInode;
+}
+
+static bool ReadProvides(sqlite3 *Handle, std::multimap<PkString, Repos::CatalogEntry::ProvideStruct> *Out)
+{ //Keyed by PackageID. Catalogs from before the provides table existed just don't have any.
+	sqlite3_stmt *Statement = NULL;
+	
+	const char SQL[] = "select PackageID, Type, Name from provides;";
+	
+	if (sqlite3_prepare_v2(Handle, SQL, sizeof SQL - 1, &Statement, NULL) != SQLITE_OK)
+	{
+		return true;
+	}
+	
+	int Code = 0;
+	
+	while ((Code = sqlite3_step(Statement)) == SQLITE_ROW)
+	{
+		Repos::CatalogEntry::ProvideStruct Provide;
+		
+		if (!Repos::ProvideTypeFromString((const char*)sqlite3_column_text(Statement, 1), &Provide.Type)) continue;
+		
+		Provide.Name = (const char*)sqlite3_column_text(Statement, 2);
+		
+		Out->insert(std::make_pair(PkString((const char*)sqlite3_column_text(Statement, 0)), Provide));
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	return Code == SQLITE_DONE;
+}
+
+bool CatIndex::BuildIndex(const char *CatalogPath, const char *IndexPath)
+{
+	struct stat CatalogStat;
+	
+	if (stat(CatalogPath, &CatalogStat) != 0) return false;
+	
+	sqlite3 *Handle = NULL;
+	
+	if (sqlite3_open_v2(CatalogPath, &Handle, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	sqlite3_stmt *Statement = NULL;
+	const char *Tail = NULL;
+	
+	const char SQL[] = "select PackageID, VersionString, PackageGeneration, Description, Dependencies from catalog order by PackageID;";
+	
+	if (sqlite3_prepare_v2(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	///Pull everything out of the catalog first. Strings get interned so dependency names that repeat thousands of times are stored once.
+	std::vector<Repos::CatalogEntry> Catalog;
+	std::map<PkString, uint32_t> StringTable;
+	
+	StringTable[""] = 0;
+	
+	int Code = 0;
+	
+	while ((Code = sqlite3_step(Statement)) == SQLITE_ROW)
+	{
+		Catalog.push_back(Repos::CatalogEntry());
+		Repos::CatalogEntry &Entry = Catalog.back();
+		
+		Entry.PackageID = (const char*)sqlite3_column_text(Statement, 0);
+		Entry.VersionString = (const char*)sqlite3_column_text(Statement, 1);
+		Entry.PackageGeneration = sqlite3_column_int(Statement, 2);
+		Entry.Description = (const char*)sqlite3_column_text(Statement, 3); //PkString turns NULL into "".
+		
+		StringTable[Entry.PackageID] = 0;
+		StringTable[Entry.VersionString] = 0;
+		StringTable[Entry.Description] = 0;
+		
+		if (sqlite3_column_type(Statement, 4) == SQLITE_NULL) continue;
+		
+		const char *Ptr = (const char*)sqlite3_column_text(Statement, 4);
+		
+		char Line[2048];
+		char ID[sizeof Line], Arch[sizeof Line];
+		
+		while (SubStrings.Line.GetLine(Line, sizeof Line, &Ptr))
+		{
+			if (!SubStrings.Split(ID, Arch, ".", Line, SPLIT_NOKEEP)) continue;
+			
+			Repos::CatalogEntry::DepStruct S = { ID, Arch };
+			
+			Entry.Dependencies.push_back(S);
+			
+			StringTable[S.PackageID] = 0;
+			StringTable[S.Arch] = 0;
+		}
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	std::multimap<PkString, Repos::CatalogEntry::ProvideStruct> Provided;
+	
+	if (Code != SQLITE_DONE || !ReadProvides(Handle, &Provided))
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	sqlite3_close(Handle);
+	
+	for (std::multimap<PkString, Repos::CatalogEntry::ProvideStruct>::iterator Iter = Provided.begin(); Iter != Provided.end(); ++Iter)
+	{
+		StringTable[Iter->second.Name] = 0;
+	}
+	
+	///Lay out the string table. std::map gives it to us sorted.
+	PkString Strings;
+	
+	for (std::map<PkString, uint32_t>::iterator Iter = StringTable.begin(); Iter != StringTable.end(); ++Iter)
+	{
+		Iter->second = Strings.size();
+		Strings.append(Iter->first.c_str(), Iter->first.size() + 1);
+	}
+	
+	///Entries and packed dependencies.
+	std::vector<IndexEntry> Entries(Catalog.size());
+	std::vector<IndexDep> Deps;
+	std::vector<IndexProvide> Provides;
+	
+	for (size_t Inc = 0; Inc < Catalog.size(); ++Inc)
+	{
+		const Repos::CatalogEntry &Entry = Catalog[Inc];
+		IndexEntry &Out = Entries[Inc];
+		
+		Out.PackageID = StringTable[Entry.PackageID];
+		Out.VersionString = StringTable[Entry.VersionString];
+		Out.Description = StringTable[Entry.Description];
+		Out.PackageGeneration = Entry.PackageGeneration;
+		Out.DepStart = Deps.size();
+		Out.DepCount = Entry.Dependencies.size();
+		
+		for (size_t DepInc = 0; DepInc < Entry.Dependencies.size(); ++DepInc)
+		{
+			IndexDep Dep = { StringTable[Entry.Dependencies[DepInc].PackageID], StringTable[Entry.Dependencies[DepInc].Arch] };
+			Deps.push_back(Dep);
+		}
+	}
+	
+	///Hash table. Power of two and at most half full, so probe chains stay short.
+	uint32_t NumBuckets = 16;
+	
+	while (NumBuckets < Entries.size() * 2) NumBuckets <<= 1;
+	
+	std::vector<uint32_t> Buckets(NumBuckets, 0);
+	
+	for (size_t Inc = 0; Inc < Catalog.size(); ++Inc)
+	{
+		uint32_t Slot = HashString(Catalog[Inc].PackageID) & (NumBuckets - 1);
+		
+		while (Buckets[Slot] != 0) Slot = (Slot + 1) & (NumBuckets - 1);
+		
+		Buckets[Slot] = Inc + 1;
+		
+		//While we're walking the catalog in entry order, attach its provides.
+		std::pair<std::multimap<PkString, Repos::CatalogEntry::ProvideStruct>::iterator,
+				std::multimap<PkString, Repos::CatalogEntry::ProvideStruct>::iterator> Range = Provided.equal_range(Catalog[Inc].PackageID);
+		
+		for (; Range.first != Range.second; ++Range.first)
+		{
+			IndexProvide Provide = { StringTable[Range.first->second.Name], (uint32_t)Inc, (uint32_t)Range.first->second.Type };
+			Provides.push_back(Provide);
+		}
+	}
+	
+	///Provides, grouped by name so one bucket covers every package providing it.
+	std::sort(Provides.begin(), Provides.end());
+	
+	uint32_t NumProvideBuckets = 16;
+	size_t NumNames = 0;
+	
+	for (size_t Inc = 0; Inc < Provides.size(); ++Inc)
+	{
+		if (!Inc || Provides[Inc].Name != Provides[Inc - 1].Name) ++NumNames;
+	}
+	
+	while (NumProvideBuckets < NumNames * 2) NumProvideBuckets <<= 1;
+	
+	std::vector<uint32_t> ProvideBuckets(NumProvideBuckets, 0);
+	
+	for (size_t Inc = 0; Inc < Provides.size(); ++Inc)
+	{
+		if (Inc && Provides[Inc].Name == Provides[Inc - 1].Name) continue;
+		
+		uint32_t Slot = HashString(Strings.c_str() + Provides[Inc].Name) & (NumProvideBuckets - 1);
+		
+		while (ProvideBuckets[Slot] != 0) Slot = (Slot + 1) & (NumProvideBuckets - 1);
+		
+		ProvideBuckets[Slot] = Inc + 1;
+	}
+	
+	///Header.
+	IndexHeader Header;
+	memset(&Header, 0, sizeof Header);
+	
+	memcpy(Header.Magic, INDEX_MAGIC, sizeof INDEX_MAGIC);
+	Header.Version = INDEX_VERSION;
+	Header.NumEntries = Entries.size();
+	Header.NumBuckets = NumBuckets;
+	Header.NumDeps = Deps.size();
+	Header.EntriesOffset = sizeof Header;
+	Header.BucketsOffset = Header.EntriesOffset + Entries.size() * sizeof(IndexEntry);
+	Header.DepsOffset = Header.BucketsOffset + NumBuckets * sizeof(uint32_t);
+	Header.NumProvides = Provides.size();
+	Header.NumProvideBuckets = NumProvideBuckets;
+	Header.ProvidesOffset = Header.DepsOffset + Deps.size() * sizeof(IndexDep);
+	Header.ProvideBucketsOffset = Header.ProvidesOffset + Provides.size() * sizeof(IndexProvide);
+	Header.StringsOffset = Header.ProvideBucketsOffset + NumProvideBuckets * sizeof(uint32_t);
+	Header.StringsSize = Strings.size();
+	Header.CatalogSize = CatalogStat.st_size;
+	Header.CatalogMTime = CatalogStat.st_mtim.tv_sec;
+	Header.CatalogMTimeNsec = CatalogStat.st_mtim.tv_nsec;
+	Header.CatalogInode = CatalogStat.st_ino;
+	
+	///Write it to a temporary and rename it into place, so readers never see half an index.
+	const PkString &TempPath = PkString(IndexPath) + ".tmp";
+	
+	FILE *Desc = fopen(TempPath, "wb");
+	
+	if (!Desc) return false;
+	
+	bool Success = fwrite(&Header, sizeof Header, 1, Desc) == 1;
+	
+	if (Success && !Entries.empty()) Success = fwrite(&Entries[0], sizeof(IndexEntry), Entries.size(), Desc) == Entries.size();
+	if (Success) Success = fwrite(&Buckets[0], sizeof(uint32_t), Buckets.size(), Desc) == Buckets.size();
+	if (Success && !Deps.empty()) Success = fwrite(&Deps[0], sizeof(IndexDep), Deps.size(), Desc) == Deps.size();
+	if (Success && !Provides.empty()) Success = fwrite(&Provides[0], sizeof(IndexProvide), Provides.size(), Desc) == Provides.size();
+	if (Success) Success = fwrite(&ProvideBuckets[0], sizeof(uint32_t), ProvideBuckets.size(), Desc) == ProvideBuckets.size();
+	if (Success) Success = fwrite(Strings.data(), 1, Strings.size(), Desc) == Strings.size();
+	
+	if (fclose(Desc) != 0) Success = false;
+	
+	if (!Success || rename(TempPath, IndexPath) != 0)
+	{
+		unlink(TempPath);
+		return false;
+	}
+	
+	return true;
+}
+
+CatIndex::IndexMap *CatIndex::OpenIndex(const char *IndexPath, const char *CatalogPath)
+{ //Returns NULL if the index is missing, damaged, or older than the catalog. Caller should rebuild in that case.
+	struct stat FileStat;
+	
+	const int Descriptor = open(IndexPath, O_RDONLY | O_CLOEXEC);
+	
+	if (Descriptor == -1) return NULL;
+	
+	if (fstat(Descriptor, &FileStat) != 0 || (size_t)FileStat.st_size < sizeof(IndexHeader))
+	{
+		close(Descriptor);
+		return NULL;
+	}
+	
+	void *Base = mmap(NULL, FileStat.st_size, PROT_READ, MAP_SHARED, Descriptor, 0);
+	close(Descriptor); //The mapping keeps its own reference.
+	
+	if (Base == MAP_FAILED) return NULL;
+	
+	IndexMap *Map = new IndexMap;
+	
+	Map->Base = static_cast<const uint8_t*>(Base);
+	Map->Size = FileStat.st_size;
+	Map->Header = static_cast<const IndexHeader*>(Base);
+	Map->FileStat = FileStat;
+	Map->Refs = 1;
+	
+	const IndexHeader &Header = *Map->Header;
+	
+	///Sanity checks.
+	bool Valid = !memcmp(Header.Magic, INDEX_MAGIC, sizeof INDEX_MAGIC) && Header.Version == INDEX_VERSION &&
+				Header.NumBuckets && !(Header.NumBuckets & (Header.NumBuckets - 1)) &&
+				Header.EntriesOffset + (uint64_t)Header.NumEntries * sizeof(IndexEntry) <= Header.BucketsOffset &&
+				Header.BucketsOffset + (uint64_t)Header.NumBuckets * sizeof(uint32_t) <= Header.DepsOffset &&
+				Header.NumProvideBuckets && !(Header.NumProvideBuckets & (Header.NumProvideBuckets - 1)) &&
+				Header.DepsOffset + (uint64_t)Header.NumDeps * sizeof(IndexDep) <= Header.ProvidesOffset &&
+				Header.ProvidesOffset + (uint64_t)Header.NumProvides * sizeof(IndexProvide) <= Header.ProvideBucketsOffset &&
+				Header.ProvideBucketsOffset + (uint64_t)Header.NumProvideBuckets * sizeof(uint32_t) <= Header.StringsOffset &&
+				Header.StringsOffset + (uint64_t)Header.StringsSize == Map->Size &&
+				Header.StringsSize && Map->Base[Map->Size - 1] == '\0';
+	
+	///Stale?
+	struct stat CatalogStat;
+	
+	if (Valid && CatalogPath)
+	{
+		Valid = stat(CatalogPath, &CatalogStat) == 0 && BuiltFrom(Header, CatalogStat);
+	}
+	
+	if (!Valid)
+	{
+		CatIndex::CloseIndex(Map);
+		return NULL;
+	}
+	
+	Map->Entries = reinterpret_cast<const IndexEntry*>(Map->Base + Header.EntriesOffset);
+	Map->Buckets = reinterpret_cast<const uint32_t*>(Map->Base + Header.BucketsOffset);
+	Map->Deps = reinterpret_cast<const IndexDep*>(Map->Base + Header.DepsOffset);
+	Map->Provides = reinterpret_cast<const IndexProvide*>(Map->Base + Header.ProvidesOffset);
+	Map->ProvideBuckets = reinterpret_cast<const uint32_t*>(Map->Base + Header.ProvideBucketsOffset);
+	Map->Strings = reinterpret_cast<const char*>(Map->Base + Header.StringsOffset);
+	
+	return Map;
+}
+
+CatIndex::IndexMap *CatIndex::OpenCatalogIndex(const char *CatalogPath)
+{ /*Opens the index for a catalog, rebuilding it first if it's missing or stale.
+	Maps are kept open after the caller closes them, so asking again, and every request packratd serves, costs two stat()s.
+	Main thread only.*/
+	const PkString &IndexPath = PkString(CatalogPath) + CATALOG_INDEX_SUFFIX;
+	IndexMap *&Cached = OpenMaps[CatalogPath];
+	struct stat IndexStat, CatalogStat;
+	
+	if (Cached)
+	{
+		if (stat(IndexPath, &IndexStat) == 0 && Utils::SameFile(Cached->FileStat, IndexStat) && stat(CatalogPath, &CatalogStat) == 0 &&
+			BuiltFrom(*Cached->Header, CatalogStat))
+		{
+			++Cached->Refs;
+			return Cached;
+		}
+		
+		//Whoever still has the old one keeps it until they close it.
+		CatIndex::CloseIndex(Cached);
+		Cached = NULL;
+	}
+	
+	IndexMap *Map = CatIndex::OpenIndex(IndexPath, CatalogPath);
+	
+	if (!Map)
+	{
+		if (!CatIndex::BuildIndex(CatalogPath, IndexPath) || !(Map = CatIndex::OpenIndex(IndexPath, CatalogPath))) return NULL;
+	}
+	
+	++Map->Refs;
+	
+	return Cached = Map;
+}
+
+void CatIndex::CloseIndex(IndexMap *Map)
+{
+	if (!Map || --Map->Refs) return;
+	
+	munmap(const_cast<uint8_t*>(Map->Base), Map->Size);
+	delete Map;
+}
+
+uint32_t CatIndex::CountEntries(const IndexMap *Map)
+{
+	return Map->Header->NumEntries;
+}
+
+bool CatIndex::FindEntry(const IndexMap *Map, const char *PackageID, uint32_t *OutIndex)
+{
+	const uint32_t Mask = Map->Header->NumBuckets - 1;
+	uint32_t Slot = HashString(PackageID) & Mask;
+	
+	//The table is never more than half full, so this always terminates on an empty bucket.
+	for (uint32_t Probes = 0; Probes <= Mask && Map->Buckets[Slot] != 0; ++Probes, Slot = (Slot + 1) & Mask)
+	{
+		const uint32_t Index = Map->Buckets[Slot] - 1;
+		
+		if (Index >= Map->Header->NumEntries) return false; //Corrupt.
+		
+		if (!strcmp(GetString(Map, Map->Entries[Index].PackageID), PackageID))
+		{
+			if (OutIndex) *OutIndex = Index;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+bool CatIndex::GetEntry(const IndexMap *Map, const uint32_t Index, Repos::CatalogEntry *Out)
+{ //Doesn't touch Out->Arch, the index doesn't know what architecture it's for.
+	if (Index >= Map->Header->NumEntries) return false;
+	
+	const IndexEntry &Entry = Map->Entries[Index];
+	
+	Out->PackageID = GetString(Map, Entry.PackageID);
+	Out->VersionString = GetString(Map, Entry.VersionString);
+	Out->PackageGeneration = Entry.PackageGeneration;
+	Out->Description = GetString(Map, Entry.Description);
+	
+	if (!Out->Description) Out->Description = "No description provided."; //Same as what the SQLite path gives.
+	
+	Out->Dependencies.clear();
+	
+	if ((uint64_t)Entry.DepStart + Entry.DepCount > Map->Header->NumDeps) return false;
+	
+	Out->Dependencies.reserve(Entry.DepCount);
+	
+	for (uint32_t Inc = 0; Inc < Entry.DepCount; ++Inc)
+	{
+		const IndexDep &Dep = Map->Deps[Entry.DepStart + Inc];
+		
+		Repos::CatalogEntry::DepStruct S = { GetString(Map, Dep.PackageID), GetString(Map, Dep.Arch) };
+		Out->Dependencies.push_back(S);
+	}
+	
+	return true;
+}
+
+const char *CatIndex::GetPackageID(const IndexMap *Map, const uint32_t Index)
+{
+	if (Index >= Map->Header->NumEntries) return "";
+	
+	return GetString(Map, Map->Entries[Index].PackageID);
+}
+
+uint32_t CatIndex::GetDepCount(const IndexMap *Map, const uint32_t Index)
+{
+	if (Index >= Map->Header->NumEntries) return 0;
+	
+	const IndexEntry &Entry = Map->Entries[Index];
+	
+	if ((uint64_t)Entry.DepStart + Entry.DepCount > Map->Header->NumDeps) return 0;
+	
+	return Entry.DepCount;
+}
+
+bool CatIndex::GetDep(const IndexMap *Map, const uint32_t Index, const uint32_t DepNum, const char **OutPackageID, const char **OutArch)
+{ //No copies, the strings point into the mapping.
+	if (DepNum >= CatIndex::GetDepCount(Map, Index)) return false;
+	
+	const IndexDep &Dep = Map->Deps[Map->Entries[Index].DepStart + DepNum];
+	
+	*OutPackageID = GetString(Map, Dep.PackageID);
+	*OutArch = GetString(Map, Dep.Arch);
+	
+	return true;
+}
+
+bool CatIndex::FindProviders(const IndexMap *Map, const char *Name, std::vector<uint32_t> *OutEntries)
+{ //Appends the entry index of every package providing Name. One hash lookup, then a contiguous run.
+	const uint32_t Mask = Map->Header->NumProvideBuckets - 1;
+	uint32_t Slot = HashString(Name) & Mask;
+	
+	for (uint32_t Probes = 0; Probes <= Mask && Map->ProvideBuckets[Slot] != 0; ++Probes, Slot = (Slot + 1) & Mask)
+	{
+		const uint32_t First = Map->ProvideBuckets[Slot] - 1;
+		
+		if (First >= Map->Header->NumProvides) return false; //Corrupt.
+		
+		const uint32_t NameOffset = Map->Provides[First].Name;
+		
+		if (strcmp(GetString(Map, NameOffset), Name) != 0) continue;
+		
+		for (uint32_t Inc = First; Inc < Map->Header->NumProvides && Map->Provides[Inc].Name == NameOffset; ++Inc)
+		{
+			if (Map->Provides[Inc].Entry < Map->Header->NumEntries)
+			{
+				OutEntries->push_back(Map->Provides[Inc].Entry);
+			}
+		}
+		
+		return true;
+	}
+	
+	return false;
+}
@@ -0,0 +1,178 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*The client half of packratd's protocol, which daemon.cpp describes. It's all packratc has in it, so it starts
+ * in a fraction of the time packrat takes to load its libraries. packrat uses it too, for --socket=.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "packrat.h"
+
+//Functions
+int Client::Forward(int argc, char **argv, const char *SocketPath)
+{ /*SocketPath is the default, which --socket= or PACKRAT_SOCKET override. Returns -1 without doing anything
+	if there's no packratd to ask, so the caller can do the work itself.*/
+	std::vector<const char*> Args;
+	
+	if (getenv("PACKRAT_SOCKET")) SocketPath = getenv("PACKRAT_SOCKET");
+	
+	for (int Inc = 1; Inc < argc; ++Inc)
+	{
+		if (!strncmp(argv[Inc], "--socket=", sizeof "--socket=" - 1)) SocketPath = argv[Inc] + sizeof "--socket=" - 1;
+		else Args.push_back(argv[Inc]);
+	}
+	
+	//The daemon's --socket= is where to listen.
+	if (!SocketPath || !*SocketPath || Args.empty() || !strcmp(Args[0], "daemon")) return -1;
+	
+	struct sockaddr_un Addr;
+	
+	memset(&Addr, 0, sizeof Addr);
+	Addr.sun_family = AF_UNIX;
+	
+	if (strlen(SocketPath) >= sizeof Addr.sun_path) return -1;
+	
+	strcpy(Addr.sun_path, SocketPath);
+	
+	const int Conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	
+	if (Conn == -1) return -1;
+	
+	if (connect(Conn, (struct sockaddr*)&Addr, sizeof Addr) != 0)
+	{
+		close(Conn);
+		return -1;
+	}
+	
+	///Build the request.
+	char Cwd[4096], Number[32];
+	
+	if (!getcwd(Cwd, sizeof Cwd))
+	{
+		close(Conn);
+		return -1;
+	}
+	
+	const mode_t Mask = umask(0);
+	size_t NumEnv = 0;
+	
+	umask(Mask);
+	
+	while (environ[NumEnv]) ++NumEnv;
+	
+	std::string Buf(DAEMON_MAGIC, sizeof DAEMON_MAGIC);
+	
+	Buf.append(Cwd, strlen(Cwd) + 1);
+	
+	snprintf(Number, sizeof Number, "%o", (unsigned)Mask);
+	Buf.append(Number, strlen(Number) + 1);
+	
+	snprintf(Number, sizeof Number, "%u", (unsigned)Args.size());
+	Buf.append(Number, strlen(Number) + 1);
+	
+	for (size_t Inc = 0; Inc < Args.size(); ++Inc)
+	{
+		Buf.append(Args[Inc], strlen(Args[Inc]) + 1);
+	}
+	
+	snprintf(Number, sizeof Number, "%u", (unsigned)NumEnv);
+	Buf.append(Number, strlen(Number) + 1);
+	
+	for (size_t Inc = 0; Inc < NumEnv; ++Inc)
+	{
+		Buf.append(environ[Inc], strlen(environ[Inc]) + 1);
+	}
+	
+	///Send it, with our stdin, stdout and stderr.
+	const int Fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	union
+	{
+		struct cmsghdr Align;
+		char Data[CMSG_SPACE(sizeof Fds)];
+	} Control;
+	struct iovec IO = { const_cast<char*>(Buf.data()), Buf.size() };
+	struct msghdr Msg;
+	
+	memset(&Msg, 0, sizeof Msg);
+	memset(&Control, 0, sizeof Control);
+	Msg.msg_iov = &IO;
+	Msg.msg_iovlen = 1;
+	Msg.msg_control = Control.Data;
+	Msg.msg_controllen = sizeof Control.Data;
+	
+	struct cmsghdr *Header = CMSG_FIRSTHDR(&Msg);
+	
+	Header->cmsg_level = SOL_SOCKET;
+	Header->cmsg_type = SCM_RIGHTS;
+	Header->cmsg_len = CMSG_LEN(sizeof Fds);
+	memcpy(CMSG_DATA(Header), Fds, sizeof Fds);
+	
+	fflush(NULL);
+	
+	ssize_t Sent = sendmsg(Conn, &Msg, MSG_NOSIGNAL);
+	
+	if (Sent == -1)
+	{ //Nothing's happened yet, so it can still be done here.
+		close(Conn);
+		return -1;
+	}
+	
+	while ((size_t)Sent < Buf.size())
+	{
+		const ssize_t Amount = send(Conn, Buf.data() + Sent, Buf.size() - Sent, MSG_NOSIGNAL);
+		
+		if (Amount <= 0) break;
+		
+		Sent += Amount;
+	}
+	
+	///Wait for the exit status.
+	char StatusLine[32];
+	size_t Length = 0;
+	ssize_t Amount;
+	
+	while (Length < sizeof StatusLine - 1 && (Amount = recv(Conn, StatusLine + Length, sizeof StatusLine - 1 - Length, 0)) != 0)
+	{
+		if (Amount == -1)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		
+		Length += Amount;
+		
+		if (memchr(StatusLine, '\n', Length)) break;
+	}
+	
+	close(Conn);
+	StatusLine[Length] = '\0';
+	
+	if (!strchr(StatusLine, '\n'))
+	{
+		fprintf(stderr, "Lost the connection to packratd at %s.\n", SocketPath);
+		return 1;
+	}
+	
+	return atoi(StatusLine);
+}
@@ -19,6 +19,7 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include "packrat.h"
 #include "substrings/substrings.h"
@@ -30,9 +31,16 @@ static inline std::set<PkString> ArchDefault(void) { std::set<PkString> RetVal;
 std::set<PkString> Config::SupportedArches = ArchDefault();
 const PkString *Config::PrimaryArch;
 PkString Config::OSRelease;
+unsigned Config::CPUJobs; //Zero means pick for us.
+unsigned Config::IOJobs;
+PkString Config::ObjectStore;
+unsigned Config::ProgressRate; //Zero means the console's default.
+
+static PkString LoadedPath; //What we last loaded, so packratd's requests don't reparse it every time.
+static struct stat LoadedStat;
 
 //Static function prototypes
-static bool ProcessConfig(const char *ConfigStream);
+static bool ProcessConfig(const char *ConfigStream, const char *Sysroot);
 
 //Actual functions
 bool Config::LoadConfig(const char *Sysroot)
@@ -47,6 +55,16 @@ bool Config::LoadConfig(const char *Sysroot)
 		return false;
 	}
 	
+	if (LoadedPath == ConfigPath && Utils::SameFile(LoadedStat, FileStat)) return true;
+	
+	//Starting over, or a second Arch=@ would look like two primary arches.
+	LoadedPath.clear();
+	SupportedArches = ArchDefault();
+	PrimaryArch = NULL;
+	OSRelease.clear();
+	CPUJobs = IOJobs = ProgressRate = 0;
+	ObjectStore.clear();
+	
 	FILE *Descriptor = fopen(ConfigPath, "rb");
 	
 	if (!Descriptor) return false;
@@ -58,7 +76,7 @@ bool Config::LoadConfig(const char *Sysroot)
 	
 	fclose(Descriptor);
 	
-	ProcessConfig(ConfigStream);
+	ProcessConfig(ConfigStream, Sysroot);
 	
 	delete[] ConfigStream;
 	
@@ -74,10 +92,19 @@ bool Config::LoadConfig(const char *Sysroot)
 		return false;
 	}
 	
+	///Default job limits. Verification is mostly hashing, so one per core. Copying spends most of its time waiting on the disk, so allow more.
+	const long NumCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	if (!CPUJobs) CPUJobs = NumCPUs > 0 ? NumCPUs : 1;
+	if (!IOJobs) IOJobs = CPUJobs * 2;
+	
+	LoadedPath = ConfigPath;
+	LoadedStat = FileStat;
+	
 	return true;
 }
 
-static bool ProcessConfig(const char *const ConfigStream)
+static bool ProcessConfig(const char *const ConfigStream, const char *Sysroot)
 {
 	char CurrentLine[4096];
 	const char *Worker = ConfigStream;
@@ -123,6 +150,24 @@ static bool ProcessConfig(const char *const ConfigStream)
 		{
 			Config::OSRelease = LineData;
 		}
+		else if (SubStrings.CaseCompare(LineID, "CPUJobs"))
+		{
+			Config::CPUJobs = atoi(LineData);
+		}
+		else if (SubStrings.CaseCompare(LineID, "IOJobs"))
+		{
+			Config::IOJobs = atoi(LineData);
+		}
+		else if (SubStrings.CaseCompare(LineID, "ObjectStore"))
+		{ //"on" keeps it in the sysroot. An absolute path is used as is, so sysroots on the same filesystem can share one.
+			if (*LineData == '/') Config::ObjectStore = LineData;
+			else if (SubStrings.CaseCompare(LineData, "on")) Config::ObjectStore = PkString(Sysroot) + OBJECTS_DIRECTORY;
+			else Config::ObjectStore.clear();
+		}
+		else if (SubStrings.CaseCompare(LineID, "ProgressRate"))
+		{ //Worth turning down over slow links.
+			Config::ProgressRate = atoi(LineData);
+		}
 	}
 	
 	return true;
@@ -15,41 +15,196 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 
+/*The status line. On a terminal, every redraw is built in one buffer and goes out as a single write, and progress
+ * updates redraw at most Config::ProgressRate times a second however often they come in. Anywhere else each action
+ * is one plain line, and a progress phase gets a summary line when it ends, which is at the next action if not before.
+ * The progress counters may be bumped from worker threads, everything else belongs to the main thread.*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
 #include "packrat.h"
 #include "substrings/substrings.h"
 
-static PkString Subject;
+#define PROGRESS_RATE_DEFAULT 10
 
-void Console::SetCurrentAction(const char *InAction, FILE *OutDescriptor, const char *Color)
+//Types
+struct ProgressState
 {
-	static PkString Current;
+	bool Active;
+	const char *Unit;
+	uint64_t Total;
+	uint64_t Done;
+	uint64_t Bytes;
+	uint64_t Started;
+	uint64_t LastDraw;
+};
+
+//Prototypes
+static bool IsTerminal(FILE *Descriptor);
+static void FormatProgress(char *Out, const size_t OutSize);
+static void Draw(const bool ShowProgress);
+static void FinishProgress(void);
+
+//Globals
+static PkString Subject;
+static PkString Current;
+static FILE *CurrentDesc = stdout;
+static const char *CurrentColor;
+static ProgressState Progress;
+static pthread_mutex_t ConsoleLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Functions
+static bool IsTerminal(FILE *Descriptor)
+{ //Asked every time, since stdout and stderr can differ.
+	return isatty(fileno(Descriptor));
+}
+
+static void FormatProgress(char *Out, const size_t OutSize)
+{ //Throughput and an ETA from the average rate so far. Nothing until there's something to show.
+	*Out = '\0';
+	
+	if (!Progress.Done) return;
+	
+	const double Seconds = (Stats::Clock() - Progress.Started) / 1e9;
+	const double Rate = Seconds > 0.0 ? Progress.Bytes / Seconds / 1048576.0 : 0.0;
+	int Length = Progress.Total ? snprintf(Out, OutSize, " (%llu/%llu %s", (unsigned long long)Progress.Done, (unsigned long long)Progress.Total, Progress.Unit)
+								: snprintf(Out, OutSize, " (%llu %s", (unsigned long long)Progress.Done, Progress.Unit);
+	
+	if (Progress.Bytes) Length += snprintf(Out + Length, OutSize - Length, ", %.1f MiB/s", Rate);
+	
+	if (Progress.Active && Progress.Total > Progress.Done)
+	{
+		const unsigned ETA = (unsigned)(Seconds * (Progress.Total - Progress.Done) / Progress.Done + 0.5);
+		
+		Length += snprintf(Out + Length, OutSize - Length, ", ETA %u:%02u", ETA / 60, ETA % 60);
+	}
+	else if (!Progress.Active) Length += snprintf(Out + Length, OutSize - Length, ", %.2fs", Seconds);
+	
+	snprintf(Out + Length, OutSize - Length, ")");
+}
+
+static void Draw(const bool ShowProgress)
+{ //ConsoleLock must be held. Clearing to the end of the screen covers a previous line that wrapped.
+	char ProgressBuf[256] = { '\0' }, Buf[4096];
+	
+	if (ShowProgress) FormatProgress(ProgressBuf, sizeof ProgressBuf);
+	
+	const int Length = snprintf(Buf, sizeof Buf, CONSOLE_CTL_RESTORESTATE CONSOLE_CTL_SAVESTATE CONSOLE_CTL_CLEARDOWN CONSOLE_COLOR_CYAN ">>%s" CONSOLE_ENDCOLOR " %s%s%s%s",
+								Subject ? +(PkString(CONSOLE_COLOR_GREEN " [") + Subject + "]" CONSOLE_ENDCOLOR) : "", CurrentColor ? CurrentColor : "",
+								+Current, CurrentColor ? CONSOLE_ENDCOLOR : "", ProgressBuf);
 	
-	fputs(CONSOLE_CTL_RESTORESTATE, OutDescriptor);
-	for (size_t Inc = 0; Inc < Current.length(); ++Inc)
+	fwrite(Buf, 1, Length < (int)sizeof Buf ? Length : sizeof Buf - 1, CurrentDesc);
+	fflush(CurrentDesc);
+	
+	Progress.LastDraw = Stats::Clock();
+}
+
+static void FinishProgress(void)
+{ //ConsoleLock must be held. Leaves the final numbers up, or logs them if we're not on a terminal.
+	if (!Progress.Active) return;
+	
+	Progress.Active = false;
+	
+	if (IsTerminal(CurrentDesc)) Draw(true);
+	else if (Progress.Done)
 	{
-		putc(' ', OutDescriptor);
+		char ProgressBuf[256];
+		
+		FormatProgress(ProgressBuf, sizeof ProgressBuf);
+		fprintf(CurrentDesc, "  %s\n", ProgressBuf + 1);
 	}
+}
+
+void Console::SetCurrentAction(const char *InAction, FILE *OutDescriptor, const char *Color)
+{
+	pthread_mutex_lock(&ConsoleLock);
 	
-	char Buf[4096];
-	snprintf(Buf, sizeof Buf, CONSOLE_CTL_RESTORESTATE CONSOLE_CTL_SAVESTATE CONSOLE_COLOR_CYAN ">>%s" CONSOLE_ENDCOLOR " %s%s%s" ,
-			Subject ? +(PkString(CONSOLE_COLOR_GREEN " [") + Subject + "]" CONSOLE_ENDCOLOR): "", Color ? Color : "", InAction, Color ? CONSOLE_ENDCOLOR : "");
-	Current = Buf;
+	FinishProgress();
 	
-	fputs(Buf, OutDescriptor);
+	Current = InAction;
+	CurrentDesc = OutDescriptor;
+	CurrentColor = Color;
+	
+	if (IsTerminal(OutDescriptor)) Draw(false);
+	else
+	{ //One line per action, and no escape codes to litter logs with.
+		const size_t Length = Current.length();
+		
+		fprintf(OutDescriptor, ">>%s%s %.*s\n", Subject ? " [" : "", Subject ? +(Subject + "]") : "", (int)(Length && Current[Length - 1] == '\n' ? Length - 1 : Length), +Current);
+	}
+	
+	pthread_mutex_unlock(&ConsoleLock);
 }
 
 void Console::InitActions(const char *InSubject)
 {
 	SetActionSubject(InSubject);
-	fputs(CONSOLE_CTL_SAVESTATE, stdout);
+	
+	if (IsTerminal(stdout))
+	{
+		fputs(CONSOLE_CTL_SAVESTATE, stdout);
+		fflush(stdout);
+	}
 }
 
 void Console::SetActionSubject(const char *InSubject)
 {
+	pthread_mutex_lock(&ConsoleLock);
 	Subject = InSubject;
+	pthread_mutex_unlock(&ConsoleLock);
 }
 
 void Console::VomitActionError(const char *ErrMsg, FILE *OutDescriptor)
 {
-	fputs(PkString() + "\n" CONSOLE_COLOR_RED "ERROR:" CONSOLE_ENDCOLOR " " + ErrMsg + "\n", OutDescriptor);
+	Console::EndProgress();
+	
+	fflush(stdout); //So it comes out after the action it's about.
+	
+	if (IsTerminal(OutDescriptor)) fputs(PkString() + "\n" CONSOLE_COLOR_RED "ERROR:" CONSOLE_ENDCOLOR " " + ErrMsg + "\n", OutDescriptor);
+	else fputs(PkString() + "ERROR: " + ErrMsg + "\n", OutDescriptor);
+}
+
+void Console::BeginProgress(const char *Unit)
+{ //Goes with the current action. Totals come from AddProgressTotal(), which may be called as the work is found.
+	pthread_mutex_lock(&ConsoleLock);
+	
+	Progress.Unit = Unit;
+	Progress.Total = Progress.Done = Progress.Bytes = 0;
+	Progress.Started = Progress.LastDraw = Stats::Clock();
+	Progress.Active = true;
+	
+	pthread_mutex_unlock(&ConsoleLock);
+}
+
+void Console::AddProgressTotal(const uint64_t Items)
+{
+	if (Progress.Active) __sync_fetch_and_add(&Progress.Total, Items);
+}
+
+void Console::AdvanceProgress(const uint64_t Bytes, const uint64_t Items)
+{ //Cheap enough to call per file. Whoever gets here first once the interval is up does the redraw.
+	if (!Progress.Active) return;
+	
+	__sync_fetch_and_add(&Progress.Done, Items);
+	__sync_fetch_and_add(&Progress.Bytes, Bytes);
+	
+	const uint64_t Interval = 1000000000ull / (Config::ProgressRate ? Config::ProgressRate : PROGRESS_RATE_DEFAULT);
+	
+	if (Stats::Clock() - Progress.LastDraw < Interval || !IsTerminal(CurrentDesc)) return;
+	
+	if (pthread_mutex_trylock(&ConsoleLock) != 0) return;
+	
+	if (Progress.Active && Stats::Clock() - Progress.LastDraw >= Interval) Draw(true);
+	
+	pthread_mutex_unlock(&ConsoleLock);
+}
+
+void Console::EndProgress(void)
+{
+	pthread_mutex_lock(&ConsoleLock);
+	FinishProgress();
+	pthread_mutex_unlock(&ConsoleLock);
 }
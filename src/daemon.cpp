@@ -0,0 +1,560 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*packratd, started with "packrat daemon". It loads the config, repo list, catalog indexes and identity tables once,
+ * then serves commands sent by packratc, or by "packrat --socket=<path> ..." or with PACKRAT_SOCKET set in the environment.
+ *
+ * Every request runs in a fork() of the daemon, so it starts with all of that already loaded, and does its
+ * own printing and exit()ing just like a packrat run from a shell. The client hands over its stdin, stdout and
+ * stderr, so output goes straight to the client's terminal, and its working directory, umask and environment.
+ * install, remove, update, mkdb and prune run one at a time, in the order they came in. Everything else runs right away.
+ * Once something's been changed the daemon reloads whatever went stale, which the caches find for themselves with stat().
+ *
+ * Protocol, over a SOCK_STREAM Unix socket. Root only, same as packrat itself.
+ *  Client: "PKRTD1", the working directory, the umask in octal, the argument count in decimal, each argument,
+ *          the environment's size in decimal and each variable, all NUL terminated,
+ *          with its fds 0, 1 and 2 attached to the first sendmsg() as SCM_RIGHTS.
+ *  Daemon: the exit status in decimal and a newline once the command is done. Hanging up first cancels a query,
+ *          but a change that's already started is finished.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <list>
+#include <deque>
+
+#include "packrat.h"
+
+#define DAEMON_MAX_REQUEST (1024 * 1024)
+
+//Types
+struct Request
+{
+	int Conn;
+	int Fds[3]; //The client's stdin, stdout and stderr.
+	PkString Cwd;
+	mode_t Umask;
+	std::vector<PkString> Args;
+	std::vector<PkString> Env;
+	bool Mutating;
+	bool Abandoned; //Client hung up while it was running.
+	pid_t PID;
+	
+	Request(const int InConn) : Conn(InConn), Umask(), Mutating(), Abandoned(), PID() { Fds[0] = Fds[1] = Fds[2] = -1; }
+	~Request(void);
+};
+
+//Prototypes
+static void OnSignal(const int Signal);
+static bool IsMutating(const char *Command);
+static bool ParseRequest(const std::vector<char> &Buf, Request *Out);
+static bool ReadRequest(Request *Out);
+static void CloseAbove2(void);
+static void Start(Request *Req, Daemon::RunFunc Run);
+static void Reply(const Request *Req, const int Status);
+static void Warm(const char *Sysroot);
+
+//Globals
+static int WakePipe[2] = { -1, -1 }; //Signals write here so poll() wakes up.
+static volatile sig_atomic_t Quit;
+
+//Functions
+Request::~Request(void)
+{
+	if (Conn != -1) close(Conn);
+	
+	for (int Inc = 0; Inc < 3; ++Inc)
+	{
+		if (Fds[Inc] != -1) close(Fds[Inc]);
+	}
+}
+
+static void OnSignal(const int Signal)
+{
+	const int SavedErrno = errno;
+	
+	if (Signal != SIGCHLD) Quit = true;
+	
+	write(WakePipe[1], "", 1);
+	
+	errno = SavedErrno;
+}
+
+static bool IsMutating(const char *Command)
+{
+	static const char *const Commands[] = { "install", "remove", "uninstall", "update", "upgrade", "mkdb", "prune" };
+	
+	for (size_t Inc = 0; Inc < sizeof Commands / sizeof *Commands; ++Inc)
+	{
+		if (!strcmp(Command, Commands[Inc])) return true;
+	}
+	
+	return false;
+}
+
+static bool ParseRequest(const std::vector<char> &Buf, Request *Out)
+{ //False until the whole thing's in.
+	std::vector<PkString> Fields;
+	size_t Start = 0;
+	
+	for (size_t Inc = 0; Inc < Buf.size(); ++Inc)
+	{
+		if (Buf[Inc]) continue;
+		
+		Fields.push_back(std::string(&Buf[Start], Inc - Start));
+		Start = Inc + 1;
+	}
+	
+	if (Fields.size() < 5) return false;
+	
+	const size_t NumArgs = strtoul(Fields[3], NULL, 10);
+	
+	if (NumArgs > Fields.size() - 5) return false;
+	
+	const size_t NumEnv = strtoul(Fields[4 + NumArgs], NULL, 10);
+	
+	if (NumEnv > Fields.size() - 5 - NumArgs) return false;
+	
+	Out->Cwd = Fields[1];
+	Out->Umask = strtoul(Fields[2], NULL, 8) & 0777;
+	Out->Args.assign(Fields.begin() + 4, Fields.begin() + 4 + NumArgs);
+	Out->Env.assign(Fields.begin() + 5 + NumArgs, Fields.begin() + 5 + NumArgs + NumEnv);
+	
+	return true;
+}
+
+static bool ReadRequest(Request *Out)
+{ //A client that takes more than a second to send a few hundred bytes is dropped, we've other clients to see to.
+	struct timeval Timeout = { 1, 0 };
+	std::vector<char> Buf;
+	char Chunk[4096];
+	
+	setsockopt(Out->Conn, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof Timeout);
+	
+	while (Buf.size() < DAEMON_MAX_REQUEST)
+	{
+		union
+		{
+			struct cmsghdr Align;
+			char Data[CMSG_SPACE(sizeof Out->Fds)];
+		} Control;
+		struct iovec IO = { Chunk, sizeof Chunk };
+		struct msghdr Msg;
+		
+		memset(&Msg, 0, sizeof Msg);
+		Msg.msg_iov = &IO;
+		Msg.msg_iovlen = 1;
+		Msg.msg_control = Control.Data;
+		Msg.msg_controllen = sizeof Control.Data;
+		
+		const ssize_t Amount = recvmsg(Out->Conn, &Msg, MSG_CMSG_CLOEXEC);
+		
+		if (Amount <= 0) return false;
+		
+		for (struct cmsghdr *Header = CMSG_FIRSTHDR(&Msg); Header; Header = CMSG_NXTHDR(&Msg, Header))
+		{
+			if (Header->cmsg_level != SOL_SOCKET || Header->cmsg_type != SCM_RIGHTS) continue;
+			
+			const size_t NumFds = (Header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			int Fds[3];
+			
+			for (size_t Inc = 0; Inc < NumFds; ++Inc)
+			{ //Anything past the three we want, or a second lot, gets closed.
+				memcpy(&Fds[0], CMSG_DATA(Header) + Inc * sizeof(int), sizeof(int));
+				
+				if (Inc < 3 && Out->Fds[Inc] == -1) Out->Fds[Inc] = Fds[0];
+				else close(Fds[0]);
+			}
+		}
+		
+		Buf.insert(Buf.end(), Chunk, Chunk + Amount);
+		
+		if (Buf.size() >= sizeof DAEMON_MAGIC && memcmp(&Buf[0], DAEMON_MAGIC, sizeof DAEMON_MAGIC) != 0) return false;
+		
+		if (ParseRequest(Buf, Out)) return !Out->Args.empty() && Out->Fds[0] != -1 && Out->Fds[1] != -1 && Out->Fds[2] != -1;
+	}
+	
+	return false;
+}
+
+static void CloseAbove2(void)
+{ //Whatever's open in the daemon belongs to it or to other clients, and a pipe held open here keeps their readers waiting on us.
+	DIR *Dir = opendir("/proc/self/fd");
+	
+	if (!Dir)
+	{
+		const long Max = sysconf(_SC_OPEN_MAX);
+		
+		for (int Inc = 3; Inc < (Max > 0 && Max < 65536 ? Max : 65536); ++Inc) close(Inc);
+		return;
+	}
+	
+	std::vector<int> Descs;
+	struct dirent *File = NULL;
+	
+	while ((File = readdir(Dir)))
+	{
+		const int Desc = atoi(File->d_name);
+		
+		if (Desc > 2 && Desc != dirfd(Dir)) Descs.push_back(Desc);
+	}
+	
+	closedir(Dir);
+	
+	for (size_t Inc = 0; Inc < Descs.size(); ++Inc) close(Descs[Inc]);
+}
+
+static void Start(Request *Req, Daemon::RunFunc Run)
+{ //In a child, as the client's own packrat would have been, only with everything already loaded.
+	fflush(NULL);
+	
+	Req->PID = fork();
+	
+	if (Req->PID == -1)
+	{
+		dprintf(Req->Fds[2], "packratd: Unable to fork: %s\n", strerror(errno));
+		Req->PID = 0;
+		return;
+	}
+	
+	if (Req->PID != 0) return;
+	
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	
+	//Only our own client's descriptors, and only as 0, 1 and 2.
+	for (int Inc = 0; Inc < 3; ++Inc)
+	{
+		dup2(Req->Fds[Inc], Inc);
+	}
+	
+	CloseAbove2();
+	
+	umask(Req->Umask);
+	clearenv();
+	
+	for (size_t Inc = 0; Inc < Req->Env.size(); ++Inc)
+	{ //putenv() keeps the pointer, and Req lives as long as we do.
+		putenv(const_cast<char*>(+Req->Env[Inc]));
+	}
+	
+	if (chdir(Req->Cwd) != 0)
+	{
+		fprintf(stderr, "packratd: Unable to change to directory \"%s\": %s\n", +Req->Cwd, strerror(errno));
+		_exit(1);
+	}
+	
+	std::vector<char*> Argv;
+	
+	Argv.push_back(const_cast<char*>("packrat"));
+	
+	for (size_t Inc = 0; Inc < Req->Args.size(); ++Inc)
+	{
+		Argv.push_back(const_cast<char*>(+Req->Args[Inc]));
+	}
+	
+	Argv.push_back(NULL);
+	
+	const int RetVal = Run(Argv.size() - 1, &Argv[0]);
+	
+	/*Freeing everything we inherited costs a query more than the query itself, so only go through exit() for the
+	atexit() handlers: --trace, --stats, and the hook helper, which only changes start.*/
+	if (Req->Mutating || Trace::Active) exit(RetVal);
+	
+	fflush(NULL);
+	_exit(RetVal);
+}
+
+static void Reply(const Request *Req, const int Status)
+{
+	char Buf[32];
+	const int Length = snprintf(Buf, sizeof Buf, "%d\n", Status);
+	
+	send(Req->Conn, Buf, Length, MSG_NOSIGNAL);
+}
+
+static void Warm(const char *Sysroot)
+{ /*Everything a request would otherwise load from scratch. Each is checked against the files again on use,
+	so this is just to have the current versions loaded before we fork, instead of in every child.*/
+	Config::LoadConfig(Sysroot);
+	
+	if (Repos::LoadRepos(Sysroot))
+	{
+		for (size_t Inc = 0; Inc < Repos::RepoList.size(); ++Inc)
+		{
+			const Repos::RepoInfo &Repo = Repos::RepoList[Inc];
+			
+			for (size_t ArchInc = 0; ArchInc < Repo.RepoArches.size(); ++ArchInc)
+			{
+				if (!Config::SupportedArches.count(Repo.RepoArches[ArchInc])) continue;
+				
+				CatIndex::CloseIndex(CatIndex::OpenCatalogIndex(Repos::GetRepoCatalogPath(Repo.RepoName, Repo.RepoArches[ArchInc], Sysroot)));
+			}
+		}
+	}
+	
+	PWSR::LookupUserID(Sysroot, 0); //Loads both passwd and group.
+	DB::Migrate(Sysroot); //Remembers the database is current.
+	
+	//SQLite connections can't be shared with a child, so every request opens its own.
+	DB::Release();
+}
+
+bool Daemon::Serve(const char *SocketPath, const char *Sysroot, RunFunc Run)
+{
+	struct sockaddr_un Addr;
+	struct stat FileStat;
+	
+	if (WakePipe[0] != -1)
+	{ //Still set in our children.
+		fputs("packratd can't start another packratd.\n", stderr);
+		return false;
+	}
+	
+	memset(&Addr, 0, sizeof Addr);
+	Addr.sun_family = AF_UNIX;
+	
+	if (strlen(SocketPath) >= sizeof Addr.sun_path)
+	{
+		fprintf(stderr, "Socket path \"%s\" is too long.\n", SocketPath);
+		return false;
+	}
+	
+	strcpy(Addr.sun_path, SocketPath);
+	
+	int ListenDesc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	
+	if (ListenDesc == -1) return false;
+	
+	//A socket left behind by a packratd that's gone can go, but not one that's still answering, or anything else.
+	if (lstat(SocketPath, &FileStat) == 0)
+	{
+		const int Probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		const bool InUse = !S_ISSOCK(FileStat.st_mode) || connect(Probe, (struct sockaddr*)&Addr, sizeof Addr) == 0;
+		
+		close(Probe);
+		
+		if (InUse)
+		{
+			fprintf(stderr, "%s already exists, is another packratd running?\n", SocketPath);
+			close(ListenDesc);
+			return false;
+		}
+		
+		unlink(SocketPath);
+	}
+	
+	const mode_t OldMask = umask(077);
+	const bool Bound = bind(ListenDesc, (struct sockaddr*)&Addr, sizeof Addr) == 0;
+	
+	umask(OldMask);
+	
+	if (!Bound || listen(ListenDesc, SOMAXCONN) != 0 || pipe2(WakePipe, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		fprintf(stderr, "Unable to listen on %s: %s\n", SocketPath, strerror(errno));
+		close(ListenDesc);
+		return false;
+	}
+	
+	struct sigaction Action;
+	
+	memset(&Action, 0, sizeof Action);
+	Action.sa_handler = OnSignal;
+	Action.sa_flags = SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &Action, NULL);
+	sigaction(SIGTERM, &Action, NULL);
+	sigaction(SIGINT, &Action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	Warm(Sysroot);
+	
+	printf("packratd serving %s on %s\n", Sysroot, SocketPath);
+	
+	std::list<Request*> Running;
+	std::deque<Request*> Waiting; //Changes, behind whichever one's running.
+	Request *Mutator = NULL;
+	
+	while (!Quit || !Running.empty())
+	{
+		///Wait for a signal, a new client, or one hanging up.
+		std::vector<struct pollfd> PollFds;
+		std::vector<Request*> Polled;
+		struct pollfd Entry = { WakePipe[0], POLLIN, 0 };
+		
+		PollFds.push_back(Entry);
+		
+		Entry.fd = ListenDesc;
+		PollFds.push_back(Entry);
+		
+		for (std::list<Request*>::iterator Iter = Running.begin(); Iter != Running.end(); ++Iter)
+		{
+			if ((*Iter)->Abandoned) continue;
+			
+			Entry.fd = (*Iter)->Conn;
+			PollFds.push_back(Entry);
+			Polled.push_back(*Iter);
+		}
+		
+		if (poll(&PollFds[0], PollFds.size(), -1) == -1 && errno != EINTR) break;
+		
+		char Drain[64];
+		
+		while (read(WakePipe[0], Drain, sizeof Drain) > 0);
+		
+		if (Quit && ListenDesc != -1)
+		{ //New clients find nobody home and can do it themselves, instead of waiting on us to finish up.
+			close(ListenDesc);
+			unlink(SocketPath);
+			ListenDesc = -1;
+		}
+		
+		///Clients that hung up. The request was all they'll ever send, so readable means gone. Before reaping, Polled has to stay valid.
+		for (size_t Inc = 0; Inc < Polled.size(); ++Inc)
+		{
+			if (!PollFds[Inc + 2].revents) continue;
+			
+			Polled[Inc]->Abandoned = true;
+			
+			//Stopping halfway through a change would leave it to journal recovery, so those go on regardless.
+			if (!Polled[Inc]->Mutating) kill(Polled[Inc]->PID, SIGTERM);
+		}
+		
+		///Children that are done.
+		int Status = 0;
+		pid_t PID;
+		bool Finished = false;
+		
+		while ((PID = waitpid(-1, &Status, WNOHANG)) > 0)
+		{
+			for (std::list<Request*>::iterator Iter = Running.begin(); Iter != Running.end(); ++Iter)
+			{
+				Request *const Req = *Iter;
+				
+				if (Req->PID != PID) continue;
+				
+				Reply(Req, WIFEXITED(Status) ? WEXITSTATUS(Status) : 128 + WTERMSIG(Status));
+				
+				Running.erase(Iter);
+				
+				if (Req == Mutator) Mutator = NULL;
+				
+				Finished = true;
+				delete Req;
+				break;
+			}
+		}
+		
+		/*Picks up our own changes, and anything edited behind our backs, which a query would have had to reload itself.
+		The client's already got its answer, so nobody waits on this.*/
+		if (Finished) Warm(Sysroot);
+		
+		///Next change in line.
+		while (!Mutator && !Waiting.empty())
+		{
+			Request *const Req = Waiting.front();
+			char Byte;
+			
+			Waiting.pop_front();
+			
+			if (Quit || recv(Req->Conn, &Byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0)
+			{ //Shutting down, or nobody's waiting for it.
+				if (Quit) dprintf(Req->Fds[2], "packratd is shutting down, not running this.\n");
+				
+				Reply(Req, 1);
+				delete Req;
+				continue;
+			}
+			
+			Start(Req, Run);
+			
+			if (!Req->PID)
+			{
+				Reply(Req, 1);
+				delete Req;
+				continue;
+			}
+			
+			Mutator = Req;
+			Running.push_back(Req);
+		}
+		
+		if (Quit || !(PollFds[1].revents & POLLIN)) continue;
+		
+		///New client.
+		const int Conn = accept4(ListenDesc, NULL, NULL, SOCK_CLOEXEC);
+		
+		if (Conn == -1) continue;
+		
+		Request *const Req = new Request(Conn);
+		struct ucred Creds;
+		socklen_t CredsSize = sizeof Creds;
+		
+		//The socket's already 0600, this is in case someone loosens it.
+		if (getsockopt(Conn, SOL_SOCKET, SO_PEERCRED, &Creds, &CredsSize) != 0 || Creds.uid != 0 || !ReadRequest(Req))
+		{
+			delete Req;
+			continue;
+		}
+		
+		Req->Mutating = IsMutating(Req->Args[0]);
+		
+		if (Req->Mutating && Mutator)
+		{
+			Waiting.push_back(Req);
+			continue;
+		}
+		
+		Start(Req, Run);
+		
+		if (!Req->PID)
+		{
+			Reply(Req, 1);
+			delete Req;
+			continue;
+		}
+		
+		if (Req->Mutating) Mutator = Req;
+		
+		Running.push_back(Req);
+	}
+	
+	for (size_t Inc = 0; Inc < Waiting.size(); ++Inc)
+	{
+		Reply(Waiting[Inc], 1);
+		delete Waiting[Inc];
+	}
+	
+	if (ListenDesc != -1)
+	{
+		close(ListenDesc);
+		unlink(SocketPath);
+	}
+	
+	return true;
+}
@@ -42,12 +42,62 @@ static const char InstalledDBSchema[] = "create table installed (\n"
 										"PreUpdate text,\n"
 										"PostUpdate text,\n"
 										"FileList text not null,\n"
-										"Checksums text not null);";
+										"Checksums text not null,\n"
+										"Triggers text,\n"
+										"Manifest blob);";
+
+/*Bumped whenever the installed table changes, and stored in the database's user_version.
+ * 1 added Triggers.
+ * 2 added Manifest, which when set holds the file list and checksums and leaves those two columns empty.*/
+#define INSTALLED_DB_VERSION 2
 
 //Prototypes
+static sqlite3 *OpenDB(const PkString &Sysroot);
+static void CloseDB(sqlite3 *Handle);
 static bool ProcessInstalledDBColumn(sqlite3_stmt *Statement, PkgObj *Pkg, const int Index);
+static bool PackManifests(sqlite3 *Handle);
+
+//Globals
+static sqlite3 *OpenHandle; //See OpenDB().
+static PkString OpenPath;
 
 //Function definitions
+static sqlite3 *OpenDB(const PkString &Sysroot)
+{ /*One connection, opened on first use and kept, since a single install makes dozens of calls in here.
+	Main thread only. Not to be carried across fork(), so packratd calls DB::Release() before it forks.*/
+	//Callers default a missing sysroot to "" or to "/", which are the same database and should be the same handle.
+	const PkString &Path = (Sysroot == "/" ? PkString() : Sysroot) + DB_MAIN_PATH;
+	
+	if (OpenHandle && OpenPath == Path) return OpenHandle;
+	
+	DB::Release();
+	
+	if (sqlite3_open(Path, &OpenHandle) != SQLITE_OK)
+	{
+		sqlite3_close(OpenHandle);
+		OpenHandle = NULL;
+		return NULL;
+	}
+	
+	OpenPath = Path;
+	
+	return OpenHandle;
+}
+
+static void CloseDB(sqlite3 *Handle)
+{ //Stays open. A transaction a failed call left open is rolled back, same as closing it used to.
+	if (!sqlite3_get_autocommit(Handle)) sqlite3_exec(Handle, "rollback;", NULL, NULL, NULL);
+}
+
+void DB::Release(void)
+{
+	if (!OpenHandle) return;
+	
+	sqlite3_close(OpenHandle);
+	OpenHandle = NULL;
+	OpenPath.clear();
+}
+
 static bool ProcessInstalledDBColumn(sqlite3_stmt *Statement, PkgObj *Pkg, const int Index)
 {
 	const PkString &Name = sqlite3_column_name(Statement, Index);
@@ -96,19 +146,63 @@ static bool ProcessInstalledDBColumn(sqlite3_stmt *Statement, PkgObj *Pkg, const
 	{
 		Pkg->Cmds.PostUpdate = sqlite3_column_type(Statement, Index) == SQLITE_NULL ? "" : (const char*)sqlite3_column_text(Statement, Index);
 	}
+	else if (Name == "Triggers")
+	{
+		Pkg->Triggers = sqlite3_column_type(Statement, Index) == SQLITE_NULL ? "" : (const char*)sqlite3_column_text(Statement, Index);
+	}
 	
 	return true;
 }
 
+static bool PackManifests(sqlite3 *Handle)
+{ //Converts every text row to a manifest. Rows that won't convert keep their text. Runs inside Migrate()'s transaction.
+	sqlite3_stmt *Select = NULL, *Update = NULL;
+	const char SelectSQL[] = "select rowid, FileList, Checksums from installed where Manifest is null;";
+	const char UpdateSQL[] = "update installed set Manifest=?, FileList='', Checksums='' where rowid=?;";
+	
+	if (sqlite3_prepare_v2(Handle, SelectSQL, sizeof SelectSQL - 1, &Select, NULL) != SQLITE_OK ||
+		sqlite3_prepare_v2(Handle, UpdateSQL, sizeof UpdateSQL - 1, &Update, NULL) != SQLITE_OK)
+	{
+		sqlite3_finalize(Select);
+		return false;
+	}
+	
+	int Code = 0;
+	bool Success = true;
+	std::string ManifestBuf;
+	
+	while (Success && (Code = sqlite3_step(Select)) == SQLITE_ROW)
+	{
+		const char *FileListBuf = (const char*)sqlite3_column_text(Select, 1);
+		const char *ChecksumsBuf = (const char*)sqlite3_column_text(Select, 2);
+		
+		if (!Manifest::Encode(FileListBuf, ChecksumsBuf, &ManifestBuf)) continue;
+		
+		sqlite3_bind_blob(Update, 1, ManifestBuf.data(), ManifestBuf.size(), SQLITE_STATIC);
+		sqlite3_bind_int64(Update, 2, sqlite3_column_int64(Select, 0));
+		
+		Success = sqlite3_step(Update) == SQLITE_DONE;
+		
+		sqlite3_reset(Update);
+	}
+	
+	sqlite3_finalize(Select);
+	sqlite3_finalize(Update);
+	
+	return Success && Code == SQLITE_DONE;
+}
+
 bool DB::SavePackage(const PkgObj &Pkg, const char *FileListPath, const char *ChecksumsPath, const PkString &Sysroot)
 {
+	const Trace::Scope Phase("db commit");
+	
 	sqlite3 *Handle = NULL;
 	
-	PkString FileListBuf, ChecksumsBuf;
+	Utils::MappedFile FileListBuf, ChecksumsBuf;
 	try
 	{
-		FileListBuf = Utils::Slurp(FileListPath);
-		ChecksumsBuf = Utils::Slurp(ChecksumsPath);
+		FileListBuf.Open(FileListPath);
+		ChecksumsBuf.Open(ChecksumsPath);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -116,22 +210,44 @@ bool DB::SavePackage(const PkgObj &Pkg, const char *FileListPath, const char *Ch
 		return false;
 	}
 	
-	if (sqlite3_open(Sysroot + DB_MAIN_PATH, &Handle) != SQLITE_OK)
+	if (!(Handle = OpenDB(Sysroot)))
 	{
 		puts("Failed to open");
 		return false;
 	}
 
+	/*Replaces any row already there, in one transaction, so an update swaps versions atomically
+	and replaying a journal that already got this far changes nothing.*/
+	const char DeleteSQL[] = "delete from installed where PackageID=? and Arch=?;";
 	const char SQL[] = "insert into installed (PackageID, Arch, VersionString, PackageGeneration, Description, PreInstall, PostInstall, "
-					"PreUninstall, PostUninstall, PreUpdate, PostUpdate, FileList, Checksums) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+					"PreUninstall, PostUninstall, PreUpdate, PostUpdate, FileList, Checksums, Triggers, Manifest) "
+					"values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);";
+	std::string ManifestBuf;
+	const bool Packed = Manifest::Encode(FileListBuf.Data(), ChecksumsBuf.Data(), &ManifestBuf);
 
 	sqlite3_stmt *Statement = NULL;
 	const char *Tail = NULL;
 
-	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	if (sqlite3_exec(Handle, "begin;", NULL, NULL, NULL) != SQLITE_OK ||
+		sqlite3_prepare(Handle, DeleteSQL, sizeof DeleteSQL - 1, &Statement, &Tail) != SQLITE_OK)
 	{
 		puts("Failed to prepare");
-		sqlite3_close(Handle);
+		CloseDB(Handle);
+		return false;
+	}
+	
+	sqlite3_bind_text(Statement, 1, Pkg.PackageID, Pkg.PackageID.size(), SQLITE_STATIC);
+	sqlite3_bind_text(Statement, 2, Pkg.Arch, Pkg.Arch.size(), SQLITE_STATIC);
+	
+	const int DeleteCode = sqlite3_step(Statement);
+	
+	sqlite3_finalize(Statement);
+	Statement = NULL;
+	
+	if (DeleteCode != SQLITE_DONE || sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		puts("Failed to prepare");
+		CloseDB(Handle);
 		return false;
 	}
 
@@ -165,27 +281,37 @@ bool DB::SavePackage(const PkgObj &Pkg, const char *FileListPath, const char *Ch
 	Pkg.Cmds.PostUpdate ? sqlite3_bind_text(Statement, Indice++, Pkg.Cmds.PostUpdate, Pkg.Cmds.PostUpdate.size(), SQLITE_STATIC)
 						: sqlite3_bind_null(Statement, Indice++);
 	
-	sqlite3_bind_text(Statement, Indice++, FileListBuf, strlen(FileListBuf), SQLITE_STATIC);
-	sqlite3_bind_text(Statement, Indice++, ChecksumsBuf, strlen(ChecksumsBuf), SQLITE_STATIC);
+	//The text columns stay empty when the manifest has it all.
+	sqlite3_bind_text(Statement, Indice++, FileListBuf.Data(), Packed ? 0 : FileListBuf.Size(), SQLITE_STATIC);
+	sqlite3_bind_text(Statement, Indice++, ChecksumsBuf.Data(), Packed ? 0 : ChecksumsBuf.Size(), SQLITE_STATIC);
+	
+	Pkg.Triggers ? sqlite3_bind_text(Statement, Indice++, Pkg.Triggers, Pkg.Triggers.size(), SQLITE_STATIC)
+				: sqlite3_bind_null(Statement, Indice++);
+	
+	Packed ? sqlite3_bind_blob(Statement, Indice++, ManifestBuf.data(), ManifestBuf.size(), SQLITE_STATIC)
+			: sqlite3_bind_null(Statement, Indice++);
 	
 	int Code = sqlite3_step(Statement);
 	
-	if (Code == SQLITE_ERROR || Code == SQLITE_MISUSE)
-	{
-		sqlite3_close(Handle);
+	sqlite3_finalize(Statement);
+	
+	if (Code != SQLITE_DONE || sqlite3_exec(Handle, "commit;", NULL, NULL, NULL) != SQLITE_OK)
+	{ //Leaving the transaction open has it rolled back.
+		CloseDB(Handle);
 		return false;
 	}
 	
-	sqlite3_finalize(Statement);
-	sqlite3_close(Handle);
+	CloseDB(Handle);
 	return true;
 }
 
 bool DB::DeletePackage(const PkString &PackageID, const PkString &Arch, const PkString &Sysroot)
 {
+	const Trace::Scope Phase("db commit");
+	
 	sqlite3 *Handle = NULL;
 
-	if (sqlite3_open(Sysroot + DB_MAIN_PATH, &Handle) != SQLITE_OK)
+	if (!(Handle = OpenDB(Sysroot)))
 	{
 		return false;
 	}
@@ -197,19 +323,19 @@ bool DB::DeletePackage(const PkString &PackageID, const PkString &Arch, const Pk
 
 	if (sqlite3_prepare(Handle, SQL, SQL.size(), &Statement, &Tail) != SQLITE_OK)
 	{
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 
 	if (sqlite3_step(Statement) != SQLITE_DONE)
 	{
 		sqlite3_finalize(Statement);
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 
 	sqlite3_finalize(Statement);
-	sqlite3_close(Handle);
+	CloseDB(Handle);
 
 	return true;
 }
@@ -222,18 +348,18 @@ bool DB::GetFilesInfo(const PkString &PackageID, const PkString &Arch, PkString
 	
 	sqlite3 *Handle = NULL;
 	
-	if (sqlite3_open(Sysroot + DB_MAIN_PATH, &Handle) != SQLITE_OK)
+	if (!(Handle = OpenDB(Sysroot)))
 	{
 		return false;
 	}
 	
-	const PkString &SQL = PkString() + "select FileList, Checksums from installed where PackageID='" + PackageID + "' and Arch='" + Arch + "';";
+	const PkString &SQL = PkString() + "select FileList, Checksums, Manifest from installed where PackageID='" + PackageID + "' and Arch='" + Arch + "';";
 	sqlite3_stmt *Statement = NULL;
 	const char *Tail = NULL;
 	
 	if (sqlite3_prepare(Handle, SQL, SQL.size(), &Statement, &Tail) != SQLITE_OK)
 	{
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 	
@@ -242,16 +368,27 @@ bool DB::GetFilesInfo(const PkString &PackageID, const PkString &Arch, PkString
 	if (Code == SQLITE_DONE)
 	{ //Not found.
 		sqlite3_finalize(Statement);
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 	
 	if (Code != SQLITE_ROW)
 	{ //Possible other error.
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 	
+	if (sqlite3_column_type(Statement, 2) != SQLITE_NULL)
+	{
+		const void *Blob = sqlite3_column_blob(Statement, 2);
+		const bool Success = Manifest::Decode(Blob, sqlite3_column_bytes(Statement, 2), OutFileList, OutChecksums);
+		
+		sqlite3_finalize(Statement);
+		CloseDB(Handle);
+		
+		return Success;
+	}
+	
 	if (OutFileList)
 	{
 		if (sqlite3_column_type(Statement, 0) == SQLITE_NULL)
@@ -274,7 +411,7 @@ bool DB::GetFilesInfo(const PkString &PackageID, const PkString &Arch, PkString
 	}
 	
 	sqlite3_finalize(Statement);
-	sqlite3_close(Handle);
+	CloseDB(Handle);
 	
 	return true;
 }
@@ -287,7 +424,7 @@ bool DB::LoadPackage(const PkString &PackageID, const PkString &Arch, PkgObj *Ou
 	
 	sqlite3 *Handle = NULL;
 	
-	if (sqlite3_open(Sysroot + DB_MAIN_PATH, &Handle) != SQLITE_OK)
+	if (!(Handle = OpenDB(Sysroot)))
 	{
 		return false;
 	}
@@ -297,13 +434,13 @@ bool DB::LoadPackage(const PkString &PackageID, const PkString &Arch, PkgObj *Ou
 	if (Arch)
 	{
 		SQL = PkString() + "select PackageID, Arch, VersionString, PackageGeneration, "
-							"Description, PreInstall, PostInstall, PreUninstall, PostUninstall, PreUpdate, PostUpdate "
+							"Description, PreInstall, PostInstall, PreUninstall, PostUninstall, PreUpdate, PostUpdate, Triggers "
 							"from installed where PackageID='" + PackageID + "' and Arch='" + Arch + "' limit 1;";
 	}
 	else
 	{
 		SQL = PkString() + "select PackageID, Arch, VersionString, PackageGeneration, "
-							"Description, PreInstall, PostInstall, PreUninstall, PostUninstall, PreUpdate, PostUpdate "
+							"Description, PreInstall, PostInstall, PreUninstall, PostUninstall, PreUpdate, PostUpdate, Triggers "
 							"from installed where PackageID='" + PackageID + "' and (Arch='" + *Config::PrimaryArch + "' or "
 							"Arch='noarch') limit 1;";
 	}
@@ -312,7 +449,7 @@ bool DB::LoadPackage(const PkString &PackageID, const PkString &Arch, PkgObj *Ou
 	
 	if (sqlite3_prepare(Handle, SQL, SQL.size(), &Statement, &Tail) != SQLITE_OK)
 	{
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		fputs("Failed to prepare SQL statement", stderr);
 		return false;
 	}
@@ -322,13 +459,13 @@ bool DB::LoadPackage(const PkString &PackageID, const PkString &Arch, PkgObj *Ou
 	if (Code == SQLITE_DONE)
 	{ //Not found.
 		sqlite3_finalize(Statement);
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 	
 	if (Code != SQLITE_ROW)
 	{ //Possible other error.
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 	
@@ -342,7 +479,7 @@ bool DB::LoadPackage(const PkString &PackageID, const PkString &Arch, PkgObj *Ou
 	}
 	
 	sqlite3_finalize(Statement);
-	sqlite3_close(Handle);
+	CloseDB(Handle);
 	
 	return true;
 }
@@ -350,12 +487,13 @@ bool DB::LoadPackage(const PkString &PackageID, const PkString &Arch, PkgObj *Ou
 bool DB::InitializeEmptyDB(const PkString &Sysroot)
 { //Wipe database and recreate as empty.
 	
-	//Wipe it and set permissions.
+	//Wipe it and set permissions. Our connection goes first, it wouldn't notice.
+	DB::Release();
 	Utils::WriteFile(Sysroot + DB_MAIN_PATH, NULL, 0, false, 0664);
 	
 	sqlite3 *Handle = NULL;
 
-	if (sqlite3_open(Sysroot + DB_MAIN_PATH, &Handle) != 0)
+	if (!(Handle = OpenDB(Sysroot)))
 	{
 		return false;
 	}
@@ -365,29 +503,106 @@ bool DB::InitializeEmptyDB(const PkString &Sysroot)
 
 	if (sqlite3_prepare(Handle, InstalledDBSchema, sizeof InstalledDBSchema - 1, &Statement, &Tail) != SQLITE_OK)
 	{
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 
 	if (sqlite3_step(Statement) != SQLITE_DONE)
 	{
 		sqlite3_finalize(Statement);
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 
 	sqlite3_finalize(Statement);
-	sqlite3_close(Handle);
+	
+	char VersionSQL[64];
+	
+	snprintf(VersionSQL, sizeof VersionSQL, "pragma user_version=%d;", INSTALLED_DB_VERSION);
+	
+	const bool Success = sqlite3_exec(Handle, VersionSQL, NULL, NULL, NULL) == SQLITE_OK;
+	
+	CloseDB(Handle);
 
-	return true;
+	return Success;
 
 }
 
+bool DB::Migrate(const PkString &Sysroot)
+{ //Brings a database made by an older packrat up to INSTALLED_DB_VERSION. No database at all is fine too.
+	static PkString CurrentPath; //Last one found up to date, which packratd's requests don't need to open to check again.
+	static struct stat CurrentStat;
+	struct stat FileStat;
+	
+	if (stat(Sysroot + DB_MAIN_PATH, &FileStat) != 0) return true;
+	
+	if (CurrentPath == Sysroot + DB_MAIN_PATH && Utils::SameFile(CurrentStat, FileStat)) return true;
+	
+	sqlite3 *Handle = NULL;
+	
+	if (!(Handle = OpenDB(Sysroot)))
+	{
+		return false;
+	}
+	
+	sqlite3_stmt *Statement = NULL;
+	const char *Tail = NULL;
+	const char SQL[] = "pragma user_version;";
+	
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK || sqlite3_step(Statement) != SQLITE_ROW)
+	{
+		sqlite3_finalize(Statement);
+		CloseDB(Handle);
+		return false;
+	}
+	
+	const int Version = sqlite3_column_int(Statement, 0);
+	
+	sqlite3_finalize(Statement);
+	
+	if (Version >= INSTALLED_DB_VERSION)
+	{
+		CloseDB(Handle);
+		
+		CurrentPath = Sysroot + DB_MAIN_PATH;
+		CurrentStat = FileStat;
+		return true;
+	}
+	
+	//Every step and the version bump go in together.
+	bool Success = sqlite3_exec(Handle, "begin;", NULL, NULL, NULL) == SQLITE_OK;
+	
+	if (Success && Version < 1)
+	{
+		Success = sqlite3_exec(Handle, "alter table installed add column Triggers text;", NULL, NULL, NULL) == SQLITE_OK;
+	}
+	
+	if (Success && Version < 2)
+	{
+		Success = sqlite3_exec(Handle, "alter table installed add column Manifest blob;", NULL, NULL, NULL) == SQLITE_OK &&
+					PackManifests(Handle);
+	}
+	
+	char VersionSQL[64];
+	
+	snprintf(VersionSQL, sizeof VersionSQL, "pragma user_version=%d;", INSTALLED_DB_VERSION);
+	
+	Success = Success && sqlite3_exec(Handle, VersionSQL, NULL, NULL, NULL) == SQLITE_OK &&
+				sqlite3_exec(Handle, "commit;", NULL, NULL, NULL) == SQLITE_OK;
+	
+	//Packing the text away leaves the pages it was on free, so hand them back. Not worth failing over.
+	if (Success && Version < 2) sqlite3_exec(Handle, "vacuum;", NULL, NULL, NULL);
+	
+	CloseDB(Handle);
+	
+	return Success;
+}
+
 bool DB::HasMultiArches(const char *PackageID, const PkString &Sysroot)
 {
 	sqlite3 *Handle = NULL;
 	
-	if (sqlite3_open(Sysroot + DB_MAIN_PATH, &Handle) != 0)
+	if (!(Handle = OpenDB(Sysroot)))
 	{
 		return false;
 	}
@@ -398,7 +613,7 @@ bool DB::HasMultiArches(const char *PackageID, const PkString &Sysroot)
 	const PkString &SQL = PkString() + "select PackageID, Arch from installed where PackageID='" + PackageID + "';";
 	if (sqlite3_prepare(Handle, SQL, SQL.size(), &Statement, &Tail) != SQLITE_OK)
 	{
-		sqlite3_close(Handle);
+		CloseDB(Handle);
 		return false;
 	}
 	
@@ -408,17 +623,139 @@ bool DB::HasMultiArches(const char *PackageID, const PkString &Sysroot)
 			sqlite3_finalize(Statement);
 			//Fall through
 		default:
-			sqlite3_close(Handle);
+			CloseDB(Handle);
 			return false;
 			break;
 		case SQLITE_ROW:
 		{
 			const bool Result = sqlite3_step(Statement) == SQLITE_ROW;
 			sqlite3_finalize(Statement);
-			sqlite3_close(Handle);
+			CloseDB(Handle);
 			return Result;
 			break;
 		}
 	}
 	
 }
+
+bool DB::GetInstalledList(std::vector<std::pair<PkString, PkString> > *Out, const PkString &Sysroot)
+{ //PackageID and Arch of everything installed.
+	sqlite3 *Handle = NULL;
+	
+	if (!(Handle = OpenDB(Sysroot)))
+	{
+		return false;
+	}
+	
+	sqlite3_stmt *Statement = NULL;
+	const char *Tail = NULL;
+	
+	const char SQL[] = "select PackageID, Arch from installed;";
+	
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		CloseDB(Handle);
+		return false;
+	}
+	
+	int Code = 0;
+	
+	while ((Code = sqlite3_step(Statement)) == SQLITE_ROW)
+	{
+		Out->push_back(std::make_pair(PkString((const char*)sqlite3_column_text(Statement, 0)), PkString((const char*)sqlite3_column_text(Statement, 1))));
+	}
+	
+	sqlite3_finalize(Statement);
+	CloseDB(Handle);
+	
+	return Code == SQLITE_DONE;
+}
+
+bool DB::GetDirectoriesInUse(const PkString &PackageID, const PkString &Arch, std::set<PkString> *Out, const PkString &Sysroot)
+{ //Every directory in the file list of any installed package other than this one.
+	sqlite3 *Handle = NULL;
+	
+	if (!(Handle = OpenDB(Sysroot)))
+	{
+		return false;
+	}
+	
+	sqlite3_stmt *Statement = NULL;
+	const char *Tail = NULL;
+	
+	const char SQL[] = "select FileList, Manifest from installed where not (PackageID=? and Arch=?);";
+	
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		CloseDB(Handle);
+		return false;
+	}
+	
+	sqlite3_bind_text(Statement, 1, PackageID, PackageID.size(), SQLITE_STATIC);
+	sqlite3_bind_text(Statement, 2, Arch, Arch.size(), SQLITE_STATIC);
+	
+	int Code = 0;
+	Utils::FileListLine LineStruct;
+	Manifest::Entry Entry;
+	
+	while ((Code = sqlite3_step(Statement)) == SQLITE_ROW)
+	{
+		if (sqlite3_column_type(Statement, 1) != SQLITE_NULL)
+		{ //Straight off the blob, no text in between.
+			const void *Blob = sqlite3_column_blob(Statement, 1);
+			Manifest::Reader Reader(Blob, sqlite3_column_bytes(Statement, 1));
+			
+			while (Reader.Next(&Entry))
+			{
+				if (Entry.Type == Utils::FileListLine::FLLTYPE_DIRECTORY) Out->insert(Entry.Path.Str());
+			}
+			continue;
+		}
+		
+		Utils::FileListView View((const char*)sqlite3_column_text(Statement, 0));
+		
+		while (View.Next(&LineStruct))
+		{
+			if (LineStruct.Type == Utils::FileListLine::FLLTYPE_DIRECTORY) Out->insert(LineStruct.Path.Str());
+		}
+	}
+	
+	sqlite3_finalize(Statement);
+	CloseDB(Handle);
+	
+	return Code == SQLITE_DONE;
+}
+
+bool DB::GetAllTriggers(PkString *Out, const PkString &Sysroot)
+{ //Trigger declarations of everything installed, one per line.
+	sqlite3 *Handle = NULL;
+	
+	if (!(Handle = OpenDB(Sysroot)))
+	{
+		return false;
+	}
+	
+	sqlite3_stmt *Statement = NULL;
+	const char *Tail = NULL;
+	
+	const char SQL[] = "select Triggers from installed where Triggers is not null;";
+	
+	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
+	{
+		CloseDB(Handle);
+		return false;
+	}
+	
+	int Code = 0;
+	
+	while ((Code = sqlite3_step(Statement)) == SQLITE_ROW)
+	{
+		*Out += (const char*)sqlite3_column_text(Statement, 0);
+		*Out += '\n';
+	}
+	
+	sqlite3_finalize(Statement);
+	CloseDB(Handle);
+	
+	return Code == SQLITE_DONE;
+}
@@ -0,0 +1,510 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Delta packages. A delta is an ordinary package whose info/ holds the new version's complete metadata, file list
+ * and checksums, plus delta.txt, which names the version it applies to and says where every file comes from:
+ *	same <path>			Unchanged, the installed copy is kept.
+ *	patch <sum> <path>	patches/<path> is a zstd --patch-from patch against the installed copy, whose checksum must be <sum>.
+ *	full <path>			files/<path> is the whole file, same as a normal package.
+ * files/ also has every directory, so Package::InstallFiles() can handle those and the full files as usual.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+//Types
+struct DeltaFile
+{ //An installed file a delta depends on.
+	PkString Path;
+	PkString BaseChecksum; //What the installed copy has to be.
+	PkString NewChecksum;
+	Utils::FileListLine Line;
+	bool IsPatch;
+	bool Failed;
+};
+
+struct DeltaJobs
+{
+	std::vector<DeltaFile> Files;
+	const char *PackageDir;
+	const char *Sysroot;
+	const Journal::Transaction *Txn;
+};
+
+//Prototypes
+static bool RunZstd(const char *const *Args);
+static void FileListToMap(const char *FileListBuf, std::map<PkString, Utils::FileListLine> *Out);
+static bool CopyInfoDir(const PkString &InfoDir, const PkString &OutDir);
+static void VerifyWorker(void *Data, const size_t Index);
+static void PatchWorker(void *Data, const size_t Index);
+
+//Functions
+static bool RunZstd(const char *const *Args)
+{
+	pid_t PID = fork();
+	
+	if (PID == -1) return false;
+	
+	if (PID == 0)
+	{ ///Child code
+		execvp("zstd", const_cast<char *const*>(Args));
+		_exit(1);
+	}
+	
+	int RawExitStatus = 0;
+	
+	waitpid(PID, &RawExitStatus, 0);
+	
+	return WIFEXITED(RawExitStatus) && WEXITSTATUS(RawExitStatus) == 0;
+}
+
+static void FileListToMap(const char *FileListBuf, std::map<PkString, Utils::FileListLine> *Out)
+{ //The lines point into FileListBuf, so it has to outlive Out.
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
+	
+	while (View.Next(&LineStruct))
+	{
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_INVALID) (*Out)[LineStruct.Path.Str()] = LineStruct;
+	}
+}
+
+static bool CopyInfoDir(const PkString &InfoDir, const PkString &OutDir)
+{ //Everything in the new package's info/ carries over unchanged.
+	DIR *Dir = opendir(InfoDir);
+	
+	if (!Dir) return false;
+	
+	struct dirent *File = NULL;
+	bool Success = true;
+	
+	while (Success && (File = readdir(Dir)))
+	{
+		if (*File->d_name == '.') continue;
+		
+		Success = Files::FileCopy(InfoDir + '/' + File->d_name, OutDir + '/' + File->d_name, true, "", 0, 0, 0644);
+	}
+	
+	closedir(Dir);
+	
+	return Success;
+}
+
+bool Delta::IsDelta(const char *PackageDir)
+{
+	struct stat FileStat;
+	
+	return stat(PkString(PackageDir) + "/info/delta.txt", &FileStat) == 0;
+}
+
+bool Delta::GetBase(const char *PackageDir, PkString *OutVersionString, unsigned *OutPackageGeneration)
+{
+	Utils::MappedFile DeltaBuf;
+	
+	try
+	{
+		DeltaBuf.Open(PkString(PackageDir) + "/info/delta.txt");
+	}
+	catch (Utils::SlurpFailure&)
+	{
+		return false;
+	}
+	
+	char Line[4096];
+	const char *Iter = DeltaBuf.Data();
+	bool GotVersion = false, GotGeneration = false;
+	
+	while (SubStrings.Line.GetLine(Line, sizeof Line, &Iter))
+	{
+		if (SubStrings.StartsWith("FromVersion=", Line))
+		{
+			*OutVersionString = Line + (sizeof "FromVersion=" - 1);
+			GotVersion = true;
+		}
+		else if (SubStrings.StartsWith("FromGeneration=", Line))
+		{
+			*OutPackageGeneration = atoi(Line + (sizeof "FromGeneration=" - 1));
+			GotGeneration = true;
+		}
+	}
+	
+	return GotVersion && GotGeneration;
+}
+
+bool Delta::CreateDelta(const char *OldPkgPath, const char *NewPkgPath, const char *Sysroot)
+{ //Writes the delta into the current directory.
+	const Trace::Scope Phase("create delta", NewPkgPath);
+	
+	Console::InitActions();
+	
+	char OldPath[4096], NewPath[4096], TempDir[4096];
+	
+	Console::SetCurrentAction("Mounting packages");
+	
+	if (!Package::MountPackage(OldPkgPath, Sysroot, OldPath, sizeof OldPath))
+	{
+		Console::VomitActionError("Failed to mount base package to temporary directory!");
+		return false;
+	}
+	
+	if (!Package::MountPackage(NewPkgPath, Sysroot, NewPath, sizeof NewPath))
+	{
+		Console::VomitActionError("Failed to mount new package to temporary directory!");
+		Action::DeleteTempCacheDir(OldPath);
+		return false;
+	}
+	
+	if (!Action::CreateTempCacheDir(TempDir, sizeof TempDir, Sysroot))
+	{
+		Console::VomitActionError("Failed to create temporary cache directory!");
+		Action::DeleteTempCacheDir(OldPath);
+		Action::DeleteTempCacheDir(NewPath);
+		return false;
+	}
+	
+	PkgObj OldPkg = PkgObj(), NewPkg = PkgObj();
+	Utils::MappedFile OldFileListBuf, OldChecksumsBuf, NewFileListBuf, NewChecksumsBuf;
+	PkString Error;
+	
+	try
+	{
+		OldFileListBuf.Open(PkString(OldPath) + "/info/filelist.txt");
+		OldChecksumsBuf.Open(PkString(OldPath) + "/info/checksums.txt");
+		NewFileListBuf.Open(PkString(NewPath) + "/info/filelist.txt");
+		NewChecksumsBuf.Open(PkString(NewPath) + "/info/checksums.txt");
+	}
+	catch (Utils::SlurpFailure &S)
+	{
+		Error = PkString() + "Unable to slurp file \"" + (S.Sysroot + S.Path) + "\": " + S.Reason;
+	}
+	
+	if (!Error && (!Package::GetMetadata(PkString(OldPath) + "/info", &OldPkg) || !Package::GetMetadata(PkString(NewPath) + "/info", &NewPkg)))
+	{
+		Error = "Failed to read package metadata!";
+	}
+	
+	if (!Error && (OldPkg.PackageID != NewPkg.PackageID || OldPkg.Arch != NewPkg.Arch))
+	{
+		Error = "Both packages must have the same package ID and architecture.";
+	}
+	
+	if (!Error && Delta::IsDelta(OldPath)) Error = "The base package can't be a delta itself.";
+	
+	const PkString FilesDir = PkString(TempDir) + "/files", PatchesDir = PkString(TempDir) + "/patches", InfoDir = PkString(TempDir) + "/info";
+	
+	if (!Error && (mkdir(FilesDir, 0755) != 0 || mkdir(PatchesDir, 0755) != 0 || mkdir(InfoDir, 0755) != 0))
+	{
+		Error = "Failed to create subdirectories of cache directory!";
+	}
+	
+	std::map<PkString, PkString> OldChecksums, NewChecksums;
+	std::map<PkString, Utils::FileListLine> OldFiles;
+	
+	Utils::ChecksumsToMap(OldChecksumsBuf.Data(), &OldChecksums);
+	Utils::ChecksumsToMap(NewChecksumsBuf.Data(), &NewChecksums);
+	FileListToMap(OldFileListBuf.Data(), &OldFiles);
+	
+	char Buf[4096];
+	
+	snprintf(Buf, sizeof Buf, "FromVersion=%s\nFromGeneration=%u\n", +OldPkg.VersionString, OldPkg.PackageGeneration);
+	
+	PkString DeltaText = Buf;
+	unsigned NumSame = 0, NumPatched = 0, NumFull = 0;
+	
+	Console::SetActionSubject(NewPkg.PackageID + "." + NewPkg.Arch);
+	Console::SetCurrentAction("Comparing files");
+	
+	Utils::FileListView View(NewFileListBuf.Data());
+	Utils::FileListLine LineStruct;
+	
+	while (!Error && View.Next(&LineStruct))
+	{
+		const PkString &Path = LineStruct.Path.Str();
+		
+		if (LineStruct.Type == Utils::FileListLine::FLLTYPE_DIRECTORY)
+		{ //InstallFiles() takes the mode from the file list, this is just so the directory exists.
+			if (mkdir(FilesDir + '/' + Path, 0755) != 0 || mkdir(PatchesDir + '/' + Path, 0755) != 0)
+			{
+				Error = "Failed to create directory " + Path;
+			}
+			continue;
+		}
+		
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE) continue;
+		
+		const PkString &NewFile = PkString(NewPath) + "/files/" + Path;
+		std::map<PkString, Utils::FileListLine>::iterator OldLine = OldFiles.find(Path);
+		std::map<PkString, PkString>::iterator OldSum = OldChecksums.find(Path), NewSum = NewChecksums.find(Path);
+		
+		//Symlinks have no checksum, and are never worth patching.
+		const bool Regular = OldSum != OldChecksums.end() && NewSum != NewChecksums.end();
+		
+		if (Regular && OldSum->second == NewSum->second && OldLine != OldFiles.end() && OldLine->second.User == LineStruct.User &&
+			OldLine->second.Group == LineStruct.Group && OldLine->second.Mode == LineStruct.Mode)
+		{
+			DeltaText += "same " + Path + '\n';
+			++NumSame;
+			continue;
+		}
+		
+		if (Regular)
+		{
+			const PkString &PatchFile = PatchesDir + '/' + Path;
+			const PkString &PatchFrom = "--patch-from=" + PkString(OldPath) + "/files/" + Path;
+			const char *const Args[] = { "zstd", "-q", "-f", "-19", PatchFrom, NewFile, "-o", PatchFile, NULL };
+			struct stat PatchStat, NewStat;
+			
+			if (RunZstd(Args) && stat(PatchFile, &PatchStat) == 0 && stat(NewFile, &NewStat) == 0 && PatchStat.st_size < NewStat.st_size)
+			{
+				DeltaText += "patch " + OldSum->second + ' ' + Path + '\n';
+				++NumPatched;
+				continue;
+			}
+			
+			unlink(PatchFile);
+		}
+		
+		struct stat FileStat;
+		
+		if (lstat(NewFile, &FileStat) != 0 ||
+			!(S_ISLNK(FileStat.st_mode) ? Files::SymlinkCopy(NewFile, FilesDir + '/' + Path, true, "", 0, 0)
+										: Files::FileCopy(NewFile, FilesDir + '/' + Path, true, "", 0, 0, FileStat.st_mode)))
+		{
+			Error = "Failed to copy " + Path;
+			continue;
+		}
+		
+		DeltaText += "full " + Path + '\n';
+		++NumFull;
+	}
+	
+	if (!Error && (!CopyInfoDir(PkString(NewPath) + "/info", InfoDir) ||
+					!Utils::WriteFile(InfoDir + "/delta.txt", DeltaText, DeltaText.size(), false, 0644)))
+	{
+		Error = "Failed to write package info!";
+	}
+	
+	char Cwd[4096];
+	
+	getcwd(Cwd, sizeof Cwd);
+	
+	snprintf(Buf, sizeof Buf, "%s_%s-%u.%s.delta-%s-%u.pkrt", +NewPkg.PackageID, +NewPkg.VersionString,
+			NewPkg.PackageGeneration, +NewPkg.Arch, +OldPkg.VersionString, OldPkg.PackageGeneration);
+	
+	const PkString &OutFile = PkString(Cwd) + '/' + Buf;
+	
+	if (!Error)
+	{
+		Console::SetCurrentAction("Compressing package");
+		
+		if (!Package::CompressPackage(TempDir, OutFile)) Error = "Failed to compress delta package.";
+	}
+	
+	Action::DeleteTempCacheDir(OldPath);
+	Action::DeleteTempCacheDir(NewPath);
+	Action::DeleteTempCacheDir(TempDir);
+	
+	if (Error)
+	{
+		Console::VomitActionError(Error);
+		return false;
+	}
+	
+	snprintf(Buf, sizeof Buf, "Generated delta package %s: %u unchanged, %u patched, %u full file(s)\n", +OutFile, NumSame, NumPatched, NumFull);
+	Console::SetCurrentAction(Buf);
+	
+	return true;
+}
+
+static void VerifyWorker(void *Data, const size_t Index)
+{
+	DeltaJobs *Jobs = static_cast<DeltaJobs*>(Data);
+	DeltaFile &File = Jobs->Files[Index];
+	
+	File.Failed = Package::MakeFileChecksum(PkString(Jobs->Sysroot) + '/' + File.Path) != File.BaseChecksum;
+}
+
+static void PatchWorker(void *Data, const size_t Index)
+{
+	DeltaJobs *Jobs = static_cast<DeltaJobs*>(Data);
+	DeltaFile &File = Jobs->Files[Index];
+	
+	if (!File.IsPatch) return;
+	
+	const PkString &Dest = PkString(Jobs->Sysroot) + '/' + Journal::TempPath(*Jobs->Txn, File.Path);
+	const PkString &PatchFrom = "--patch-from=" + PkString(Jobs->Sysroot) + '/' + File.Path;
+	const PkString &PatchFile = PkString(Jobs->PackageDir) + "/patches/" + File.Path;
+	const char *const Args[] = { "zstd", "-q", "-d", "-f", "--memory=2048MB", PatchFrom, PatchFile, "-o", Dest, NULL };
+	
+	if (!RunZstd(Args) || Package::MakeFileChecksum(Dest) != File.NewChecksum)
+	{
+		unlink(Dest);
+		File.Failed = true;
+		return;
+	}
+	
+	gid_t GroupID = 0;
+	
+	PWSR::LookupGroupname(Jobs->Sysroot, File.Line.Group.Str(), &GroupID);
+	
+	chown(Dest, PWSR::LookupUsername(Jobs->Sysroot, File.Line.User.Str()).UserID, GroupID);
+	chmod(Dest, File.Line.Mode & 07777);
+}
+
+bool Delta::StageFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf, const char *ChecksumsBuf,
+						const char *InstalledChecksumsBuf, const Journal::Transaction *Txn)
+{ /*The delta counterpart of Package::InstallFiles(), always under a journal. Everything it relies on from the
+	installed version is checked against the database's checksums before anything is written.*/
+	const Trace::Scope Phase("stage delta");
+	
+	Utils::MappedFile DeltaBuf;
+	
+	try
+	{
+		DeltaBuf.Open(PkString(PackageDir) + "/info/delta.txt");
+	}
+	catch (Utils::SlurpFailure &S)
+	{
+		fprintf(stderr, "Unable to slurp file \"%s\": %s\n", +(S.Sysroot + S.Path), +S.Reason);
+		return false;
+	}
+	
+	std::map<PkString, PkString> NewChecksums, InstalledChecksums;
+	std::map<PkString, Utils::FileListLine> NewFiles;
+	
+	Utils::ChecksumsToMap(ChecksumsBuf, &NewChecksums);
+	Utils::ChecksumsToMap(InstalledChecksumsBuf, &InstalledChecksums);
+	FileListToMap(FileListBuf, &NewFiles);
+	
+	DeltaJobs Jobs;
+	PkString FullList, FullChecksums;
+	
+	Jobs.PackageDir = PackageDir;
+	Jobs.Sysroot = Sysroot;
+	Jobs.Txn = Txn;
+	
+	char Line[4096];
+	const char *Iter = DeltaBuf.Data();
+	
+	while (SubStrings.Line.GetLine(Line, sizeof Line, &Iter))
+	{
+		DeltaFile File = DeltaFile();
+		const char *Worker = Line;
+		char Op[64];
+		
+		if (!SubStrings.CopyUntilC(Op, sizeof Op, &Worker, " ", false) || !Worker || !*Worker) continue; //The header has no spaces.
+		
+		if (!strcmp(Op, "patch"))
+		{
+			char Sum[256];
+			
+			SubStrings.CopyUntilC(Sum, sizeof Sum, &Worker, " ", false);
+			File.BaseChecksum = Sum;
+			File.IsPatch = true;
+		}
+		else if (strcmp(Op, "same") && strcmp(Op, "full")) continue;
+		
+		File.Path = Worker;
+		
+		std::map<PkString, Utils::FileListLine>::iterator LineIter = NewFiles.find(File.Path);
+		
+		if (LineIter == NewFiles.end())
+		{
+			fprintf(stderr, "Delta names \"%s\", which isn't in its file list.\n", +File.Path);
+			return false;
+		}
+		
+		File.Line = LineIter->second;
+		NewFiles.erase(LineIter);
+		
+		if (!strcmp(Op, "full"))
+		{
+			FullList += File.Line.Text.Str() + '\n';
+			
+			if (NewChecksums.count(File.Path)) FullChecksums += NewChecksums[File.Path] + ' ' + File.Path + '\n';
+			continue;
+		}
+		
+		File.NewChecksum = NewChecksums[File.Path];
+		
+		if (!File.IsPatch) File.BaseChecksum = File.NewChecksum;
+		
+		//The database has to agree before we look at the disk, or we'd happily build on a file someone replaced.
+		if (!File.BaseChecksum || InstalledChecksums[File.Path] != File.BaseChecksum)
+		{
+			fprintf(stderr, "Installed \"%s\" isn't the version this delta was made against.\n", +File.Path);
+			return false;
+		}
+		
+		Jobs.Files.push_back(File);
+	}
+	
+	///Whatever's left in the file list had no delta line, which is fine for directories only.
+	for (std::map<PkString, Utils::FileListLine>::iterator LineIter = NewFiles.begin(); LineIter != NewFiles.end(); ++LineIter)
+	{
+		if (LineIter->second.Type != Utils::FileListLine::FLLTYPE_DIRECTORY)
+		{
+			fprintf(stderr, "Delta has no entry for \"%s\".\n", +LineIter->first);
+			return false;
+		}
+	}
+	
+	if (!Package::VerifyChecksums(FullChecksums, PkString(PackageDir) + "/files"))
+	{
+		fputs("Delta package file checksum failure; package may be damaged.\n", stderr);
+		return false;
+	}
+	
+	Workers::Run(VerifyWorker, &Jobs, Jobs.Files.size(), Config::CPUJobs);
+	
+	for (size_t Inc = 0; Inc < Jobs.Files.size(); ++Inc)
+	{
+		if (!Jobs.Files[Inc].Failed) continue;
+		
+		fprintf(stderr, "Installed \"%s\" has been modified since it was installed, the full package is needed.\n", +Jobs.Files[Inc].Path);
+		return false;
+	}
+	
+	Workers::Run(PatchWorker, &Jobs, Jobs.Files.size(), Config::CPUJobs);
+	
+	for (size_t Inc = 0; Inc < Jobs.Files.size(); ++Inc)
+	{
+		if (!Jobs.Files[Inc].Failed) continue;
+		
+		fprintf(stderr, "Failed to patch \"%s\".\n", +Jobs.Files[Inc].Path);
+		return false;
+	}
+	
+	//Every directory ahead of every file, which still keeps parents ahead of what's in them.
+	PkString DirList;
+	
+	Iter = FileListBuf;
+	
+	while (SubStrings.Line.GetLine(Line, sizeof Line, &Iter))
+	{
+		if (*Line == 'd') DirList += PkString(Line) + '\n';
+	}
+	
+	return Package::InstallFiles(PackageDir, Sysroot, DirList + FullList, Txn, FullChecksums);
+}
@@ -15,56 +15,348 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 
+/*Shared library dependency scanning. We read the dynamic section of ELF files ourselves, straight out of an mmap,
+ * instead of running readelf on every binary. Handles 32 and 64 bit, either byte order, regardless of what we're running on.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
 #include "packrat.h"
 #include "substrings/substrings.h"
 
-std::vector<PkString> *DepCalc_GetDynLibs(const PkString &Path)
-{	
-	PkString Execute = "readelf -d " + Path;
+//Types
+struct ELFImage
+{ //Bounds checked, byte order aware access to a mapped ELF file.
+	const uint8_t *Data;
+	size_t Size;
+	bool Is64;
+	bool BigEndian;
+	
+	bool Has(const uint64_t Offset, const uint64_t Length) const { return Offset <= Size && Length <= Size - Offset; }
+	uint64_t Read(const uint64_t Offset, const unsigned Length) const;
+	uint64_t ReadWord(const uint64_t Offset) const { return Read(Offset, Is64 ? 8 : 4); } //Addr, Off, Xword etc.
+	const char *String(const uint64_t TableOffset, const uint64_t TableSize, const uint64_t Index) const;
+};
+
+struct ScanJob
+{
+	PkString Path;
+	DepCalc::DynInfo Info;
+	bool IsDynamic;
+};
+
+struct ScanBatch
+{
+	std::vector<ScanJob> Jobs;
+};
+
+//Prototypes
+static bool ParseDynamic(const ELFImage &Image, DepCalc::DynInfo *Out);
+static bool FindDynamicFromSegments(const ELFImage &Image, uint64_t *DynOffset, uint64_t *DynSize, uint64_t *StrOffset, uint64_t *StrSize);
+static bool FindDynamicFromSections(const ELFImage &Image, uint64_t *DynOffset, uint64_t *DynSize, uint64_t *StrOffset, uint64_t *StrSize);
+static void ScanWorker(void *Data, const size_t Index);
+
+//Functions
+uint64_t ELFImage::Read(const uint64_t Offset, const unsigned Length) const
+{
+	if (!Has(Offset, Length)) return 0;
+	
+	uint64_t RetVal = 0;
+	
+	for (unsigned Inc = 0; Inc < Length; ++Inc)
+	{ //Byte at a time, so the host's byte order never matters.
+		RetVal |= (uint64_t)Data[Offset + Inc] << (8 * (BigEndian ? Length - 1 - Inc : Inc));
+	}
+	
+	return RetVal;
+}
+
+const char *ELFImage::String(const uint64_t TableOffset, const uint64_t TableSize, const uint64_t Index) const
+{ //NULL unless the whole string, terminator included, is inside the table.
+	if (Index >= TableSize || !Has(TableOffset, TableSize)) return NULL;
 	
-	FILE *CmdStdout = popen(Execute, "r");
+	const char *Start = (const char*)Data + TableOffset + Index;
 	
-	if (!CmdStdout) return NULL;
+	if (!memchr(Start, '\0', TableSize - Index)) return NULL;
 	
-	std::vector<char> Array;
+	return Start;
+}
+
+static bool FindDynamicFromSegments(const ELFImage &Image, uint64_t *DynOffset, uint64_t *DynSize, uint64_t *StrOffset, uint64_t *StrSize)
+{ //What the dynamic linker itself uses, so it works on binaries with their section headers stripped.
+	const uint64_t PhOff = Image.ReadWord(Image.Is64 ? offsetof(Elf64_Ehdr, e_phoff) : offsetof(Elf32_Ehdr, e_phoff));
+	const unsigned PhEntSize = Image.Read(Image.Is64 ? offsetof(Elf64_Ehdr, e_phentsize) : offsetof(Elf32_Ehdr, e_phentsize), 2);
+	const unsigned PhNum = Image.Read(Image.Is64 ? offsetof(Elf64_Ehdr, e_phnum) : offsetof(Elf32_Ehdr, e_phnum), 2);
+	
+	if (!PhOff || PhEntSize < (unsigned)(Image.Is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr)) || !Image.Has(PhOff, (uint64_t)PhEntSize * PhNum)) return false;
+	
+	//p_flags moves in 64 bit, so everything after p_type is at a different offset.
+	const unsigned OffOffset = Image.Is64 ? offsetof(Elf64_Phdr, p_offset) : offsetof(Elf32_Phdr, p_offset);
+	const unsigned VAddrOffset = Image.Is64 ? offsetof(Elf64_Phdr, p_vaddr) : offsetof(Elf32_Phdr, p_vaddr);
+	const unsigned FileSzOffset = Image.Is64 ? offsetof(Elf64_Phdr, p_filesz) : offsetof(Elf32_Phdr, p_filesz);
 	
-	Array.reserve(4096);
+	bool Found = false;
 	
-	int Char = 0;
-	while ((Char = getc(CmdStdout)) != EOF)
+	for (unsigned Inc = 0; Inc < PhNum; ++Inc)
 	{
-		if (Array.size() + 1 >= Array.capacity()) Array.reserve(Array.capacity() + 1024);
-		Array.push_back(Char);
+		const uint64_t Ph = PhOff + (uint64_t)Inc * PhEntSize;
+		
+		if (Image.Read(Ph, 4) != PT_DYNAMIC) continue;
+		
+		*DynOffset = Image.ReadWord(Ph + OffOffset);
+		*DynSize = Image.ReadWord(Ph + FileSzOffset);
+		Found = true;
+		break;
 	}
 	
-	Array.push_back('\0');
+	if (!Found) return false;
 	
+	///DT_STRTAB is a virtual address, find the PT_LOAD it lives in to get the file offset.
+	const unsigned DynEntSize = Image.Is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+	uint64_t StrAddr = 0;
 	
-	pclose(CmdStdout);
+	*StrSize = 0;
 	
+	for (uint64_t Dyn = *DynOffset; Image.Has(Dyn, DynEntSize) && Dyn + DynEntSize <= *DynOffset + *DynSize; Dyn += DynEntSize)
+	{
+		const uint64_t Tag = Image.ReadWord(Dyn);
+		
+		if (Tag == DT_NULL) break;
+		else if (Tag == DT_STRTAB) StrAddr = Image.ReadWord(Dyn + DynEntSize / 2);
+		else if (Tag == DT_STRSZ) *StrSize = Image.ReadWord(Dyn + DynEntSize / 2);
+	}
 	
-	std::vector<PkString> *LibList = new std::vector<PkString>;
+	if (!StrAddr || !*StrSize) return false;
 	
-	LibList->reserve(10);
+	for (unsigned Inc = 0; Inc < PhNum; ++Inc)
+	{
+		const uint64_t Ph = PhOff + (uint64_t)Inc * PhEntSize;
+		
+		if (Image.Read(Ph, 4) != PT_LOAD) continue;
+		
+		const uint64_t VAddr = Image.ReadWord(Ph + VAddrOffset);
+		const uint64_t FileSz = Image.ReadWord(Ph + FileSzOffset);
+		
+		if (StrAddr >= VAddr && StrAddr - VAddr < FileSz)
+		{
+			*StrOffset = StrAddr - VAddr + Image.ReadWord(Ph + OffOffset);
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static bool FindDynamicFromSections(const ELFImage &Image, uint64_t *DynOffset, uint64_t *DynSize, uint64_t *StrOffset, uint64_t *StrSize)
+{ //For the odd file whose program headers don't tell us enough. SHT_DYNAMIC's sh_link is its string table.
+	const uint64_t ShOff = Image.ReadWord(Image.Is64 ? offsetof(Elf64_Ehdr, e_shoff) : offsetof(Elf32_Ehdr, e_shoff));
+	const unsigned ShEntSize = Image.Read(Image.Is64 ? offsetof(Elf64_Ehdr, e_shentsize) : offsetof(Elf32_Ehdr, e_shentsize), 2);
+	const unsigned ShNum = Image.Read(Image.Is64 ? offsetof(Elf64_Ehdr, e_shnum) : offsetof(Elf32_Ehdr, e_shnum), 2);
 	
-	char Line[4096];
+	if (!ShOff || ShEntSize < (unsigned)(Image.Is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)) || !Image.Has(ShOff, (uint64_t)ShEntSize * ShNum)) return false;
 	
-	const char *Worker = &Array[0];
+	const unsigned TypeOffset = Image.Is64 ? offsetof(Elf64_Shdr, sh_type) : offsetof(Elf32_Shdr, sh_type);
+	const unsigned OffOffset = Image.Is64 ? offsetof(Elf64_Shdr, sh_offset) : offsetof(Elf32_Shdr, sh_offset);
+	const unsigned SizeOffset = Image.Is64 ? offsetof(Elf64_Shdr, sh_size) : offsetof(Elf32_Shdr, sh_size);
+	const unsigned LinkOffset = Image.Is64 ? offsetof(Elf64_Shdr, sh_link) : offsetof(Elf32_Shdr, sh_link);
 	
-	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
-	{	
-		//Not a shared library line.
-		if (!strstr(Line, "(NEEDED)")) continue;
+	for (unsigned Inc = 0; Inc < ShNum; ++Inc)
+	{
+		const uint64_t Sh = ShOff + (uint64_t)Inc * ShEntSize;
+		
+		if (Image.Read(Sh + TypeOffset, 4) != SHT_DYNAMIC) continue;
+		
+		const uint64_t Link = Image.Read(Sh + LinkOffset, 4);
 		
-		char Buf[1024] = { 0 };
-		//Get the data.
+		if (Link >= ShNum) return false;
 		
-		SubStrings.Extract(Buf, sizeof Buf, ": [", "]", Line);
+		const uint64_t StrSh = ShOff + Link * ShEntSize;
+		
+		*DynOffset = Image.ReadWord(Sh + OffOffset);
+		*DynSize = Image.ReadWord(Sh + SizeOffset);
+		*StrOffset = Image.ReadWord(StrSh + OffOffset);
+		*StrSize = Image.ReadWord(StrSh + SizeOffset);
+		return true;
+	}
+	
+	return false;
+}
 
-		if (*Line)
-			LibList->push_back(Buf);
+static bool ParseDynamic(const ELFImage &Image, DepCalc::DynInfo *Out)
+{
+	uint64_t DynOffset = 0, DynSize = 0, StrOffset = 0, StrSize = 0;
+	
+	if (!FindDynamicFromSegments(Image, &DynOffset, &DynSize, &StrOffset, &StrSize) &&
+		!FindDynamicFromSections(Image, &DynOffset, &DynSize, &StrOffset, &StrSize))
+	{ //Static binary, object file, or something mangled.
+		return false;
 	}
+	
+	const unsigned DynEntSize = Image.Is64 ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn);
+	
+	for (uint64_t Dyn = DynOffset; Image.Has(Dyn, DynEntSize) && Dyn + DynEntSize <= DynOffset + DynSize; Dyn += DynEntSize)
+	{
+		const uint64_t Tag = Image.ReadWord(Dyn);
+		
+		if (Tag == DT_NULL) break;
+		
+		if (Tag != DT_NEEDED && Tag != DT_SONAME && Tag != DT_RUNPATH && Tag != DT_RPATH) continue;
+		
+		const char *Value = Image.String(StrOffset, StrSize, Image.ReadWord(Dyn + DynEntSize / 2));
+		
+		if (!Value || !*Value) continue;
 		
+		switch (Tag)
+		{
+			case DT_NEEDED:
+				Out->Needed.push_back(Value);
+				break;
+			case DT_SONAME:
+				Out->SOName = Value;
+				break;
+			default:
+			{ //DT_RPATH is the deprecated spelling of DT_RUNPATH, as far as we care. Both are colon separated lists.
+				const char *Worker = Value;
+				char Dir[4096];
+				
+				while (SubStrings.CopyUntilC(Dir, sizeof Dir, &Worker, ":", false))
+				{
+					if (*Dir) Out->RunPaths.push_back(Dir);
+				}
+				break;
+			}
+		}
+	}
+	
+	return true;
+}
+
+bool DepCalc::ScanELF(const char *Path, DynInfo *Out)
+{ //Returns false for anything that isn't a dynamically linked ELF file.
+	const int Descriptor = open(Path, O_RDONLY);
+	
+	if (Descriptor == -1) return false;
+	
+	struct stat FileStat;
+	
+	if (fstat(Descriptor, &FileStat) != 0 || !S_ISREG(FileStat.st_mode) || (size_t)FileStat.st_size < sizeof(Elf32_Ehdr))
+	{
+		close(Descriptor);
+		return false;
+	}
+	
+	void *Map = mmap(NULL, FileStat.st_size, PROT_READ, MAP_PRIVATE, Descriptor, 0);
+	
+	close(Descriptor);
+	
+	if (Map == MAP_FAILED) return false;
+	
+	const uint8_t *Ident = static_cast<const uint8_t*>(Map);
+	
+	bool RetVal = false;
+	
+	if (!memcmp(Ident, ELFMAG, SELFMAG) &&
+		(Ident[EI_CLASS] == ELFCLASS32 || Ident[EI_CLASS] == ELFCLASS64) &&
+		(Ident[EI_DATA] == ELFDATA2LSB || Ident[EI_DATA] == ELFDATA2MSB))
+	{
+		const ELFImage Image = { Ident, (size_t)FileStat.st_size, Ident[EI_CLASS] == ELFCLASS64, Ident[EI_DATA] == ELFDATA2MSB };
+		
+		if (Image.Has(0, Image.Is64 ? sizeof(Elf64_Ehdr) : sizeof(Elf32_Ehdr)))
+		{
+			RetVal = ParseDynamic(Image, Out);
+		}
+	}
+	
+	munmap(Map, FileStat.st_size);
+	
+	return RetVal;
+}
+
+std::vector<PkString> *DepCalc::GetDynLibs(const PkString &Path)
+{ //Just the DT_NEEDED entries. NULL if it's not a dynamic ELF file.
+	DynInfo Info;
+	
+	if (!ScanELF(Path, &Info)) return NULL;
+	
+	return new std::vector<PkString>(Info.Needed);
+}
+
+static void ScanWorker(void *Data, const size_t Index)
+{
+	ScanJob &Job = static_cast<ScanBatch*>(Data)->Jobs[Index];
+	
+	Job.IsDynamic = DepCalc::ScanELF(Job.Path, &Job.Info);
+}
+
+bool DepCalc::ScanTree(const char *Directory, const char *FileListBuf, std::map<PkString, DynInfo> *Out)
+{ //Scans every regular file in a file list, rooted at Directory, in parallel. Out is keyed by file list path.
+	ScanBatch Batch;
+	std::vector<PkString> RelPaths;
+	
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
+	struct stat FileStat;
+	
+	while (View.Next(&LineStruct))
+	{
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE) continue;
+		
+		const PkString &Path = PkString(Directory) + '/' + LineStruct.Path.Str();
+		
+		//Symlinks point at something we'll get to anyway, or something outside the package.
+		if (lstat(Path, &FileStat) != 0 || !S_ISREG(FileStat.st_mode)) continue;
+		
+		Batch.Jobs.push_back(ScanJob());
+		Batch.Jobs.back().Path = Path;
+		Batch.Jobs.back().IsDynamic = false;
+		RelPaths.push_back(LineStruct.Path.Str());
+	}
+	
+	Workers::Run(ScanWorker, &Batch, Batch.Jobs.size(), Config::CPUJobs);
+	
+	for (size_t Inc = 0; Inc < Batch.Jobs.size(); ++Inc)
+	{
+		if (Batch.Jobs[Inc].IsDynamic) (*Out)[RelPaths[Inc]] = Batch.Jobs[Inc].Info;
+	}
+	
+	return true;
+}
+
+bool DepCalc::WriteDynLibs(const char *Directory, const char *FileListBuf, const char *OutPath)
+{ /*Writes the package's shared library summary: a "provides <soname>" line for every library in it,
+	and a "needs <soname>" line for every library something in it links against that it doesn't provide itself.*/
+	std::map<PkString, DynInfo> Scanned;
+	
+	if (!ScanTree(Directory, FileListBuf, &Scanned)) return false;
+	
+	std::set<PkString> Provides, Needs;
+	std::map<PkString, DynInfo>::iterator Iter = Scanned.begin();
+	
+	for (; Iter != Scanned.end(); ++Iter)
+	{
+		if (Iter->second.SOName) Provides.insert(Iter->second.SOName);
+		
+		Needs.insert(Iter->second.Needed.begin(), Iter->second.Needed.end());
+	}
+	
+	PkString Output;
+	
+	for (std::set<PkString>::iterator SetIter = Provides.begin(); SetIter != Provides.end(); ++SetIter)
+	{
+		Output += "provides " + *SetIter + '\n';
+	}
+	
+	for (std::set<PkString>::iterator SetIter = Needs.begin(); SetIter != Needs.end(); ++SetIter)
+	{
+		if (!Provides.count(*SetIter)) Output += "needs " + *SetIter + '\n';
+	}
 	
-	return LibList;
+	return Utils::WriteFile(OutPath, Output, Output.size(), false);
 }
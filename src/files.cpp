@@ -19,12 +19,212 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <grp.h>
 #include <pwd.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif //SYS_openat2
 #include "substrings/substrings.h"
 #include "packrat.h"
+
+/*Paths inside a sysroot are resolved from an open descriptor of the sysroot, with openat2() and RESOLVE_IN_ROOT
+ * where the kernel has it, so a symlink in the sysroot can't lead outside of it. Each thread keeps the last few
+ * parent directories it used open, and file lists are sorted by directory, so most files cost no path walk at all.
+ * An empty sysroot means plain paths, relative to the working directory.*/
+#define PARENT_CACHE_SIZE 8
+
+//Types
+struct ParentCache
+{ //Per thread, freed when the thread exits.
+	struct Entry
+	{
+		int SysrootDesc;
+		int Desc;
+		PkString Path;
+		
+		Entry(void) : SysrootDesc(-1), Desc(-1) {}
+	} Entries[PARENT_CACHE_SIZE];
+	
+	unsigned Next; //Round robin replacement.
+	unsigned Generation;
+	
+	ParentCache(void) : Next(), Generation() {}
+	~ParentCache(void) { this->Clear(); }
+	
+	void Clear(void)
+	{
+		for (size_t Inc = 0; Inc < PARENT_CACHE_SIZE; ++Inc)
+		{
+			if (Entries[Inc].Desc != -1) close(Entries[Inc].Desc);
+			Entries[Inc] = Entry();
+		}
+	}
+};
+
+//Prototypes
+static void FreeParentCache(void *Data);
+static void MakeParentCacheKey(void);
+static ParentCache *GetParentCache(void);
+static int OpenInRoot(const int SysrootDesc, const char *Path);
+
+//Globals
+static pthread_mutex_t SysrootDescsLock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<PkString, int> SysrootDescs;
+static pthread_once_t ParentCacheKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t ParentCacheKey;
+static volatile unsigned DirGeneration; //Bumped by ForgetDirectories(), so caches drop descriptors of removed directories.
+
+//Functions
+static void FreeParentCache(void *Data)
+{
+	delete static_cast<ParentCache*>(Data);
+}
+
+static void MakeParentCacheKey(void)
+{
+	pthread_key_create(&ParentCacheKey, FreeParentCache);
+}
+
+static ParentCache *GetParentCache(void)
+{
+	pthread_once(&ParentCacheKeyOnce, MakeParentCacheKey);
+	
+	ParentCache *Cache = static_cast<ParentCache*>(pthread_getspecific(ParentCacheKey));
+	
+	if (!Cache)
+	{
+		Cache = new ParentCache;
+		pthread_setspecific(ParentCacheKey, Cache);
+	}
+	
+	const unsigned Generation = DirGeneration;
+	
+	if (Cache->Generation != Generation)
+	{
+		Cache->Clear();
+		Cache->Generation = Generation;
+	}
+	
+	return Cache;
+}
+
+static int OpenInRoot(const int SysrootDesc, const char *Path)
+{ //Opens a directory with SysrootDesc acting as /, or the plain way if the kernel predates openat2().
+#ifdef SYS_openat2
+	static volatile bool NoOpenat2 = false;
+	
+	if (SysrootDesc != AT_FDCWD && !NoOpenat2)
+	{
+		struct open_how How;
+		
+		memset(&How, 0, sizeof How);
+		How.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+		How.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+		
+		const int Desc = syscall(SYS_openat2, SysrootDesc, Path, &How, sizeof How);
+		
+		if (Desc != -1 || errno != ENOSYS) return Desc;
+		
+		NoOpenat2 = true;
+	}
+#endif //SYS_openat2
+	
+	return openat(SysrootDesc, Path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+int Files::SysrootDescriptor(const char *Sysroot)
+{ //Opened once per sysroot and kept for the life of the process.
+	if (!Sysroot || !*Sysroot) return AT_FDCWD;
 	
+	pthread_mutex_lock(&SysrootDescsLock);
+	
+	std::map<PkString, int>::iterator Iter = SysrootDescs.find(Sysroot);
+	
+	if (Iter == SysrootDescs.end())
+	{
+		const int Desc = open(Sysroot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		
+		if (Desc == -1)
+		{
+			pthread_mutex_unlock(&SysrootDescsLock);
+			return -1;
+		}
+		
+		Iter = SysrootDescs.insert(std::make_pair(PkString(Sysroot), Desc)).first;
+	}
+	
+	const int Desc = Iter->second;
+	
+	pthread_mutex_unlock(&SysrootDescsLock);
+	
+	return Desc;
+}
+
+int Files::OpenDirectory(const char *Sysroot, const char *Path)
+{ //A descriptor the caller owns and has to close.
+	const int RootDesc = Files::SysrootDescriptor(Sysroot);
+	
+	if (RootDesc == -1) return -1;
+	
+	if (RootDesc != AT_FDCWD) while (*Path == '/') ++Path;
+	
+	return OpenInRoot(RootDesc, *Path ? Path : ".");
+}
+
+int Files::ParentDescriptor(const char *Sysroot, const char *Path, const char **OutName)
+{ /*The directory Path is in, and in OutName, the part of Path to use with it in *at() calls.
+	The descriptor belongs to the cache, so don't close it, and don't keep it past the next call.*/
+	const int RootDesc = Files::SysrootDescriptor(Sysroot);
+	
+	if (RootDesc == -1) return -1;
+	
+	if (RootDesc != AT_FDCWD) while (*Path == '/') ++Path;
+	
+	const char *Slash = strrchr(Path, '/');
+	
+	*OutName = Slash ? Slash + 1 : Path;
+	
+	if (!Slash) return RootDesc;
+	
+	const size_t ParentSize = Slash == Path ? 1 : Slash - Path;
+	ParentCache *Cache = GetParentCache();
+	
+	for (size_t Inc = 0; Inc < PARENT_CACHE_SIZE; ++Inc)
+	{
+		const ParentCache::Entry &Entry = Cache->Entries[Inc];
+		
+		if (Entry.Desc != -1 && Entry.SysrootDesc == RootDesc && Entry.Path.size() == ParentSize &&
+			!memcmp(Entry.Path.data(), Path, ParentSize))
+		{
+			return Entry.Desc;
+		}
+	}
+	
+	Utils::PathBuilder Parent;
+	
+	if (!Parent.Push(Path, ParentSize)) return -1;
+	
+	const int Desc = OpenInRoot(RootDesc, Parent);
+	
+	if (Desc == -1) return -1;
+	
+	ParentCache::Entry &Victim = Cache->Entries[Cache->Next++ % PARENT_CACHE_SIZE];
+	
+	if (Victim.Desc != -1) close(Victim.Desc);
+	
+	Victim.SysrootDesc = RootDesc;
+	Victim.Desc = Desc;
+	Victim.Path.assign(Parent.c_str(), Parent.Size());
+	
+	return Desc;
+}
+
 bool Files::TextUserAndGroupToIDs(const char *const User, const char *const Group, uid_t *UIDOut, gid_t *GIDOut)
 {
 	struct passwd *UserVal = getpwnam(User);
@@ -37,40 +237,56 @@ bool Files::TextUserAndGroupToIDs(const char *const User, const char *const Grou
 	return true;
 }
 
-bool Files::Mkdir(const char *Source, const char *Destination_, const PkString &Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode)
+bool Files::Mkdir(const char *Source, const char *Destination_, const char *Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode)
 { //There will be no overwrite option for this one. The directory is probably not empty.
 	struct stat DirStat;
 	
 	//Source doesn't exist.
 	if (stat(Source, &DirStat) != 0) return false;
 	
+	size_t DestSize = strlen(Destination_);
+	
+	while (DestSize > 1 && Destination_[DestSize - 1] == '/') --DestSize;
+	
+	Utils::PathBuilder Destination;
+	
+	if (!Destination.Push(Destination_, DestSize)) return false;
+	
+	const char *Name = NULL;
+	const int ParentDesc = Files::ParentDescriptor(Sysroot, Destination, &Name);
+	
+	if (ParentDesc == -1 || !*Name) return false;
+	
 	struct stat Temp;
 	
-	PkString Destination = Sysroot ? Sysroot + "/" + Destination_ : PkString(Destination_);
-
 	//Destination already exists.
-	if (stat(Destination, &Temp) == 0)
+	if (fstatat(ParentDesc, Name, &Temp, AT_SYMLINK_NOFOLLOW) == 0)
 	{
-		//Change permissions to reflect the new version
-		chown(Destination, DirStat.st_uid, DirStat.st_gid);
-		chmod(Destination, DirStat.st_mode);
-		return false; //I wish I could pass NULL to stat for the second argument. Sometimes I just want to know it exists.
+		//Change permissions to reflect the new version. Not through a symlink though, that could point anywhere.
+		if (S_ISDIR(Temp.st_mode))
+		{
+			fchownat(ParentDesc, Name, DirStat.st_uid, DirStat.st_gid, AT_SYMLINK_NOFOLLOW);
+			fchmodat(ParentDesc, Name, DirStat.st_mode, 0);
+		}
+		return false;
 	}
 	
+	Stats::Add(Stats::SYS_MKDIR);
 	
-	if (mkdir(Destination, DirStat.st_mode) != 0) return false;
+	if (mkdirat(ParentDesc, Name, DirStat.st_mode) != 0) return false;
 		
-	chown(Destination, UserID, GroupID);
-	chmod(Destination, Mode);
+	fchownat(ParentDesc, Name, UserID, GroupID, AT_SYMLINK_NOFOLLOW);
+	fchmodat(ParentDesc, Name, Mode, 0);
+	
+	Stats::Add(Stats::DIRS_CREATED);
+	Stats::Add(Stats::SYS_ATTR, 2);
 	return true;
 }
 
-bool Files::SymlinkCopy(const char *Source, const char *Destination_, bool Overwrite, const PkString &Sysroot, const uid_t UserID, const gid_t GroupID)
+bool Files::SymlinkCopy(const char *Source, const char *Destination, bool Overwrite, const char *Sysroot, const uid_t UserID, const gid_t GroupID)
 {
 	struct stat LinkStat;
 	
-	PkString Destination = Sysroot ? Sysroot + "/" + Destination_ : PkString(Destination_);
-
 	if (lstat(Source, &LinkStat) != 0) return false;
 	
 	//Not a symlink.
@@ -81,20 +297,29 @@ bool Files::SymlinkCopy(const char *Source, const char *Destination_, bool Overw
 	//Get the link target.
 	if (readlink(Source, Target, sizeof Target - 1) == -1) return false;
 	
+	const char *Name = NULL;
+	const int ParentDesc = Files::ParentDescriptor(Sysroot, Destination, &Name);
+	
+	if (ParentDesc == -1) return false;
+	
 	//Try and delete any other symlink that has the same name as Destination but possibly different target.
 	struct stat Temp;
 
 	//What to do if our target exists.
-	if (lstat(Destination, &Temp) == 0)
+	if (fstatat(ParentDesc, Name, &Temp, AT_SYMLINK_NOFOLLOW) == 0)
 	{
 		//if it's a directory, purge it.
 		if (Overwrite)
 		{
+			Stats::Add(Stats::SYS_UNLINK);
+			
 			if (S_ISDIR(Temp.st_mode))
 			{
-				if (rmdir(Destination) == -1) return false;
+				if (unlinkat(ParentDesc, Name, AT_REMOVEDIR) == -1) return false;
+				
+				Files::ForgetDirectories();
 			}
-			else unlink(Destination);
+			else unlinkat(ParentDesc, Name, 0);
 		}
 		else
 		{
@@ -102,90 +327,227 @@ bool Files::SymlinkCopy(const char *Source, const char *Destination_, bool Overw
 		}
 	}
 	
+	Stats::Add(Stats::SYS_SYMLINK);
+	
 	//Create the link.
-	if (symlink(Target, Destination) == -1)
+	if (symlinkat(Target, ParentDesc, Name) == -1)
 	{
 		return false;
 	}
 	//Restore the owner that the original had.
-	lchown(Destination, UserID, GroupID);
+	fchownat(ParentDesc, Name, UserID, GroupID, AT_SYMLINK_NOFOLLOW);
+	
+	Stats::Add(Stats::SYMLINKS_CREATED);
+	Stats::Add(Stats::SYS_ATTR);
 	
 	return true;
 }
 
-bool Files::FileCopy(const char *Source, const char *Destination_, const bool Overwrite, const PkString &Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode)
+bool Files::FileCopy(const char *Source, const char *Destination, const bool Overwrite, const char *Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode)
 { //Copies a file preserving its permissions.
-	FILE *In = fopen(Source, "rb");
+	const int InDesc = open(Source, O_RDONLY | O_CLOEXEC);
 
-	if (!In) return false;
+	if (InDesc == -1) return false;
 	
 	struct stat FileStat;
-	bool Exists = false;
+	const char *Name = NULL;
+	const int ParentDesc = Files::ParentDescriptor(Sysroot, Destination, &Name);
+	
+	if (ParentDesc == -1)
+	{
+		close(InDesc);
+		return false;
+	}
 	
-	PkString Destination = Sysroot ? Sysroot + "/" + Destination_ : PkString(Destination_);
+	const bool Exists = fstatat(ParentDesc, Name, &FileStat, AT_SYMLINK_NOFOLLOW) == 0;
 	
 	//Destination already exists.
-	if (!Overwrite && (Exists = !stat(Destination, &FileStat)))
+	if (!Overwrite && Exists)
 	{
-		fclose(In);
+		close(InDesc);
 		return false;
 	}
 	//Delete existing file if present.
 	if (Overwrite && Exists)
 	{
+		Stats::Add(Stats::SYS_UNLINK);
+		
 		if (S_ISDIR(FileStat.st_mode))
 		{
-			if (rmdir(Destination) == -1) return false; //Not empty.
+			if (unlinkat(ParentDesc, Name, AT_REMOVEDIR) == -1)
+			{ //Not empty.
+				close(InDesc);
+				return false;
+			}
+			
+			Files::ForgetDirectories();
 		}
-		else unlink(Destination);
+		else unlinkat(ParentDesc, Name, 0);
 	}
 	
-	FILE *Out = fopen(Destination, "wb");
+	//O_NOFOLLOW, so nothing can swap in a symlink and have us write somewhere else.
+	const int OutDesc = openat(ParentDesc, Name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
 	
-	if (!Out)
+	if (OutDesc == -1)
 	{
-		fclose(In);
-		return false;
-	}
-	//Get permissions and owner from source.
-	if (stat(Source, &FileStat) != 0)
-	{
-		fclose(In);
-		fclose(Out);
+		close(InDesc);
 		return false;
 	}
 	
-	//Do the copy.
-	const unsigned SizeToRead = 1024 * 1024 * 5; //5MB chunks, for speed.
-	unsigned AmountRead = 0;
-	char *ReadBuf = (char*)malloc(SizeToRead);
-	do
+	Stats::Add(Stats::SYS_OPEN, 2);
+	Stats::Add(Stats::FILES_CREATED);
+	
+	//Do the copy, on the stack. This runs once per file, so no heap buffer.
+	char ReadBuf[65536];
+	ssize_t AmountRead = 0;
+	bool Success = true;
+	
+	while (Success && (AmountRead = read(InDesc, ReadBuf, sizeof ReadBuf)) != 0)
 	{
-		AmountRead = fread(ReadBuf, 1, SizeToRead, In);
-		if (AmountRead) fwrite(ReadBuf, 1, AmountRead, Out);
-	} while (AmountRead > 0);
-	free(ReadBuf);
+		if (AmountRead == -1)
+		{
+			Success = errno == EINTR;
+			continue;
+		}
+		
+		for (ssize_t Written = 0; Success && Written < AmountRead;)
+		{
+			const ssize_t Amount = write(OutDesc, ReadBuf + Written, AmountRead - Written);
+			
+			if (Amount > 0) Written += Amount;
+			else Success = Amount == -1 && errno == EINTR;
+		}
+		
+		if (Success) Stats::Add(Stats::BYTES_COPIED, AmountRead);
+	}
 	
-	fclose(In);
-	fclose(Out);
+	close(InDesc);
 	
 	//Now we reset the permissions on the destination to match the source.
+	fchown(OutDesc, UserID, GroupID);
+	fchmod(OutDesc, Mode);
+	Stats::Add(Stats::SYS_ATTR, 2);
 	
-	chown(Destination, UserID, GroupID); //not using lchmod because we already deleted any symlink that was there before.
-	chmod(Destination, Mode);
-	return true;
+	close(OutDesc);
+	
+	return Success;
 }
 
+static std::set<PkString> KnownDirectories; //Directories RecursiveMkdir has already created or found.
+static pthread_mutex_t KnownDirectoriesLock = PTHREAD_MUTEX_INITIALIZER;
 
 bool Files::RecursiveMkdir(const char *Path, const uid_t UserID, const gid_t GroupID, const int32_t Mode)
-{ //I should probably write my own implementation here, but I'm not going to.
-	bool Success = !system(PkString("mkdir -p ") + Path);
+{ /*Like mkdir -p, walking down with mkdirat() from the deepest parent we already know exists.
+	Only the last component gets the owner and mode. Install jobs call this from worker threads.*/
+	PkString Known = Path;
+	
+	while (Known.length() > 1 && Known[Known.length() - 1] == '/') Known.erase(Known.length() - 1);
 	
-	if (Success)
+	pthread_mutex_lock(&KnownDirectoriesLock);
+	
+	if (KnownDirectories.count(Known))
+	{ //Already been here, attributes included.
+		pthread_mutex_unlock(&KnownDirectoriesLock);
+		return true;
+	}
+	
+	size_t Start = Known.length();
+	
+	while ((Start = Known.rfind('/', Start - 1)) != std::string::npos && Start > 0)
 	{
-		chown(Path, UserID, GroupID);
-		chmod(Path, Mode == -1 ? 0755 : Mode);
+		if (KnownDirectories.count(Known.substr(0, Start))) break;
 	}
 	
+	pthread_mutex_unlock(&KnownDirectoriesLock);
+	
+	int DirDesc = -1;
+	
+	if (Start == std::string::npos)
+	{ //Relative, and nothing cached.
+		DirDesc = open(".", O_RDONLY | O_DIRECTORY);
+		Start = 0;
+	}
+	else DirDesc = open(Start == 0 ? "/" : Known.substr(0, Start).c_str(), O_RDONLY | O_DIRECTORY);
+	
+	if (DirDesc == -1) return false;
+	
+	std::vector<PkString> Created;
+	
+	while (Start < Known.length())
+	{
+		while (Known[Start] == '/') ++Start;
+		
+		size_t End = Known.find('/', Start);
+		
+		if (End == std::string::npos) End = Known.length();
+		
+		const PkString &Component = Known.substr(Start, End - Start);
+		
+		Stats::Add(Stats::SYS_MKDIR);
+		
+		if (mkdirat(DirDesc, Component, 0755) == 0) Stats::Add(Stats::DIRS_CREATED);
+		else if (errno != EEXIST)
+		{
+			close(DirDesc);
+			return false;
+		}
+		
+		Stats::Add(Stats::SYS_OPEN);
+		
+		const int NextDesc = openat(DirDesc, Component, O_RDONLY | O_DIRECTORY);
+		
+		close(DirDesc);
+		
+		if (NextDesc == -1) return false;
+		
+		DirDesc = NextDesc;
+		Start = End;
+		
+		if (End < Known.length()) Created.push_back(Known.substr(0, End));
+	}
+	
+	const bool Success = fchown(DirDesc, UserID, GroupID) == 0 && fchmod(DirDesc, Mode == -1 ? 0755 : Mode) == 0;
+	
+	Stats::Add(Stats::SYS_ATTR, 2);
+	
+	close(DirDesc);
+	
+	if (Success) Created.push_back(Known);
+	
+	pthread_mutex_lock(&KnownDirectoriesLock);
+	KnownDirectories.insert(Created.begin(), Created.end());
+	pthread_mutex_unlock(&KnownDirectoriesLock);
+	
+	return Success;
+}
+
+void Files::ForgetDirectories(void)
+{ //Call after removing directories, so RecursiveMkdir doesn't trust stale entries.
+	pthread_mutex_lock(&KnownDirectoriesLock);
+	KnownDirectories.clear();
+	pthread_mutex_unlock(&KnownDirectoriesLock);
+	
+	__sync_add_and_fetch(&DirGeneration, 1);
+}
+
+static int RemoveTreeCallback(const char *Path, const struct stat *FileStat, int TypeFlag, struct FTW *FTWInfo)
+{ //Depth first, so directories are already empty when we get to them.
+	Stats::Add(Stats::SYS_UNLINK);
+	
+	if ((TypeFlag == FTW_DP ? rmdir(Path) : unlink(Path)) == 0) Stats::Add(Stats::PATHS_REMOVED);
+	else if (errno != ENOENT)
+	{
+		fprintf(stderr, "\nWARNING: Unable to remove \"%s\"\n", Path);
+	}
+	
+	return 0;
+}
+
+bool Files::RemoveTree(const char *Path)
+{ //rm -rf without the shell. Doesn't cross into other filesystems, in case something is still mounted in there.
+	const bool Success = nftw(Path, RemoveTreeCallback, 64, FTW_DEPTH | FTW_PHYS | FTW_MOUNT) == 0;
+	
+	Files::ForgetDirectories();
+	
 	return Success;
 }
@@ -0,0 +1,244 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Package command runner. The first hook for a sysroot forks a helper that chroots into it once and stays
+ * there. Commands go to it over a socketpair, it posix_spawn()s sh -c for each and sends back the wait status
+ * and everything the command wrote to stdout and stderr.
+ * Request:	uint32_t length, then the command.
+ * Reply:	int32_t wait status (-1 if sh couldn't be spawned), uint32_t output length, then the output.
+ * The helper quits when its end of the socket closes, so it never outlives us.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "packrat.h"
+
+extern char **environ;
+
+//Prototypes
+static bool ReadAll(const int Descriptor, void *Buf, const size_t Size);
+static bool WriteAll(const int Descriptor, const void *Buf, const size_t Size);
+static void HelperLoop(const int Socket);
+static bool StartHelper(const char *Sysroot);
+static void StopHelper(void);
+
+//Globals
+static pthread_mutex_t HelperLock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t HelperPID = -1;
+static int HelperSocket = -1;
+static PkString HelperSysroot;
+
+//Functions
+static bool ReadAll(const int Descriptor, void *Buf, const size_t Size)
+{
+	size_t Done = 0;
+	
+	while (Done < Size)
+	{
+		const ssize_t Amount = read(Descriptor, (char*)Buf + Done, Size - Done);
+		
+		if (Amount == -1 && errno == EINTR) continue;
+		if (Amount <= 0) return false;
+		
+		Done += Amount;
+	}
+	
+	return true;
+}
+
+static bool WriteAll(const int Descriptor, const void *Buf, const size_t Size)
+{ //send() so a dead helper gives us EPIPE instead of SIGPIPE.
+	size_t Done = 0;
+	
+	while (Done < Size)
+	{
+		const ssize_t Amount = send(Descriptor, (const char*)Buf + Done, Size - Done, MSG_NOSIGNAL);
+		
+		if (Amount == -1 && errno == EINTR) continue;
+		if (Amount <= 0) return false;
+		
+		Done += Amount;
+	}
+	
+	return true;
+}
+
+static void HelperLoop(const int Socket)
+{ //Runs in the chrooted child until the socket closes.
+	uint32_t Length = 0;
+	
+	while (ReadAll(Socket, &Length, sizeof Length))
+	{
+		std::vector<char> Command(Length + 1, '\0');
+		
+		if (Length && !ReadAll(Socket, &Command[0], Length)) break;
+		
+		int OutPipe[2];
+		int32_t Status = -1;
+		std::vector<char> Output;
+		
+		if (pipe2(OutPipe, O_CLOEXEC) == 0)
+		{
+			posix_spawn_file_actions_t Actions;
+			posix_spawn_file_actions_init(&Actions);
+			posix_spawn_file_actions_addopen(&Actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+			posix_spawn_file_actions_adddup2(&Actions, OutPipe[1], STDOUT_FILENO);
+			posix_spawn_file_actions_adddup2(&Actions, OutPipe[1], STDERR_FILENO);
+			
+			const char *Argv[] = { "sh", "-c", &Command[0], NULL };
+			pid_t PID = -1;
+			
+			const bool Spawned = posix_spawnp(&PID, "sh", &Actions, NULL, const_cast<char *const*>(Argv), environ) == 0;
+			
+			posix_spawn_file_actions_destroy(&Actions);
+			close(OutPipe[1]);
+			
+			char Buf[4096];
+			ssize_t Amount = 0;
+			
+			//Read until every copy of the write end is gone, which includes anything the command backgrounded.
+			while (Spawned && ((Amount = read(OutPipe[0], Buf, sizeof Buf)) > 0 || (Amount == -1 && errno == EINTR)))
+			{
+				if (Amount > 0) Output.insert(Output.end(), Buf, Buf + Amount);
+			}
+			
+			close(OutPipe[0]);
+			
+			int RawStatus = 0;
+			
+			if (Spawned && waitpid(PID, &RawStatus, 0) == PID) Status = RawStatus;
+		}
+		
+		const uint32_t OutputLength = Output.size();
+		
+		if (!WriteAll(Socket, &Status, sizeof Status) || !WriteAll(Socket, &OutputLength, sizeof OutputLength) ||
+			(OutputLength && !WriteAll(Socket, &Output[0], OutputLength)))
+		{
+			break;
+		}
+	}
+}
+
+static bool StartHelper(const char *Sysroot)
+{ //HelperLock must be held.
+	int Sockets[2];
+	
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, Sockets) != 0) return false;
+	
+	const pid_t PID = fork();
+	
+	if (PID == -1)
+	{
+		close(Sockets[0]);
+		close(Sockets[1]);
+		return false;
+	}
+	
+	if (PID == 0)
+	{ //Child code
+		close(Sockets[0]);
+		
+		if (chroot(Sysroot) != 0 || chdir("/") != 0) _exit(1);
+		
+		HelperLoop(Sockets[1]);
+		
+		_exit(0);
+	}
+	
+	close(Sockets[1]);
+	
+	HelperPID = PID;
+	HelperSocket = Sockets[0];
+	HelperSysroot = Sysroot;
+	
+	return true;
+}
+
+static void StopHelper(void)
+{ //HelperLock must be held. Closing the socket is the helper's cue to quit.
+	if (HelperPID == -1) return;
+	
+	close(HelperSocket);
+	waitpid(HelperPID, NULL, 0);
+	
+	HelperPID = -1;
+	HelperSocket = -1;
+	HelperSysroot.clear();
+}
+
+void Hooks::Shutdown(void)
+{
+	pthread_mutex_lock(&HelperLock);
+	StopHelper();
+	pthread_mutex_unlock(&HelperLock);
+}
+
+bool Hooks::Run(const char *Command, const char *Sysroot, int *OutExitStatus, PkString *OutOutput)
+{ //Returns false only if the command couldn't be run at all. Check OutExitStatus for how it went.
+	const Trace::Scope Phase("hook");
+	
+	if (!Sysroot || !*Sysroot) Sysroot = "/";
+	
+	pthread_mutex_lock(&HelperLock);
+	
+	if (HelperPID != -1 && HelperSysroot != Sysroot) StopHelper();
+	
+	if (HelperPID == -1)
+	{
+		static bool Registered = false;
+		
+		if (!Registered) Registered = atexit(Hooks::Shutdown) == 0;
+		
+		if (!StartHelper(Sysroot))
+		{
+			pthread_mutex_unlock(&HelperLock);
+			return false;
+		}
+	}
+	
+	const uint32_t Length = strlen(Command);
+	int32_t Status = -1;
+	uint32_t OutputLength = 0;
+	bool Success = WriteAll(HelperSocket, &Length, sizeof Length) && WriteAll(HelperSocket, Command, Length) &&
+					ReadAll(HelperSocket, &Status, sizeof Status) && ReadAll(HelperSocket, &OutputLength, sizeof OutputLength);
+	
+	std::vector<char> Output(OutputLength + 1, '\0');
+	
+	if (Success && OutputLength) Success = ReadAll(HelperSocket, &Output[0], OutputLength);
+	
+	if (!Success) StopHelper(); //Helper died or couldn't chroot. Start over next time.
+	
+	pthread_mutex_unlock(&HelperLock);
+	
+	if (!Success) return false;
+	
+	if (OutOutput) OutOutput->assign(&Output[0], OutputLength);
+	
+	if (Status == -1 || !WIFEXITED(Status)) return false;
+	
+	if (OutExitStatus) *OutExitStatus = WEXITSTATUS(Status);
+	
+	return true;
+}
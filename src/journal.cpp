@@ -0,0 +1,435 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Install journal. Every install or update gets a directory under JOURNAL_DIRECTORY holding journal.txt,
+ * which lists the files the package is staging ("f <temporary name> <path>"), the files it will delete ("d <path>") and
+ * unchanged files that need a new owner or mode ("a <uid>:<gid>:<mode> <path>"),
+ * plus copies of the package's metadata.txt, filelist.txt and checksums.txt.
+ * Files are written next to their destination under a temporary name and only renamed into place once
+ * a "commit" line has been appended to journal.txt, after everything staged has been synced.
+ * journal.txt itself is synced before anything is staged, so a temporary is never left where Recover() can't find it.
+ * Recover() rolls a journal with that line forward and one without it back.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+//Prototypes
+static PkString TempName(const Journal::Transaction &Txn, const char *Path);
+static bool SyncDirectory(const char *Path);
+static bool WriteJournal(const PkString &Path, const PkString &Text);
+static bool ReadJournal(Journal::Transaction *Txn, bool *OutCommitted);
+static bool CopyInfoFile(const char *InfoDir, const PkString &JournalDir, const char *File);
+static void ApplyTransaction(const Journal::Transaction &Txn);
+
+//Functions
+static PkString TempName(const Journal::Transaction &Txn, const char *Path)
+{ /*A fixed length, so a name that's already as long as it can be still gets one. FNV-1a of the package and the path,
+	since two packages in a wave can stage into the same directory.*/
+	const PkString &Key = Txn.Pkg.PackageID + '.' + Txn.Pkg.Arch + '/' + Path;
+	uint64_t Hash = 14695981039346656037ull;
+	char Buf[32];
+	
+	for (size_t Inc = 0; Inc < Key.size(); ++Inc)
+	{
+		Hash ^= (uint8_t)Key[Inc];
+		Hash *= 1099511628211ull;
+	}
+	
+	snprintf(Buf, sizeof Buf, ".pkrt-%016llx", (unsigned long long)Hash);
+	
+	return Buf;
+}
+
+PkString Journal::TempPath(const Transaction &Txn, const char *Path)
+{ //Same directory as the real file, so the rename can't cross filesystems.
+	const char *Slash = strrchr(Path, '/');
+	
+	if (!Slash) return TempName(Txn, Path);
+	
+	return PkString(std::string(Path, Slash + 1 - Path)) + TempName(Txn, Path);
+}
+
+static bool SyncDirectory(const char *Path)
+{ //For the entries in it, which syncing a file doesn't cover.
+	const int Descriptor = open(Path, O_RDONLY | O_DIRECTORY);
+	
+	if (Descriptor == -1) return false;
+	
+	Stats::Add(Stats::SYS_SYNC);
+	
+	const bool RetVal = fsync(Descriptor) == 0;
+	
+	close(Descriptor);
+	
+	return RetVal;
+}
+
+static bool WriteJournal(const PkString &Path, const PkString &Text)
+{
+	const int Descriptor = open(Path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	
+	if (Descriptor == -1) return false;
+	
+	Stats::Add(Stats::SYS_SYNC);
+	
+	const bool Success = write(Descriptor, +Text, Text.size()) == (ssize_t)Text.size() && fdatasync(Descriptor) == 0;
+	
+	close(Descriptor);
+	
+	return Success;
+}
+
+static bool CopyInfoFile(const char *InfoDir, const PkString &JournalDir, const char *File)
+{
+	return Files::FileCopy(PkString(InfoDir) + '/' + File, JournalDir + '/' + File, true, "", getuid(), getgid(), 0600);
+}
+
+bool Journal::Begin(Transaction *Txn, const PkgObj &Pkg, const char *InfoDir, const char *FileListBuf, const char *OldFileListBuf, const char *Sysroot)
+{ //Called before anything touches the sysroot. OldFileListBuf is the installed version's list for an update, NULL otherwise.
+	const Trace::Scope Phase("journal");
+	
+	Txn->Sysroot = Sysroot ? Sysroot : "/";
+	Txn->Pkg = Pkg;
+	Txn->Dir = Txn->Sysroot + JOURNAL_DIRECTORY + Pkg.PackageID + '.' + Pkg.Arch;
+	Txn->Files.clear();
+	Txn->TempNames.clear();
+	Txn->Deletes.clear();
+	Txn->Attrs.clear();
+	
+	std::set<PkString> Wanted;
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
+	
+	while (View.Next(&LineStruct))
+	{
+		if (LineStruct.Type == Utils::FileListLine::FLLTYPE_INVALID) continue;
+		
+		const PkString &Path = LineStruct.Path.Str();
+		
+		if (LineStruct.Type == Utils::FileListLine::FLLTYPE_FILE)
+		{
+			Txn->Files.push_back(Path);
+			Txn->TempNames.push_back(TempName(*Txn, Path));
+		}
+		
+		Wanted.insert(Path);
+	}
+	
+	//Whatever the old version had that the new one doesn't goes away after the commit.
+	for (Utils::FileListView OldView(OldFileListBuf); OldView.Next(&LineStruct);)
+	{
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE) continue;
+		
+		const PkString &Path = LineStruct.Path.Str();
+		
+		if (!Wanted.count(Path)) Txn->Deletes.push_back(Path);
+	}
+	
+	const bool NewRoot = mkdir(Txn->Sysroot + JOURNAL_DIRECTORY, 0700) == 0;
+	
+	if (mkdir(Txn->Dir, 0700) != 0 && errno != EEXIST) return false;
+	
+	if (!CopyInfoFile(InfoDir, Txn->Dir, "metadata.txt") || !CopyInfoFile(InfoDir, Txn->Dir, "filelist.txt") ||
+		!CopyInfoFile(InfoDir, Txn->Dir, "checksums.txt"))
+	{
+		Journal::Finish(*Txn);
+		return false;
+	}
+	
+	PkString Text;
+	
+	for (size_t Inc = 0; Inc < Txn->Files.size(); ++Inc) Text += "f " + Txn->TempNames[Inc] + ' ' + Txn->Files[Inc] + '\n';
+	for (size_t Inc = 0; Inc < Txn->Deletes.size(); ++Inc) Text += "d " + Txn->Deletes[Inc] + '\n';
+	
+	/*Synced, along with the directories leading to it, before any temporary exists. The copies of the info files
+	can wait for the sync after staging, a rollback doesn't need them.*/
+	if (!WriteJournal(Txn->Dir + "/journal.txt", Text) || !SyncDirectory(Txn->Dir) || !SyncDirectory(Txn->Sysroot + JOURNAL_DIRECTORY) ||
+		(NewRoot && !SyncDirectory(Txn->Sysroot + DB_DIRECTORY)))
+	{
+		Journal::Finish(*Txn);
+		return false;
+	}
+	
+	return true;
+}
+
+bool Journal::AddAttrChanges(Transaction *Txn, const std::vector<AttrChange> &Changes)
+{ //Must come before the commit. Appended without a sync, the one before the commit covers it.
+	PkString Text;
+	char Buf[128];
+	
+	for (size_t Inc = 0; Inc < Changes.size(); ++Inc)
+	{
+		snprintf(Buf, sizeof Buf, "a %u:%u:%o ", (unsigned)Changes[Inc].UserID, (unsigned)Changes[Inc].GroupID, (unsigned)Changes[Inc].Mode);
+		Text += PkString(Buf) + Changes[Inc].Path + '\n';
+	}
+	
+	if (!Utils::WriteFile(Txn->Dir + "/journal.txt", Text, Text.size(), true)) return false;
+	
+	Txn->Attrs.insert(Txn->Attrs.end(), Changes.begin(), Changes.end());
+	
+	return true;
+}
+
+bool Journal::SyncSysroot(const char *Sysroot)
+{ //One syncfs() for everything written so far, instead of an fsync() per file.
+	const Trace::Scope Phase("sync");
+	
+	const int Descriptor = open(Sysroot && *Sysroot ? Sysroot : "/", O_RDONLY | O_DIRECTORY);
+	
+	if (Descriptor == -1) return false;
+	
+	Stats::Add(Stats::SYS_SYNC);
+	
+	const bool RetVal = syncfs(Descriptor) == 0;
+	
+	close(Descriptor);
+	
+	return RetVal;
+}
+
+static void ApplyTransaction(const Journal::Transaction &Txn)
+{ //Safe to repeat, anything already renamed or deleted is skipped.
+	struct stat FileStat;
+	const char *Name = NULL;
+	int ParentDesc = -1;
+	
+	for (size_t Inc = 0; Inc < Txn.Files.size(); ++Inc)
+	{
+		//The temporary is in the same directory, so one lookup does for both.
+		if ((ParentDesc = Files::ParentDescriptor(Txn.Sysroot, Txn.Files[Inc], &Name)) == -1) continue;
+		
+		const PkString &Temp = Txn.TempNames[Inc];
+		
+		if (fstatat(ParentDesc, Temp, &FileStat, AT_SYMLINK_NOFOLLOW) != 0) continue;
+		
+		Stats::Add(Stats::SYS_RENAME);
+		
+		if (renameat(ParentDesc, Temp, ParentDesc, Name) != 0)
+		{ //A directory where the file is going, FileCopy() used to rmdir() these too.
+			if (errno != EISDIR || unlinkat(ParentDesc, Name, AT_REMOVEDIR) != 0 || renameat(ParentDesc, Temp, ParentDesc, Name) != 0)
+			{
+				fprintf(stderr, "\nWARNING: Unable to move \"%s/%s\" into place.\n", +Txn.Sysroot, +Txn.Files[Inc]);
+			}
+			
+			Files::ForgetDirectories();
+		}
+		
+		//rename() does nothing when both are links to the same object, which happens when a file didn't change.
+		unlinkat(ParentDesc, Temp, 0);
+		
+		Stats::Add(Stats::SYS_UNLINK);
+	}
+	
+	for (size_t Inc = 0; Inc < Txn.Deletes.size(); ++Inc)
+	{
+		if ((ParentDesc = Files::ParentDescriptor(Txn.Sysroot, Txn.Deletes[Inc], &Name)) == -1) continue;
+		
+		Stats::Add(Stats::SYS_UNLINK);
+		
+		if (unlinkat(ParentDesc, Name, 0) == 0) Stats::Add(Stats::PATHS_REMOVED);
+	}
+	
+	for (size_t Inc = 0; Inc < Txn.Attrs.size(); ++Inc)
+	{
+		if ((ParentDesc = Files::ParentDescriptor(Txn.Sysroot, Txn.Attrs[Inc].Path, &Name)) == -1) continue;
+		
+		fchownat(ParentDesc, Name, Txn.Attrs[Inc].UserID, Txn.Attrs[Inc].GroupID, AT_SYMLINK_NOFOLLOW);
+		fchmodat(ParentDesc, Name, Txn.Attrs[Inc].Mode, 0);
+		
+		Stats::Add(Stats::SYS_ATTR, 2);
+	}
+}
+
+bool Journal::Commit(Transaction *Txn)
+{ /*The files must already be synced with SyncSysroot(). Once the commit line is on disk the transaction
+	goes forward no matter what, then the staged files replace the real ones.*/
+	const Trace::Scope Phase("publish");
+	
+	const int Descriptor = open(Txn->Dir + "/journal.txt", O_WRONLY | O_APPEND);
+	
+	if (Descriptor == -1) return false;
+	
+	static const char Marker[] = "commit\n";
+	
+	Stats::Add(Stats::SYS_SYNC);
+	
+	const bool Success = write(Descriptor, Marker, sizeof Marker - 1) == sizeof Marker - 1 && fdatasync(Descriptor) == 0;
+	
+	close(Descriptor);
+	
+	if (!Success) return false;
+	
+	ApplyTransaction(*Txn);
+	
+	return true;
+}
+
+bool Journal::CommitDB(const Transaction &Txn)
+{ //Uses the journal's copies, so it works the same during recovery when the package is long gone.
+	return DB::SavePackage(Txn.Pkg, Txn.Dir + "/filelist.txt", Txn.Dir + "/checksums.txt", Txn.Sysroot);
+}
+
+void Journal::Finish(const Transaction &Txn)
+{ //The database has it now, so the journal can go. Losing this to a crash just means a harmless replay.
+	static const char *const Names[] = { "journal.txt", "metadata.txt", "filelist.txt", "checksums.txt" };
+	
+	for (size_t Inc = 0; Inc < sizeof Names / sizeof *Names; ++Inc)
+	{
+		unlink(Txn.Dir + '/' + Names[Inc]);
+	}
+	
+	rmdir(Txn.Dir);
+}
+
+void Journal::Abort(const Transaction &Txn)
+{
+	const char *Name = NULL;
+	int ParentDesc = -1;
+	
+	for (size_t Inc = 0; Inc < Txn.Files.size(); ++Inc)
+	{
+		if ((ParentDesc = Files::ParentDescriptor(Txn.Sysroot, Txn.Files[Inc], &Name)) != -1) unlinkat(ParentDesc, Txn.TempNames[Inc], 0);
+	}
+	
+	Journal::Finish(Txn);
+}
+
+static bool ReadJournal(Journal::Transaction *Txn, bool *OutCommitted)
+{
+	Utils::MappedFile JournalBuf;
+	
+	try
+	{
+		JournalBuf.Open(Txn->Dir + "/journal.txt");
+	}
+	catch (Utils::SlurpFailure&)
+	{
+		return false;
+	}
+	
+	*OutCommitted = false;
+	
+	char CurLine[4096];
+	const char *Iter = JournalBuf.Data();
+	
+	while (SubStrings.Line.GetLine(CurLine, sizeof CurLine, &Iter))
+	{
+		if (SubStrings.StartsWith("f ", CurLine))
+		{
+			const char *Path = strchr(CurLine + 2, ' ');
+			
+			if (!Path) continue;
+			
+			Txn->TempNames.push_back(std::string(CurLine + 2, Path - (CurLine + 2)));
+			Txn->Files.push_back(Path + 1);
+		}
+		else if (SubStrings.StartsWith("d ", CurLine)) Txn->Deletes.push_back(CurLine + 2);
+		else if (SubStrings.StartsWith("a ", CurLine))
+		{
+			unsigned UserID = 0, GroupID = 0, Mode = 0;
+			int PathOffset = 0;
+			
+			if (sscanf(CurLine, "a %u:%u:%o %n", &UserID, &GroupID, &Mode, &PathOffset) != 3 || !PathOffset) continue;
+			
+			const Journal::AttrChange Change = { CurLine + PathOffset, UserID, GroupID, Mode };
+			
+			Txn->Attrs.push_back(Change);
+		}
+		else if (SubStrings.Compare("commit", CurLine)) *OutCommitted = true;
+	}
+	
+	return true;
+}
+
+bool Journal::Recover(const char *Sysroot)
+{ /*Finishes or undoes whatever an interrupted run left behind. Hooks aren't run again, we can't know
+	how far they got, and running half a post-install twice is worse than not running it.*/
+	const Trace::Scope Phase("recover");
+	
+	const PkString &JournalRoot = PkString(Sysroot ? Sysroot : "/") + JOURNAL_DIRECTORY;
+	
+	DIR *Dir = opendir(JournalRoot);
+	
+	if (!Dir) return true; //No journal directory, nothing was ever interrupted.
+	
+	std::vector<PkString> Names;
+	struct dirent *File = NULL;
+	
+	while ((File = readdir(Dir)))
+	{
+		if (*File->d_name != '.') Names.push_back(File->d_name);
+	}
+	
+	closedir(Dir);
+	
+	bool Success = true;
+	
+	for (size_t Inc = 0; Inc < Names.size(); ++Inc)
+	{
+		Transaction Txn;
+		bool Committed = false;
+		
+		Txn.Sysroot = Sysroot ? Sysroot : "/";
+		Txn.Dir = JournalRoot + Names[Inc];
+		
+		if (!ReadJournal(&Txn, &Committed))
+		{ //Died before the journal was even written, so it never touched the sysroot.
+			Journal::Finish(Txn);
+			continue;
+		}
+		
+		if (!Committed)
+		{ //The journal has all a rollback needs. The info files may not have made it.
+			fprintf(stderr, "Rolling back interrupted transaction for package %s\n", +Names[Inc]);
+			Journal::Abort(Txn);
+			continue;
+		}
+		
+		if (!Package::GetMetadata(Txn.Dir, &Txn.Pkg))
+		{ //Synced before the commit, so this isn't a crash we can fix by forgetting it.
+			fprintf(stderr, "ERROR: Unable to read metadata for interrupted transaction %s\n", +Names[Inc]);
+			Success = false;
+			continue;
+		}
+		
+		fprintf(stderr, "Completing interrupted transaction for package %s_%s-%u.%s\n", +Txn.Pkg.PackageID, +Txn.Pkg.VersionString,
+				Txn.Pkg.PackageGeneration, +Txn.Pkg.Arch);
+		
+		ApplyTransaction(Txn);
+		
+		if (!Journal::SyncSysroot(Txn.Sysroot) || !Journal::CommitDB(Txn))
+		{ //Leave the journal so we try again next time.
+			fprintf(stderr, "ERROR: Unable to complete transaction for package %s.%s\n", +Txn.Pkg.PackageID, +Txn.Pkg.Arch);
+			Success = false;
+			continue;
+		}
+		
+		Journal::Finish(Txn);
+	}
+	
+	return Success;
+}
@@ -31,17 +31,58 @@ enum OperationMode
 	OP_REMOVE,
 	OP_UPDATE,
 	OP_DISPLAY,
-	OP_MKDB
+	OP_MKDB,
+	OP_SEARCH,
+	OP_RESOLVE,
+	OP_PROVIDES,
+	OP_PRUNE,
+	OP_MKDELTA,
+	OP_DAEMON
 };
 
+//Prototypes
+static int Run(int argc, char **argv);
+static bool PlanFromRepos(const std::vector<PkString> &PackageIDs, const char *Arch, const char *Sysroot, Resolver::Graph *Graph, std::vector<uint32_t> *Plan);
+
+//Functions
+static bool PlanFromRepos(const std::vector<PkString> &PackageIDs, const char *Arch, const char *Sysroot, Resolver::Graph *Graph, std::vector<uint32_t> *Plan)
+{ //Everything that has to be installed for PackageIDs, dependencies first.
+	if (!Repos::LoadRepos(Sysroot))
+	{
+		fputs("Failed to load repositories.\n", stderr);
+		return false;
+	}
+	
+	std::vector<uint32_t> Targets;
+	
+	Resolver::BuildGraph(Sysroot, Graph);
+	
+	for (size_t Inc = 0; Inc < PackageIDs.size(); ++Inc)
+	{
+		uint32_t Node = 0;
+		
+		if (!Resolver::FindPackage(*Graph, PackageIDs[Inc], Arch, &Node))
+		{
+			fprintf(stderr, "No repository provides package %s.\n", +PackageIDs[Inc]);
+			return false;
+		}
+		Targets.push_back(Node);
+	}
+	
+	return Resolver::MakePlan(*Graph, Targets, Sysroot, Plan);
+}
+
 int main(int argc, char **argv)
 {
 	srand(time(NULL) ^ clock());
-	setvbuf(stdout, NULL, _IONBF, 0);
+	setvbuf(stdout, NULL, _IOLBF, 0); //Console flushes the status line itself.
 	setvbuf(stderr, NULL, _IONBF, 0);
-	enum OperationMode Mode = OP_NONE;
 	
-	struct PkgObj Pkg = { 0 }; //Zero-initialized
+	if (argc < 2)
+	{
+		fputs("Need a primary command.\n", stderr);
+		return 1;
+	}
 	
 	if (getuid() != 0)
 	{
@@ -50,6 +91,20 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 	
+	//With --socket= or PACKRAT_SOCKET, packratd does it for us if it's there.
+	const int Forwarded = Client::Forward(argc, argv);
+	
+	if (Forwarded != -1) return Forwarded;
+	
+	return Run(argc, argv);
+}
+
+static int Run(int argc, char **argv)
+{ //Everything after main()'s checks. packratd calls this in a child for every request.
+	enum OperationMode Mode = OP_NONE;
+	
+	struct PkgObj Pkg = { 0 }; //Zero-initialized
+	
 	///Master "mode" of operation
 	if (!strcmp(argv[1], "createpkg"))
 	{
@@ -75,6 +130,30 @@ int main(int argc, char **argv)
 	{
 		Mode = OP_MKDB;
 	}
+	else if (!strcmp(argv[1], "search"))
+	{
+		Mode = OP_SEARCH;
+	}
+	else if (!strcmp(argv[1], "resolve"))
+	{
+		Mode = OP_RESOLVE;
+	}
+	else if (!strcmp(argv[1], "provides"))
+	{
+		Mode = OP_PROVIDES;
+	}
+	else if (!strcmp(argv[1], "prune"))
+	{
+		Mode = OP_PRUNE;
+	}
+	else if (!strcmp(argv[1], "mkdelta"))
+	{
+		Mode = OP_MKDELTA;
+	}
+	else if (!strcmp(argv[1], "daemon"))
+	{
+		Mode = OP_DAEMON;
+	}
 	else
 	{
 		fprintf(stderr, "Bad primary command \"%s\".\n", argv[1]);
@@ -86,6 +165,14 @@ int main(int argc, char **argv)
 	char CreationDirectory[4096] = { '\0' };
 	char Sysroot[4096] = { "/" };
 	char InFile[4096] = { '\0' };
+	char BaseFile[4096] = { '\0' };
+	char Query[256] = { '\0' };
+	char TraceFile[4096] = { '\0' };
+	char StatsFile[4096] = { '\0' };
+	char SocketPath[4096] = { DAEMON_SOCKET_PATH };
+	bool StatsSummary = false;
+	Search::MatchMode MatchMode = Search::MATCH_KEYWORD;
+	std::vector<PkString> PackageIDs; //For commands that take more than one --pkgid.
 	
 	char Temp[256];
 	
@@ -96,6 +183,7 @@ int main(int argc, char **argv)
 			char PkgID[256];
 			SubStrings.Extract(PkgID, sizeof PkgID, "=", NULL,  argv[Inc]);
 			Pkg.PackageID = PkgID;
+			PackageIDs.push_back(PkgID);
 		}
 		else if (SubStrings.StartsWith("--sysroot=", argv[Inc]))
 		{
@@ -118,6 +206,10 @@ int main(int argc, char **argv)
 		{
 			SubStrings.Extract(InFile, sizeof InFile, "=", NULL, argv[Inc]);
 		}
+		else if (SubStrings.StartsWith("--base=", argv[Inc]))
+		{
+			SubStrings.Extract(BaseFile, sizeof BaseFile, "=", NULL, argv[Inc]);
+		}
 		else if (SubStrings.StartsWith("--directory=", argv[Inc]))
 		{
 			SubStrings.Extract(CreationDirectory, sizeof CreationDirectory, "=", NULL, argv[Inc]);
@@ -177,6 +269,51 @@ int main(int argc, char **argv)
 			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
 			Pkg.Cmds.PostUpdate = Temp;
 		}
+		else if (SubStrings.StartsWith("--trigger=", argv[Inc]))
+		{ //Can be given more than once.
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			
+			if (!Triggers::Parse(Temp, NULL))
+			{
+				fprintf(stderr, "Bad trigger \"%s\". Must be \"<name> <path prefix or -> <command>\".\n", Temp);
+				exit(1);
+			}
+			
+			Pkg.Triggers += PkString(Temp) + '\n';
+		}
+		else if (SubStrings.StartsWith("--trace=", argv[Inc]))
+		{ //Chrome trace-event JSON of every phase, for chrome://tracing or Perfetto.
+			SubStrings.Extract(TraceFile, sizeof TraceFile, "=", NULL, argv[Inc]);
+		}
+		else if (!strcmp(argv[Inc], "--stats"))
+		{ //Counters for the whole run, per phase and per package, on stderr at exit.
+			StatsSummary = true;
+		}
+		else if (SubStrings.StartsWith("--stats-json=", argv[Inc]))
+		{ //Same counters as JSON.
+			SubStrings.Extract(StatsFile, sizeof StatsFile, "=", NULL, argv[Inc]);
+		}
+		else if (SubStrings.StartsWith("--socket=", argv[Inc]))
+		{ //Where packratd listens. Anything else only gets here if it wasn't listening, and then we do it ourselves.
+			SubStrings.Extract(SocketPath, sizeof SocketPath, "=", NULL, argv[Inc]);
+		}
+		else if (SubStrings.StartsWith("--query=", argv[Inc]))
+		{
+			SubStrings.Extract(Query, sizeof Query, "=", NULL, argv[Inc]);
+		}
+		else if (SubStrings.StartsWith("--match=", argv[Inc]))
+		{
+			SubStrings.Extract(Temp, sizeof Temp, "=", NULL, argv[Inc]);
+			
+			if (!strcmp(Temp, "keyword")) MatchMode = Search::MATCH_KEYWORD;
+			else if (!strcmp(Temp, "prefix")) MatchMode = Search::MATCH_PREFIX;
+			else if (!strcmp(Temp, "substring")) MatchMode = Search::MATCH_SUBSTRING;
+			else
+			{
+				fprintf(stderr, "Bad match type \"%s\". Must be keyword, prefix, or substring.\n", Temp);
+				exit(1);
+			}
+		}
 		else
 		{
 			fprintf(stderr, "Bad argument \"%s\" for supercommand \"%s\".\n", argv[Inc], argv[1]);
@@ -185,18 +322,48 @@ int main(int argc, char **argv)
 		
 	}
 		
+	if (*TraceFile && !Trace::Open(TraceFile))
+	{
+		fprintf(stderr, "Unable to open trace file \"%s\".\n", TraceFile);
+		exit(1);
+	}
+	
+	if ((StatsSummary || *StatsFile) && !Stats::Enable(StatsSummary, StatsFile))
+	{
+		fprintf(stderr, "Unable to open stats file \"%s\".\n", StatsFile);
+		exit(1);
+	}
+	
 	//Load configuration.
 	if (!Config::LoadConfig(Sysroot))
 	{
 		fprintf(stderr, "Failed to load packrat configuration.\n");
 		exit(1);
 	}
+	
+	if (Mode != OP_MKDB && !DB::Migrate(Sysroot))
+	{
+		fputs("Unable to upgrade the package database, not continuing.\n", stderr);
+		return 1;
+	}
+	
+	//Finish or undo anything a crash left half done before we touch the sysroot again.
+	if ((Mode == OP_INSTALL || Mode == OP_UPDATE || Mode == OP_REMOVE) && !Journal::Recover(Sysroot))
+	{
+		fputs("Unable to recover interrupted transactions, not continuing.\n", stderr);
+		return 1;
+	}
+	
 	switch (Mode)
 	{
 		case OP_MKDB:
 		{
 			return !DB::InitializeEmptyDB(Sysroot);
 		}
+		case OP_DAEMON:
+		{
+			return !Daemon::Serve(SocketPath, Sysroot, Run);
+		}
 		case OP_CREATE:
 		{
 			if (Pkg.PackageID.empty() || Pkg.Arch.empty() || Pkg.VersionString.empty() || !*CreationDirectory)
@@ -220,9 +387,61 @@ int main(int argc, char **argv)
 		}
 		case OP_INSTALL:
 		{
+			if (!PackageIDs.empty() && *CreationDirectory)
+			{ //Install packages and their dependencies from a directory of .pkrt files, using the repo catalogs to plan.
+				Resolver::Graph Graph;
+				std::vector<uint32_t> Plan;
+				
+				if (!PlanFromRepos(PackageIDs, Pkg.Arch, Sysroot, &Graph, &Plan)) return 1;
+				
+				if (*CreationDirectory != '/')
+				{ //Convert to absolute path.
+					char TmpDir[sizeof CreationDirectory];
+					
+					getcwd(TmpDir, sizeof TmpDir);
+					
+					SubStrings.Cat(TmpDir, "/", sizeof TmpDir);
+					SubStrings.Cat(TmpDir, CreationDirectory, sizeof TmpDir);
+					
+					SubStrings.Copy(CreationDirectory, TmpDir, sizeof CreationDirectory);
+				}
+				
+				std::vector<std::vector<uint32_t> > NodeWaves;
+				
+				Resolver::SplitWaves(Graph, Plan, &NodeWaves);
+				
+				std::vector<std::vector<PkString> > Waves(NodeWaves.size());
+				
+				for (size_t WaveInc = 0; WaveInc < NodeWaves.size(); ++WaveInc)
+				{
+					for (size_t Inc = 0; Inc < NodeWaves[WaveInc].size(); ++Inc)
+					{
+						Repos::CatalogEntry Entry;
+						char PkgFile[sizeof CreationDirectory + 1024];
+						struct stat FileStat;
+						
+						Resolver::GetNodeInfo(Graph, NodeWaves[WaveInc][Inc], &Entry, NULL);
+						
+						snprintf(PkgFile, sizeof PkgFile, "%s/%s_%s-%u.%s.pkrt", CreationDirectory,
+								+Entry.PackageID, +Entry.VersionString, Entry.PackageGeneration, +Entry.Arch);
+						
+						if (stat(PkgFile, &FileStat) != 0)
+						{
+							fprintf(stderr, "Package file %s not found.\n", PkgFile);
+							return 1;
+						}
+						
+						Waves[WaveInc].push_back(PkgFile);
+					}
+				}
+				
+				return !Action::InstallPackages(Waves, Sysroot);
+			}
+			
 			if (!*InFile)
 			{
-				fputs("Missing arguments. Need absolute path to package file to install with \"--file=\".\n", stderr);
+				fputs("Missing arguments. Need absolute path to package file to install with \"--file=\", "
+					"or package IDs with \"--pkgid=\" and a directory of packages with \"--directory=\".\n", stderr);
 				return 1;
 			}
 			
@@ -270,6 +489,171 @@ int main(int argc, char **argv)
 			}
 			return !Action::UpdatePackage(InFile, Sysroot);
 		}
+		case OP_SEARCH:
+		{
+			if (!*Query)
+			{
+				fputs("Missing arguments. Need something to search for with \"--query=\".\n", stderr);
+				return 1;
+			}
+			
+			if (!Repos::LoadRepos(Sysroot))
+			{
+				fputs("Failed to load repositories.\n", stderr);
+				return 1;
+			}
+			
+			std::list<Search::SearchResult> *Results = Search::SearchRepos(Query, MatchMode, Sysroot);
+			
+			for (std::list<Search::SearchResult>::iterator Iter = Results->begin(); Iter != Results->end(); ++Iter)
+			{
+				printf("%s/%s.%s %s-%u: %s\n", +Iter->RepoName, +Iter->Entry.PackageID, +Iter->Entry.Arch,
+						+Iter->Entry.VersionString, Iter->Entry.PackageGeneration, +Iter->Entry.Description);
+			}
+			
+			const bool Found = !Results->empty();
+			delete Results;
+			
+			return !Found;
+		}
+		case OP_RESOLVE:
+		{
+			if (PackageIDs.empty())
+			{
+				fputs("Missing arguments. Need at least one package ID, optionally an architecture.\n", stderr);
+				return 1;
+			}
+			
+			Resolver::Graph Graph;
+			std::vector<uint32_t> Plan;
+			
+			if (!PlanFromRepos(PackageIDs, Pkg.Arch, Sysroot, &Graph, &Plan)) return 1;
+			
+			for (size_t Inc = 0; Inc < Plan.size(); ++Inc)
+			{
+				Repos::CatalogEntry Entry;
+				PkString RepoName;
+				
+				Resolver::GetNodeInfo(Graph, Plan[Inc], &Entry, &RepoName);
+				
+				printf("%s/%s.%s %s-%u\n", +RepoName, +Entry.PackageID, +Entry.Arch, +Entry.VersionString, Entry.PackageGeneration);
+			}
+			
+			return 0;
+		}
+		case OP_PROVIDES:
+		{ //Either one name with --query=, or every "needs" line of a dynlibs.txt given with --file=.
+			std::vector<PkString> Names;
+			
+			if (*Query) Names.push_back(Query);
+			
+			if (*InFile)
+			{
+				Utils::MappedFile DynLibs;
+				
+				try
+				{
+					DynLibs.Open(InFile);
+				}
+				catch (Utils::SlurpFailure &S)
+				{
+					fprintf(stderr, "Unable to slurp file \"%s\": %s\n", +(S.Sysroot + S.Path), +S.Reason);
+					return 1;
+				}
+				
+				char Line[4096];
+				const char *Worker = DynLibs.Data();
+				
+				while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
+				{
+					if (SubStrings.StartsWith("needs ", Line)) Names.push_back(Line + (sizeof "needs " - 1));
+				}
+			}
+			
+			if (Names.empty())
+			{
+				fputs("Missing arguments. Need a soname or file path with \"--query=\", or a dynlibs.txt with \"--file=\".\n", stderr);
+				return 1;
+			}
+			
+			if (!Repos::LoadRepos(Sysroot))
+			{
+				fputs("Failed to load repositories.\n", stderr);
+				return 1;
+			}
+			
+			std::map<PkString, std::vector<Repos::Provider> > Providers;
+			
+			Repos::FindProviders(Names, Sysroot, &Providers);
+			
+			bool AllFound = true;
+			
+			for (std::map<PkString, std::vector<Repos::Provider> >::iterator Iter = Providers.begin(); Iter != Providers.end(); ++Iter)
+			{
+				if (Iter->second.empty())
+				{
+					fprintf(stderr, "%s: no repository provides this.\n", +Iter->first);
+					AllFound = false;
+					continue;
+				}
+				
+				for (size_t Inc = 0; Inc < Iter->second.size(); ++Inc)
+				{
+					const Repos::Provider &Prov = Iter->second[Inc];
+					
+					printf("%s: %s/%s.%s %s-%u\n", +Iter->first, +Prov.RepoName, +Prov.Entry.PackageID, +Prov.Entry.Arch,
+							+Prov.Entry.VersionString, Prov.Entry.PackageGeneration);
+				}
+			}
+			
+			return !AllFound;
+		}
+		case OP_MKDELTA:
+		{
+			if (!*InFile || !*BaseFile)
+			{
+				fputs("Missing arguments. Need the new package with \"--file=\" and the one to make a delta against with \"--base=\".\n", stderr);
+				return 1;
+			}
+			
+			char *const Paths[] = { InFile, BaseFile };
+			
+			for (size_t Inc = 0; Inc < sizeof Paths / sizeof *Paths; ++Inc)
+			{
+				if (*Paths[Inc] == '/') continue;
+				
+				//Convert to absolute path.
+				char TmpFile[sizeof InFile];
+				
+				getcwd(TmpFile, sizeof TmpFile);
+				
+				SubStrings.Cat(TmpFile, "/", sizeof TmpFile);
+				SubStrings.Cat(TmpFile, Paths[Inc], sizeof TmpFile);
+				
+				SubStrings.Copy(Paths[Inc], TmpFile, sizeof InFile);
+			}
+			
+			return !Delta::CreateDelta(BaseFile, InFile, Sysroot);
+		}
+		case OP_PRUNE:
+		{
+			if (!Config::ObjectStore)
+			{
+				fputs("No object store is configured.\n", stderr);
+				return 1;
+			}
+			
+			unsigned NumRemoved = 0;
+			
+			if (!ObjStore::Prune(&NumRemoved))
+			{
+				fprintf(stderr, "Unable to open object store %s\n", +Config::ObjectStore);
+				return 1;
+			}
+			
+			printf("Removed %u unused object(s) from %s\n", NumRemoved, +Config::ObjectStore);
+			return 0;
+		}
 		default:
 			break;
 	}
@@ -0,0 +1,281 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Binary manifests, the database's packed form of a file list plus its checksums. Numbers are unsigned LEB128 varints.
+ *	"PKM1"
+ *	varint name count, then each name as varint length and bytes. Users and groups both index this table.
+ *	varint entry count, then for each entry:
+ *		byte flags:		bit 0 set for a directory, bit 1 set if a digest follows, bit 2 set if that digest is 32 bytes rather than 20.
+ *		varint user, varint group, varint mode.
+ *		varint bytes shared with the previous path, varint length of the rest, then the rest.
+ *		the raw digest, if any.
+ * Anything that doesn't fit, like a checksum for a path the list doesn't have, makes Encode() fail, and the
+ * database just keeps the text for that package.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packrat.h"
+
+#define MANIFEST_MAGIC "PKM1"
+
+enum { MFLAG_DIRECTORY = 1 << 0, MFLAG_DIGEST = 1 << 1, MFLAG_DIGEST32 = 1 << 2 };
+
+//Prototypes
+static void PutVarint(std::string *Out, uint64_t Value);
+static bool GetVarint(const unsigned char **Cursor, const unsigned char *End, uint64_t *Out);
+static bool HexToRaw(const char *Hex, const size_t HexSize, std::string *Out);
+static unsigned InternName(const Utils::StringView &Name, std::map<std::string, unsigned> *Index, std::vector<std::string> *Names);
+
+//Functions
+static void PutVarint(std::string *Out, uint64_t Value)
+{
+	while (Value >= 0x80)
+	{
+		Out->push_back((char)((Value & 0x7F) | 0x80));
+		Value >>= 7;
+	}
+	
+	Out->push_back((char)Value);
+}
+
+static bool GetVarint(const unsigned char **Cursor, const unsigned char *End, uint64_t *Out)
+{
+	uint64_t Value = 0;
+	
+	for (unsigned Shift = 0; *Cursor < End && Shift < 64; Shift += 7)
+	{
+		const unsigned char Byte = *(*Cursor)++;
+		
+		Value |= (uint64_t)(Byte & 0x7F) << Shift;
+		
+		if (!(Byte & 0x80))
+		{
+			*Out = Value;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+static bool HexToRaw(const char *Hex, const size_t HexSize, std::string *Out)
+{ //Lowercase only, so decoding gives back exactly what MakeFileChecksum() wrote.
+	Out->clear();
+	
+	if (HexSize != 40 && HexSize != 64) return false;
+	
+	for (size_t Inc = 0; Inc < HexSize; Inc += 2)
+	{
+		unsigned char Byte = 0;
+		
+		for (size_t Half = 0; Half < 2; ++Half)
+		{
+			const char Digit = Hex[Inc + Half];
+			
+			if (Digit >= '0' && Digit <= '9') Byte = (Byte << 4) | (Digit - '0');
+			else if (Digit >= 'a' && Digit <= 'f') Byte = (Byte << 4) | (Digit - 'a' + 10);
+			else return false;
+		}
+		
+		Out->push_back((char)Byte);
+	}
+	
+	return true;
+}
+
+static unsigned InternName(const Utils::StringView &Name, std::map<std::string, unsigned> *Index, std::vector<std::string> *Names)
+{
+	const std::string Key(Name.Data, Name.Size);
+	std::map<std::string, unsigned>::iterator Iter = Index->find(Key);
+	
+	if (Iter != Index->end()) return Iter->second;
+	
+	Names->push_back(Key);
+	
+	return (*Index)[Key] = Names->size() - 1;
+}
+
+bool Manifest::Encode(const char *FileListBuf, const char *ChecksumsBuf, std::string *Out)
+{ //Returns false if the pair can't be represented exactly, and the caller should keep the text.
+	std::map<PkString, PkString> Checksums;
+	std::map<std::string, unsigned> NameIndex;
+	std::vector<std::string> Names;
+	std::string Entries, Digest, LastPath;
+	size_t NumEntries = 0, NumDigests = 0;
+	
+	Utils::ChecksumsToMap(ChecksumsBuf, &Checksums);
+	
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
+	
+	while (View.Next(&LineStruct))
+	{
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE && LineStruct.Type != Utils::FileListLine::FLLTYPE_DIRECTORY) return false;
+		
+		std::map<PkString, PkString>::iterator Sum = Checksums.find(LineStruct.Path.Str());
+		unsigned char Flags = LineStruct.Type == Utils::FileListLine::FLLTYPE_DIRECTORY ? MFLAG_DIRECTORY : 0;
+		
+		if (Sum != Checksums.end())
+		{
+			if (!HexToRaw(Sum->second, Sum->second.size(), &Digest)) return false;
+			
+			Flags |= MFLAG_DIGEST | (Digest.size() == 32 ? MFLAG_DIGEST32 : 0);
+			++NumDigests;
+		}
+		
+		size_t Shared = 0;
+		
+		while (Shared < LastPath.size() && Shared < LineStruct.Path.Size && LastPath[Shared] == LineStruct.Path.Data[Shared]) ++Shared;
+		
+		Entries.push_back((char)Flags);
+		PutVarint(&Entries, InternName(LineStruct.User, &NameIndex, &Names));
+		PutVarint(&Entries, InternName(LineStruct.Group, &NameIndex, &Names));
+		PutVarint(&Entries, LineStruct.Mode);
+		PutVarint(&Entries, Shared);
+		PutVarint(&Entries, LineStruct.Path.Size - Shared);
+		Entries.append(LineStruct.Path.Data + Shared, LineStruct.Path.Size - Shared);
+		
+		if (Flags & MFLAG_DIGEST) Entries += Digest;
+		
+		LastPath.assign(LineStruct.Path.Data, LineStruct.Path.Size);
+		++NumEntries;
+	}
+	
+	//A checksum for something that isn't in the list would get lost.
+	if (NumDigests != Checksums.size()) return false;
+	
+	Out->assign(MANIFEST_MAGIC, sizeof MANIFEST_MAGIC - 1);
+	PutVarint(Out, Names.size());
+	
+	for (size_t Inc = 0; Inc < Names.size(); ++Inc)
+	{
+		PutVarint(Out, Names[Inc].size());
+		*Out += Names[Inc];
+	}
+	
+	PutVarint(Out, NumEntries);
+	*Out += Entries;
+	
+	return true;
+}
+
+bool Manifest::Decode(const void *Blob, const size_t Size, PkString *OutFileList, PkString *OutChecksums)
+{ //Gives back the text forms, as Package::InstallFiles() and friends expect them. Either output may be NULL.
+	static const char HexDigits[] = "0123456789abcdef";
+	Manifest::Reader Reader(Blob, Size);
+	Manifest::Entry Entry;
+	char Buf[64];
+	
+	if (OutFileList) OutFileList->clear();
+	if (OutChecksums) OutChecksums->clear();
+	
+	while (Reader.Next(&Entry))
+	{
+		if (OutFileList)
+		{
+			snprintf(Buf, sizeof Buf, ":%o ", (unsigned)Entry.Mode);
+			
+			OutFileList->append(Entry.Type == Utils::FileListLine::FLLTYPE_DIRECTORY ? "d " : "f ");
+			OutFileList->append(Entry.User.Data, Entry.User.Size).append(1, ':');
+			OutFileList->append(Entry.Group.Data, Entry.Group.Size).append(Buf);
+			OutFileList->append(Entry.Path.Data, Entry.Path.Size).append(1, '\n');
+		}
+		
+		if (OutChecksums && Entry.DigestSize)
+		{
+			for (size_t Inc = 0; Inc < Entry.DigestSize; ++Inc)
+			{
+				const unsigned char Byte = Entry.Digest[Inc];
+				
+				OutChecksums->append(1, HexDigits[Byte >> 4]).append(1, HexDigits[Byte & 0xF]);
+			}
+			
+			OutChecksums->append(1, ' ').append(Entry.Path.Data, Entry.Path.Size).append(1, '\n');
+		}
+	}
+	
+	return !Reader.Failed();
+}
+
+Manifest::Reader::Reader(const void *Blob, const size_t Size)
+	: Cursor((const unsigned char*)Blob), End((const unsigned char*)Blob + Size), Remaining(), Bad(true)
+{
+	uint64_t NumNames = 0;
+	
+	if (!Blob || Size < sizeof MANIFEST_MAGIC - 1 || memcmp(Blob, MANIFEST_MAGIC, sizeof MANIFEST_MAGIC - 1) != 0) return;
+	
+	Cursor += sizeof MANIFEST_MAGIC - 1;
+	
+	if (!GetVarint(&Cursor, End, &NumNames)) return;
+	
+	for (uint64_t Inc = 0; Inc < NumNames; ++Inc)
+	{
+		uint64_t Length = 0;
+		
+		if (!GetVarint(&Cursor, End, &Length) || Length > (uint64_t)(End - Cursor)) return;
+		
+		Names.push_back(Utils::StringView((const char*)Cursor, Length));
+		Cursor += Length;
+	}
+	
+	Bad = !GetVarint(&Cursor, End, &Remaining);
+}
+
+bool Manifest::Reader::Next(Entry *Out)
+{ //Returns false at the end, or on a truncated or corrupt blob, which Failed() tells apart.
+	uint64_t User = 0, Group = 0, Mode = 0, Shared = 0, Length = 0;
+	
+	if (Bad || !Remaining) return false;
+	
+	Bad = true; //Until this entry checks out.
+	
+	if (Cursor >= End) return false;
+	
+	const unsigned char Flags = *Cursor++;
+	
+	if (!GetVarint(&Cursor, End, &User) || !GetVarint(&Cursor, End, &Group) || !GetVarint(&Cursor, End, &Mode) ||
+		!GetVarint(&Cursor, End, &Shared) || !GetVarint(&Cursor, End, &Length))
+	{
+		return false;
+	}
+	
+	if (User >= Names.size() || Group >= Names.size() || Shared > Path.size() || Length > (uint64_t)(End - Cursor)) return false;
+	
+	Path.resize(Shared);
+	Path.append((const char*)Cursor, Length);
+	Cursor += Length;
+	
+	const size_t DigestSize = !(Flags & MFLAG_DIGEST) ? 0 : (Flags & MFLAG_DIGEST32) ? 32 : 20;
+	
+	if (DigestSize > (size_t)(End - Cursor)) return false;
+	
+	Out->Type = Flags & MFLAG_DIRECTORY ? Utils::FileListLine::FLLTYPE_DIRECTORY : Utils::FileListLine::FLLTYPE_FILE;
+	Out->User = Names[User];
+	Out->Group = Names[Group];
+	Out->Mode = Mode;
+	Out->Path = Utils::StringView(Path.data(), Path.size());
+	Out->Digest = Cursor;
+	Out->DigestSize = DigestSize;
+	
+	Cursor += DigestSize;
+	--Remaining;
+	Bad = false;
+	
+	return true;
+}
@@ -0,0 +1,308 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Object store. When Config::ObjectStore is set, every regular file a package installs is kept once in that
+ * directory, named <sha1>-<uid>-<gid>-<mode> under a two character fanout directory, and the sysroot gets a
+ * hardlink to it. Owner and mode are part of the name because hardlinks share them.
+ * Files that get edited in place, like configuration in /etc, would corrupt the store through a hardlink,
+ * so those are reflinked instead, or copied if the filesystem can't do that.
+ * Next to each object, <object>.stat records its size, mtime, ctime and inode as of the last time it was known good.
+ * Any write through any link moves the ctime, so that catches tampering without checksumming on every install.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> //For FICLONE
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+//Prototypes
+static bool HardlinkSafe(const char *Path);
+static bool CloneOrCopy(const char *Source, const int DestDirDesc, const char *Destination, const mode_t Mode);
+static bool StoreObject(const char *Source, const PkString &ObjectPath, const uid_t UserID, const gid_t GroupID, const mode_t Mode);
+static PkString StatLine(const struct stat &ObjectStat);
+static bool RecordObject(const PkString &ObjectPath);
+static bool ObjectIntact(const PkString &ObjectPath, const struct stat &ObjectStat, const char *Checksum);
+
+//Functions
+static bool HardlinkSafe(const char *Path)
+{ //Path is relative to the sysroot.
+	return !SubStrings.StartsWith("etc/", Path);
+}
+
+static bool CloneOrCopy(const char *Source, const int DestDirDesc, const char *Destination, const mode_t Mode)
+{ //Reflinks where the filesystem supports it, plain copy otherwise. Destination is relative to DestDirDesc, and must not exist.
+	const int In = open(Source, O_RDONLY);
+	
+	if (In == -1) return false;
+	
+	const int Out = openat(DestDirDesc, Destination, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, Mode & 07777);
+	
+	if (Out == -1)
+	{
+		close(In);
+		return false;
+	}
+	
+	Stats::Add(Stats::SYS_OPEN, 2);
+	Stats::Add(Stats::FILES_CREATED);
+	
+	bool Success = false;
+
+#ifdef FICLONE
+	Success = ioctl(Out, FICLONE, In) == 0;
+#endif //FICLONE
+	
+	if (!Success)
+	{
+		char Buf[65536];
+		ssize_t AmountRead = 0;
+		
+		Success = true;
+		
+		while (Success && (AmountRead = read(In, Buf, sizeof Buf)) > 0)
+		{
+			Success = write(Out, Buf, AmountRead) == AmountRead;
+			
+			if (Success) Stats::Add(Stats::BYTES_COPIED, AmountRead);
+		}
+		
+		if (AmountRead < 0) Success = false;
+	}
+	
+	close(In);
+	close(Out);
+	
+	if (!Success) unlinkat(DestDirDesc, Destination, 0);
+	
+	return Success;
+}
+
+static bool StoreObject(const char *Source, const PkString &ObjectPath, const uid_t UserID, const gid_t GroupID, const mode_t Mode)
+{ /*Written to a unique temporary and then linked into place, so two jobs storing the same object at once
+	both end up pointing at the same inode.*/
+	char TempPath[4096];
+	
+	snprintf(TempPath, sizeof TempPath, "%s.tmpXXXXXX", +ObjectPath);
+	
+	const int Descriptor = mkstemp(TempPath);
+	
+	if (Descriptor == -1) return false;
+	
+	close(Descriptor);
+	unlink(TempPath);
+	
+	if (!CloneOrCopy(Source, AT_FDCWD, TempPath, Mode)) return false;
+	
+	chown(TempPath, UserID, GroupID);
+	chmod(TempPath, Mode & 07777);
+	
+	Stats::Add(Stats::SYS_ATTR, 2);
+	Stats::Add(Stats::SYS_LINK);
+	Stats::Add(Stats::SYS_UNLINK);
+	
+	const bool Success = link(TempPath, ObjectPath) == 0 || errno == EEXIST;
+	
+	unlink(TempPath);
+	
+	return Success;
+}
+
+static PkString StatLine(const struct stat &ObjectStat)
+{
+	char Buf[256];
+	
+	snprintf(Buf, sizeof Buf, "%lld %lld.%09ld %lld.%09ld %llu\n", (long long)ObjectStat.st_size,
+			(long long)ObjectStat.st_mtim.tv_sec, (long)ObjectStat.st_mtim.tv_nsec,
+			(long long)ObjectStat.st_ctim.tv_sec, (long)ObjectStat.st_ctim.tv_nsec, (unsigned long long)ObjectStat.st_ino);
+	
+	return Buf;
+}
+
+static bool RecordObject(const PkString &ObjectPath)
+{ //Only call this once the object is known to be good.
+	struct stat ObjectStat;
+	
+	if (lstat(ObjectPath, &ObjectStat) != 0) return false;
+	
+	const PkString &Line = StatLine(ObjectStat);
+	const int Descriptor = open(ObjectPath + ".stat", O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+	
+	if (Descriptor == -1) return false;
+	
+	Stats::Add(Stats::SYS_OPEN);
+	
+	const bool Success = write(Descriptor, Line, Line.size()) == (ssize_t)Line.size();
+	
+	close(Descriptor);
+	
+	return Success;
+}
+
+static bool ObjectIntact(const PkString &ObjectPath, const struct stat &ObjectStat, const char *Checksum)
+{ /*Nothing short of changing the clock can set a ctime, so a write that puts the mtime back still shows.
+	Adding or removing a link moves the ctime too, so after another package drops one this checksums once more.
+	Objects without a record, like ones from before there was one, get checksummed and recorded the same way.*/
+	if (!S_ISREG(ObjectStat.st_mode)) return false;
+	
+	char Recorded[256] = { 0 };
+	const int Descriptor = open(ObjectPath + ".stat", O_RDONLY | O_NOFOLLOW);
+	
+	if (Descriptor != -1)
+	{
+		Stats::Add(Stats::SYS_OPEN);
+		
+		if (read(Descriptor, Recorded, sizeof Recorded - 1) < 0) *Recorded = '\0';
+		
+		close(Descriptor);
+		
+		if (StatLine(ObjectStat) == Recorded) return true;
+	}
+	
+	if (Package::MakeFileChecksum(ObjectPath) != Checksum) return false;
+	
+	RecordObject(ObjectPath);
+	
+	return true;
+}
+
+PkString ObjStore::GetObjectPath(const char *Checksum, const uid_t UserID, const gid_t GroupID, const mode_t Mode)
+{
+	char Buf[256];
+	
+	snprintf(Buf, sizeof Buf, "%.2s/%s-%u-%u-%o", Checksum, Checksum, (unsigned)UserID, (unsigned)GroupID, (unsigned)(Mode & 07777));
+	
+	return Config::ObjectStore + '/' + Buf;
+}
+
+bool ObjStore::InstallFile(const char *Source, const char *Sysroot, const char *Destination, const char *Checksum,
+							const uid_t UserID, const gid_t GroupID, const mode_t Mode)
+{ //Destination is relative to the sysroot, and gets replaced if it exists.
+	const PkString &ObjectPath = ObjStore::GetObjectPath(Checksum, UserID, GroupID, Mode);
+	struct stat SourceStat, ObjectStat;
+	
+	if (stat(Source, &SourceStat) != 0) return false;
+	
+	//Cheap check that nobody has written through one of the links. Checksumming every time would defeat the purpose.
+	if (lstat(ObjectPath, &ObjectStat) == 0 && (ObjectStat.st_size != SourceStat.st_size || !ObjectIntact(ObjectPath, ObjectStat, Checksum)))
+	{
+		unlink(ObjectPath);
+		unlink(ObjectPath + ".stat");
+	}
+	
+	if (lstat(ObjectPath, &ObjectStat) != 0)
+	{
+		Files::RecursiveMkdir(ObjectPath.substr(0, ObjectPath.rfind('/')).c_str(), geteuid(), getegid(), 0700);
+		
+		if (!StoreObject(Source, ObjectPath, UserID, GroupID, Mode)) return false;
+		
+		RecordObject(ObjectPath);
+	}
+	
+	const char *Name = NULL;
+	const int ParentDesc = Files::ParentDescriptor(Sysroot, Destination, &Name);
+	
+	if (ParentDesc == -1) return false;
+	
+	unlinkat(ParentDesc, Name, 0);
+	
+	Stats::Add(Stats::SYS_UNLINK);
+	
+	//Hardlinks can't cross filesystems or exceed the link limit, so those get a copy too.
+	if (HardlinkSafe(Destination))
+	{
+		Stats::Add(Stats::SYS_LINK);
+		
+		if (linkat(AT_FDCWD, ObjectPath, ParentDesc, Name, 0) == 0)
+		{
+			Stats::Add(Stats::FILES_CREATED);
+			
+			RecordObject(ObjectPath); //The new link moved the ctime, and it was just checked.
+			return true;
+		}
+	}
+	
+	if (!CloneOrCopy(ObjectPath, ParentDesc, Name, Mode)) return false;
+	
+	fchownat(ParentDesc, Name, UserID, GroupID, AT_SYMLINK_NOFOLLOW);
+	fchmodat(ParentDesc, Name, Mode & 07777, 0);
+	
+	Stats::Add(Stats::SYS_ATTR, 2);
+	
+	return true;
+}
+
+bool ObjStore::Prune(unsigned *OutNumRemoved)
+{ //Removes every object nothing links to anymore, and temporaries left by interrupted stores.
+	if (OutNumRemoved) *OutNumRemoved = 0;
+	
+	DIR *Root = opendir(Config::ObjectStore);
+	
+	if (!Root) return false;
+	
+	struct dirent *Fanout = NULL;
+	
+	while ((Fanout = readdir(Root)))
+	{
+		if (*Fanout->d_name == '.') continue;
+		
+		const PkString &FanoutPath = Config::ObjectStore + '/' + Fanout->d_name;
+		
+		DIR *Dir = opendir(FanoutPath);
+		
+		if (!Dir) continue;
+		
+		struct dirent *File = NULL;
+		struct stat FileStat;
+		
+		while ((File = readdir(Dir)))
+		{
+			if (*File->d_name == '.') continue;
+			
+			const PkString &Path = FanoutPath + '/' + File->d_name;
+			
+			if (lstat(Path, &FileStat) != 0) continue;
+			
+			if (SubStrings.EndsWith(".stat", File->d_name))
+			{ //Records go with their object, and on their own if it's already gone.
+				if (access(Path.substr(0, Path.size() - (sizeof ".stat" - 1)).c_str(), F_OK) != 0) unlink(Path);
+				continue;
+			}
+			
+			if (FileStat.st_nlink > 1 && !strstr(File->d_name, ".tmp")) continue;
+			
+			if (unlink(Path) == 0 && OutNumRemoved) ++*OutNumRemoved;
+			
+			unlink(Path + ".stat");
+		}
+		
+		closedir(Dir);
+		
+		rmdir(FanoutPath); //Only goes if it's empty.
+	}
+	
+	closedir(Root);
+	
+	return true;
+}
@@ -25,19 +25,52 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <sys/stat.h>
 #include <openssl/sha.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <grp.h>
 #include "packrat.h"
 #include "substrings/substrings.h"
 
 #define SHA1_PER_READ_SIZE ((1024 * 1024) * 5) //5MB
+#define UNINSTALL_PARALLEL_THRESHOLD 512 //Files in a package before uninstalling it uses more than one thread.
 
+//Types
+struct UninstallGroup
+{ //Files to remove from one directory.
+	PkString Directory;
+	std::vector<PkString> Names;
+	std::vector<PkString> Failed;
+};
+
+struct UninstallJobs
+{
+	std::vector<UninstallGroup> Groups;
+	const char *Sysroot;
+};
+
+struct OwnerCache
+{ //The last user and group looked up. File lists name the same ones line after line.
+	PkString User, Group;
+	uid_t UserID;
+	gid_t GroupID;
+	bool Valid;
+	
+	OwnerCache(void) : UserID(), GroupID(), Valid() {}
+};
+
+//Prototypes
 static bool BuildFileList(const char *const Directory_, FILE *const OutDesc, bool FullPath, const char *Sysroot = "/");
 static bool MakeAllChecksums(const char *Directory, const char *FileListPath, FILE *const OutDesc);
 static bool MkPkgCloneFiles(const char *PackageDir, const char *InputDir, const char *FileList);
+static void UninstallWorker(void *Data, const size_t Index);
+static void LookupOwner(const char *Sysroot, const Utils::FileListLine &Line, OwnerCache *Cache);
+static bool PathTooLong(const Utils::FileListLine &Line);
+static size_t CountLines(const char *Buf);
 	
 bool Package::MountPackage(const char *AbsolutePathToPkg, const char *const Sysroot, char *PkgDirPath, unsigned PkgDirPathSize)
 {	
+	const Trace::Scope Phase("mount");
+	
 	if (!Action::CreateTempCacheDir(PkgDirPath, PkgDirPathSize, Sysroot))
 	{
 		return false;
@@ -107,6 +140,8 @@ bool Package::GetPackageConfig(const char *const DirPath, const char *const File
 
 bool Package::CreatePackage(const PkgObj *Job, const char *Directory)
 {
+	const Trace::Scope Phase("create", Job->PackageID);
+	
 	//cd to the new directory
 	printf("---\nCreating package from directory %s\n---\nPackageID=%s\nVersionString=%s\nArch=%s\nPackageGeneration=%u\n",
 			Directory, +Job->PackageID, +Job->VersionString, +Job->Arch, Job->PackageGeneration);
@@ -180,6 +215,29 @@ bool Package::CreatePackage(const PkgObj *Job, const char *Directory)
 	}
 	fclose(Desc);
 	
+	puts("Building info/dynlibs.txt...");
+	//Record which shared libraries the package provides and needs.
+	try
+	{
+		char DynLibsPath[4096];
+		snprintf(DynLibsPath, sizeof DynLibsPath, "%s/dynlibs.txt", PackageInfoDir);
+		
+		Utils::MappedFile FileListBuf;
+		
+		FileListBuf.Open(FileListPath);
+		
+		if (!DepCalc::WriteDynLibs(Directory, FileListBuf.Data(), DynLibsPath))
+		{
+			fprintf(stderr, "Failed to build dynlibs.txt.\n");
+			return false;
+		}
+	}
+	catch (Utils::SlurpFailure &S)
+	{
+		fprintf(stderr, "Failed to slurp file \"%s\": %s\n", +(S.Sysroot + S.Path), +S.Reason);
+		return false;
+	}
+	
 	puts("Building info/metadata.txt...");
 	//Save package metadata.
 	if (!Package::SaveMetadata(Job, PackageInfoDir))
@@ -205,10 +263,8 @@ bool Package::CreatePackage(const PkgObj *Job, const char *Directory)
 	}
 	
 	//Delete temporary directory.
-	char CmdBuf[4096];
-	snprintf(CmdBuf, sizeof CmdBuf, "rm -rf %s", PackageFullName);
 	puts("Removing temporary directory...");
-	system(CmdBuf);
+	Files::RemoveTree(PackageFullName);
 	
 	printf("Package %s.pkrt created successfully.\n", PackageFullName);
 	
@@ -219,6 +275,8 @@ bool Package::CreatePackage(const PkgObj *Job, const char *Directory)
 
 bool Package::CompressPackage(const char *PackageTempDir, const char *OutFile)
 {
+	const Trace::Scope Phase("compress");
+	
 	char PackageName[4096];
 	
 	if (OutFile)
@@ -304,6 +362,17 @@ bool Package::SaveMetadata(const PkgObj *Pkg, const char *InfoPath)
 		SubStrings.Cat(MetadataBuf, TmpBuf, sizeof MetadataBuf);
 	}
 	
+	//One line per trigger.
+	char Trigger[sizeof TmpBuf];
+	const char *Iter = Pkg->Triggers;
+	
+	while (SubStrings.Line.GetLine(Trigger, sizeof Trigger, &Iter))
+	{ //Straight in, since going through TmpBuf would leave less room than Trigger has.
+		SubStrings.Cat(MetadataBuf, "Trigger=", sizeof MetadataBuf);
+		SubStrings.Cat(MetadataBuf, Trigger, sizeof MetadataBuf);
+		SubStrings.Cat(MetadataBuf, "\n", sizeof MetadataBuf);
+	}
+	
 	//Write the post-install commands.
 	if (*MetadataBuf)
 	{
@@ -314,76 +383,92 @@ bool Package::SaveMetadata(const PkgObj *Pkg, const char *InfoPath)
 	return true;
 }
 
-bool Package::UpdateFiles(const char *PackageDir, const char *Sysroot, const char *OldFileListBuf, const char *NewFileListBuf)
-{ //Deletes files that no longer exist in the newer version of the package, and then overwrites the remaining with new data.
-	if (!OldFileListBuf || !NewFileListBuf) return false;
-	
-	//First thing is write the new versions of the files.
-	
-	if (!Package::InstallFiles(PackageDir, Sysroot, NewFileListBuf))
-	{
-		return false;
-	}
+bool Package::UpdateFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf, const char *ChecksumsBuf,
+						const char *InstalledChecksumsBuf, Journal::Transaction *Txn)
+{ /*Only rewrites what changed. A file whose checksum matches the database's is left alone, and if its owner or mode
+	changed, that's recorded in the journal and fixed in place at commit. Obsolete files are the journal's job too.*/
+	const Trace::Scope Phase("update files");
 	
+	std::map<PkString, PkString> NewChecksums, InstalledChecksums;
 	
-	//Next we compare the old and new, and delete what was present in the old, but NOT the new.
+	Utils::ChecksumsToMap(ChecksumsBuf, &NewChecksums);
+	Utils::ChecksumsToMap(InstalledChecksumsBuf, &InstalledChecksums);
 	
-	///We're doing this linked-list conversion to speed up the comparison (by a lot) for NewFileListBuf, mostly.
-	std::list<PkString> *OldList = Utils::LinesToLinkedList(OldFileListBuf);
-	std::list<PkString> *NewList = Utils::LinesToLinkedList(NewFileListBuf);
+	PkString ChangedList;
+	std::vector<Journal::AttrChange> Attrs;
 	
-	std::list<PkString>::iterator Iter1 = OldList->begin(), Iter2;
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
+	struct stat FileStat;
+	const char *Name = NULL;
+	int ParentDesc = -1;
+	OwnerCache Owner;
 	
-	for (; Iter1 != OldList->end(); ++Iter1)
-	{ ///This is almost certainly really expensive, but I'll be damned if I'm going to use a linked list or something for *just this*.
-		Utils::FileListLine LineStruct = Utils::BreakdownFileListLine(*Iter1);
+	while (View.Next(&LineStruct))
+	{
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE)
+		{ //Directories and symlinks are cheap, and have no checksums anyway.
+			ChangedList.append(LineStruct.Text.Data, LineStruct.Text.Size).append(1, '\n');
+			continue;
+		}
 		
-		if (LineStruct.Type == Utils::FileListLine::FLLTYPE_DIRECTORY) continue;
+		const PkString &Path = LineStruct.Path.Str();
+		std::map<PkString, PkString>::iterator NewSum = NewChecksums.find(Path);
+		std::map<PkString, PkString>::iterator InstalledSum = InstalledChecksums.find(Path);
 		
-		for (Iter2 = NewList->begin(); Iter2 != NewList->end(); ++Iter2)
+		if (NewSum == NewChecksums.end() || InstalledSum == InstalledChecksums.end() || NewSum->second != InstalledSum->second ||
+			(ParentDesc = Files::ParentDescriptor(Sysroot, Path, &Name)) == -1 ||
+			fstatat(ParentDesc, Name, &FileStat, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(FileStat.st_mode))
 		{
-			Utils::FileListLine LineStruct2 = Utils::BreakdownFileListLine(*Iter2);
+			ChangedList.append(LineStruct.Text.Data, LineStruct.Text.Size).append(1, '\n');
+			continue;
+		}
 		
-			//Don't try to delete directories.
-			if (LineStruct2.Type == Utils::FileListLine::FLLTYPE_DIRECTORY) continue;
-
-			//This file is supposed to be here, don't delete it.
-			if (LineStruct.Path == LineStruct2.Path) goto SkipDelete;
+		LookupOwner(Sysroot, LineStruct, &Owner);
+		
+		const uid_t UserID = Owner.UserID;
+		const gid_t GroupID = Owner.GroupID;
+		
+		if (FileStat.st_uid == UserID && FileStat.st_gid == GroupID && (FileStat.st_mode & 07777) == (LineStruct.Mode & 07777)) continue;
+		
+		//A hardlink from the object store shares its owner and mode with every other link, so it has to be replaced.
+		if (Config::ObjectStore)
+		{
+			ChangedList.append(LineStruct.Text.Data, LineStruct.Text.Size).append(1, '\n');
+			continue;
 		}
 		
-		//Delete obsolete file
-
-		unlink(PkString(Sysroot) + "/" + LineStruct.Path);
+		const Journal::AttrChange Change = { Path, UserID, GroupID, LineStruct.Mode & 07777 };
 		
-	SkipDelete:
-		continue;
+		Attrs.push_back(Change);
 	}
 	
-	delete OldList;
-	delete NewList;
-	return true;
-
+	if (!Attrs.empty() && !Journal::AddAttrChanges(Txn, Attrs)) return false;
+	
+	return Package::InstallFiles(PackageDir, Sysroot, ChangedList, Txn, ChecksumsBuf);
 }
 
 bool Package::ReverseInstallFiles(const char *Destination, const char *Sysroot, const char *FileListBuf)
 {
-	char CurLine[4096];
-	const char *Iter = FileListBuf;
+	const Trace::Scope Phase("gather files");
+	
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
 	struct stat FileStat;
+	OwnerCache Owner;
+	Utils::PathBuilder Path1(Sysroot), Path2(Destination);
+	
+	Path1.Push("/"); //So an empty Sysroot still gives absolute paths.
+	Path2.Push("files");
 	
-	while (SubStrings.Line.GetLine(CurLine, sizeof CurLine, &Iter))
+	while (View.Next(&LineStruct))
 	{
-		Utils::FileListLine LineStruct = Utils::BreakdownFileListLine(CurLine);
-		
-		uid_t User = PWSR::LookupUsername(Sysroot, LineStruct.User).UserID;
-		gid_t Group = 0;
-		PWSR::LookupGroupname(Sysroot, LineStruct.Group, &Group);
+		LookupOwner(Sysroot, LineStruct, &Owner);
 		
-		const char *ActualPath = LineStruct.Path; //Plus the 'd ' or 'f '
-		
-		const PkString Path1 = PkString(Sysroot) + '/' + ActualPath;
-		const PkString Path2 = PkString(Destination) + "/files/" + ActualPath;
+		const uid_t User = Owner.UserID;
+		const gid_t Group = Owner.GroupID;
 		
+		if (!Path1.Push(LineStruct.Path) || !Path2.Push(LineStruct.Path)) return PathTooLong(LineStruct);
 		
 		switch (LineStruct.Type)
 		{
@@ -412,35 +497,49 @@ bool Package::ReverseInstallFiles(const char *Destination, const char *Sysroot,
 			default:
 				break;
 		}
+		
+		Path1.Pop();
+		Path2.Pop();
 	}
 	return true;
 }
 
-bool Package::InstallFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf)
-{
-	char CurLine[4096];
-	const char *Iter = FileListBuf;
+bool Package::InstallFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf, const Journal::Transaction *Txn, const char *ChecksumsBuf)
+{ /*With a transaction, files go to their temporary names and Journal::Commit() moves them into place. Directories are made right away.
+	Given the package's checksums and an object store, regular files are linked from the store rather than copied.*/
+	const Trace::Scope Phase("copy files");
+	
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
 	struct stat FileStat;
 	
-	while (SubStrings.Line.GetLine(CurLine, sizeof CurLine, &Iter))
+	std::map<PkString, PkString> Checksums;
+	
+	if (Config::ObjectStore) Utils::ChecksumsToMap(ChecksumsBuf, &Checksums);
+	
+	OwnerCache Owner;
+	Utils::PathBuilder SrcPath(PackageDir), ActualPath;
+	PkString TempPath;
+	
+	SrcPath.Push("files");
+	
+	Console::AddProgressTotal(CountLines(FileListBuf));
+	
+	while (View.Next(&LineStruct))
 	{
-		Utils::FileListLine LineStruct = Utils::BreakdownFileListLine(CurLine);
-
-		gid_t GroupID = 0;
-		PasswdUser UserInfo = PWSR::LookupUsername(Sysroot, LineStruct.User);
-		uid_t &UserID = UserInfo.UserID;
+		LookupOwner(Sysroot, LineStruct, &Owner);
 		
-		PWSR::LookupGroupname(Sysroot, LineStruct.Group, &GroupID);
+		const uid_t UserID = Owner.UserID;
+		const gid_t GroupID = Owner.GroupID;
 		
-		const char *ActualPath = LineStruct.Path;
-		
-		PkString SrcPath = PkString(PackageDir) + "/files/" + ActualPath;
+		if (!SrcPath.Push(LineStruct.Path) || !ActualPath.Push(LineStruct.Path)) return PathTooLong(LineStruct);
 		
 		switch (LineStruct.Type)
 		{
 			case Utils::FileListLine::FLLTYPE_DIRECTORY:
 			{
 				Files::Mkdir(SrcPath, ActualPath, Sysroot, UserID, GroupID, LineStruct.Mode); //We don't care much if this fails, it updates the mode if the directory exists.
+				Console::AdvanceProgress(0);
 				break;
 			}
 			case Utils::FileListLine::FLLTYPE_FILE:
@@ -450,107 +549,218 @@ bool Package::InstallFiles(const char *PackageDir, const char *Sysroot, const ch
 					return false;
 				}
 				
+				const char *DestPath = Txn ? (TempPath = Journal::TempPath(*Txn, ActualPath)).c_str() : ActualPath.c_str();
+				std::map<PkString, PkString>::iterator Sum = Checksums.empty() ? Checksums.end() : Checksums.find(ActualPath.c_str());
+				const uint64_t CopyStart = Stats::Active ? Stats::Clock() : 0;
+				
 				if (S_ISLNK(FileStat.st_mode))
 				{
-					if (!Files::SymlinkCopy(SrcPath, ActualPath, true, Sysroot, UserID, GroupID)) return false;
+					if (!Files::SymlinkCopy(SrcPath, DestPath, true, Sysroot, UserID, GroupID)) return false;
+				}
+				else if (Sum != Checksums.end())
+				{
+					if (!ObjStore::InstallFile(SrcPath, Sysroot, DestPath, Sum->second, UserID, GroupID, LineStruct.Mode)) return false;
 				}
 				else
 				{
-					if (!Files::FileCopy(SrcPath, ActualPath, true, Sysroot, UserID, GroupID, LineStruct.Mode)) return false;
+					if (!Files::FileCopy(SrcPath, DestPath, true, Sysroot, UserID, GroupID, LineStruct.Mode)) return false;
 				}
+				
+				if (Stats::Active) Stats::CopyLatency(Stats::Clock() - CopyStart);
+				
+				Console::AdvanceProgress(S_ISREG(FileStat.st_mode) ? FileStat.st_size : 0);
 				break;
 			}
 			default:
 				break;
 		}
+		
+		SrcPath.Pop();
+		ActualPath.Pop();
 	}
 	return true;
 }
 
-bool Package::UninstallFiles(const char *Sysroot, const char *FileListBuf)
-{
-	char CurLine[4096];
-	struct stat FileStat;
-	const char *Iter = FileListBuf;
+static void LookupOwner(const char *Sysroot, const Utils::FileListLine &Line, OwnerCache *Cache)
+{ //Goes to the passwd and group files only when the name differs from last time.
+	if (!Cache->Valid || Line.User != Cache->User)
+	{
+		Cache->User = Line.User.Str();
+		Cache->UserID = PWSR::LookupUsername(Sysroot, Cache->User).UserID;
+	}
+	else Stats::Add(Stats::PWSR_CACHE_HITS);
+	
+	if (!Cache->Valid || Line.Group != Cache->Group)
+	{
+		Cache->Group = Line.Group.Str();
+		Cache->GroupID = 0;
+		PWSR::LookupGroupname(Sysroot, Cache->Group, &Cache->GroupID);
+	}
+	else Stats::Add(Stats::PWSR_CACHE_HITS);
+	
+	Cache->Valid = true;
+}
+
+static bool PathTooLong(const Utils::FileListLine &Line)
+{ //Always false, so callers can return it.
+	fprintf(stderr, "Path too long: \"%.*s\"\n", (int)Line.Path.Size, Line.Path.Data);
+	return false;
+}
+
+static size_t CountLines(const char *Buf)
+{ //For progress totals. A last line without a newline still counts.
+	size_t NumLines = 0;
+	
+	for (const char *Newline = Buf; (Newline = strchr(Newline, '\n')); ++Newline) ++NumLines;
+	
+	return NumLines + (*Buf && Buf[strlen(Buf) - 1] != '\n');
+}
+
+static void UninstallWorker(void *Data, const size_t Index)
+{ //Opens the directory once and removes everything in it relative to that.
+	UninstallJobs *Jobs = static_cast<UninstallJobs*>(Data);
+	UninstallGroup &Group = Jobs->Groups[Index];
+	
+	const int DirDesc = Files::OpenDirectory(Jobs->Sysroot, Group.Directory);
+	
+	if (DirDesc == -1)
+	{ //Directory's gone, so are its files.
+		if (errno != ENOENT) Group.Failed = Group.Names;
+		return;
+	}
 	
-	while (SubStrings.Line.GetLine(CurLine, sizeof CurLine, &Iter))
+	for (size_t Inc = 0; Inc < Group.Names.size(); ++Inc)
 	{
-		Utils::FileListLine LineStruct = Utils::BreakdownFileListLine(CurLine);
+		Stats::Add(Stats::SYS_UNLINK);
 		
-		switch (LineStruct.Type)
+		if (unlinkat(DirDesc, Group.Names[Inc], 0) == 0) Stats::Add(Stats::PATHS_REMOVED);
+		else if (errno != ENOENT) Group.Failed.push_back(Group.Names[Inc]);
+	}
+	
+	close(DirDesc);
+}
+
+bool Package::UninstallFiles(const char *Sysroot, const char *FileListBuf, const std::set<PkString> *KeepDirs)
+{ /*Files are grouped by directory so each directory is opened once. Big packages spread the groups over
+	Config::IOJobs workers. Afterwards, directories the package owned are removed if they're empty and no
+	package in KeepDirs still lists them, deepest first.*/
+	const Trace::Scope Phase("delete files");
+	
+	std::map<PkString, size_t> GroupIndices;
+	std::set<PkString> OwnedDirs;
+	UninstallJobs Jobs;
+	size_t NumFiles = 0, LastGroup = 0;
+	
+	Jobs.Sysroot = Sysroot;
+	
+	Utils::FileListView View(FileListBuf);
+	Utils::FileListLine LineStruct;
+	
+	while (View.Next(&LineStruct))
+	{
+		if (LineStruct.Type == Utils::FileListLine::FLLTYPE_DIRECTORY)
 		{
-			case Utils::FileListLine::FLLTYPE_FILE:
+			OwnedDirs.insert(LineStruct.Path.Str());
+			continue;
+		}
+		
+		if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE) continue;
+		
+		size_t Slash = LineStruct.Path.Size;
+		
+		while (Slash && LineStruct.Path.Data[Slash - 1] != '/') --Slash;
+		
+		const Utils::StringView Directory = Slash ? Utils::StringView(LineStruct.Path.Data, Slash - 1) : Utils::StringView(".", 1);
+		
+		//Files in the same directory usually come together, so only look it up when it changes.
+		if (Jobs.Groups.empty() || Directory != Utils::StringView(Jobs.Groups[LastGroup].Directory.data(), Jobs.Groups[LastGroup].Directory.size()))
+		{
+			const PkString &DirectoryText = Directory.Str();
+			std::map<PkString, size_t>::iterator GroupIter = GroupIndices.find(DirectoryText);
+			
+			if (GroupIter == GroupIndices.end())
 			{
-				PkString Path = PkString(Sysroot) + "/" + LineStruct.Path;
-				//build a path for the file we're removing.
-				
-				if (lstat(Path, &FileStat) != 0) continue;
-				
-				//Delete it.
-				if (unlink(Path) != 0)
-				{ //Just warn us on failure.
-					fprintf(stderr, "\nWARNING: Unable to uninstall file \"%s\"\n", +Path);
-				}
+				GroupIter = GroupIndices.insert(std::make_pair(DirectoryText, Jobs.Groups.size())).first;
+				Jobs.Groups.push_back(UninstallGroup());
+				Jobs.Groups.back().Directory = DirectoryText;
 			}
-			default:
-				break;
+			
+			LastGroup = GroupIter->second;
+		}
+		
+		Jobs.Groups[LastGroup].Names.push_back(std::string(LineStruct.Path.Data + Slash, LineStruct.Path.Size - Slash));
+		++NumFiles;
+	}
+	
+	//Thread startup isn't worth it for a handful of files.
+	Workers::Run(UninstallWorker, &Jobs, Jobs.Groups.size(), NumFiles >= UNINSTALL_PARALLEL_THRESHOLD ? Config::IOJobs : 1);
+	
+	for (size_t Inc = 0; Inc < Jobs.Groups.size(); ++Inc)
+	{
+		for (size_t NameInc = 0; NameInc < Jobs.Groups[Inc].Failed.size(); ++NameInc)
+		{ //Just warn us on failure.
+			fprintf(stderr, "\nWARNING: Unable to uninstall file \"%s/%s/%s\"\n", Sysroot, +Jobs.Groups[Inc].Directory, +Jobs.Groups[Inc].Failed[NameInc]);
 		}
 	}
+	
+	//A child always sorts after its parent, so walking backwards gets to it first.
+	for (std::set<PkString>::reverse_iterator DirIter = OwnedDirs.rbegin(); DirIter != OwnedDirs.rend(); ++DirIter)
+	{
+		if (KeepDirs && KeepDirs->count(*DirIter)) continue;
+		
+		const char *Name = NULL;
+		const int ParentDesc = Files::ParentDescriptor(Sysroot, *DirIter, &Name);
+		
+		if (ParentDesc == -1) continue;
+		
+		Stats::Add(Stats::SYS_UNLINK);
+		
+		//Fails if it's not empty, which is fine.
+		if (unlinkat(ParentDesc, Name, AT_REMOVEDIR) == 0) Stats::Add(Stats::PATHS_REMOVED);
+	}
+	
+	if (!OwnedDirs.empty()) Files::ForgetDirectories();
+	
 	return true;
 }
 
 static bool MkPkgCloneFiles(const char *PackageDir, const char *InputDir, const char *FileList)
 { //Used when building a package.
 	
-	PkString Buffer;
+	Utils::MappedFile Buffer;
 	try
 	{
-		Buffer = Utils::Slurp(FileList);
+		Buffer.Open(FileList);
 	}
 	catch (...)
 	{
 		return false;
 	}
 	
-	char Line[4096];
-	
-	const char *Iter = Buffer;
-	
-
+	Utils::FileListView View(Buffer.Data());
+	Utils::FileListLine LineStruct;
 	
 	struct stat FileStat;
 	
-	PasswdUser LastUser;
-	PkString LastGroupText;
-	gid_t LastGroupID = 0;
+	OwnerCache Owner;
 	
-	while (SubStrings.Line.GetLine(Line, sizeof Line, &Iter))
+	//Incoming and outgoing paths.
+	Utils::PathBuilder Path1(InputDir), Path2(PackageDir);
+	
+	while (View.Next(&LineStruct))
 	{
-		Utils::FileListLine LineStruct = Utils::BreakdownFileListLine(Line);
-		
-		PasswdUser User = LineStruct.User == LastUser.Username ? LastUser : PWSR::LookupUsername("/", LineStruct.User);
+		LookupOwner("/", LineStruct, &Owner);
 		
-		gid_t GroupID = 0;
+		const uid_t UserID = Owner.UserID;
+		const gid_t GroupID = Owner.GroupID;
 		
-		if (LineStruct.Group == LastUser.Groupname) GroupID = LastGroupID;
-		else PWSR::LookupGroupname("/", LineStruct.Group, &GroupID);
-		
-		LastGroupID = GroupID;
-		LastGroupText = LineStruct.Group;
-		
-		const char *ActualPath = LineStruct.Path;
-		
-		//Incoming path.
-		const PkString Path1 = PkString(InputDir) + "/" + ActualPath;
-		
-		//Outgoing path.		
-		const PkString Path2 = PkString(PackageDir) + "/" + ActualPath;
+		if (!Path1.Push(LineStruct.Path) || !Path2.Push(LineStruct.Path)) return PathTooLong(LineStruct);
 		
 		switch (LineStruct.Type)
 		{
 			case Utils::FileListLine::FLLTYPE_DIRECTORY:
 			{
-				Files::Mkdir(Path1, Path2, "", User.UserID, GroupID, LineStruct.Mode);
+				Files::Mkdir(Path1, Path2, "", UserID, GroupID, LineStruct.Mode);
 				break;
 			}
 			case Utils::FileListLine::FLLTYPE_FILE:
@@ -562,48 +772,47 @@ static bool MkPkgCloneFiles(const char *PackageDir, const char *InputDir, const
 				
 				if (S_ISLNK(FileStat.st_mode))
 				{
-					Files::SymlinkCopy(Path1, Path2, false, "", User.UserID, GroupID);
+					Files::SymlinkCopy(Path1, Path2, false, "", UserID, GroupID);
 				}
 				else
 				{
-					Files::FileCopy(Path1, Path2, false, "", User.UserID, GroupID, LineStruct.Mode);
+					Files::FileCopy(Path1, Path2, false, "", UserID, GroupID, LineStruct.Mode);
 				}
 				break;
 			}
 			default:
 				break;
 		}
+		
+		Path1.Pop();
+		Path2.Pop();
 	}
 	return true;
 }
 
 static bool MakeAllChecksums(const char *Directory, const char *FileListPath, FILE *const OutDesc)
 { //Build a checksums file list.
-	PkString FileData;
+	const Trace::Scope Phase("checksums");
+	
+	Utils::MappedFile FileData;
 	try
 	{
-		FileData = Utils::Slurp(FileListPath);
+		FileData.Open(FileListPath);
 	}
 	catch (...)
 	{
 		return false;
 	}
 	
-	char LineBuf[4096];
-	
-	*LineBuf = 0;
-	const char *Iter = FileData;
+	Utils::FileListView View(FileData.Data());
+	Utils::FileListLine LineStruct;
 	
 	//Iterate over the items in the file list.
-	while (SubStrings.Line.GetLine(LineBuf, sizeof LineBuf, &Iter))
+	while (View.Next(&LineStruct))
 	{
-		if (!*LineBuf) continue;
-		
-		Utils::FileListLine LineStruct = Utils::BreakdownFileListLine(LineBuf);
-		
 		if (LineStruct.Type == Utils::FileListLine::FLLTYPE_DIRECTORY) continue;
 		
-		PkString PathBuf = PkString(Directory) + "/" + LineStruct.Path;
+		PkString PathBuf = PkString(Directory) + "/" + LineStruct.Path.Str();
 		
 		
 		struct stat TempStat;
@@ -620,7 +829,7 @@ static bool MakeAllChecksums(const char *Directory, const char *FileListPath, FI
 		//Write the checksum to the output file.
 		fwrite(Checksum, 1, Checksum.length(), OutDesc);
 		fputc(' ', OutDesc);
-		fwrite(LineStruct.Path, 1, LineStruct.Path.length(), OutDesc);
+		fwrite(LineStruct.Path.Data, 1, LineStruct.Path.Size, OutDesc);
 		fputc('\n', OutDesc);
 	}
 	
@@ -628,8 +837,8 @@ static bool MakeAllChecksums(const char *Directory, const char *FileListPath, FI
 }
 	
 	
-PkString Package::MakeFileChecksum(const char *FilePath)
-{ //Fairly fast function to get a sha1 of a file.
+PkString Package::MakeFileChecksum(const char *FilePath, uint64_t *OutSize)
+{ //Fairly fast function to get a sha1 of a file. OutSize, if given, gets how much was read.
 	unsigned char Hash[SHA_DIGEST_LENGTH];
 	
 	struct stat FileStat;
@@ -643,10 +852,14 @@ PkString Package::MakeFileChecksum(const char *FilePath)
 	
 	if (!Descriptor) return PkString();
 	
+	if (OutSize) *OutSize = FileStat.st_size;
+	
 	SHA_CTX CTX;
 	
 	SHA1_Init(&CTX);
-		
+	
+	const uint64_t HashStart = Stats::Active ? Stats::Clock() : 0;
+	
 	unsigned long long SizeToRead = FileStat.st_size >= SHA1_PER_READ_SIZE ? SHA1_PER_READ_SIZE : FileStat.st_size;
 	size_t Read = 0;
 	char *ReadBuf = (char*)malloc(SHA1_PER_READ_SIZE);
@@ -655,6 +868,8 @@ PkString Package::MakeFileChecksum(const char *FilePath)
 	{
 		Read = fread(ReadBuf, 1, SizeToRead, Descriptor);
 		if (Read) SHA1_Update(&CTX, ReadBuf, Read);
+		
+		Stats::Add(Stats::BYTES_HASHED, Read);
 	} while (Read > 0);
 	
 	free(ReadBuf);
@@ -662,6 +877,8 @@ PkString Package::MakeFileChecksum(const char *FilePath)
 	
 	SHA1_Final(Hash, &CTX);
 	
+	if (Stats::Active) Stats::Add(Stats::HASH_NSEC, Stats::Clock() - HashStart);
+	
 	char Buf[4096] = { 0 };
 	
 	unsigned Inc = 0;
@@ -676,14 +893,18 @@ PkString Package::MakeFileChecksum(const char *FilePath)
 
 bool Package::VerifyChecksums(const char *ChecksumBuf, const PkString &FilesDir)
 {
+	const Trace::Scope Phase("verify");
+	
 	char Line[4096];
 	const char *Iter = ChecksumBuf;
 	
 	//Needs to be this size for Split()
 	char Checksum[sizeof Line], Path[sizeof Line];
 	
-	//Change to files directory.
-
+	uint64_t FileSize = 0;
+	
+	Console::AddProgressTotal(CountLines(ChecksumBuf));
+	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Iter))
 	{
 		if (!SubStrings.Split(Checksum, Path, " ", Line, SPLIT_NOKEEP))
@@ -691,12 +912,14 @@ bool Package::VerifyChecksums(const char *ChecksumBuf, const PkString &FilesDir)
 			return false;
 		}
 		
-		PkString NewChecksum = Package::MakeFileChecksum(FilesDir + '/' + Path);
+		PkString NewChecksum = Package::MakeFileChecksum(FilesDir + '/' + Path, &FileSize);
 		
 		if (!SubStrings.Compare(NewChecksum, Checksum))
 		{
 			return false;
 		}
+		
+		Console::AdvanceProgress(FileSize);
 	}
 	
 	return true;
@@ -746,6 +969,8 @@ static bool BuildFileList(const char *const Directory_, FILE *const OutDesc, boo
 		if (S_ISDIR(FileStat.st_mode))
 		{ //It's a directory.
 			
+			Stats::Add(Stats::PWSR_CACHE_HITS, (FileStat.st_uid == LastUser.UserID) + (FileStat.st_gid == LastGroupID));
+			
 			PasswdUser User = FileStat.st_uid != LastUser.UserID ? PWSR::LookupUserID("/", FileStat.st_uid) : LastUser;
 			PkString Group = FileStat.st_gid != LastGroupID ? PWSR::LookupGroupID("/", FileStat.st_gid) : LastGroup;
 			
@@ -774,6 +999,8 @@ static bool BuildFileList(const char *const Directory_, FILE *const OutDesc, boo
 		}
 		//It's a file.
 		
+		Stats::Add(Stats::PWSR_CACHE_HITS, (FileStat.st_uid == LastUser.UserID) + (FileStat.st_gid == LastGroupID));
+		
 		PasswdUser User = FileStat.st_uid != LastUser.UserID ? PWSR::LookupUserID("/", FileStat.st_uid) : LastUser;
 		PkString Group = FileStat.st_gid != LastGroupID ? PWSR::LookupGroupID("/", FileStat.st_gid) : LastGroup;
 		
@@ -794,6 +1021,7 @@ static bool BuildFileList(const char *const Directory_, FILE *const OutDesc, boo
 
 bool Package::GetMetadata(const char *Path, PkgObj *OutPkg)
 { //Loads basic metadata info.
+	const Trace::Scope Phase("metadata");
 	
 	if (!Path) Path = ".";
 	
@@ -885,6 +1113,11 @@ bool Package::GetMetadata(const char *Path, PkgObj *OutPkg)
 			SubStrings.Copy(Temp, Data, sizeof Temp);
 			OutPkg->Cmds.PostUpdate = Temp;
 		}
+		else if (SubStrings.StartsWith("Trigger=", Line))
+		{
+			const char *Data = Line + (sizeof "Trigger=" - 1);
+			OutPkg->Triggers += PkString(Data) + '\n';
+		}
 		else continue; //Ignore anything that doesn't make sense.
 	}
 	
@@ -36,9 +36,16 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #define REPOS_DIRECTORY "/var/packrat/repos/"
 #define REPO_DESC_FILENAME "info.pkrepo"
 #define REPOS_CATALOGS_DIRECTORY "catalogs/"
+#define CATALOG_INDEX_SUFFIX ".idx"
+#define CATALOG_SEARCH_SUFFIX ".search"
+#define JOURNAL_DIRECTORY "/var/packrat/journal/"
+#define OBJECTS_DIRECTORY "/var/packrat/objects"
+#define DAEMON_SOCKET_PATH "/run/packratd.sock"
+#define DAEMON_MAGIC "PKRTD1" //Starts every request, see daemon.cpp.
 
 #define CONSOLE_CTL_SAVESTATE "\033[s"
 #define CONSOLE_CTL_RESTORESTATE "\033[u"
+#define CONSOLE_CTL_CLEARDOWN "\033[J"
 
 #define CONSOLE_COLOR_BLACK "\033[30m"
 #define CONSOLE_COLOR_RED "\033[31m"
@@ -106,6 +113,8 @@ struct PkgObj
 		PkString PreUpdate;
 		PkString PostUpdate;
 	} Cmds;
+	
+	PkString Triggers; //Trigger declarations, one per line. See triggers.cpp.
 };
 
 #include "utils.h"
@@ -116,6 +125,7 @@ namespace Action
 	bool InstallPackage(const char *PkgPath, const char *Sysroot);
 	bool UninstallPackage(const char *PackageID, const char *Arch, const char *Sysroot);
 	bool UpdatePackage(const char *PkgPath, const char *Sysroot);
+	bool InstallPackages(const std::vector<std::vector<PkString> > &Waves, const char *Sysroot);
 	bool ReverseInstall(const char *PackageID, const char *Arch, const char *Sysroot);
 	bool CreateTempCacheDir(char *OutBuf, const unsigned OutBufSize, const char *Sysroot);
 	void DeleteTempCacheDir(const char *Path);
@@ -130,6 +140,45 @@ namespace Config
 	extern std::set<PkString> SupportedArches;
 	extern const PkString *PrimaryArch;
 	extern PkString OSRelease;
+	extern unsigned CPUJobs; //Concurrency limits for parallel installs.
+	extern unsigned IOJobs;
+	extern PkString ObjectStore; //Absolute path of the object store, empty if it's off.
+	extern unsigned ProgressRate; //Most progress redraws per second.
+}
+
+//journal.cpp
+namespace Journal
+{
+	struct AttrChange
+	{ //An unchanged file that only needs its owner or mode fixed.
+		PkString Path;
+		uid_t UserID;
+		gid_t GroupID;
+		mode_t Mode;
+	};
+	
+	struct Transaction
+	{
+		PkString Sysroot;
+		PkString Dir; //This transaction's directory under JOURNAL_DIRECTORY.
+		PkgObj Pkg;
+		std::vector<PkString> Files; //Staged under TempPath() until the commit.
+		std::vector<PkString> TempNames; //What TempPath() named each of Files, in the same directory.
+		std::vector<PkString> Deletes; //Left over from the version being replaced.
+		std::vector<AttrChange> Attrs;
+		
+		Transaction(void) : Pkg() {}
+	};
+	
+	bool Begin(Transaction *Txn, const PkgObj &Pkg, const char *InfoDir, const char *FileListBuf, const char *OldFileListBuf, const char *Sysroot);
+	bool AddAttrChanges(Transaction *Txn, const std::vector<AttrChange> &Changes);
+	PkString TempPath(const Transaction &Txn, const char *Path);
+	bool SyncSysroot(const char *Sysroot);
+	bool Commit(Transaction *Txn);
+	bool CommitDB(const Transaction &Txn);
+	void Finish(const Transaction &Txn);
+	void Abort(const Transaction &Txn);
+	bool Recover(const char *Sysroot);
 }
 
 //package.cpp
@@ -137,11 +186,12 @@ namespace Package
 {
 	bool MountPackage(const char *AbsolutePathToPkg, const char *const Sysroot, char *PkgDirPath, unsigned PkgDirPathSize);
 	bool GetPackageConfig(const char *const DirPath, const char *const File, char *Data, unsigned DataOutSize);
-	PkString MakeFileChecksum(const char *FilePath);
-	bool InstallFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf);
-	bool UpdateFiles(const char *PackageDir, const char *Sysroot, const char *OldFileListBuf, const char *NewFileListBuf);
+	PkString MakeFileChecksum(const char *FilePath, uint64_t *OutSize = NULL);
+	bool InstallFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf, const Journal::Transaction *Txn = NULL, const char *ChecksumsBuf = NULL);
+	bool UpdateFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf, const char *ChecksumsBuf,
+					const char *InstalledChecksumsBuf, Journal::Transaction *Txn);
 	bool SaveMetadata(const PkgObj *Pkg, const char *InfoPath);
-	bool UninstallFiles(const char *Sysroot, const char *FileListBuf);
+	bool UninstallFiles(const char *Sysroot, const char *FileListBuf, const std::set<PkString> *KeepDirs = NULL);
 	bool CreatePackage(const PkgObj *Job, const char *Directory);
 	bool VerifyChecksums(const char *ChecksumBuf, const PkString &FilesDir);
 	bool ReverseInstallFiles(const char *Destination, const char *Sysroot, const char *FileListBuf);
@@ -149,13 +199,155 @@ namespace Package
 	bool GetMetadata(const char *Path, PkgObj *OutPkg);
 }
 
+//objstore.cpp
+namespace ObjStore
+{
+	PkString GetObjectPath(const char *Checksum, const uid_t UserID, const gid_t GroupID, const mode_t Mode);
+	bool InstallFile(const char *Source, const char *Sysroot, const char *Destination, const char *Checksum,
+					const uid_t UserID, const gid_t GroupID, const mode_t Mode);
+	bool Prune(unsigned *OutNumRemoved);
+}
+
+//delta.cpp
+namespace Delta
+{
+	bool IsDelta(const char *PackageDir);
+	bool GetBase(const char *PackageDir, PkString *OutVersionString, unsigned *OutPackageGeneration);
+	bool CreateDelta(const char *OldPkgPath, const char *NewPkgPath, const char *Sysroot);
+	bool StageFiles(const char *PackageDir, const char *Sysroot, const char *FileListBuf, const char *ChecksumsBuf,
+					const char *InstalledChecksumsBuf, const Journal::Transaction *Txn);
+}
+
+//hooks.cpp
+namespace Hooks
+{
+	bool Run(const char *Command, const char *Sysroot, int *OutExitStatus = NULL, PkString *OutOutput = NULL);
+	void Shutdown(void);
+}
+
+//stats.cpp
+namespace Stats
+{
+	enum Counter
+	{
+		FILES_CREATED, DIRS_CREATED, SYMLINKS_CREATED, PATHS_REMOVED, BYTES_COPIED, BYTES_HASHED, HASH_NSEC,
+		SYS_OPEN, SYS_MKDIR, SYS_SYMLINK, SYS_LINK, SYS_RENAME, SYS_UNLINK, SYS_ATTR, SYS_SYNC,
+		DB_STATEMENTS, DB_NSEC, PWSR_LOOKUPS, PWSR_CACHE_HITS, NET_REQUESTS, NET_BYTES,
+		IO_READ_BYTES, IO_WRITE_BYTES, IO_READ_CALLS, IO_WRITE_CALLS, IO_DISK_READ_BYTES, IO_DISK_WRITE_BYTES, //From /proc.
+		COUNTER_MAX
+	};
+	
+	extern bool Active;
+	extern __thread uint64_t ThreadCounters[COUNTER_MAX];
+	
+	inline void Add(const Counter Which, const uint64_t Amount = 1) { if (Active) ThreadCounters[Which] += Amount; }
+	uint64_t Clock(void);
+	bool Enable(const bool PrintSummary, const char *JSONPath);
+	void Snapshot(uint64_t *Out);
+	void Retire(uint64_t *Into);
+	void Absorb(const uint64_t *From);
+	void CopyLatency(const uint64_t Nanoseconds);
+	void PhaseDone(const char *Name, const char *Package, const uint64_t Nanoseconds, const uint64_t *Before);
+}
+
+//trace.cpp
+namespace Trace
+{
+	extern bool Active;
+	
+	class Scope
+	{ //Begins a phase when made and ends it when destroyed. Package, if given, has to outlive the scope.
+	private:
+		bool Began;
+		const char *Name, *PrevPackage;
+		uint64_t StartTime;
+		uint64_t Before[Stats::COUNTER_MAX]; //Only filled in for --stats.
+		void Start(const char *Package);
+		void Stop(void);
+		Scope(const Scope&);
+		Scope &operator=(const Scope&);
+	public:
+		Scope(const char *InName, const char *Package = NULL) : Began(Active), Name(InName), PrevPackage(), StartTime() { if (Began) Start(Package); }
+		~Scope(void) { if (Began) Stop(); }
+	};
+	
+	bool Open(const char *Path);
+	void Close(void);
+	const char *CurrentPackage(void);
+	void InheritPackage(const char *Package);
+}
+
+//triggers.cpp
+namespace Triggers
+{
+	struct Trigger
+	{
+		PkString Name;
+		PkString Prefix; //Relative to the sysroot, like file lists. Unused if Explicit.
+		PkString Command;
+		bool Explicit; //Fires only for the declaring package, no path.
+		
+		Trigger() : Explicit() {}
+	};
+	
+	struct Pending
+	{ //One per transaction.
+		std::vector<Trigger> Known;
+		std::vector<PkString> Touched; //File lists from Activate(), for RunPending() to match against Known.
+		std::vector<Trigger> Fired; //In the order they fired.
+		std::set<PkString> FiredNames;
+	};
+	
+	bool Parse(const char *Declarations, std::vector<Trigger> *Out);
+	bool Begin(Pending *Txn, const char *Sysroot);
+	void Activate(Pending *Txn, const PkgObj &Pkg, const char *FileListBuf);
+	bool RunPending(Pending *Txn, const char *Sysroot);
+}
+
+//manifest.cpp
+namespace Manifest
+{
+	struct Entry
+	{ //Views into the blob and the Reader, good until the next call to Next().
+		Utils::FileListLine::FLLType Type;
+		Utils::StringView User, Group, Path;
+		mode_t Mode;
+		const unsigned char *Digest; //Raw, DigestSize bytes. NULL for directories and symlinks.
+		size_t DigestSize;
+		
+		Entry() : Type(), Mode(), Digest(), DigestSize() {}
+	};
+	
+	class Reader
+	{ //Walks a blob in place. Only the current path is copied, since each one builds on the last.
+	private:
+		const unsigned char *Cursor, *End;
+		std::vector<Utils::StringView> Names;
+		std::string Path;
+		uint64_t Remaining;
+		bool Bad;
+	public:
+		Reader(const void *Blob, const size_t Size);
+		bool Next(Entry *Out);
+		bool Failed(void) const { return Bad; }
+	};
+	
+	bool Encode(const char *FileListBuf, const char *ChecksumsBuf, std::string *Out);
+	bool Decode(const void *Blob, const size_t Size, PkString *OutFileList, PkString *OutChecksums);
+}
+
 //files.cpp
 namespace Files
 {
-	bool FileCopy(const char *Source, const char *Destination, bool Overwrite, const PkString &Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode);
-	bool Mkdir(const char *Source, const char *Destination, const PkString &Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode);
+	bool FileCopy(const char *Source, const char *Destination, bool Overwrite, const char *Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode);
+	bool Mkdir(const char *Source, const char *Destination, const char *Sysroot, const uid_t UserID, const gid_t GroupID, const int32_t Mode);
 	bool RecursiveMkdir(const char *Path, const uid_t UserID, const gid_t GroupID, const int32_t Mode);
-	bool SymlinkCopy(const char *Source, const char *Destination, bool Overwrite, const PkString &Sysroot , const uid_t UserID, const gid_t GroupID);
+	void ForgetDirectories(void);
+	bool RemoveTree(const char *Path);
+	int SysrootDescriptor(const char *Sysroot);
+	int OpenDirectory(const char *Sysroot, const char *Path);
+	int ParentDescriptor(const char *Sysroot, const char *Path, const char **OutName);
+	bool SymlinkCopy(const char *Source, const char *Destination, bool Overwrite, const char *Sysroot, const uid_t UserID, const gid_t GroupID);
 	bool TextUserAndGroupToIDs(const char *const User, const char *const Group, uid_t *UIDOut, gid_t *GIDOut);
 }
 
@@ -168,6 +360,11 @@ namespace DB
 	bool InitializeEmptyDB(const PkString &Sysroot = "/");
 	bool GetFilesInfo(const PkString &PackageID, const PkString &Arch, PkString *OutFileList, PkString *OutChecksums, const PkString &Sysroot = "/");
 	bool HasMultiArches(const char *PackageID, const PkString &Sysroot);
+	bool GetInstalledList(std::vector<std::pair<PkString, PkString> > *Out, const PkString &Sysroot = "/");
+	bool GetAllTriggers(PkString *Out, const PkString &Sysroot = "/");
+	bool Migrate(const PkString &Sysroot = "/");
+	bool GetDirectoriesInUse(const PkString &PackageID, const PkString &Arch, std::set<PkString> *Out, const PkString &Sysroot = "/");
+	void Release(void);
 }
 
 //passwd_w_sysroot.cpp
@@ -210,6 +407,19 @@ namespace Repos
 			PkString Arch; //usually it will be the same, but not necessarily.
 		};
 		std::vector<DepStruct> Dependencies;
+		
+		struct ProvideStruct
+		{ //Only used when adding to a catalog, lookups go through Repos::FindProviders().
+			enum ProvideType { PROVIDE_SONAME, PROVIDE_FILE } Type;
+			PkString Name;
+		};
+		std::vector<ProvideStruct> Provides;
+	};
+	
+	struct Provider
+	{
+		PkString RepoName;
+		CatalogEntry Entry;
 	};
 	
 	//Prototypes
@@ -224,18 +434,132 @@ namespace Repos
 	bool LoadRepos(const PkString &Sysroot);
 	RepoInfo *LookupRepo(const PkString &RepoName);
 	std::list<CatalogEntry> *SearchRepoCatalogs(const PkString &RepoName, const PkString &PackageID, const PkString &Sysroot);
+	PkString GetRepoCatalogPath(const char *RepoName, const char *Arch, const PkString &Sysroot);
+	bool ProvideTypeFromString(const char *String, CatalogEntry::ProvideStruct::ProvideType *Out);
+	const char *ProvideTypeToString(const CatalogEntry::ProvideStruct::ProvideType Type);
+	void FindProviders(const std::vector<PkString> &Names, const PkString &Sysroot, std::map<PkString, std::vector<Provider> > *Out);
 	
 	//Globals
 	extern std::vector<RepoInfo> RepoList;
 
 }
 
+//catindex.cpp
+namespace CatIndex
+{
+	struct IndexMap; //Opaque, it's a read-only mmap of the index file.
+	
+	bool BuildIndex(const char *CatalogPath, const char *IndexPath);
+	IndexMap *OpenIndex(const char *IndexPath, const char *CatalogPath = NULL);
+	IndexMap *OpenCatalogIndex(const char *CatalogPath);
+	void CloseIndex(IndexMap *Map);
+	uint32_t CountEntries(const IndexMap *Map);
+	bool FindEntry(const IndexMap *Map, const char *PackageID, uint32_t *OutIndex);
+	bool GetEntry(const IndexMap *Map, const uint32_t Index, Repos::CatalogEntry *Out);
+	const char *GetPackageID(const IndexMap *Map, const uint32_t Index);
+	uint32_t GetDepCount(const IndexMap *Map, const uint32_t Index);
+	bool GetDep(const IndexMap *Map, const uint32_t Index, const uint32_t DepNum, const char **OutPackageID, const char **OutArch);
+	bool FindProviders(const IndexMap *Map, const char *Name, std::vector<uint32_t> *OutEntries);
+}
+
+//resolver.cpp
+namespace Resolver
+{
+	struct Graph
+	{
+		static const uint32_t NO_NODE = 0xFFFFFFFF; //Edge to a dependency nobody provides.
+		
+		struct Catalog
+		{
+			PkString RepoName;
+			PkString Arch;
+			CatIndex::IndexMap *Map;
+			uint32_t FirstNode; //Node number of this catalog's first entry.
+		};
+		
+		std::vector<Catalog> Catalogs;
+		std::vector<uint32_t> EdgeStart; //Edges of node N are Edges[EdgeStart[N]] through Edges[EdgeStart[N + 1] - 1].
+		std::vector<uint32_t> Edges;
+		
+		Graph(void) {}
+		~Graph(void);
+	private:
+		Graph(const Graph&); //It owns the index mappings, no copies.
+		Graph &operator=(const Graph&);
+	};
+	
+	bool BuildGraph(const PkString &Sysroot, Graph *Out);
+	bool FindPackage(const Graph &G, const char *PackageID, const char *Arch, uint32_t *OutNode);
+	bool GetNodeInfo(const Graph &G, const uint32_t Node, Repos::CatalogEntry *Out, PkString *OutRepoName);
+	bool MakePlan(const Graph &G, const std::vector<uint32_t> &Targets, const PkString &Sysroot, std::vector<uint32_t> *OutPlan);
+	void SplitWaves(const Graph &G, const std::vector<uint32_t> &Plan, std::vector<std::vector<uint32_t> > *OutWaves);
+}
+
+//search.cpp
+namespace Search
+{
+	enum MatchMode { MATCH_KEYWORD, MATCH_PREFIX, MATCH_SUBSTRING };
+	
+	struct SearchResult
+	{
+		PkString RepoName;
+		Repos::CatalogEntry Entry;
+		double Rank; //Lower is better.
+	};
+	
+	bool BuildSearchIndex(const char *CatalogPath, const char *SearchDBPath);
+	std::list<SearchResult> *SearchRepos(const PkString &Query, const MatchMode Mode, const PkString &Sysroot);
+	bool ExplainQuery(const PkString &CatalogPath, const PkString &Query, const MatchMode Mode, PkString *OutPlan);
+}
+
+//depcalculator.cpp
+namespace DepCalc
+{
+	struct DynInfo
+	{ //What an ELF file's dynamic section says about it.
+		PkString SOName;
+		std::vector<PkString> Needed;
+		std::vector<PkString> RunPaths; //DT_RUNPATH and DT_RPATH, split on colons.
+	};
+	
+	bool ScanELF(const char *Path, DynInfo *Out);
+	std::vector<PkString> *GetDynLibs(const PkString &Path);
+	bool ScanTree(const char *Directory, const char *FileListBuf, std::map<PkString, DynInfo> *Out);
+	bool WriteDynLibs(const char *Directory, const char *FileListBuf, const char *OutPath);
+}
+
+//workers.cpp
+namespace Workers
+{
+	typedef void (*JobFunc)(void *Data, const size_t Index);
+	
+	void Run(JobFunc Func, void *Data, const size_t NumJobs, unsigned MaxThreads);
+}
+
+//daemon.cpp
+namespace Daemon
+{
+	typedef int (*RunFunc)(int argc, char **argv);
+	
+	bool Serve(const char *SocketPath, const char *Sysroot, RunFunc Run);
+}
+
+//client.cpp
+namespace Client
+{
+	int Forward(int argc, char **argv, const char *SocketPath = NULL);
+}
+
 namespace Console
 {
 	void InitActions(const char *InSubject = "");
 	void SetActionSubject(const char *InSubject = "");
 	void SetCurrentAction(const char *InAction, FILE *OutDescriptor = stdout, const char *Color = NULL);
 	void VomitActionError(const char *ErrMsg, FILE *OutDescriptor = stderr);
+	void BeginProgress(const char *Unit = "files");
+	void AddProgressTotal(const uint64_t Items);
+	void AdvanceProgress(const uint64_t Bytes, const uint64_t Items = 1);
+	void EndProgress(void);
 }
 
 //Globals
@@ -0,0 +1,43 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*packratc, the thin client for packratd. Takes the same command line as packrat, but only ever hands it to the daemon.*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "packrat.h"
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		fputs("Need a primary command.\n", stderr);
+		return 1;
+	}
+	
+	const int RetVal = Client::Forward(argc, argv, DAEMON_SOCKET_PATH);
+	
+	if (RetVal == -1)
+	{
+		fprintf(stderr, "Unable to reach packratd: %s\n", strerror(errno));
+		return 1;
+	}
+	
+	return RetVal;
+}
@@ -18,17 +18,72 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "packrat.h"
 #include "substrings/substrings.h"
 
+//Types
+struct IdentityTable
+{
+	struct stat FileStat;
+	Utils::MappedFile *File;
+};
+
+//Prototypes
+static const Utils::MappedFile &GetTable(const char *Path, const char *Sysroot) throw(Utils::SlurpFailure);
+
+//Globals
+static std::map<PkString, IdentityTable> Tables; //By full path.
+static pthread_mutex_t TablesLock = PTHREAD_MUTEX_INITIALIZER;
+
+//Functions
+static const Utils::MappedFile &GetTable(const char *Path, const char *Sysroot) throw(Utils::SlurpFailure)
+{ /*passwd and group are read once and kept, packratd especially, with a stat() each time to catch edits.
+	A replaced copy is never freed, since another thread may still be walking it. They're small and rarely change.*/
+	const PkString &FullPath = PkString(Sysroot ? Sysroot : "") + '/' + Path;
+	struct stat FileStat = { 0 };
+	
+	pthread_mutex_lock(&TablesLock);
+	
+	IdentityTable &Table = Tables[FullPath];
+	
+	if (stat(FullPath, &FileStat) == 0 && Table.File && Utils::SameFile(Table.FileStat, FileStat))
+	{
+		pthread_mutex_unlock(&TablesLock);
+		return *Table.File;
+	}
+	
+	Utils::MappedFile *const File = new Utils::MappedFile;
+	
+	try
+	{
+		File->Open(Path, Sysroot ? Sysroot : "");
+	}
+	catch (Utils::SlurpFailure &)
+	{
+		delete File;
+		pthread_mutex_unlock(&TablesLock);
+		throw;
+	}
+	
+	Table.File = File;
+	Table.FileStat = FileStat;
+	
+	pthread_mutex_unlock(&TablesLock);
+	
+	return *File;
+}
+
 struct PasswdUser PWSR::LookupUsername(const char *Sysroot, const char *Username)
 {
-	PkString PasswdFile;
+	const Utils::MappedFile *PasswdFile = NULL;
+	
+	Stats::Add(Stats::PWSR_LOOKUPS);
 	
 	try
 	{
-		PasswdFile = Utils::Slurp("/etc/passwd", Sysroot);
+		PasswdFile = &GetTable("/etc/passwd", Sysroot);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -41,7 +96,7 @@ struct PasswdUser PWSR::LookupUsername(const char *Sysroot, const char *Username
 	char Line[2048];
 	char Extract[1024];
 	
-	const char *Worker = PasswdFile;
+	const char *Worker = PasswdFile->Data();
 	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
 	{
@@ -77,14 +132,12 @@ struct PasswdUser PWSR::LookupUsername(const char *Sysroot, const char *Username
 		break;
 	}
 	
-	PasswdFile.clear(); //Release so we don't have two possibly semi-large files on the heap for no reason.
-	
 	//Now find the possibly different group name.
-	PkString GroupFile;
+	const Utils::MappedFile *GroupFile = NULL;
 	
 	try
 	{
-		GroupFile = Utils::Slurp("/etc/group", Sysroot);
+		GroupFile = &GetTable("/etc/group", Sysroot);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -92,7 +145,7 @@ struct PasswdUser PWSR::LookupUsername(const char *Sysroot, const char *Username
 		return PasswdUser();
 	}
 	
-	Worker = GroupFile;
+	Worker = GroupFile->Data();
 	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
 	{
@@ -121,11 +174,13 @@ struct PasswdUser PWSR::LookupUsername(const char *Sysroot, const char *Username
 
 PkString PWSR::LookupGroupID(const char *Sysroot, const gid_t GID)
 {
-	PkString GroupFile;
+	const Utils::MappedFile *GroupFile = NULL;
+	
+	Stats::Add(Stats::PWSR_LOOKUPS);
 	
 	try
 	{
-		GroupFile = Utils::Slurp("/etc/group", Sysroot);
+		GroupFile = &GetTable("/etc/group", Sysroot);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -135,7 +190,7 @@ PkString PWSR::LookupGroupID(const char *Sysroot, const gid_t GID)
 	
 	char Line[2048], Extract[1024];
 	
-	const char *Worker = GroupFile;
+	const char *Worker = GroupFile->Data();
 	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
 	{
@@ -160,11 +215,13 @@ PkString PWSR::LookupGroupID(const char *Sysroot, const gid_t GID)
 
 struct PasswdUser PWSR::LookupUserID(const char *Sysroot, const uid_t UID)
 {
-	PkString PasswdFile;
+	const Utils::MappedFile *PasswdFile = NULL;
+	
+	Stats::Add(Stats::PWSR_LOOKUPS);
 	
 	try
 	{
-		PasswdFile = Utils::Slurp("/etc/passwd", Sysroot);
+		PasswdFile = &GetTable("/etc/passwd", Sysroot);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -177,7 +234,7 @@ struct PasswdUser PWSR::LookupUserID(const char *Sysroot, const uid_t UID)
 	char Line[2048];
 	char Extract[1024];
 	
-	const char *Worker = PasswdFile;
+	const char *Worker = PasswdFile->Data();
 	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
 	{
@@ -217,14 +274,12 @@ struct PasswdUser PWSR::LookupUserID(const char *Sysroot, const uid_t UID)
 		break;
 	}
 	
-	PasswdFile.clear(); //Release so we don't have two possibly semi-large files on the heap for no reason.
-	
 	//Now find the possibly different group name.
-	PkString GroupFile;
+	const Utils::MappedFile *GroupFile = NULL;
 	
 	try
 	{
-		GroupFile = Utils::Slurp("/etc/group", Sysroot);
+		GroupFile = &GetTable("/etc/group", Sysroot);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -232,7 +287,7 @@ struct PasswdUser PWSR::LookupUserID(const char *Sysroot, const uid_t UID)
 		return PasswdUser();
 	}
 	
-	Worker = GroupFile;
+	Worker = GroupFile->Data();
 	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
 	{
@@ -261,11 +316,13 @@ struct PasswdUser PWSR::LookupUserID(const char *Sysroot, const uid_t UID)
 
 bool PWSR::LookupGroupname(const char *Sysroot, const char *Groupname, gid_t *OutGID)
 {
-	PkString GroupFile;
+	const Utils::MappedFile *GroupFile = NULL;
+	
+	Stats::Add(Stats::PWSR_LOOKUPS);
 	
 	try
 	{
-		GroupFile = Utils::Slurp("/etc/group", Sysroot);
+		GroupFile = &GetTable("/etc/group", Sysroot);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -275,7 +332,7 @@ bool PWSR::LookupGroupname(const char *Sysroot, const char *Groupname, gid_t *Ou
 	
 	char Line[2048], Extract[1024];
 	
-	const char *Worker = GroupFile;
+	const char *Worker = GroupFile->Data();
 	
 	while (SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
 	{
@@ -18,6 +18,7 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 #include <dirent.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <string.h>
 #include <sqlite3.h>
 
 #include "packrat.h"
@@ -25,6 +26,7 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 
 //Globals
 std::vector<Repos::RepoInfo> Repos::RepoList;
+static PkString LoadedSignature; //What the repos directory looked like when RepoList was filled.
 
 //Prototypes
 static bool NeedNewCatalog(const char *RepoName, const char *MirrorURL, const char *Arch, const PkString &Sysroot);
@@ -41,19 +43,19 @@ static PkString BuildRepoCatalogURL(const char *MirrorURL, const char *OSRelease
 	return PkString(MirrorURL) + '/' + OSRelease + '/' + Arch + "/catalog." + Arch + ".db";
 }
 
-static PkString GetRepoCatalogPath(const char *RepoName, const char *Arch, const PkString &Sysroot)
+PkString Repos::GetRepoCatalogPath(const char *RepoName, const char *Arch, const PkString &Sysroot)
 {
-	return Sysroot + REPOS_DIRECTORY + '/' + RepoName + REPOS_CATALOGS_DIRECTORY + "/catalog." + Arch + ".db";
+	return Sysroot + REPOS_DIRECTORY + '/' + RepoName + '/' + REPOS_CATALOGS_DIRECTORY + "/catalog." + Arch + ".db";
 }
 
 
 PkString Repos::LoadRepoFile(const char *FilePath)
 {
-	PkString RepoFile;
+	Utils::MappedFile RepoFile;
 	
 	try
 	{
-		RepoFile = Utils::Slurp(FilePath);
+		RepoFile.Open(FilePath);
 	}
 	catch (Utils::SlurpFailure &S)
 	{
@@ -61,7 +63,7 @@ PkString Repos::LoadRepoFile(const char *FilePath)
 		return PkString();
 	}
 	
-	const char *Worker = RepoFile;
+	const char *Worker = RepoFile.Data();
 	size_t LineNum = 1;
 	char Line[2048];
 	
@@ -127,8 +129,7 @@ PkString Repos::LoadRepoFile(const char *FilePath)
 }
 
 bool Repos::LoadRepos(const PkString &Sysroot)
-{
-	
+{ //Fine to call again, packratd does for every request. Only rereads anything if a repo came, went, or changed.
 	struct dirent *DirPtr = NULL;
 	const PkString &DirPath = Sysroot + REPOS_DIRECTORY;
 	
@@ -136,7 +137,11 @@ bool Repos::LoadRepos(const PkString &Sysroot)
 	
 	if (!CurDir) return false; //Failed, obviously
 
+	std::vector<PkString> Names;
+	PkString Signature = DirPath;
+	char StatLine[128];
 	struct stat FileStat;
+	
 	while ((DirPtr = readdir(CurDir)))
 	{
 		if (stat(DirPath + '/' + DirPtr->d_name, &FileStat) != 0 || !S_ISDIR(FileStat.st_mode)) //We're not using lstat() on purpose.
@@ -148,18 +153,35 @@ bool Repos::LoadRepos(const PkString &Sysroot)
 		{
 			continue; //Malformed.
 		}
-		PkString RepoName = Repos::LoadRepoFile(File);
+		
+		snprintf(StatLine, sizeof StatLine, "\n%llu %llu %lld.%09ld ", (unsigned long long)FileStat.st_ino, (unsigned long long)FileStat.st_size,
+				(long long)FileStat.st_mtim.tv_sec, (long)FileStat.st_mtim.tv_nsec);
+		
+		Signature += PkString(StatLine) + DirPtr->d_name;
+		Names.push_back(DirPtr->d_name);
+	}
+	
+	closedir(CurDir);
+	
+	if (Signature == LoadedSignature) return true;
+	
+	RepoList.clear();
+	LoadedSignature = Signature;
+	
+	for (size_t Inc = 0; Inc < Names.size(); ++Inc)
+	{
+		PkString RepoName = Repos::LoadRepoFile(DirPath + '/' + Names[Inc] + '/' + REPO_DESC_FILENAME);
 		
 		if (!RepoName)
 		{
-			fprintf(stderr, "WARNING: Unable to load repository at directory \"%s\".\n", +(DirPath + '/' + DirPtr->d_name));
+			fprintf(stderr, "WARNING: Unable to load repository at directory \"%s\".\n", +(DirPath + '/' + Names[Inc]));
 			continue;
 		}
 		
-		if (RepoName != DirPtr->d_name) //This is important.
+		if (RepoName != Names[Inc]) //This is important.
 		{
 			ForgetRepo(RepoName);
-			fprintf(stderr, "WARNING: Repo directory %s does not match repo %s's name. Disabling repo.\n", DirPtr->d_name, +RepoName);
+			fprintf(stderr, "WARNING: Repo directory %s does not match repo %s's name. Disabling repo.\n", +Names[Inc], +RepoName);
 			continue;
 		}
 	}
@@ -189,7 +211,7 @@ bool Repos::DownloadCatalogs(const char *Sysroot)
 					continue;
 				}
 				
-				const PkString &OutPath = GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot);
+				const PkString &OutPath = Repos::GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot);
 				const PkString &URL = BuildRepoCatalogURL(*MirrorIter, Config::OSRelease, *ArchIter);
 				
 				if (!Web::Fetch(URL, OutPath))
@@ -197,6 +219,17 @@ bool Repos::DownloadCatalogs(const char *Sysroot)
 					fputs("\nCatalog download failed; trying another mirror.\n", stderr);
 					goto NextMirror;
 				}
+				
+				//Build the binary index now, so searches don't have to.
+				if (!CatIndex::BuildIndex(OutPath, OutPath + CATALOG_INDEX_SUFFIX))
+				{
+					fprintf(stderr, "\nWARNING: Failed to build index for catalog %s.%s\n", +RepoIter->RepoName, +*ArchIter);
+				}
+				
+				if (!Search::BuildSearchIndex(OutPath, OutPath + CATALOG_SEARCH_SUFFIX))
+				{
+					fprintf(stderr, "\nWARNING: Failed to build search index for catalog %s.%s\n", +RepoIter->RepoName, +*ArchIter);
+				}
 			}
 			
 		NextMirror:
@@ -216,7 +249,7 @@ ReCheck:
 			
 			struct stat FileStat = { 0 };
 			
-			if (stat(GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot), &FileStat) != 0)
+			if (stat(Repos::GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot), &FileStat) != 0)
 			{ //We couldn't download a catalog we needed.
 				fprintf(stderr, "\nWARNING: Failed to download required repo catalog %s.%s. Disabling repo.\n", +RepoIter->RepoName, +*ArchIter);
 				ForgetRepo(RepoIter->RepoName);
@@ -276,9 +309,38 @@ std::list<Repos::CatalogEntry> *Repos::SearchRepoCatalogs(const PkString &RepoNa
 	{ //Iterate through db files
 		if (!Config::SupportedArches.count(*Iter)) continue; //We don't support this architecture.
 		
+		const PkString &CatalogPath = Repos::GetRepoCatalogPath(RepoName, *Iter, Sysroot);
+		
+		///Try the binary index first. Only fall back to SQLite if we can't get one.
+		CatIndex::IndexMap *Index = CatIndex::OpenCatalogIndex(CatalogPath);
+		
+		if (Index)
+		{
+			uint32_t Inc = 0;
+			uint32_t Stopper = CatIndex::CountEntries(Index);
+			
+			if (PackageID)
+			{ //Only one possible match per architecture.
+				if (!CatIndex::FindEntry(Index, PackageID, &Inc)) Stopper = 0;
+				else Stopper = Inc + 1;
+			}
+			
+			for (; Inc < Stopper; ++Inc)
+			{
+				RetVal->push_back(CatalogEntry());
+				CatalogEntry &Entry = RetVal->back();
+				
+				CatIndex::GetEntry(Index, Inc, &Entry);
+				Entry.Arch = *Iter;
+			}
+			
+			CatIndex::CloseIndex(Index);
+			continue;
+		}
+		
 		sqlite3 *Handle = NULL;
 		
-		if (sqlite3_open(Sysroot + REPOS_DIRECTORY + '/' + RepoName + '/' + REPOS_CATALOGS_DIRECTORY + "/catalog." + *Iter + ".db", &Handle) != 0)
+		if (sqlite3_open(CatalogPath, &Handle) != 0)
 		{
 			fprintf(stderr, "\nERROR: Unable to open catalog for %s.%s\n", +RepoName, +*Iter);
 			delete RetVal;
@@ -380,29 +442,17 @@ bool Repos::InitializeEmptyCatalog(const char *Path)
 		return false;
 	}
 
-	sqlite3_stmt *Statement = NULL;
-	const char *Tail = NULL;
-
+	//provides maps sonames and file paths to the packages that ship them.
 	const char SQL[] = "create table catalog (PackageID text unique not null, VersionString text not null, "
-						"PackageGeneration integer default 0, Description text, Dependencies text);";
+						"PackageGeneration integer default 0, Description text, Dependencies text);"
+						"create table provides (PackageID text not null, Type text not null, Name text not null);"
+						"create index provides_name on provides (Name);";
+	
+	const bool Success = sqlite3_exec(Handle, SQL, NULL, NULL, NULL) == SQLITE_OK;
 	
-	if (sqlite3_prepare(Handle, SQL, sizeof SQL - 1, &Statement, &Tail) != SQLITE_OK)
-	{
-		sqlite3_close(Handle);
-		return false;
-	}
-
-	if (sqlite3_step(Statement) != SQLITE_DONE)
-	{
-		sqlite3_finalize(Statement);
-		sqlite3_close(Handle);
-		return false;
-	}
-
-	sqlite3_finalize(Statement);
 	sqlite3_close(Handle);
 
-	return true;
+	return Success;
 
 }
 
@@ -458,7 +508,7 @@ bool Repos::AddToCatalog(const char *CatalogFilePath, const CatalogEntry &Entry)
 		{
 			Buffer += Entry.Dependencies[Inc].PackageID + '.' + Entry.Dependencies[Inc].Arch + '\n';
 		}
-		sqlite3_bind_text(Statement, Indice++, Buffer, Buffer.size(), SQLITE_STATIC);
+		sqlite3_bind_text(Statement, Indice++, Buffer, Buffer.size(), SQLITE_TRANSIENT); //Buffer dies at the end of this block.
 	}
 	else
 	{
@@ -466,30 +516,118 @@ bool Repos::AddToCatalog(const char *CatalogFilePath, const CatalogEntry &Entry)
 	}
 	
 	///Execute SQL
-	bool Success = true;
+	bool Success = sqlite3_exec(Handle, "begin;", NULL, NULL, NULL) == SQLITE_OK;
 	
-	if (sqlite3_step(Statement) != SQLITE_DONE)
+	if (Success && sqlite3_step(Statement) != SQLITE_DONE)
 	{
 		Success = false;
 	}
 	
 	sqlite3_finalize(Statement);
+	
+	///Provides
+	const char ProvidesSQL[] = "insert into provides (PackageID, Type, Name) values (?, ?, ?);";
+	
+	if (Success && !Entry.Provides.empty() && sqlite3_prepare_v2(Handle, ProvidesSQL, sizeof ProvidesSQL - 1, &Statement, NULL) == SQLITE_OK)
+	{
+		for (size_t Inc = 0; Success && Inc < Entry.Provides.size(); ++Inc)
+		{
+			sqlite3_bind_text(Statement, 1, Entry.PackageID, Entry.PackageID.size(), SQLITE_STATIC);
+			sqlite3_bind_text(Statement, 2, Repos::ProvideTypeToString(Entry.Provides[Inc].Type), -1, SQLITE_STATIC);
+			sqlite3_bind_text(Statement, 3, Entry.Provides[Inc].Name, Entry.Provides[Inc].Name.size(), SQLITE_STATIC);
+			
+			Success = sqlite3_step(Statement) == SQLITE_DONE;
+			sqlite3_reset(Statement);
+		}
+		
+		sqlite3_finalize(Statement);
+	}
+	else if (!Entry.Provides.empty()) Success = false;
+	
+	sqlite3_exec(Handle, Success ? "commit;" : "rollback;", NULL, NULL, NULL);
 	sqlite3_close(Handle);
 		
 	return Success;
 }
 
+bool Repos::ProvideTypeFromString(const char *String, CatalogEntry::ProvideStruct::ProvideType *Out)
+{
+	if (!String) return false;
+	
+	if (!strcmp(String, "soname")) *Out = CatalogEntry::ProvideStruct::PROVIDE_SONAME;
+	else if (!strcmp(String, "file")) *Out = CatalogEntry::ProvideStruct::PROVIDE_FILE;
+	else return false;
+	
+	return true;
+}
+
+const char *Repos::ProvideTypeToString(const CatalogEntry::ProvideStruct::ProvideType Type)
+{
+	return Type == CatalogEntry::ProvideStruct::PROVIDE_FILE ? "file" : "soname";
+}
+
+void Repos::FindProviders(const std::vector<PkString> &Names, const PkString &Sysroot, std::map<PkString, std::vector<Provider> > *Out)
+{ /*Looks up every name in every catalog's binary index. Each index is opened once for the whole batch,
+	so this stays cheap for thousands of names. Names nobody provides get an empty list.*/
+	for (size_t Inc = 0; Inc < Names.size(); ++Inc)
+	{
+		(*Out)[Names[Inc]];
+	}
+	
+	std::vector<RepoInfo>::iterator RepoIter = RepoList.begin();
+	
+	for (; RepoIter != RepoList.end(); ++RepoIter)
+	{
+		std::vector<PkString>::iterator ArchIter = RepoIter->RepoArches.begin();
+		
+		for (; ArchIter != RepoIter->RepoArches.end(); ++ArchIter)
+		{
+			if (!Config::SupportedArches.count(*ArchIter)) continue;
+			
+			CatIndex::IndexMap *Index = CatIndex::OpenCatalogIndex(Repos::GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot));
+			
+			if (!Index)
+			{
+				fprintf(stderr, "WARNING: Unable to open catalog %s.%s, skipping it.\n", +RepoIter->RepoName, +*ArchIter);
+				continue;
+			}
+			
+			std::map<PkString, std::vector<Provider> >::iterator Iter = Out->begin();
+			std::vector<uint32_t> Entries;
+			
+			for (; Iter != Out->end(); ++Iter)
+			{
+				Entries.clear();
+				
+				CatIndex::FindProviders(Index, Iter->first, &Entries);
+				
+				for (size_t EntryInc = 0; EntryInc < Entries.size(); ++EntryInc)
+				{
+					Iter->second.push_back(Provider());
+					Provider &New = Iter->second.back();
+					
+					New.RepoName = RepoIter->RepoName;
+					CatIndex::GetEntry(Index, Entries[EntryInc], &New.Entry);
+					New.Entry.Arch = *ArchIter;
+				}
+			}
+			
+			CatIndex::CloseIndex(Index);
+		}
+	}
+}
+
 static bool NeedNewCatalog(const char *RepoName, const char *MirrorURL, const char *Arch, const PkString &Sysroot)
 { //Checks if it exists, then if the checksums match.
 	
 	struct stat FileStat;
-	if (stat(GetRepoCatalogPath(RepoName, Arch, Sysroot), &FileStat) != 0)
+	if (stat(Repos::GetRepoCatalogPath(RepoName, Arch, Sysroot), &FileStat) != 0)
 	{
 		return true; //Yes, we need a new one.
 	}
 	
 	PkString NewChecksum = Web::Fetch(BuildRepoCatalogURL(MirrorURL, Config::OSRelease, Arch) + ".chksum");
-	PkString OldChecksum = Package::MakeFileChecksum(GetRepoCatalogPath(RepoName, Arch, Sysroot));
+	PkString OldChecksum = Package::MakeFileChecksum(Repos::GetRepoCatalogPath(RepoName, Arch, Sysroot));
 	
 	if (NewChecksum != OldChecksum) return true;
 	
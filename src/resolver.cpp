@@ -0,0 +1,286 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Dependency resolution over the catalogs of every loaded repo.
+ * Every package in every catalog gets an integer node number, Catalog.FirstNode + its index in that catalog's
+ * binary index. Dependencies are stored as adjacency arrays (EdgeStart/Edges), with edge k of a node being
+ * dependency k of its catalog entry, so names never need to be compared once the graph is built.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+//Prototypes
+static bool LookupNode(const Resolver::Graph &G, const char *PackageID, const char *Arch, uint32_t *OutNode);
+static uint32_t NodeCatalog(const Resolver::Graph &G, const uint32_t Node);
+static PkString NodeName(const Resolver::Graph &G, const uint32_t Node);
+
+//Functions
+Resolver::Graph::~Graph(void)
+{
+	for (size_t Inc = 0; Inc < Catalogs.size(); ++Inc)
+	{
+		CatIndex::CloseIndex(Catalogs[Inc].Map);
+	}
+}
+
+static uint32_t NodeCatalog(const Resolver::Graph &G, const uint32_t Node)
+{ //Binary search, catalogs are stored in ascending FirstNode order.
+	uint32_t Low = 0, High = G.Catalogs.size();
+	
+	while (High - Low > 1)
+	{
+		const uint32_t Mid = (Low + High) / 2;
+		
+		if (G.Catalogs[Mid].FirstNode <= Node) Low = Mid;
+		else High = Mid;
+	}
+	
+	return Low;
+}
+
+static PkString NodeName(const Resolver::Graph &G, const uint32_t Node)
+{
+	const Resolver::Graph::Catalog &Cat = G.Catalogs[NodeCatalog(G, Node)];
+	
+	return PkString(CatIndex::GetPackageID(Cat.Map, Node - Cat.FirstNode)) + '.' + Cat.Arch;
+}
+
+static bool LookupNode(const Resolver::Graph &G, const char *PackageID, const char *Arch, uint32_t *OutNode)
+{ //Repos are searched in the order they were loaded, first one that has it wins.
+	for (size_t Inc = 0; Inc < G.Catalogs.size(); ++Inc)
+	{
+		const Resolver::Graph::Catalog &Cat = G.Catalogs[Inc];
+		
+		if (Cat.Arch != Arch) continue;
+		
+		uint32_t Index = 0;
+		
+		if (CatIndex::FindEntry(Cat.Map, PackageID, &Index))
+		{
+			*OutNode = Cat.FirstNode + Index;
+			return true;
+		}
+	}
+	
+	return false;
+}
+
+bool Resolver::BuildGraph(const PkString &Sysroot, Graph *Out)
+{
+	uint32_t NumNodes = 0;
+	
+	///Open every catalog we can use.
+	std::vector<Repos::RepoInfo>::iterator RepoIter = Repos::RepoList.begin();
+	
+	for (; RepoIter != Repos::RepoList.end(); ++RepoIter)
+	{
+		std::vector<PkString>::iterator ArchIter = RepoIter->RepoArches.begin();
+		
+		for (; ArchIter != RepoIter->RepoArches.end(); ++ArchIter)
+		{
+			if (!Config::SupportedArches.count(*ArchIter)) continue;
+			
+			CatIndex::IndexMap *Map = CatIndex::OpenCatalogIndex(Repos::GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot));
+			
+			if (!Map)
+			{
+				fprintf(stderr, "WARNING: Unable to open catalog %s.%s, ignoring it for dependency resolution.\n", +RepoIter->RepoName, +*ArchIter);
+				continue;
+			}
+			
+			Graph::Catalog Cat = { RepoIter->RepoName, *ArchIter, Map, NumNodes };
+			Out->Catalogs.push_back(Cat);
+			
+			NumNodes += CatIndex::CountEntries(Map);
+		}
+	}
+	
+	///Now resolve every dependency of every package to a node number, once.
+	Out->EdgeStart.resize(NumNodes + 1);
+	Out->Edges.clear();
+	
+	for (size_t CatInc = 0; CatInc < Out->Catalogs.size(); ++CatInc)
+	{
+		const Graph::Catalog &Cat = Out->Catalogs[CatInc];
+		const uint32_t NumEntries = CatIndex::CountEntries(Cat.Map);
+		
+		for (uint32_t Index = 0; Index < NumEntries; ++Index)
+		{
+			Out->EdgeStart[Cat.FirstNode + Index] = Out->Edges.size();
+			
+			const uint32_t NumDeps = CatIndex::GetDepCount(Cat.Map, Index);
+			
+			for (uint32_t DepNum = 0; DepNum < NumDeps; ++DepNum)
+			{
+				const char *DepID = NULL, *DepArch = NULL;
+				uint32_t DepNode = Graph::NO_NODE;
+				
+				CatIndex::GetDep(Cat.Map, Index, DepNum, &DepID, &DepArch);
+				
+				if (!LookupNode(*Out, DepID, DepArch, &DepNode)) DepNode = Graph::NO_NODE;
+				
+				Out->Edges.push_back(DepNode);
+			}
+		}
+	}
+	
+	Out->EdgeStart[NumNodes] = Out->Edges.size();
+	
+	return true;
+}
+
+bool Resolver::FindPackage(const Graph &G, const char *PackageID, const char *Arch, uint32_t *OutNode)
+{ //No arch means the primary arch, then noarch, same as DB::LoadPackage().
+	if (Arch && *Arch) return LookupNode(G, PackageID, Arch, OutNode);
+	
+	return LookupNode(G, PackageID, *Config::PrimaryArch, OutNode) || LookupNode(G, PackageID, "noarch", OutNode);
+}
+
+bool Resolver::GetNodeInfo(const Graph &G, const uint32_t Node, Repos::CatalogEntry *Out, PkString *OutRepoName)
+{
+	if (Node >= G.EdgeStart.size() - 1) return false;
+	
+	const Graph::Catalog &Cat = G.Catalogs[NodeCatalog(G, Node)];
+	
+	if (!CatIndex::GetEntry(Cat.Map, Node - Cat.FirstNode, Out)) return false;
+	
+	Out->Arch = Cat.Arch;
+	
+	if (OutRepoName) *OutRepoName = Cat.RepoName;
+	
+	return true;
+}
+
+bool Resolver::MakePlan(const Graph &G, const std::vector<uint32_t> &Targets, const PkString &Sysroot, std::vector<uint32_t> *OutPlan)
+{ /*Depth first, iterative so deep chains can't blow the stack. A package goes into the plan after everything
+	it depends on, which gives us a topological order. Packages that are already installed are treated as
+	satisfied and not descended into.*/
+	enum { WHITE, GREY, BLACK };
+	
+	const uint32_t NumNodes = G.EdgeStart.size() - 1;
+	std::vector<uint8_t> Color(NumNodes, WHITE);
+	
+	///Anything already installed counts as done before we start.
+	std::vector<std::pair<PkString, PkString> > Installed;
+	
+	DB::GetInstalledList(&Installed, Sysroot);
+	
+	for (size_t Inc = 0; Inc < Installed.size(); ++Inc)
+	{
+		uint32_t Node = 0;
+		
+		if (LookupNode(G, Installed[Inc].first, Installed[Inc].second, &Node)) Color[Node] = BLACK;
+	}
+	
+	//Node and the next edge of it to look at.
+	std::vector<std::pair<uint32_t, uint32_t> > Stack;
+	
+	bool Success = true;
+	
+	for (size_t TargetInc = 0; TargetInc < Targets.size(); ++TargetInc)
+	{
+		if (Targets[TargetInc] >= NumNodes || Color[Targets[TargetInc]] != WHITE) continue;
+		
+		Stack.push_back(std::make_pair(Targets[TargetInc], G.EdgeStart[Targets[TargetInc]]));
+		Color[Targets[TargetInc]] = GREY;
+		
+		while (!Stack.empty())
+		{
+			const uint32_t Node = Stack.back().first;
+			uint32_t &EdgeInc = Stack.back().second;
+			
+			if (EdgeInc == G.EdgeStart[Node + 1])
+			{ //All dependencies handled.
+				Color[Node] = BLACK;
+				OutPlan->push_back(Node);
+				Stack.pop_back();
+				continue;
+			}
+			
+			const uint32_t DepNode = G.Edges[EdgeInc];
+			const uint32_t DepNum = EdgeInc - G.EdgeStart[Node];
+			
+			++EdgeInc;
+			
+			if (DepNode == Graph::NO_NODE)
+			{
+				const Graph::Catalog &Cat = G.Catalogs[NodeCatalog(G, Node)];
+				const char *DepID = NULL, *DepArch = NULL;
+				
+				CatIndex::GetDep(Cat.Map, Node - Cat.FirstNode, DepNum, &DepID, &DepArch);
+				
+				fprintf(stderr, "ERROR: Package %s depends on %s.%s, which no repository provides.\n", +NodeName(G, Node), DepID, DepArch);
+				Success = false;
+				continue;
+			}
+			
+			if (Color[DepNode] == BLACK) continue;
+			
+			if (Color[DepNode] == GREY)
+			{ //Everything on the stack from DepNode up is the cycle.
+				PkString Cycle;
+				size_t Inc = Stack.size();
+				
+				while (Inc > 0 && Stack[Inc - 1].first != DepNode) --Inc;
+				
+				for (Inc = Inc ? Inc - 1 : 0; Inc < Stack.size(); ++Inc)
+				{
+					Cycle += NodeName(G, Stack[Inc].first) + " -> ";
+				}
+				
+				fprintf(stderr, "ERROR: Circular dependency: %s\n", +(Cycle + NodeName(G, DepNode)));
+				Success = false;
+				continue;
+			}
+			
+			Color[DepNode] = GREY;
+			Stack.push_back(std::make_pair(DepNode, G.EdgeStart[DepNode]));
+		}
+	}
+	
+	return Success;
+}
+
+void Resolver::SplitWaves(const Graph &G, const std::vector<uint32_t> &Plan, std::vector<std::vector<uint32_t> > *OutWaves)
+{ /*Groups a plan from MakePlan() into waves. A package's wave is one past the highest wave of anything it depends on
+	in the plan, so nothing in a wave depends on anything else in it, and every wave only needs the ones before it.
+	Dependencies outside the plan are already installed and don't count.*/
+	std::map<uint32_t, uint32_t> WaveOf;
+	
+	for (size_t Inc = 0; Inc < Plan.size(); ++Inc)
+	{
+		const uint32_t Node = Plan[Inc];
+		uint32_t Wave = 0;
+		
+		for (uint32_t EdgeInc = G.EdgeStart[Node]; EdgeInc < G.EdgeStart[Node + 1]; ++EdgeInc)
+		{
+			std::map<uint32_t, uint32_t>::iterator Iter = WaveOf.find(G.Edges[EdgeInc]);
+			
+			if (Iter != WaveOf.end() && Iter->second + 1 > Wave) Wave = Iter->second + 1;
+		}
+		
+		WaveOf[Node] = Wave;
+		
+		if (OutWaves->size() <= Wave) OutWaves->resize(Wave + 1);
+		
+		(*OutWaves)[Wave].push_back(Node);
+	}
+}
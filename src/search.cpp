@@ -0,0 +1,370 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Text search over repository catalogs. Every catalog.<arch>.db gets a sibling catalog.<arch>.db.search,
+ * an FTS5 table using the trigram tokenizer over PackageID and Description, so prefix, substring and
+ * keyword queries are all index lookups rather than walks through every row.
+ * FTS5 only sees a LIKE with no ESCAPE clause, so '%' and '_' in a query go in as wildcards, and whatever
+ * they let through that the literal text wouldn't is dropped by RowMatches().
+ * Terms under three characters have no trigrams, so those are the one case that still reads every row.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+//Prototypes
+static bool SearchDBIsCurrent(sqlite3 *Handle, const char *CatalogPath);
+static sqlite3 *OpenSearchDB(const PkString &CatalogPath);
+static PkString QuoteFTSTerm(const char *In);
+static bool RunSQL(sqlite3 *Handle, const char *SQL);
+static bool PrepareQuery(sqlite3 *Handle, const char *Explain, const PkString &Query, const Search::MatchMode Mode,
+						sqlite3_stmt **OutStatement, std::vector<PkString> *OutLiterals);
+static bool RowMatches(const Search::MatchMode Mode, const std::vector<PkString> &Literals, const char *PackageID, const char *Description);
+static bool SearchOneCatalog(sqlite3 *Handle, const PkString &Query, const Search::MatchMode Mode,
+							const PkString &RepoName, const PkString &Arch, std::list<Search::SearchResult> *Out);
+static bool CompareResults(const Search::SearchResult &First, const Search::SearchResult &Second);
+
+//Functions
+static bool RunSQL(sqlite3 *Handle, const char *SQL)
+{
+	return sqlite3_exec(Handle, SQL, NULL, NULL, NULL) == SQLITE_OK;
+}
+
+static PkString QuoteFTSTerm(const char *In)
+{ //Quoting makes FTS5 treat it as a plain string, no operators.
+	PkString RetVal = "\"";
+	
+	for (; *In; ++In)
+	{
+		if (*In == '"') RetVal += '"';
+		RetVal += *In;
+	}
+	
+	return RetVal + '"';
+}
+
+static bool SearchDBIsCurrent(sqlite3 *Handle, const char *CatalogPath)
+{
+	struct stat CatalogStat;
+	
+	if (stat(CatalogPath, &CatalogStat) != 0) return false;
+	
+	sqlite3_stmt *Statement = NULL;
+	
+	//An index from before CatalogMTimeNsec and CatalogInode fails to prepare, and gets rebuilt.
+	const char SQL[] = "select CatalogSize, CatalogMTime, CatalogMTimeNsec, CatalogInode from meta limit 1;";
+	
+	if (sqlite3_prepare_v2(Handle, SQL, sizeof SQL - 1, &Statement, NULL) != SQLITE_OK)
+	{
+		return false;
+	}
+	
+	bool RetVal = sqlite3_step(Statement) == SQLITE_ROW &&
+				sqlite3_column_int64(Statement, 0) == (sqlite3_int64)CatalogStat.st_size &&
+				sqlite3_column_int64(Statement, 1) == (sqlite3_int64)CatalogStat.st_mtim.tv_sec &&
+				sqlite3_column_int64(Statement, 2) == (sqlite3_int64)CatalogStat.st_mtim.tv_nsec &&
+				sqlite3_column_int64(Statement, 3) == (sqlite3_int64)CatalogStat.st_ino;
+	
+	sqlite3_finalize(Statement);
+	
+	return RetVal;
+}
+
+bool Search::BuildSearchIndex(const char *CatalogPath, const char *SearchDBPath)
+{
+	struct stat CatalogStat;
+	
+	if (stat(CatalogPath, &CatalogStat) != 0) return false;
+	
+	const PkString &TempPath = PkString(SearchDBPath) + ".tmp";
+	
+	unlink(TempPath);
+	
+	sqlite3 *Handle = NULL;
+	
+	if (sqlite3_open(TempPath, &Handle) != SQLITE_OK)
+	{
+		sqlite3_close(Handle);
+		return false;
+	}
+	
+	//It's a throwaway file until we rename it, so don't bother with a journal.
+	RunSQL(Handle, "pragma journal_mode=off; pragma synchronous=off;");
+	
+	char MetaSQL[256];
+	snprintf(MetaSQL, sizeof MetaSQL, "insert into meta (CatalogSize, CatalogMTime, CatalogMTimeNsec, CatalogInode) values (%lld, %lld, %lld, %lld);",
+			(long long)CatalogStat.st_size, (long long)CatalogStat.st_mtim.tv_sec, (long long)CatalogStat.st_mtim.tv_nsec, (long long)CatalogStat.st_ino);
+	
+	sqlite3_stmt *Statement = NULL;
+	
+	bool Success = RunSQL(Handle, "begin;") &&
+					RunSQL(Handle, "create virtual table search using fts5(PackageID, Description, "
+									"VersionString unindexed, PackageGeneration unindexed, tokenize='trigram');") &&
+					RunSQL(Handle, "create table meta (CatalogSize integer, CatalogMTime integer, CatalogMTimeNsec integer, CatalogInode integer);") &&
+					RunSQL(Handle, MetaSQL) &&
+					sqlite3_prepare_v2(Handle, "attach database ? as cat;", -1, &Statement, NULL) == SQLITE_OK;
+	
+	if (Success)
+	{
+		sqlite3_bind_text(Statement, 1, CatalogPath, -1, SQLITE_STATIC);
+		Success = sqlite3_step(Statement) == SQLITE_DONE;
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	Success = Success && RunSQL(Handle, "insert into search (PackageID, Description, VersionString, PackageGeneration) "
+										"select PackageID, Description, VersionString, PackageGeneration from cat.catalog;") &&
+						RunSQL(Handle, "commit;") && RunSQL(Handle, "detach database cat;");
+	
+	sqlite3_close(Handle);
+	
+	if (!Success || rename(TempPath, SearchDBPath) != 0)
+	{
+		unlink(TempPath);
+		return false;
+	}
+	
+	return true;
+}
+
+static sqlite3 *OpenSearchDB(const PkString &CatalogPath)
+{ //Opens the search database for a catalog, rebuilding it first if it's missing or stale.
+	const PkString &SearchDBPath = CatalogPath + CATALOG_SEARCH_SUFFIX;
+	
+	for (int Attempt = 0; Attempt < 2; ++Attempt)
+	{
+		sqlite3 *Handle = NULL;
+		
+		if (sqlite3_open_v2(SearchDBPath, &Handle, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK && SearchDBIsCurrent(Handle, CatalogPath))
+		{
+			return Handle;
+		}
+		
+		sqlite3_close(Handle);
+		
+		if (Attempt == 0 && !Search::BuildSearchIndex(CatalogPath, SearchDBPath)) break;
+	}
+	
+	return NULL;
+}
+
+static bool PrepareQuery(sqlite3 *Handle, const char *Explain, const PkString &Query, const Search::MatchMode Mode,
+						sqlite3_stmt **OutStatement, std::vector<PkString> *OutLiterals)
+{ /*Explain goes in front of the statement, for "explain query plan ". OutLiterals gets what RowMatches() checks.
+	Leaves *OutStatement NULL if there's nothing to look for.*/
+	PkString SQL = PkString(Explain) + "select PackageID, VersionString, PackageGeneration, Description, ";
+	std::vector<PkString> Binds;
+	
+	*OutStatement = NULL;
+	
+	switch (Mode)
+	{
+		case Search::MATCH_PREFIX:
+		{ //Shortest names first, so "gcc" puts gcc ahead of gcc-doc.
+			SQL += "length(PackageID) from search where PackageID like ?;";
+			Binds.push_back(Query + '%');
+			OutLiterals->push_back(Query);
+			break;
+		}
+		case Search::MATCH_SUBSTRING:
+		{ /*Hits in the name beat hits in the description. A quoted trigram match is exactly a substring match, and
+			unlike LIKE on two columns, every SQLite with FTS5 takes it to the index. Shorter than a trigram can't use
+			the index any way we ask.*/
+			SQL += "(case when PackageID like ?1 then 0 else 1000 end) + length(PackageID) from search where ";
+			SQL += Query.size() >= 3 ? "search match ?2;" : "PackageID like ?1 or Description like ?1;";
+			Binds.push_back('%' + Query + '%');
+			if (Query.size() >= 3) Binds.push_back(QuoteFTSTerm(Query));
+			OutLiterals->push_back(Query);
+			break;
+		}
+		case Search::MATCH_KEYWORD:
+		default:
+		{ /*Every term has to show up somewhere. Terms of three characters or more go through the trigram index
+			and get ranked by bm25, weighting the name well above the description. The tokenizer can't do shorter
+			terms, so those are left to RowMatches() unless they're all there is. Putting a LIKE next to the match
+			would have SQLite use the LIKE for the index instead, and then bm25 has nothing to rank.*/
+			PkString MatchExpr;
+			
+			const char *Worker = Query;
+			char Term[256];
+			
+			while (SubStrings.CopyUntilC(Term, sizeof Term, &Worker, " \t", true))
+			{
+				if (!*Term) continue;
+				
+				if (strlen(Term) >= 3)
+				{
+					if (MatchExpr) MatchExpr += ' ';
+					MatchExpr += QuoteFTSTerm(Term);
+				}
+				else OutLiterals->push_back(Term);
+			}
+			
+			if (!MatchExpr && OutLiterals->empty()) return true; //Nothing to look for.
+			
+			if (MatchExpr)
+			{
+				SQL += "(case when PackageID = ? then -1000000.0 else bm25(search, 10.0, 1.0) end) from search where search match ?;";
+				Binds.push_back(Query);
+				Binds.push_back(MatchExpr);
+			}
+			else
+			{ //Short terms only. The first narrows it down, RowMatches() does the rest.
+				SQL += "length(PackageID) from search where PackageID like ?1 or Description like ?1;";
+				Binds.push_back('%' + OutLiterals->front() + '%');
+			}
+			
+			break;
+		}
+	}
+	
+	if (sqlite3_prepare_v2(Handle, SQL, SQL.size(), OutStatement, NULL) != SQLITE_OK)
+	{
+		*OutStatement = NULL;
+		return false;
+	}
+	
+	for (size_t Inc = 0; Inc < Binds.size(); ++Inc)
+	{
+		sqlite3_bind_text(*OutStatement, Inc + 1, Binds[Inc], Binds[Inc].size(), SQLITE_TRANSIENT);
+	}
+	
+	return true;
+}
+
+static bool RowMatches(const Search::MatchMode Mode, const std::vector<PkString> &Literals, const char *PackageID, const char *Description)
+{ //Case-insensitive for ASCII only, same as LIKE.
+	if (Mode == Search::MATCH_PREFIX) return !strncasecmp(PackageID, Literals[0], Literals[0].size());
+	
+	for (size_t Inc = 0; Inc < Literals.size(); ++Inc)
+	{
+		if (!strcasestr(PackageID, Literals[Inc]) && !strcasestr(Description, Literals[Inc])) return false;
+	}
+	
+	return true;
+}
+
+static bool SearchOneCatalog(sqlite3 *Handle, const PkString &Query, const Search::MatchMode Mode,
+							const PkString &RepoName, const PkString &Arch, std::list<Search::SearchResult> *Out)
+{
+	sqlite3_stmt *Statement = NULL;
+	std::vector<PkString> Literals;
+	
+	if (!PrepareQuery(Handle, "", Query, Mode, &Statement, &Literals)) return false;
+	
+	if (!Statement) return true;
+	
+	int Code = 0;
+	
+	while ((Code = sqlite3_step(Statement)) == SQLITE_ROW)
+	{
+		const char *PackageID = (const char*)sqlite3_column_text(Statement, 0);
+		const char *Description = (const char*)sqlite3_column_text(Statement, 3);
+		
+		if (!RowMatches(Mode, Literals, PackageID ? PackageID : "", Description ? Description : "")) continue;
+		
+		Out->push_back(Search::SearchResult());
+		Search::SearchResult &Result = Out->back();
+		
+		Result.RepoName = RepoName;
+		Result.Entry.Arch = Arch;
+		Result.Entry.PackageID = PackageID;
+		Result.Entry.VersionString = (const char*)sqlite3_column_text(Statement, 1);
+		Result.Entry.PackageGeneration = sqlite3_column_int(Statement, 2);
+		Result.Entry.Description = Description ? Description : "No description provided.";
+		Result.Rank = sqlite3_column_double(Statement, 4);
+	}
+	
+	sqlite3_finalize(Statement);
+	
+	return Code == SQLITE_DONE;
+}
+
+static bool CompareResults(const Search::SearchResult &First, const Search::SearchResult &Second)
+{
+	if (First.Rank != Second.Rank) return First.Rank < Second.Rank;
+	
+	return First.Entry.PackageID < Second.Entry.PackageID;
+}
+
+bool Search::ExplainQuery(const PkString &CatalogPath, const PkString &Query, const MatchMode Mode, PkString *OutPlan)
+{ //The plan SearchRepos() would get, one line per step, so the benchmarks can check every scan uses the index.
+	sqlite3 *Handle = OpenSearchDB(CatalogPath);
+	
+	if (!Handle) return false;
+	
+	sqlite3_stmt *Statement = NULL;
+	std::vector<PkString> Literals;
+	bool Success = PrepareQuery(Handle, "explain query plan ", Query, Mode, &Statement, &Literals);
+	
+	OutPlan->clear();
+	
+	while (Success && Statement && sqlite3_step(Statement) == SQLITE_ROW)
+	{
+		*OutPlan += (const char*)sqlite3_column_text(Statement, 3);
+		*OutPlan += '\n';
+	}
+	
+	sqlite3_finalize(Statement);
+	sqlite3_close(Handle);
+	
+	return Success;
+}
+
+std::list<Search::SearchResult> *Search::SearchRepos(const PkString &Query, const MatchMode Mode, const PkString &Sysroot)
+{ //Searches every architecture we support in every loaded repo, best matches first.
+	std::list<SearchResult> *RetVal = new std::list<SearchResult>;
+	
+	std::vector<Repos::RepoInfo>::iterator RepoIter = Repos::RepoList.begin();
+	
+	for (; RepoIter != Repos::RepoList.end(); ++RepoIter)
+	{
+		std::vector<PkString>::iterator ArchIter = RepoIter->RepoArches.begin();
+		
+		for (; ArchIter != RepoIter->RepoArches.end(); ++ArchIter)
+		{
+			if (!Config::SupportedArches.count(*ArchIter)) continue;
+			
+			const PkString &CatalogPath = Repos::GetRepoCatalogPath(RepoIter->RepoName, *ArchIter, Sysroot);
+			
+			sqlite3 *Handle = OpenSearchDB(CatalogPath);
+			
+			if (!Handle)
+			{
+				fprintf(stderr, "WARNING: Unable to open search index for catalog %s.%s\n", +RepoIter->RepoName, +*ArchIter);
+				continue;
+			}
+			
+			if (!SearchOneCatalog(Handle, Query, Mode, RepoIter->RepoName, *ArchIter, RetVal))
+			{
+				fprintf(stderr, "WARNING: Search failed on catalog %s.%s: %s\n", +RepoIter->RepoName, +*ArchIter, sqlite3_errmsg(Handle));
+			}
+			
+			sqlite3_close(Handle);
+		}
+	}
+	
+	RetVal->sort(CompareResults);
+	
+	return RetVal;
+}
@@ -0,0 +1,383 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Operation counters for --stats and --stats-json=<file>. Every thread counts into its own array, and
+ * Workers::Run() folds a worker's counts into the thread that started it once the worker is done, so the
+ * caller's numbers always include the work it farmed out. Read and write totals come from the kernel's
+ * per-thread I/O accounting in /proc, the rest from Stats::Add() calls at the places that do the work.
+ * Each Trace::Scope records its before and after into a per-phase total, and into a per-package total
+ * if it's the outermost scope on its thread to name a package. When stats are off, Stats::Add() costs
+ * one check of Stats::Active.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sqlite3.h>
+
+#include "packrat.h"
+
+#define LATENCY_BUCKETS 24 //Bucket N holds copies under 2^N microseconds, the last one everything slower.
+
+//Types
+struct CounterInfo
+{
+	const char *Key; //For JSON.
+	const char *Label; //For the summary.
+	bool Nanoseconds;
+};
+
+struct Totals
+{
+	uint64_t Calls;
+	uint64_t Nanoseconds;
+	uint64_t Counters[Stats::COUNTER_MAX];
+	
+	Totals(void) : Calls(), Nanoseconds() { memset(Counters, 0, sizeof Counters); }
+};
+
+//Prototypes
+static void ReadThreadIO(uint64_t *Out);
+static int CountStatement(unsigned Type, void *Context, void *Statement, void *Extra);
+static int WatchConnection(sqlite3 *Handle, const char **ErrMsg, const sqlite3_api_routines *API);
+static void PutJSONString(FILE *Desc, const char *String);
+static void PutJSONCounters(FILE *Desc, const uint64_t *Counters);
+static void PutJSONTotals(FILE *Desc, const std::map<std::string, Totals> &Map);
+static void PutSummaryCounters(const uint64_t *Counters);
+static void Report(void);
+
+//Globals
+bool Stats::Active;
+__thread uint64_t Stats::ThreadCounters[Stats::COUNTER_MAX];
+
+static const CounterInfo Info[Stats::COUNTER_MAX] =
+{
+	{ "files_created", "files created", false },
+	{ "dirs_created", "directories created", false },
+	{ "symlinks_created", "symlinks created", false },
+	{ "paths_removed", "paths removed", false },
+	{ "bytes_copied", "bytes copied", false },
+	{ "bytes_hashed", "bytes hashed", false },
+	{ "hash_ns", "hashing time", true },
+	{ "sys_open", "open() calls", false },
+	{ "sys_mkdir", "mkdir() calls", false },
+	{ "sys_symlink", "symlink() calls", false },
+	{ "sys_link", "link() calls", false },
+	{ "sys_rename", "rename() calls", false },
+	{ "sys_unlink", "unlink() calls", false },
+	{ "sys_attr", "chown()/chmod() calls", false },
+	{ "sys_sync", "sync calls", false },
+	{ "db_statements", "DB statements", false },
+	{ "db_ns", "DB time", true },
+	{ "pwsr_lookups", "passwd/group lookups", false },
+	{ "pwsr_cache_hits", "passwd/group cache hits", false },
+	{ "net_requests", "network requests", false },
+	{ "net_bytes", "network bytes", false },
+	{ "io_read_bytes", "bytes read", false },
+	{ "io_write_bytes", "bytes written", false },
+	{ "io_read_calls", "read() calls", false },
+	{ "io_write_calls", "write() calls", false },
+	{ "io_disk_read_bytes", "bytes read from disk", false },
+	{ "io_disk_write_bytes", "bytes written to disk", false },
+};
+
+static pthread_mutex_t StatsLock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, Totals> Phases, Packages;
+static uint64_t CopyLatencies[LATENCY_BUCKETS];
+static uint64_t StartTime;
+static bool Summary;
+static FILE *JSONDesc;
+
+//Functions
+uint64_t Stats::Clock(void)
+{
+	struct timespec Now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	
+	return (uint64_t)Now.tv_sec * 1000000000ull + Now.tv_nsec;
+}
+
+static void ReadThreadIO(uint64_t *Out)
+{ //Adds the kernel's counts for this thread. Stays quiet if the kernel doesn't keep them.
+	static const struct { const char *Field; Stats::Counter Which; } Fields[] =
+	{
+		{ "rchar", Stats::IO_READ_BYTES },
+		{ "wchar", Stats::IO_WRITE_BYTES },
+		{ "syscr", Stats::IO_READ_CALLS },
+		{ "syscw", Stats::IO_WRITE_CALLS },
+		{ "read_bytes", Stats::IO_DISK_READ_BYTES },
+		{ "write_bytes", Stats::IO_DISK_WRITE_BYTES },
+	};
+	
+	FILE *Desc = fopen("/proc/thread-self/io", "rb");
+	
+	if (!Desc) return;
+	
+	char Field[64];
+	unsigned long long Value = 0;
+	
+	while (fscanf(Desc, "%63[^:]: %llu\n", Field, &Value) == 2)
+	{
+		for (size_t Inc = 0; Inc < sizeof Fields / sizeof *Fields; ++Inc)
+		{
+			if (!strcmp(Field, Fields[Inc].Field)) Out[Fields[Inc].Which] += Value;
+		}
+	}
+	
+	fclose(Desc);
+}
+
+static int CountStatement(unsigned Type, void *Context, void *Statement, void *Extra)
+{ //Runs on whichever thread stepped the statement, so it lands in the right counters.
+	if (Type == SQLITE_TRACE_PROFILE)
+	{
+		Stats::Add(Stats::DB_STATEMENTS);
+		Stats::Add(Stats::DB_NSEC, *static_cast<sqlite3_int64*>(Extra));
+	}
+	
+	return 0;
+}
+
+static int WatchConnection(sqlite3 *Handle, const char **ErrMsg, const sqlite3_api_routines *API)
+{ //Auto extension, so every connection opened from here on gets counted without DB knowing about it.
+	sqlite3_trace_v2(Handle, SQLITE_TRACE_PROFILE, CountStatement, NULL);
+	
+	return SQLITE_OK;
+}
+
+bool Stats::Enable(const bool PrintSummary, const char *JSONPath)
+{ //Call before anything opens the database. The summary goes to stderr and the JSON to JSONPath, at exit.
+	if (Stats::Active) return false;
+	
+	if (JSONPath && *JSONPath && !(JSONDesc = fopen(JSONPath, "wb"))) return false;
+	
+	Summary = PrintSummary;
+	StartTime = Stats::Clock();
+	
+	sqlite3_auto_extension(reinterpret_cast<void (*)(void)>(WatchConnection));
+	
+	Stats::Active = true;
+	Trace::Active = true; //Phases come from trace scopes, with or without a trace file.
+	
+	atexit(Report);
+	
+	return true;
+}
+
+void Stats::Snapshot(uint64_t *Out)
+{ //This thread's counters so far, including what its finished workers handed over.
+	memcpy(Out, Stats::ThreadCounters, sizeof Stats::ThreadCounters);
+	
+	ReadThreadIO(Out);
+}
+
+void Stats::Retire(uint64_t *Into)
+{ //Last thing a worker thread does. The caller holds whatever lock protects Into.
+	uint64_t Counters[Stats::COUNTER_MAX];
+	
+	Stats::Snapshot(Counters);
+	
+	for (size_t Inc = 0; Inc < Stats::COUNTER_MAX; ++Inc) Into[Inc] += Counters[Inc];
+}
+
+void Stats::Absorb(const uint64_t *From)
+{
+	for (size_t Inc = 0; Inc < Stats::COUNTER_MAX; ++Inc) Stats::ThreadCounters[Inc] += From[Inc];
+}
+
+void Stats::CopyLatency(const uint64_t Nanoseconds)
+{
+	if (!Stats::Active) return;
+	
+	size_t Bucket = 0;
+	
+	for (uint64_t Micro = Nanoseconds / 1000; Micro && Bucket < LATENCY_BUCKETS - 1; Micro >>= 1) ++Bucket;
+	
+	__sync_fetch_and_add(&CopyLatencies[Bucket], 1);
+}
+
+void Stats::PhaseDone(const char *Name, const char *Package, const uint64_t Nanoseconds, const uint64_t *Before)
+{ //Package is only given for the outermost scope naming one, so nested scopes don't count twice.
+	uint64_t After[Stats::COUNTER_MAX];
+	
+	Stats::Snapshot(After);
+	
+	pthread_mutex_lock(&StatsLock);
+	
+	for (size_t Which = 0; Which < (Package ? 2 : 1); ++Which)
+	{
+		Totals &Total = (Which ? Packages : Phases)[Which ? Package : Name];
+		
+		++Total.Calls;
+		Total.Nanoseconds += Nanoseconds;
+		
+		for (size_t Inc = 0; Inc < Stats::COUNTER_MAX; ++Inc) Total.Counters[Inc] += After[Inc] - Before[Inc];
+	}
+	
+	pthread_mutex_unlock(&StatsLock);
+}
+
+static void PutJSONString(FILE *Desc, const char *String)
+{
+	putc('"', Desc);
+	
+	for (; *String; ++String)
+	{
+		if (*String == '"' || *String == '\\') fprintf(Desc, "\\%c", *String);
+		else if ((unsigned char)*String < ' ') fprintf(Desc, "\\u%04x", (unsigned)(unsigned char)*String);
+		else putc(*String, Desc);
+	}
+	
+	putc('"', Desc);
+}
+
+static void PutJSONCounters(FILE *Desc, const uint64_t *Counters)
+{
+	putc('{', Desc);
+	
+	for (size_t Inc = 0; Inc < Stats::COUNTER_MAX; ++Inc)
+	{
+		fprintf(Desc, "%s\"%s\":%llu", Inc ? "," : "", Info[Inc].Key, (unsigned long long)Counters[Inc]);
+	}
+	
+	putc('}', Desc);
+}
+
+static void PutJSONTotals(FILE *Desc, const std::map<std::string, Totals> &Map)
+{
+	putc('{', Desc);
+	
+	for (std::map<std::string, Totals>::const_iterator Iter = Map.begin(); Iter != Map.end(); ++Iter)
+	{
+		fputs(Iter == Map.begin() ? "\n\t\t" : ",\n\t\t", Desc);
+		PutJSONString(Desc, Iter->first.c_str());
+		fprintf(Desc, ": {\"calls\":%llu,\"seconds\":%.6f,\"counters\":", (unsigned long long)Iter->second.Calls, Iter->second.Nanoseconds / 1e9);
+		PutJSONCounters(Desc, Iter->second.Counters);
+		putc('}', Desc);
+	}
+	
+	fputs(Map.empty() ? "}" : "\n\t}", Desc);
+}
+
+static void PutSummaryCounters(const uint64_t *Counters)
+{ //Just the ones that moved, on one line.
+	for (size_t Inc = 0; Inc < Stats::COUNTER_MAX; ++Inc)
+	{
+		if (!Counters[Inc]) continue;
+		
+		if (Info[Inc].Nanoseconds) fprintf(stderr, " %s=%.3fms", Info[Inc].Key, Counters[Inc] / 1e6);
+		else fprintf(stderr, " %s=%llu", Info[Inc].Key, (unsigned long long)Counters[Inc]);
+	}
+	
+	putc('\n', stderr);
+}
+
+static void Report(void)
+{ //Registered with atexit(). Runs on the main thread with every worker folded in.
+	uint64_t Counters[Stats::COUNTER_MAX];
+	
+	Stats::Snapshot(Counters);
+	
+	pthread_mutex_lock(&StatsLock);
+	
+	const double Seconds = (Stats::Clock() - StartTime) / 1e9;
+	const double HashRate = Counters[Stats::HASH_NSEC] ? Counters[Stats::BYTES_HASHED] / (Counters[Stats::HASH_NSEC] / 1e9) / 1048576.0 : 0.0;
+	const uint64_t Lookups = Counters[Stats::PWSR_LOOKUPS] + Counters[Stats::PWSR_CACHE_HITS];
+	const double HitRate = Lookups ? 100.0 * Counters[Stats::PWSR_CACHE_HITS] / Lookups : 0.0;
+	
+	if (Summary)
+	{
+		fprintf(stderr, "\nStatistics for %.3f seconds:\n", Seconds);
+		
+		for (size_t Inc = 0; Inc < Stats::COUNTER_MAX; ++Inc)
+		{
+			if (Info[Inc].Nanoseconds) fprintf(stderr, "\t%-28s %14.3f ms\n", Info[Inc].Label, Counters[Inc] / 1e6);
+			else fprintf(stderr, "\t%-28s %14llu\n", Info[Inc].Label, (unsigned long long)Counters[Inc]);
+		}
+		
+		fprintf(stderr, "\t%-28s %14.1f MiB/s\n", "hash throughput", HashRate);
+		fprintf(stderr, "\t%-28s %14.1f%%\n", "passwd/group cache hit rate", HitRate);
+		
+		const std::map<std::string, Totals> *const Maps[] = { &Phases, &Packages };
+		
+		for (size_t Which = 0; Which < 2; ++Which)
+		{
+			if (Maps[Which]->empty()) continue;
+			
+			fputs(Which ? "Packages:\n" : "Phases:\n", stderr);
+			
+			for (std::map<std::string, Totals>::const_iterator Iter = Maps[Which]->begin(); Iter != Maps[Which]->end(); ++Iter)
+			{
+				fprintf(stderr, "\t%-20s %6llux %10.3fs", Iter->first.c_str(), (unsigned long long)Iter->second.Calls, Iter->second.Nanoseconds / 1e9);
+				PutSummaryCounters(Iter->second.Counters);
+			}
+		}
+		
+		uint64_t MostCopies = 0;
+		
+		for (size_t Inc = 0; Inc < LATENCY_BUCKETS; ++Inc)
+		{
+			if (CopyLatencies[Inc] > MostCopies) MostCopies = CopyLatencies[Inc];
+		}
+		
+		if (MostCopies)
+		{
+			fputs("Per-file copy latency:\n", stderr);
+			
+			for (size_t Inc = 0; Inc < LATENCY_BUCKETS; ++Inc)
+			{
+				if (!CopyLatencies[Inc]) continue;
+				
+				char Bar[41] = { '\0' };
+				
+				memset(Bar, '#', (size_t)(CopyLatencies[Inc] * (sizeof Bar - 1) / MostCopies));
+				
+				if (Inc == LATENCY_BUCKETS - 1) fputs("\t   slower    ", stderr);
+				else fprintf(stderr, "\t< %8llu us ", 1ull << Inc);
+				
+				fprintf(stderr, "%10llu %s\n", (unsigned long long)CopyLatencies[Inc], Bar);
+			}
+		}
+	}
+	
+	if (JSONDesc)
+	{
+		fprintf(JSONDesc, "{\n\t\"seconds\": %.6f,\n\t\"totals\": ", Seconds);
+		PutJSONCounters(JSONDesc, Counters);
+		fprintf(JSONDesc, ",\n\t\"hash_mib_per_second\": %.3f,\n\t\"pwsr_cache_hit_percent\": %.3f,\n\t\"phases\": ", HashRate, HitRate);
+		PutJSONTotals(JSONDesc, Phases);
+		fputs(",\n\t\"packages\": ", JSONDesc);
+		PutJSONTotals(JSONDesc, Packages);
+		fputs(",\n\t\"copy_latency_us\": [", JSONDesc);
+		
+		for (size_t Inc = 0; Inc < LATENCY_BUCKETS; ++Inc)
+		{ //Upper bounds, the last bucket has none.
+			if (Inc == LATENCY_BUCKETS - 1) fprintf(JSONDesc, "{\"lt\":null,\"count\":%llu}", (unsigned long long)CopyLatencies[Inc]);
+			else fprintf(JSONDesc, "{\"lt\":%llu,\"count\":%llu},", 1ull << Inc, (unsigned long long)CopyLatencies[Inc]);
+		}
+		
+		fputs("]\n}\n", JSONDesc);
+		fclose(JSONDesc);
+		JSONDesc = NULL;
+	}
+	
+	Stats::Active = false;
+	
+	pthread_mutex_unlock(&StatsLock);
+}
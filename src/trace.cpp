@@ -0,0 +1,188 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Phase tracing for --trace=<file>. Writes Chrome trace-event JSON, which chrome://tracing and Perfetto both load.
+ * Every Trace::Scope is a begin/end pair on the thread that made it. A scope given a package name tags everything
+ * under it on that thread with that package, so worker threads get the right one too.
+ * Scopes also feed the per-phase numbers for --stats, which turns them on without a trace file.
+ * When both are off, a scope costs one check of Trace::Active.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "packrat.h"
+
+//Prototypes
+static double Timestamp(void);
+static void PutEscaped(const char *String);
+static void PutEvent(const char Phase, const char *Name);
+
+//Globals
+bool Trace::Active;
+
+static FILE *TraceDesc;
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec Epoch;
+static bool FirstEvent;
+static pid_t ProcessID;
+
+static __thread const char *ThreadPackage; //Innermost scope that named one.
+static __thread pid_t ThreadID;
+
+//Functions
+static double Timestamp(void)
+{ //Microseconds since Trace::Open(), which is the unit the format wants.
+	struct timespec Now;
+	
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+	
+	return (Now.tv_sec - Epoch.tv_sec) * 1e6 + (Now.tv_nsec - Epoch.tv_nsec) / 1e3;
+}
+
+static void PutEscaped(const char *String)
+{ //TraceLock must be held.
+	for (; *String; ++String)
+	{
+		if (*String == '"' || *String == '\\') fprintf(TraceDesc, "\\%c", *String);
+		else if ((unsigned char)*String < ' ') fprintf(TraceDesc, "\\u%04x", (unsigned)(unsigned char)*String);
+		else putc(*String, TraceDesc);
+	}
+}
+
+static void PutEvent(const char Phase, const char *Name)
+{ //Name is only used for begin events. An end event closes the last open begin on its thread.
+	const double When = Timestamp();
+	bool NameThread = false;
+	
+	if (!ThreadID)
+	{
+		ThreadID = syscall(SYS_gettid);
+		NameThread = true;
+	}
+	
+	pthread_mutex_lock(&TraceLock);
+	
+	if (!TraceDesc)
+	{ //Closed under us by exit().
+		pthread_mutex_unlock(&TraceLock);
+		return;
+	}
+	
+	if (NameThread)
+	{
+		fprintf(TraceDesc, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				FirstEvent ? "" : ",\n", (int)ProcessID, (int)ThreadID, ThreadID == ProcessID ? "main" : "worker");
+		FirstEvent = false;
+	}
+	
+	fprintf(TraceDesc, "%s{\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d", FirstEvent ? "" : ",\n", Phase, When, (int)ProcessID, (int)ThreadID);
+	FirstEvent = false;
+	
+	if (Phase == 'B')
+	{
+		fputs(",\"cat\":\"packrat\",\"name\":\"", TraceDesc);
+		PutEscaped(Name);
+		putc('"', TraceDesc);
+		
+		if (ThreadPackage)
+		{
+			fputs(",\"args\":{\"package\":\"", TraceDesc);
+			PutEscaped(ThreadPackage);
+			fputs("\"}", TraceDesc);
+		}
+	}
+	
+	putc('}', TraceDesc);
+	
+	pthread_mutex_unlock(&TraceLock);
+}
+
+bool Trace::Open(const char *Path)
+{
+	if (TraceDesc) return false;
+	
+	if (!(TraceDesc = fopen(Path, "wb"))) return false;
+	
+	clock_gettime(CLOCK_MONOTONIC, &Epoch);
+	ProcessID = getpid();
+	FirstEvent = true;
+	
+	fputs("[\n", TraceDesc);
+	
+	Trace::Active = true;
+	
+	//Anything still open when we exit() gets cut off, but the file stays valid JSON.
+	atexit(Trace::Close);
+	
+	return true;
+}
+
+void Trace::Close(void)
+{
+	pthread_mutex_lock(&TraceLock);
+	
+	if (TraceDesc)
+	{
+		fputs("\n]\n", TraceDesc);
+		fclose(TraceDesc);
+		TraceDesc = NULL;
+	}
+	
+	Trace::Active = Stats::Active; //--stats still wants the scopes.
+	
+	pthread_mutex_unlock(&TraceLock);
+}
+
+const char *Trace::CurrentPackage(void)
+{
+	return ThreadPackage;
+}
+
+void Trace::InheritPackage(const char *Package)
+{ //For worker threads, so their scopes get tagged with the package of the scope that started them.
+	ThreadPackage = Package;
+}
+
+void Trace::Scope::Start(const char *Package)
+{
+	PrevPackage = ThreadPackage;
+	
+	if (Package) ThreadPackage = Package;
+	
+	if (TraceDesc) PutEvent('B', Name);
+	
+	if (Stats::Active)
+	{
+		StartTime = Stats::Clock();
+		Stats::Snapshot(Before);
+	}
+}
+
+void Trace::Scope::Stop(void)
+{
+	if (TraceDesc) PutEvent('E', NULL);
+	
+	//An inherited or enclosing package already counts everything in here.
+	if (Stats::Active) Stats::PhaseDone(Name, PrevPackage ? NULL : ThreadPackage, Stats::Clock() - StartTime, Before);
+	
+	ThreadPackage = PrevPackage;
+}
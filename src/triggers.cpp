@@ -0,0 +1,188 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Transaction triggers, for cache rebuilds like ldconfig that only need to happen once no matter how many
+ * packages asked for them. A package declares triggers in its metadata, one Trigger= line each:
+ *	Trigger=<name> <path prefix> <command>	Fires when any package in the transaction touches a file under the prefix.
+ *	Trigger=<name> - <command>				Fires when the declaring package itself is installed, updated or removed.
+ * Declarations of every installed package count, so one package can declare Trigger=ldconfig /usr/lib ldconfig
+ * and library packages need nothing at all, even ones committed before the declaring package in the same transaction.
+ * Each fired name runs once, after everything else in the transaction.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "packrat.h"
+#include "substrings/substrings.h"
+
+//Prototypes
+static bool PathMatches(const PkString &Prefix, const Utils::StringView &Path);
+static void Fire(Triggers::Pending *Txn, const Triggers::Trigger &Trig);
+static void MatchPaths(Triggers::Pending *Txn);
+
+//Functions
+static bool PathMatches(const PkString &Prefix, const Utils::StringView &Path)
+{ //Prefix and Path are both relative to the sysroot. An empty prefix is the whole sysroot.
+	if (Prefix.empty()) return true;
+	
+	if (Path.Size < Prefix.size() || memcmp(Prefix.data(), Path.Data, Prefix.size()) != 0) return false;
+	
+	return Path.Size == Prefix.size() || Path.Data[Prefix.size()] == '/';
+}
+
+static void Fire(Triggers::Pending *Txn, const Triggers::Trigger &Trig)
+{
+	if (Txn->FiredNames.count(Trig.Name)) return;
+	
+	Txn->FiredNames.insert(Trig.Name);
+	Txn->Fired.push_back(Trig);
+}
+
+bool Triggers::Parse(const char *Declarations, std::vector<Trigger> *Out)
+{ //Out may be NULL just to check the syntax.
+	char Line[4096];
+	const char *Iter = Declarations;
+	
+	while (SubStrings.Line.GetLine(Line, sizeof Line, &Iter))
+	{
+		if (!*Line) continue;
+		
+		Trigger Trig;
+		char Name[256], Prefix[4096];
+		const char *Worker = Line;
+		
+		if (!SubStrings.CopyUntilC(Name, sizeof Name, &Worker, " \t", true) || !Worker ||
+			!SubStrings.CopyUntilC(Prefix, sizeof Prefix, &Worker, " \t", true) || !Worker || !*Worker)
+		{
+			return false;
+		}
+		
+		if (!Out) continue;
+		
+		Trig.Name = Name;
+		Trig.Explicit = !strcmp(Prefix, "-");
+		Trig.Command = Worker;
+		
+		//File lists don't have the leading slash, or a trailing one on directories.
+		if (!Trig.Explicit)
+		{
+			const char *PrefixStart = Prefix;
+			
+			while (*PrefixStart == '/') ++PrefixStart;
+			
+			Trig.Prefix = PrefixStart;
+			
+			while (!Trig.Prefix.empty() && Trig.Prefix[Trig.Prefix.size() - 1] == '/') Trig.Prefix.erase(Trig.Prefix.size() - 1);
+		}
+		
+		Out->push_back(Trig);
+	}
+	
+	return true;
+}
+
+bool Triggers::Begin(Pending *Txn, const char *Sysroot)
+{ //Declarations from what's installed right now. Packages in the transaction add theirs in Activate().
+	PkString Declarations;
+	
+	if (!DB::GetAllTriggers(&Declarations, Sysroot ? Sysroot : "")) return false;
+	
+	if (!Triggers::Parse(Declarations, &Txn->Known))
+	{ //Don't let one broken package stop everything.
+		fputs("\nWARNING: Ignoring malformed trigger declarations in the package database.\n", stderr);
+	}
+	
+	return true;
+}
+
+void Triggers::Activate(Pending *Txn, const PkgObj &Pkg, const char *FileListBuf)
+{ /*FileListBuf is what the package installed or removed. It's kept and matched in RunPending(), once every
+	package in the transaction has added its declarations.*/
+	std::vector<Trigger> Own;
+	
+	Triggers::Parse(Pkg.Triggers, &Own);
+	
+	for (size_t Inc = 0; Inc < Own.size(); ++Inc)
+	{
+		if (Own[Inc].Explicit) Fire(Txn, Own[Inc]);
+		else Txn->Known.push_back(Own[Inc]);
+	}
+	
+	if (FileListBuf && *FileListBuf) Txn->Touched.push_back(FileListBuf);
+}
+
+static void MatchPaths(Triggers::Pending *Txn)
+{
+	std::vector<const Triggers::Trigger*> ByPath;
+	
+	for (size_t Inc = 0; Inc < Txn->Known.size(); ++Inc)
+	{
+		if (!Txn->Known[Inc].Explicit && !Txn->FiredNames.count(Txn->Known[Inc].Name)) ByPath.push_back(&Txn->Known[Inc]);
+	}
+	
+	for (size_t ListInc = 0; ListInc < Txn->Touched.size() && !ByPath.empty(); ++ListInc)
+	{
+		Utils::FileListView View(Txn->Touched[ListInc]);
+		Utils::FileListLine LineStruct;
+		
+		while (View.Next(&LineStruct))
+		{
+			if (LineStruct.Type != Utils::FileListLine::FLLTYPE_FILE) continue;
+			
+			for (size_t Inc = 0; Inc < ByPath.size(); ++Inc)
+			{
+				if (PathMatches(ByPath[Inc]->Prefix, LineStruct.Path)) Fire(Txn, *ByPath[Inc]);
+			}
+		}
+	}
+	
+	Txn->Touched.clear();
+}
+
+bool Triggers::RunPending(Pending *Txn, const char *Sysroot)
+{ //Failures are warnings, like post-install commands. Returns false if any failed.
+	const Trace::Scope Phase("triggers");
+	
+	MatchPaths(Txn);
+	
+	bool Success = true;
+	
+	for (size_t Inc = 0; Inc < Txn->Fired.size(); ++Inc)
+	{
+		const Trigger &Trig = Txn->Fired[Inc];
+		int ExitStatus = 1;
+		PkString Output;
+		
+		Console::SetCurrentAction(PkString("Running trigger ") + Trig.Name);
+		
+		const bool Ran = Hooks::Run(Trig.Command, Sysroot, &ExitStatus, &Output);
+		
+		fputs(Output, stdout);
+		
+		if (!Ran || ExitStatus != 0)
+		{
+			fprintf(stderr, "\nWARNING: Failure executing trigger \"%s\".\n", +Trig.Name);
+			Success = false;
+		}
+	}
+	
+	Txn->Fired.clear();
+	Txn->FiredNames.clear();
+	
+	return Success;
+}
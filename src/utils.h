@@ -25,6 +25,18 @@ along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+//Files at least this big get mapped instead of read.
+#define MAPPEDFILE_THRESHOLD (64 * 1024)
+
+//Capacity of a PathBuilder, and how many components it can take back off.
+#define PATHBUILDER_SIZE 4096
+#define PATHBUILDER_DEPTH 32
 
 #include "substrings/substrings.h" //Has header guards, don't worry.
 namespace Utils
@@ -36,52 +48,204 @@ namespace Utils
 		SlurpFailure(const char *InReason = "Unspecified", const char *InPath = "Unspecified", const char *InSysroot = "")
 					: Reason(InReason), Path(InPath), Sysroot(InSysroot) {}
 	};
+	struct StringView
+	{ //Part of somebody else's buffer. Not null terminated, and only valid as long as the buffer is.
+		const char *Data;
+		size_t Size;
+		
+		StringView(const char *InData = "", const size_t InSize = 0) : Data(InData), Size(InSize) {}
+		
+		PkString Str(void) const { return std::string(Data, Size); }
+		bool operator==(const char *Other) const { return !strncmp(Data, Other, Size) && Other[Size] == '\0'; }
+		bool operator!=(const char *Other) const { return !(*this == Other); }
+		bool operator==(const StringView &Other) const { return Size == Other.Size && !memcmp(Data, Other.Data, Size); }
+		bool operator!=(const StringView &Other) const { return !(*this == Other); }
+	};
 	struct FileListLine
-	{
-		PkString User, Group, Path;
+	{ //One line of a file list, as handed out by FileListView.
+		StringView User, Group, Path;
+		StringView Text; //The whole line, without the newline.
 		mode_t Mode;
 		enum FLLType { FLLTYPE_INVALID, FLLTYPE_FILE, FLLTYPE_DIRECTORY, FLLTYPE_MAX } Type;
+		
+		FileListLine(void) : Mode(), Type() {}
+	};
+	class FileListView
+	{ /*Walks a file list in place. Nothing gets copied or allocated, Next() just points into the buffer,
+		so the buffer has to outlive every FileListLine it hands out.*/
+	private:
+		const char *Cursor;
+	public:
+		FileListView(const char *Buffer) : Cursor(Buffer ? Buffer : "") {}
+		inline bool Next(FileListLine *Out);
+	};
+	class MappedFile
+	{ /*A whole file, read-only. Big regular files are mmap()ed, small or special ones are read into the heap.
+		Either way there's a null byte after the last one, so text parsers can walk Data() as a C string,
+		but Size() is the real length, embedded nulls and all.*/
+	private:
+		char *Buffer;
+		size_t Length;
+		bool Mapped;
+		
+		MappedFile(const MappedFile&); //We own the mapping, so no copies.
+		MappedFile &operator=(const MappedFile&);
+	public:
+		MappedFile(void) : Buffer(), Length(), Mapped() {}
+		~MappedFile(void) { this->Close(); }
+		
+		inline void Open(const char *Path, const PkString &Sysroot = "") throw(Utils::SlurpFailure);
+		inline void Close(void);
+		const char *Data(void) const { return Buffer ? Buffer : ""; }
+		size_t Size(void) const { return Length; }
+	};
+	class PathBuilder
+	{ /*A path in stack storage, for the per-file loops, which would otherwise build a few temporary strings
+		for every file. Push() adds a component after a slash, Pop() takes the last one back off.*/
+	private:
+		char Buffer[PATHBUILDER_SIZE];
+		size_t Length;
+		size_t Starts[PATHBUILDER_DEPTH]; //Length before each Push().
+		unsigned Depth;
+	public:
+		PathBuilder(const char *Base = "") : Length(), Depth() { *Buffer = '\0'; if (Base) this->Push(Base); }
+		
+		inline bool Push(const char *Component, size_t Size);
+		bool Push(const char *Component) { return this->Push(Component, strlen(Component)); }
+		bool Push(const StringView &Component) { return this->Push(Component.Data, Component.Size); }
+		void Pop(void) { if (Depth) Buffer[Length = Starts[--Depth]] = '\0'; }
+		
+		const char *c_str(void) const { return Buffer; }
+		operator const char *(void) const { return Buffer; }
+		size_t Size(void) const { return Length; }
 	};
 	class FileSize_Error {};
 	static inline PkString Slurp(const char *Path, const PkString &Sysroot = "") throw(Utils::SlurpFailure);
 	static inline bool WriteFile(const PkString &Filename, const char *Data, const size_t DataSize, const bool Append, const signed Permissions = -1);
 	static inline size_t FileSize(const char *Path, const PkString &Sysroot = NULL);
-	static inline FileListLine BreakdownFileListLine(const PkString &Line);
 	static inline std::list<PkString> *LinesToLinkedList(const char *FileStream);
+	static inline void ChecksumsToMap(const char *ChecksumsBuf, std::map<PkString, PkString> *Out);
 	static inline bool IsValidIdentifier(const char *String);
+	static inline bool SameFile(const struct stat &Old, const struct stat &New);
 }
 
 //Functions
 static inline PkString Utils::Slurp(const char *Path, const PkString &Sysroot) throw(Utils::SlurpFailure)
+{ //For a copy that has to be kept or changed. Anything that just reads the file once should use a MappedFile.
+	MappedFile File;
+	
+	File.Open(Path, Sysroot);
+	
+	return std::string(File.Data(), File.Size());
+}
+
+inline void Utils::MappedFile::Open(const char *Path, const PkString &Sysroot) throw(Utils::SlurpFailure)
 {
+	this->Close();
+	
 	if (!Path || !*Path) throw Utils::SlurpFailure("No path specified");
+	
+	const PkString &FinalPath = Sysroot ? PkString(Sysroot) + '/' + Path : PkString(Path);
 	struct stat FileStat;
 	
-	PkString FinalPath = Sysroot ? PkString(Sysroot) + '/' + Path : PkString(Path);
-	//Stat the file.
-	if (stat(FinalPath, &FileStat) != 0) throw Utils::SlurpFailure("Unable to stat target file", Path, Sysroot);
+	//Open the file.
+	const int Descriptor = open(FinalPath, O_RDONLY | O_CLOEXEC);
 	
-	FILE *Desc;
+	if (Descriptor == -1) throw Utils::SlurpFailure("Unable to open target file for reading.", Path, Sysroot);
 	
-	//Open the file.
-	Desc = fopen(FinalPath, "rb");
+	if (fstat(Descriptor, &FileStat) != 0)
+	{
+		close(Descriptor);
+		throw Utils::SlurpFailure("Unable to stat target file", Path, Sysroot);
+	}
 	
-	//Failed.
-	if (!Desc) throw Utils::SlurpFailure("Unable to open target file for reading.", Path, Sysroot);
+	/*The kernel zero fills the rest of the last page, and that's our null terminator.
+	A file that ends right on a page boundary doesn't have one, so it gets read instead.*/
+	if (S_ISREG(FileStat.st_mode) && FileStat.st_size >= MAPPEDFILE_THRESHOLD && FileStat.st_size % sysconf(_SC_PAGESIZE) != 0)
+	{
+		void *Map = mmap(NULL, FileStat.st_size, PROT_READ, MAP_PRIVATE, Descriptor, 0);
+		
+		if (Map != MAP_FAILED)
+		{
+			close(Descriptor);
+			
+			this->Buffer = static_cast<char*>(Map);
+			this->Length = FileStat.st_size;
+			this->Mapped = true;
+			return;
+		}
+	}
 	
-	//Allocate.
-	uint8_t *Buffer = new uint8_t[FileStat.st_size + 1];
+	//Read until EOF instead of trusting st_size, which is 0 for anything in /proc.
+	size_t Capacity = S_ISREG(FileStat.st_mode) ? FileStat.st_size + 1 : 4096;
+	ssize_t Amount = 0;
 	
-	//Read and then close.
-	fread(Buffer, 1, FileStat.st_size, Desc);
-	fclose(Desc);
-	Buffer[FileStat.st_size] = 0;
+	this->Buffer = static_cast<char*>(malloc(Capacity));
+	
+	while (this->Buffer)
+	{
+		if (this->Length + 1 >= Capacity)
+		{
+			char *const Bigger = static_cast<char*>(realloc(this->Buffer, Capacity *= 2));
+			
+			if (!Bigger)
+			{
+				Amount = -1;
+				break;
+			}
+			
+			this->Buffer = Bigger;
+		}
+		
+		Amount = read(Descriptor, this->Buffer + this->Length, Capacity - this->Length - 1);
+		
+		if (Amount == -1 && errno == EINTR) continue;
+		if (Amount <= 0) break;
+		
+		this->Length += Amount;
+	}
+	
+	close(Descriptor);
 	
-	//Create the PkString and release the old buffer.
-	PkString RetVal = reinterpret_cast<char*>(Buffer);
-	delete[] Buffer;
+	if (!this->Buffer || Amount != 0)
+	{
+		this->Close();
+		throw Utils::SlurpFailure("Unable to read target file.", Path, Sysroot);
+	}
 	
-	return RetVal;
+	this->Buffer[this->Length] = '\0';
+}
+
+inline bool Utils::PathBuilder::Push(const char *Component, size_t Size)
+{ //False, and nothing changes, if it won't fit.
+	if (Depth == PATHBUILDER_DEPTH) return false;
+	
+	//One slash between components, however many either side brought.
+	if (Length) while (Size && *Component == '/') ++Component, --Size;
+	
+	const bool Slash = Length && Size && Buffer[Length - 1] != '/';
+	
+	if (Length + Slash + Size >= sizeof Buffer) return false;
+	
+	Starts[Depth++] = Length;
+	
+	if (Slash) Buffer[Length++] = '/';
+	
+	memcpy(Buffer + Length, Component, Size);
+	Length += Size;
+	Buffer[Length] = '\0';
+	
+	return true;
+}
+
+inline void Utils::MappedFile::Close(void)
+{
+	if (this->Mapped) munmap(this->Buffer, this->Length);
+	else free(this->Buffer);
+	
+	this->Buffer = NULL;
+	this->Length = 0;
+	this->Mapped = false;
 }
 
 static inline size_t Utils::FileSize(const char *Path, const PkString &Sysroot)
@@ -97,49 +261,69 @@ static inline size_t Utils::FileSize(const char *Path, const PkString &Sysroot)
 	return FileStat.st_size;
 }
 
-static inline Utils::FileListLine Utils::BreakdownFileListLine(const PkString &Line)
-{
-	if (!Line) return FileListLine(); //Idiot gave us a null string, vomit down their throat.
+inline bool Utils::FileListView::Next(FileListLine *Out)
+{ //Lines look like "f user:group:0644 path/to/file". Blank lines are skipped. Returns false at the end.
+	while (*Cursor == '\n' || *Cursor == '\r') ++Cursor;
+	
+	if (!*Cursor) return false;
+	
+	const char *Line = Cursor;
+	const char *End = strchr(Line, '\n');
+	
+	if (!End) End = Line + strlen(Line);
 	
-	const char PreType = *Line;
+	Cursor = End;
 	
-	FileListLine RetVal = FileListLine();
+	if (End > Line && End[-1] == '\r') --End;
 	
-	switch (PreType)
+	*Out = FileListLine();
+	Out->Text = StringView(Line, End - Line);
+	
+	switch (*Line)
 	{
 		case 'd':
-			RetVal.Type = FileListLine::FLLTYPE_DIRECTORY;
+			Out->Type = FileListLine::FLLTYPE_DIRECTORY;
 			break;
 		case 'f':
-			RetVal.Type = FileListLine::FLLTYPE_FILE;
+			Out->Type = FileListLine::FLLTYPE_FILE;
 			break;
 		default:
 			break;
 	}
 	
-	const char *Worker = +Line + 2; //sizeof d or f plus the space.	
-	char Buf[2048] = { 0 };
-
-	//Get user name.	
-	SubStrings.CopyUntilC(Buf, sizeof Buf, &Worker, ":", false);
+	const char *Worker = End - Line >= 2 ? Line + 2 : End; //sizeof d or f plus the space.
+	const char *FieldStart = Worker;
+	
+	//Get user name.
+	while (Worker < End && *Worker != ':') ++Worker;
+	
+	Out->User = StringView(FieldStart, Worker - FieldStart);
 	
-	RetVal.User = Buf;
+	if (Worker < End) ++Worker;
 	
 	//Get group name.
-	SubStrings.CopyUntilC(Buf, sizeof Buf, &Worker, ":", false);
+	FieldStart = Worker;
 	
-	RetVal.Group = Buf;
+	while (Worker < End && *Worker != ':') ++Worker;
 	
-	//Get permissions/mode.
-	SubStrings.CopyUntilC(Buf, sizeof Buf, &Worker, " ", false); //Space, not colon!
+	Out->Group = StringView(FieldStart, Worker - FieldStart);
 	
-	sscanf(Buf, "%o", &RetVal.Mode);
+	if (Worker < End) ++Worker;
 	
-	//Get file path. This one's easy.
-	RetVal.Path = Worker;
+	//Get permissions/mode. Space, not colon!
+	for (; Worker < End && *Worker >= '0' && *Worker <= '7'; ++Worker)
+	{
+		Out->Mode = (Out->Mode << 3) | (*Worker - '0');
+	}
+	
+	while (Worker < End && *Worker != ' ') ++Worker;
 	
+	if (Worker < End) ++Worker;
 	
-	return RetVal;
+	//Get file path. This one's easy.
+	Out->Path = StringView(Worker, End - Worker);
+	
+	return true;
 }
 
 static inline std::list<PkString> *Utils::LinesToLinkedList(const char *FileStream)
@@ -156,6 +340,19 @@ static inline std::list<PkString> *Utils::LinesToLinkedList(const char *FileStre
 	return New;
 }
 
+static inline void Utils::ChecksumsToMap(const char *ChecksumsBuf, std::map<PkString, PkString> *Out)
+{ //Path to checksum, from a checksums.txt or the database's Checksums column.
+	char Line[4096];
+	const char *Worker = ChecksumsBuf;
+	
+	while (Worker && SubStrings.Line.GetLine(Line, sizeof Line, &Worker))
+	{
+		const char *Space = strchr(Line, ' ');
+		
+		if (Space) (*Out)[Space + 1] = std::string(Line, Space - Line);
+	}
+}
+
 static inline bool Utils::WriteFile(const PkString &Filename, const char *Data, const size_t DataSize, const bool Append, const signed Permissions)
 {
 	if (!Filename) return false;
@@ -181,5 +378,11 @@ static inline bool Utils::IsValidIdentifier(const char *String)
 	return strpbrk(String, "-+=[]}{:\"';><,./\\)(*&^%#$@!~`\t ") == NULL;
 }
 
+static inline bool Utils::SameFile(const struct stat &Old, const struct stat &New)
+{ //For caches. True if New is still the file Old was taken from, unchanged.
+	return Old.st_dev == New.st_dev && Old.st_ino == New.st_ino && Old.st_size == New.st_size &&
+			Old.st_mtim.tv_sec == New.st_mtim.tv_sec && Old.st_mtim.tv_nsec == New.st_mtim.tv_nsec;
+}
+
 
 #endif //__PKRT_UTILS_H__
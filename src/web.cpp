@@ -89,6 +89,16 @@ static bool Fetch_Internal(const PkString &URL_, size_t (*WriteFunction)(void*,
 		
 		Code = curl_easy_perform(Curl);
 		
+		if (Stats::Active)
+		{ //Failed attempts count too, they still cost a round trip.
+			curl_off_t Downloaded = 0;
+			
+			curl_easy_getinfo(Curl, CURLINFO_SIZE_DOWNLOAD_T, &Downloaded);
+			
+			Stats::Add(Stats::NET_REQUESTS);
+			Stats::Add(Stats::NET_BYTES, (uint64_t)Downloaded);
+		}
+		
 		curl_easy_cleanup(Curl);
 	} while (--AttemptsRemaining, (Code != CURLE_OK && AttemptsRemaining));
 	
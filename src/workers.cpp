@@ -0,0 +1,117 @@
+/*Packrat package manager, Copyright 2016 (C) Subsentient
+
+This file is part of Packrat.
+
+Packrat is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Packrat is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Packrat.  If not, see <http://www.gnu.org/licenses/>.*/
+
+/*Minimal worker pool. Workers::Run() calls Func once for every index in 0..NumJobs-1, spread over up to
+ * MaxThreads threads including the calling one, and returns when all of them are done.
+ * Jobs must not touch Console beyond its progress counters, the rest isn't thread safe.*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "packrat.h"
+
+//Types
+struct WorkerShared
+{
+	Workers::JobFunc Func;
+	void *Data;
+	size_t NumJobs;
+	size_t NextJob;
+	pthread_mutex_t Lock;
+	const char *Package; //The caller's, for Trace.
+	uint64_t Counters[Stats::COUNTER_MAX]; //What finished threads counted, for the caller to take over.
+};
+
+//Prototypes
+static void *WorkerLoop(void *Arg);
+static void *WorkerThread(void *Arg);
+
+//Functions
+static void *WorkerLoop(void *Arg)
+{
+	WorkerShared *Shared = static_cast<WorkerShared*>(Arg);
+	
+	while (true)
+	{
+		pthread_mutex_lock(&Shared->Lock);
+		const size_t Index = Shared->NextJob++;
+		pthread_mutex_unlock(&Shared->Lock);
+		
+		if (Index >= Shared->NumJobs) break;
+		
+		Shared->Func(Shared->Data, Index);
+	}
+	
+	return NULL;
+}
+
+static void *WorkerThread(void *Arg)
+{ //The threads we start, as opposed to the caller running WorkerLoop() itself.
+	WorkerShared *Shared = static_cast<WorkerShared*>(Arg);
+	
+	Trace::InheritPackage(Shared->Package);
+	
+	WorkerLoop(Shared);
+	
+	if (Stats::Active)
+	{
+		pthread_mutex_lock(&Shared->Lock);
+		Stats::Retire(Shared->Counters);
+		pthread_mutex_unlock(&Shared->Lock);
+	}
+	
+	return NULL;
+}
+
+void Workers::Run(JobFunc Func, void *Data, const size_t NumJobs, unsigned MaxThreads)
+{
+	if (!NumJobs) return;
+	
+	if (MaxThreads < 1) MaxThreads = 1;
+	if (MaxThreads > NumJobs) MaxThreads = NumJobs;
+	
+	WorkerShared Shared = { Func, Data, NumJobs, 0 };
+	
+	Shared.Package = Trace::CurrentPackage();
+	
+	pthread_mutex_init(&Shared.Lock, NULL);
+	
+	//We're one of the workers, so start one fewer.
+	std::vector<pthread_t> Threads;
+	
+	for (unsigned Inc = 1; Inc < MaxThreads; ++Inc)
+	{
+		pthread_t Thread;
+		
+		//If we can't get more threads, the ones we have will pick up the slack.
+		if (pthread_create(&Thread, NULL, WorkerThread, &Shared) != 0) break;
+		
+		Threads.push_back(Thread);
+	}
+	
+	WorkerLoop(&Shared);
+	
+	for (size_t Inc = 0; Inc < Threads.size(); ++Inc)
+	{
+		pthread_join(Threads[Inc], NULL);
+	}
+	
+	if (Stats::Active) Stats::Absorb(Shared.Counters);
+	
+	pthread_mutex_destroy(&Shared.Lock);
+}